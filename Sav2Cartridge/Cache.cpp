@@ -0,0 +1,276 @@
+﻿/*  This file is part of UKNCBTL.
+UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// Cache.cpp : On-disk cache of the cartridge images
+
+#ifdef _MSC_VER
+# define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+#include "Sav2Cart.h"
+
+
+//////////////////////////////////////////////////////////////////////
+
+// Cache entry file: header, then the cartridge image, then the second one for a split image
+struct CacheEntryHeader
+{
+    char        magic[4];       // "S2CC"
+    uint16_t    codecOption;    // OPTION_COMPRESSION_XXX of the chosen codec
+    uint16_t    reserved;
+    uint32_t    encodedSize;
+    uint32_t    fileSize;       // SAV file size, checked on the lookup
+    uint32_t    encodedSize2;   // Second cartridge of the split image, 0 = single cartridge
+    uint32_t    reserved2;
+    uint64_t    imageHash[2];   // CacheHash of the cartridge images, checked on the lookup
+};
+
+static const char CACHE_MAGIC[4] = { 'S', '2', 'C', 'C' };
+static const char CACHE_EXTENSION[] = ".s2c";
+
+static std::string g_cacheDirectory;
+static uint64_t g_cacheMaxSize = 0;
+
+
+//////////////////////////////////////////////////////////////////////
+
+// FNV-1a 64, two lanes with different offset basis give 128-bit key
+static void CacheHash(uint64_t hash[2], const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash[0] = (hash[0] ^ p[i]) * 0x00000100000001b3ULL;
+        hash[1] = (hash[1] ^ p[i]) * 0x00000100000001b3ULL;
+    }
+}
+
+static std::string CacheEntryPath(const char* key)
+{
+    return g_cacheDirectory + "/" + key + CACHE_EXTENSION;
+}
+
+bool CacheSetDirectory(const char* dirname, uint64_t maxSize)
+{
+    g_cacheDirectory = dirname;
+    g_cacheMaxSize = maxSize;
+#ifdef _WIN32
+    _mkdir(dirname);
+#else
+    mkdir(dirname, 0777);
+#endif
+    struct stat st;
+    if (stat(dirname, &st) != 0 || (st.st_mode & S_IFDIR) == 0)
+    {
+        printf("Failed to create the cache directory %s.\n", dirname);
+        g_cacheDirectory.clear();
+        return false;
+    }
+    return true;
+}
+
+bool CacheIsEnabled()
+{
+    return !g_cacheDirectory.empty();
+}
+
+// The key covers everything the cartridge image depends on: the SAV file, the codec options,
+// the dictionary, the loaders and the format version
+void CacheMakeKey(const SavImage& sav, int codecOptions, char key[33])
+{
+    uint64_t hash[2] = { 0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL };
+    uint32_t header[13] = { SAV2CART_CACHE_VERSION, (uint32_t)codecOptions, (uint32_t)lzssMaxChain, lzssOptimal ? 1u : 0u,
+                            (uint32_t)lz4MaxChain, lzsaBackward ? 1u : 0u, (uint32_t)lzsaMinMatch, lzsaFavorRatio ? 1u : 0u,
+                            lzsaExhaustive ? 1u : 0u, pdpFilter ? 1u : 0u, multicart ? 1u : 0u, (uint32_t)dictionary.size(),
+                            sav.fileSize };
+    CacheHash(hash, header, sizeof(header));
+    CacheHash(hash, loader, loaderSize);
+    CacheHash(hash, loaderRLE, loaderRLESize);
+    CacheHash(hash, loaderLZSS, loaderLZSSSize);
+    CacheHash(hash, loaderLZ4, loaderLZ4Size);
+    CacheHash(hash, loaderLZSA1, loaderLZSA1Size);
+    CacheHash(hash, loaderLZSA2, loaderLZSA2Size);
+    CacheHash(hash, loaderZX0, loaderZX0Size);
+    CacheHash(hash, loaderMultiLZSA1, loaderMultiLZSA1Size);
+    CacheHash(hash, loaderLZSA1B, loaderLZSA1BSize);
+    CacheHash(hash, loaderLZSA2B, loaderLZSA2BSize);
+    CacheHash(hash, loaderFilter, loaderFilterSize);
+    CacheHash(hash, dictionary.data(), dictionary.size());
+    CacheHash(hash, sav.pFileImage, sav.fileSize);
+    sprintf(key, "%016llx%016llx", (unsigned long long)hash[0], (unsigned long long)hash[1]);
+}
+
+// Hash of the cartridge images of the entry, to catch a truncated or damaged entry file
+static void CacheImageHash(uint64_t hash[2], const uint8_t* pCartImage, const uint8_t* pCartImage2)
+{
+    hash[0] = 0xcbf29ce484222325ULL;  hash[1] = 0x84222325cbf29ce4ULL;
+    CacheHash(hash, pCartImage, 24576);
+    if (pCartImage2 != nullptr)
+        CacheHash(hash, pCartImage2, 24576);
+}
+
+bool CacheLookup(const char* key, const SavImage& sav, uint8_t* pCartImage, uint8_t* pCartImage2,
+                 int* pCodecOption, size_t* pEncodedSize, size_t* pEncodedSize2)
+{
+    std::string path = CacheEntryPath(key);
+    FILE* entryfile = fopen(path.c_str(), "rb");
+    if (entryfile == nullptr)
+        return false;
+    CacheEntryHeader header;
+    bool result =
+        ::fread(&header, 1, sizeof(header), entryfile) == sizeof(header) &&
+        memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+        header.fileSize == sav.fileSize &&
+        ::fread(pCartImage, 1, 24576, entryfile) == 24576 &&
+        (header.encodedSize2 == 0 || ::fread(pCartImage2, 1, 24576, entryfile) == 24576);
+    ::fclose(entryfile);
+    if (!result)
+        return false;
+    uint64_t imageHash[2];
+    CacheImageHash(imageHash, pCartImage, (header.encodedSize2 > 0) ? pCartImage2 : nullptr);
+    if (imageHash[0] != header.imageHash[0] || imageHash[1] != header.imageHash[1])
+    {
+        printf("Cache entry %s is damaged, ignored\n", key);
+        return false;
+    }
+
+    *pCodecOption = header.codecOption;
+    *pEncodedSize = header.encodedSize;
+    *pEncodedSize2 = header.encodedSize2;
+    utime(path.c_str(), nullptr);  // Modification time is the last use time for the eviction
+    return true;
+}
+
+void CacheStore(const char* key, const SavImage& sav, const uint8_t* pCartImage, const uint8_t* pCartImage2,
+                int codecOption, size_t encodedSize, size_t encodedSize2)
+{
+    CacheEntryHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.codecOption = (uint16_t)codecOption;
+    header.reserved = 0;
+    header.encodedSize = (uint32_t)encodedSize;
+    header.fileSize = sav.fileSize;
+    header.encodedSize2 = (pCartImage2 != nullptr) ? (uint32_t)encodedSize2 : 0;
+    header.reserved2 = 0;
+    CacheImageHash(header.imageHash, pCartImage, pCartImage2);
+
+    // Write to a temporary file, then rename, so other threads and processes never see a partial entry;
+    // the thread id is unique in the process only, the process id makes the name unique between processes
+#ifdef _WIN32
+    unsigned long processId = (unsigned long)_getpid();
+#else
+    unsigned long processId = (unsigned long)getpid();
+#endif
+    std::string path = CacheEntryPath(key);
+    char suffix[48];
+    sprintf(suffix, ".%lx.%lx.tmp", processId, (unsigned long)std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::string temppath = path + suffix;
+    FILE* entryfile = fopen(temppath.c_str(), "wb");
+    if (entryfile == nullptr)
+        return;
+    bool result =
+        ::fwrite(&header, 1, sizeof(header), entryfile) == sizeof(header) &&
+        ::fwrite(pCartImage, 1, 24576, entryfile) == 24576 &&
+        (pCartImage2 == nullptr || ::fwrite(pCartImage2, 1, 24576, entryfile) == 24576);
+    result = (::fclose(entryfile) == 0) && result;
+    if (result)
+    {
+#ifdef _WIN32
+        ::remove(path.c_str());  // Windows rename does not replace; POSIX rename replaces the entry atomically
+#endif
+        result = ::rename(temppath.c_str(), path.c_str()) == 0;
+    }
+    if (!result)
+        ::remove(temppath.c_str());
+}
+
+// Delete the least recently used entries until the cache fits the size limit
+void CacheTrim()
+{
+    if (g_cacheDirectory.empty() || g_cacheMaxSize == 0)
+        return;
+
+    struct CacheFile
+    {
+        std::string name;
+        uint64_t    size;
+        time_t      time;
+        bool operator<(const CacheFile& other) const { return time < other.time; }
+    };
+    std::vector<CacheFile> files;
+    uint64_t totalSize = 0;
+    auto addfile = [&](const char* name)
+    {
+        size_t len = strlen(name);
+        if (len <= sizeof(CACHE_EXTENSION) - 1 || strcmp(name + len - (sizeof(CACHE_EXTENSION) - 1), CACHE_EXTENSION) != 0)
+            return;
+        CacheFile file;
+        file.name = g_cacheDirectory + "/" + name;
+        struct stat st;
+        if (stat(file.name.c_str(), &st) != 0)
+            return;
+        file.size = st.st_size;
+        file.time = st.st_mtime;
+        totalSize += file.size;
+        files.push_back(file);
+    };
+#ifdef _WIN32
+    struct _finddata_t finddata;
+    intptr_t hfind = _findfirst((g_cacheDirectory + "/*" + CACHE_EXTENSION).c_str(), &finddata);
+    if (hfind != -1)
+    {
+        do addfile(finddata.name); while (_findnext(hfind, &finddata) == 0);
+        _findclose(hfind);
+    }
+#else
+    DIR* dir = opendir(g_cacheDirectory.c_str());
+    if (dir == nullptr)
+        return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr)
+        addfile(entry->d_name);
+    closedir(dir);
+#endif
+
+    if (totalSize <= g_cacheMaxSize)
+        return;
+    std::sort(files.begin(), files.end());
+    int removed = 0;
+    for (size_t i = 0; i < files.size() && totalSize > g_cacheMaxSize; i++)
+    {
+        if (::remove(files[i].name.c_str()) != 0)
+            continue;
+        totalSize -= files[i].size;
+        removed++;
+    }
+    printf("Cache: %d. old entries removed, %llu. bytes left\n", removed, (unsigned long long)totalSize);
+}
+
+
+//////////////////////////////////////////////////////////////////////
@@ -0,0 +1,1326 @@
+﻿/*  This file is part of UKNCBTL.
+    UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+
+// Cartridge.cpp : Cartridge image preparation with every codec
+
+#ifdef _MSC_VER
+# define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#include "Sav2Cart.h"
+
+
+int lzssMaxChain = 0;
+int lz4MaxChain = 0;
+bool lzssOptimal = false;
+bool lzsaBackward = false;
+int lzsaMinMatch = 3;
+bool lzsaFavorRatio = true;
+bool lzsaExhaustive = false;
+bool pdpFilter = false;
+bool multicart = false;  // Split over two cartridges if doesn't fit one
+std::vector<uint8_t> dictionary;
+
+
+//////////////////////////////////////////////////////////////////////
+
+// Length of the run of bytes equal to value, from the start of the data; 16 bytes at a time
+static size_t ScanRun(const uint8_t * data, size_t size, uint8_t value)
+{
+    size_t length = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i pattern = _mm_set1_epi8((char)value);
+    while (length + 16 <= size)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + length));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern)) != 0xffff)
+            break;
+        length += 16;
+    }
+#else
+    uint64_t pattern = 0x0101010101010101ULL * value;
+    while (length + 8 <= size)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, data + length, 8);
+        if (chunk != pattern)
+            break;
+        length += 8;
+    }
+#endif
+    while (length < size && data[length] == value)
+        length++;
+    return length;
+}
+
+// Count of the bytes different from the previous ones, from data[1]; 16 bytes at a time
+static size_t ScanNoRun(const uint8_t * data, size_t size)
+{
+    size_t length = 1;
+#if defined(__SSE2__) || defined(_M_X64)
+    while (length + 16 <= size)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + length));
+        __m128i previous = _mm_loadu_si128((const __m128i*)(data + length - 1));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, previous)) != 0)
+            break;
+        length += 16;
+    }
+#endif
+    while (length < size && data[length] != data[length - 1])
+        length++;
+    return length - 1;
+}
+
+size_t EncodeRLE(const uint8_t * source, size_t sourceLength, uint8_t * buffer, size_t bufferLength)
+{
+    size_t destOffset = 0;
+    size_t seqBlockOffset = 0;
+    size_t seqBlockSize = 1;
+    size_t varBlockOffset = 0;
+    size_t varBlockSize = 1;
+    uint8_t prevByte = source[0];
+    size_t currOffset = 0;
+    size_t codedSizeTotal = 0;
+    while (currOffset < sourceLength)
+    {
+        currOffset++;
+        uint8_t currByte = (currOffset < sourceLength) ? source[currOffset] : ~prevByte;
+
+        if ((currOffset == sourceLength) ||
+            (currByte != prevByte && seqBlockSize > 31) ||
+            (currByte != prevByte && seqBlockSize > 1 && prevByte == 0) ||
+            (currByte != prevByte && seqBlockSize > 1 && prevByte == 0xff) ||
+            (currByte != prevByte && varBlockSize >= 0x1fff) || seqBlockSize == 0x1fff)
+        {
+            if (varBlockOffset < seqBlockOffset)
+            {
+                size_t varSize = varBlockSize - seqBlockSize;
+                if (seqBlockSize < 2)
+                    varSize = varBlockSize;  // The last byte is not a run: at the end of input stream or at the block size limit
+                size_t codedSize = varSize + ((varSize < 256 / 8) ? 1 : 2);
+                //printf("RLE  at\t%06o\tVAR  %06o  %06o  %06o\t", varBlockOffset + 512, destOffset, varSize, codedSize);
+                codedSizeTotal += codedSize;
+                if (destOffset + codedSize < bufferLength)
+                {
+                    uint8_t flagByte = 0x40;
+                    if (varSize < 256 / 8)
+                    {
+                        //printf("%02x ", (uint8_t)(flagByte | varSize));
+                        buffer[destOffset++] = (uint8_t)(flagByte | varSize);
+                    }
+                    else
+                    {
+                        //printf("%02x ", (uint8_t)(0x80 | flagByte | ((varSize & 0x1f00) >> 8)));
+                        buffer[destOffset++] = (uint8_t)(0x80 | flagByte | ((varSize & 0x1f00) >> 8));
+                        //printf("%02x ", (uint8_t)(varSize & 0xff));
+                        buffer[destOffset++] = (uint8_t)(varSize & 0xff);
+                    }
+                    for (size_t offset = varBlockOffset; offset < varBlockOffset + varSize; offset++)
+                        buffer[destOffset++] = source[offset];
+                }
+                //printf("\n");
+            }
+            if ((varBlockOffset < seqBlockOffset && seqBlockSize > 1) ||
+                (varBlockOffset == seqBlockOffset && varBlockSize == seqBlockSize))
+            {
+                size_t codedSize = ((seqBlockSize < 256 / 8) ? 1 : 2) + ((prevByte == 0 || prevByte == 255) ? 0 : 1);
+                //printf("RLE  at\t%06o\tSEQ  %06o  %06o  %06o\t%02x\n", seqBlockOffset + 512, destOffset, seqBlockSize, codedSize, prevByte);
+                codedSizeTotal += codedSize;
+                if (destOffset + codedSize < bufferLength)
+                {
+                    uint8_t flagByte = ((prevByte == 0) ? 0 : ((prevByte == 255) ? 0x60 : 0x20));
+                    if (seqBlockSize < 256 / 8)
+                        buffer[destOffset++] = (uint8_t)(flagByte | seqBlockSize);
+                    else
+                    {
+                        buffer[destOffset++] = (uint8_t)(0x80 | flagByte | ((seqBlockSize & 0x1f00) >> 8));
+                        buffer[destOffset++] = (uint8_t)(seqBlockSize & 0xff);
+                    }
+                    if (prevByte != 0 && prevByte != 255)
+                        buffer[destOffset++] = prevByte;
+                }
+            }
+
+            seqBlockOffset = varBlockOffset = currOffset;
+            seqBlockSize = varBlockSize = 1;
+
+            prevByte = currByte;
+            continue;
+        }
+
+        varBlockSize++;
+        if (currByte == prevByte)
+        {
+            seqBlockSize++;
+            // Inside the run, only the run size limit and the end of input break the block:
+            // skip the rest of the run up to the limit, the same as the byte-by-byte steps
+            size_t skip = ScanRun(source + currOffset + 1, sourceLength - currOffset - 1, currByte);
+            skip = std::min(skip, (size_t)0x1fff - seqBlockSize);
+            currOffset += skip;
+            seqBlockSize += skip;
+            varBlockSize += skip;
+        }
+        else
+        {
+            seqBlockSize = 1;  seqBlockOffset = currOffset;
+            // Bytes different from the previous ones only grow the block, up to its size limit
+            size_t skip = ScanNoRun(source + currOffset, sourceLength - currOffset);
+            skip = std::min(skip, (size_t)0x1fff - varBlockSize);
+            currOffset += skip;
+            varBlockSize += skip;
+            seqBlockOffset = currOffset;
+            currByte = source[currOffset];
+        }
+
+        prevByte = currByte;
+    }
+
+    //printf("RLE Source size: %d  Coded size: %d  Dest offset: %d\n", sourceLength, codedSizeTotal, destOffset);
+    printf("RLE input size %lu. bytes\n", sourceLength);
+    printf("RLE output size %lu. bytes (%1.2f %%)\n", codedSizeTotal, codedSizeTotal * 100.0 / sourceLength);
+    return codedSizeTotal;
+}
+
+size_t DecodeRLE(const uint8_t * source, size_t sourceLength, uint8_t * buffer, size_t bufferLength)
+{
+    size_t currOffset = 0;
+    size_t destOffset = 0;
+    uint8_t filler = 0;
+    while (currOffset < sourceLength)
+    {
+        uint8_t first = source[currOffset++];
+        if (first == 0)
+            break;
+        size_t count = 0;
+        if ((first & 0x80) == 0)  // 1-byte command
+            count = first & 0x1f;
+        else if (currOffset < sourceLength)  // 2-byte command
+            count = (((size_t)first & 0x1f) << 8) | source[currOffset++];
+        // Bad input stops the decoding at the end of the buffers
+        if ((first & 0x60) == 0x40 && count > sourceLength - currOffset)
+            count = sourceLength - currOffset;
+        if ((first & 0x60) == 0x20 && currOffset >= sourceLength)
+            break;
+        if (count > bufferLength - destOffset)
+            count = bufferLength - destOffset;
+        switch (first & 0x60)
+        {
+        case 0x00:
+            filler = 0;
+            for (size_t i = 0; i < count; i++)
+                buffer[destOffset++] = filler;
+            break;
+        case 0x60:
+            filler = 0xff;
+            for (size_t i = 0; i < count; i++)
+                buffer[destOffset++] = filler;
+            break;
+        case 0x20:
+            filler = source[currOffset++];
+            for (size_t i = 0; i < count; i++)
+                buffer[destOffset++] = filler;
+            break;
+        case 0x40:
+            for (size_t i = 0; i < count; i++)
+                buffer[destOffset++] = source[currOffset++];
+            break;
+        }
+    }
+
+    return destOffset;
+}
+
+size_t CRleCodec::Encode(CodecSpan in, CodecSpan out)
+{
+    return EncodeRLE(in.data, in.size, out.data, out.size);
+}
+
+size_t CRleCodec::Decode(CodecSpan in, CodecSpan out)
+{
+    return DecodeRLE(in.data, in.size, out.data, out.size);
+}
+
+bool CRleCodec::Analyze(CodecSpan in, CodecStats* pStats)
+{
+    size_t currOffset = 0;
+    size_t decoded = 0;
+    while (currOffset < in.size)
+    {
+        uint8_t first = in.data[currOffset++];
+        if (first == 0)
+            break;
+        size_t count = first & 0x1f;
+        if (first & 0x80)  // 2-byte command
+        {
+            if (currOffset >= in.size)
+                return false;
+            count = (count << 8) | in.data[currOffset++];
+        }
+        if ((first & 0x60) == 0x40)
+        {
+            pStats->literals += count;
+            pStats->literalRuns++;
+            currOffset += count;
+        }
+        else
+        {
+            if ((first & 0x60) == 0x20)
+                currOffset++;  // Filler byte
+            pStats->matches++;
+            pStats->matchBytes += count;
+        }
+        decoded += count;
+        if (decoded > currOffset && decoded - currOffset > pStats->maxLead)
+            pStats->maxLead = decoded - currOffset;
+    }
+    return currOffset <= in.size;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+uint16_t CalcCheckum(const uint16_t* pData, int nWords)
+{
+    uint16_t wChecksum = 0;
+    for (int i = 0; i < nWords; i++)
+    {
+        uint16_t src = wChecksum;
+        uint16_t src2 = *pData;
+        wChecksum += src2;
+        if (((src & src2) | ((src ^ src2) & ~wChecksum)) & 0100000)  // if Carry
+            wChecksum++;
+        pData++;
+    }
+    return wChecksum;
+}
+
+// Loader decompression time model: CPU cycles from the token statistics of the encoded stream;
+// coefficients fitted to the cycle counts of the loaders run by EmulateLoader() on sample SAV files
+struct LoaderCostModel
+{
+    double      fixed;
+    double      perWord;        // Checksum of the words read from the cartridge
+    double      perLiteral;
+    double      perLiteralRun;
+    double      perMatch;
+    double      perMatchByte;
+    double      perBit;
+};
+
+// Checksum loop is 56 cycles per word in all the loaders. Fitted on 45 code, text, zero-filled, run-heavy
+// and random SAV images of 9000..52000 bytes; the largest error against the emulator is 1 % for RLE, LZSS and LZ4,
+// 3.5 % for LZSA1 and ZX0 (run-heavy images), 7 % for LZSA2: its offset and length encodings vary in cost
+// more than the token counts show, the estimate is low on the code-like images and high on the zero-filled ones
+static const LoaderCostModel g_costPlain = {  808, 56,  0,   0,   0,  0,  0 };
+static const LoaderCostModel g_costRLE   = {  678, 56, 64,   0, 473, 40,  0 };
+static const LoaderCostModel g_costLZSS  = {  913, 56, 144,  0, 320, 48,  0 };
+static const LoaderCostModel g_costLZ4   = {    0, 56, 50, 124, 267, 49,  0 };
+static const LoaderCostModel g_costLZSA1 = {    0, 56, 51, 289, 459, 49,  0 };
+static const LoaderCostModel g_costLZSA2 = {    0, 56, 60, 568, 570, 48,  0 };
+static const LoaderCostModel g_costZX0   = {    0, 56, 50,  15, 417, 48, 108 };
+
+// Filter undo loop, per word of the image
+static const LoaderCostModel g_costFilter = {    0, 78,  0,   0,   0,  0,  0 };
+
+static double CalcLoaderCycles(const LoaderCostModel& model, const CodecStats& stats, size_t words)
+{
+    return model.fixed + model.perWord * words +
+           model.perLiteral * stats.literals + model.perLiteralRun * stats.literalRuns +
+           model.perMatch * stats.matches + model.perMatchByte * stats.matchBytes +
+           model.perBit * stats.bits;
+}
+
+uint64_t EstimateLoaderCycles(const char* name, const LoaderCostModel& model, const CodecStats& stats, size_t words)
+{
+    double cycles = CalcLoaderCycles(model, stats, words);
+    printf("%s loader estimate %.0f. cycles (%1.1f ms at 8 MHz): %lu. literals in %lu. runs, %lu. matches for %lu. bytes, %lu. bits\n",
+           name, cycles, cycles / 8000.0, (unsigned long)stats.literals, (unsigned long)stats.literalRuns,
+           (unsigned long)stats.matches, (unsigned long)stats.matchBytes, (unsigned long)stats.bits);
+    return (uint64_t)cycles;
+}
+
+// The cartridge bytes after the data: only the cartridge is filled, not the whole 64K image buffer
+static void FillCartTail(uint8_t* pCartImage, size_t used, uint8_t value)
+{
+    if (used < 24576)
+        ::memset(pCartImage + used, value, 24576 - used);
+}
+
+// The dictionary goes to the loader block right below 01000, above the loader code and the filter stub,
+// so the forward unpacker finds it in the memory right before the output; the head of the data is taken if it doesn't fit
+static CodecSpan GetLoaderDictionary(const char* name, size_t codeSize)
+{
+    size_t limit = pdpFilter ? std::max(codeSize, (size_t)FILTER_STUB_ADDRESS + loaderFilterSize) : codeSize;
+    size_t size = std::min(dictionary.size(), (size_t)01000 - limit);
+    if (dictionary.size() > 0)
+        printf("%s dictionary %lu. of %lu. bytes at %06o\n", name, (unsigned long)size, (unsigned long)dictionary.size(), (unsigned)(01000 - size));
+    return CodecSpan(dictionary.data(), size);
+}
+
+// The forward loaders read the stream to a fixed address (RLE, LZSS, LZ4) or right below 0160000 (LZSA1, LZSA2, ZX0)
+// and unpack the program from 01000 up, over the stream for a big program: the decoded bytes may lead the read ones by stats.maxLead,
+// so the stream must be at least that far above 01000, or the loader overwrites the bytes it has not read yet
+static bool CheckStreamRoom(const char* name, CCartWorkspace& ws, const CodecStats& stats, size_t imageSize, uint16_t wStreamAddr)
+{
+    if (01000 + stats.maxLead <= wStreamAddr)
+        return true;
+    printf("%s image too big to unpack over the stream at %06o: image end %06lo, safety gap %lu. bytes, max %d. bytes\n",
+           name, wStreamAddr, (unsigned long)(01000 + imageSize), (unsigned long)stats.maxLead, wStreamAddr - 01000);
+    ws.SetNoRoom(true);
+    return false;
+}
+
+size_t PrepareCartPlain(const SavImage& sav, CCartWorkspace& /*ws*/, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles)
+{
+    *pEncodedSize = sav.fileSize;
+    if (sav.fileSize > 24576)
+    {
+        printf("Input file is too big for cartridge: %u. bytes, max 24576. bytes\n", sav.fileSize);
+        return 0;
+    }
+
+    // Copy SAV image as is
+    ::memcpy(pCartImage, sav.pFileImage, sav.fileSize);
+    FillCartTail(pCartImage, sav.fileSize, 0);
+
+    // Prepare the loader
+    memcpy(pCartImage, loader, loaderSize);
+    *((uint16_t*)(pCartImage + 0074)) = sav.wStackAddr;
+    *((uint16_t*)(pCartImage + 0100)) = sav.wStartAddr;
+    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), 027400);
+
+    *pCycles = EstimateLoaderCycles("none", g_costPlain, CodecStats(), 027400);
+
+    return sav.fileSize;  // Finished encoding with plain copy
+}
+
+size_t PrepareCartRLE(const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles)
+{
+    CCodec& codec = *ws.GetCodec(OPTION_COMPRESSION_RLE);
+    size_t rleCodedSize = codec.Encode(CodecSpan(sav.pFileImage + 512, sav.imageSize), CodecSpan(pCartImage + 512, 24576 - 512));
+    *pEncodedSize = rleCodedSize;
+    if (rleCodedSize > 24576 - 512)
+    {
+        printf("RLE encoded size too big: %lu. bytes, max %d. bytes\n", rleCodedSize, 24576 - 512);
+        return 0;
+    }
+    FillCartTail(pCartImage, 512 + rleCodedSize, 0);
+
+    // Trying to decode to make sure encoder works fine
+    uint8_t* pTempBuffer = ws.GetTempBuffer();
+    if (pTempBuffer == NULL)
+    {
+        printf("Failed to allocate memory.");
+        return 0;
+    }
+    size_t decodedSize = codec.Decode(CodecSpan(pCartImage + 512, 24576 - 512), CodecSpan(pTempBuffer, sav.imageSize));
+    if (decodedSize != sav.imageSize)  // Or (size_t)-1: the temp buffer keeps the previous attempt, not to be compared
+    {
+        printf("RLE decode failed, decoded size = %lu (must be: %lu)\n", decodedSize, sav.imageSize);
+        return 0;
+    }
+    for (size_t offset = 0; offset < sav.imageSize; offset++)
+    {
+        if (pTempBuffer[offset] == sav.pFileImage[512 + offset])
+            continue;
+
+        printf("RLE decode failed at offset %06ho (%02x != %02x)\n", (uint16_t)(512 + offset), pTempBuffer[offset], sav.pFileImage[512 + offset]);
+        return 0;
+    }
+    printf("RLE decode check done, decoded size %lu. bytes\n", decodedSize);
+    CodecStats stats;
+    codec.Analyze(CodecSpan(pCartImage + 512, rleCodedSize), &stats);
+    if (!CheckStreamRoom("RLE", ws, stats, sav.imageSize, 0100000))
+        return 0;
+    *pCycles = EstimateLoaderCycles("RLE", g_costRLE, stats, 027400);
+
+    ::memcpy(pCartImage, sav.pFileImage, 512);
+
+    // Prepare the loader
+    memcpy(pCartImage, loaderRLE, loaderRLESize);
+    *((uint16_t*)(pCartImage + 0076)) = sav.wStackAddr;
+    *((uint16_t*)(pCartImage + 0102)) = sav.wStartAddr;
+    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), 027400);
+
+    return rleCodedSize;  // Finished encoding with RLE
+}
+
+size_t PrepareCartLZSS(const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles)
+{
+    CCodec& codec = *ws.GetCodec(OPTION_COMPRESSION_LZSS);
+    size_t lzssCodedSize = codec.Encode(CodecSpan(sav.pFileImage + 512, sav.imageSize), CodecSpan(pCartImage + 512, 65536 - 512));
+    *pEncodedSize = lzssCodedSize;
+    if (lzssCodedSize > 24576 - 512)
+    {
+        printf("LZSS encoded size too big: %lu. bytes, max %d. bytes\n", lzssCodedSize, 24576 - 512);
+        return 0;
+    }
+    FillCartTail(pCartImage, 512 + lzssCodedSize, 0);
+
+    // Trying to decode to make sure encoder works fine
+    uint8_t* pTempBuffer = ws.GetTempBuffer();
+    if (pTempBuffer == NULL)
+    {
+        printf("Failed to allocate memory.");
+        return 0;
+    }
+    size_t decodedSize = codec.Decode(CodecSpan(pCartImage + 512, lzssCodedSize), CodecSpan(pTempBuffer, 65536));
+    if (decodedSize != sav.imageSize)
+    {
+        printf("LZSS decode failed, decoded size = %lu (must be: %lu)\n", decodedSize, sav.imageSize);
+        return 0;
+    }
+    for (size_t offset = 0; offset < sav.imageSize; offset++)
+    {
+        if (pTempBuffer[offset] == sav.pFileImage[512 + offset])
+            continue;
+
+        printf("LZSS decode failed at offset %06ho 0x%04x (%02x != %02x)\n", (uint16_t)(512 + offset), (uint16_t)(512 + offset), pTempBuffer[offset], sav.pFileImage[512 + offset]);
+        return 0;
+    }
+    printf("LZSS decode check done, decoded size %lu. bytes\n", decodedSize);
+    CodecStats stats;
+    codec.Analyze(CodecSpan(pCartImage + 512, lzssCodedSize), &stats);
+    if (!CheckStreamRoom("LZSS", ws, stats, sav.imageSize, 0100600))
+        return 0;
+    *pCycles = EstimateLoaderCycles("LZSS", g_costLZSS, stats, 027400);
+
+    ::memcpy(pCartImage, sav.pFileImage, 512);
+
+    // Prepare the loader
+    memcpy(pCartImage, loaderLZSS, loaderLZSSSize);
+    *((uint16_t*)(pCartImage + 0076)) = sav.wStackAddr;
+    *((uint16_t*)(pCartImage + 0102)) = sav.wStartAddr;
+    *((uint16_t*)(pCartImage + 0212)) = 01000 + sav.imageSize;  // CTOP
+    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), 027400);
+    //printf("LZSS CTOP = %06o\n", 01000 + sav.imageSize);
+
+    return lzssCodedSize;  // Finished encoding with LZSS
+}
+
+size_t PrepareCartLZ4(const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles)
+{
+    CCodec& codec = *ws.GetCodec(OPTION_COMPRESSION_LZ4);
+    CodecSpan dict = GetLoaderDictionary("LZ4", loaderLZ4Size);
+    codec.SetDictionary(dict);
+    size_t lz4CodedSize = codec.Encode(CodecSpan(sav.pFileImage + 512, sav.imageSize), CodecSpan(pCartImage + 512, 65536 - 512));
+    *pEncodedSize = lz4CodedSize;
+    if (lz4CodedSize > 24576 - 512)
+    {
+        printf("LZ4 encoded size too big: %lu. bytes, max %d. bytes\n", lz4CodedSize, 24576 - 512);
+        return 0;
+    }
+    FillCartTail(pCartImage, 512 + lz4CodedSize, 0xff);
+
+    // Trying to decode to make sure encoder works fine
+    uint8_t* pTempBuffer = ws.GetTempBuffer();
+    if (pTempBuffer == NULL)
+    {
+        printf("Failed to allocate memory.");
+        return 0;
+    }
+    size_t decodedSize = codec.Decode(CodecSpan(pCartImage + 512, lz4CodedSize), CodecSpan(pTempBuffer, 65536));
+    if (decodedSize != sav.imageSize)
+    {
+        printf("LZ4 decode failed, decoded size = %lu (must be: %lu)\n", decodedSize, sav.imageSize);
+        return 0;
+    }
+    for (size_t offset = 0; offset < sav.imageSize; offset++)
+    {
+        if (pTempBuffer[offset] == sav.pFileImage[512 + offset])
+            continue;
+
+        printf("LZ4 decode failed at offset %06ho 0x%04x (%02x != %02x)\n", (uint16_t)(512 + offset),
+               (uint16_t)(512 + offset), pTempBuffer[offset], sav.pFileImage[512 + offset]);
+        return 0;
+    }
+    printf("LZ4 decode check done, decoded size %lu. bytes\n", decodedSize);
+    CodecStats stats;
+    codec.Analyze(CodecSpan(pCartImage + 512, lz4CodedSize), &stats);
+    if (!CheckStreamRoom("LZ4", ws, stats, sav.imageSize, 0100600))
+        return 0;
+    *pCycles = EstimateLoaderCycles("LZ4", g_costLZ4, stats, 027400);
+
+    ::memcpy(pCartImage, sav.pFileImage, 512);
+
+    // Prepare the loader
+    memcpy(pCartImage, loaderLZ4, loaderLZ4Size);
+    if (dict.size > 0)
+        memcpy(pCartImage + 01000 - dict.size, dict.data, dict.size);
+    *((uint16_t*)(pCartImage + 0076)) = sav.wStackAddr;
+    *((uint16_t*)(pCartImage + 0102)) = sav.wStartAddr;
+    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), 027400);
+
+    return lz4CodedSize;  // Finished encoding with LZ4
+}
+
+// LZSA encoding with the parameters given, or with all the combinations of the parameters for -lzsaall:
+// the combinations run in parallel, one compression context of the workspace per thread, or one by one
+// in a batch pool thread; of the results that fit the cartridge, the fastest to unpack by the cost model is taken,
+// the smallest one if nothing fits
+static size_t EncodeLZSA(const char* name, int version, const LoaderCostModel& model, CCartWorkspace& ws, CCodec& codec, CodecSpan in, CodecSpan out)
+{
+    if (!lzsaExhaustive)
+        return codec.Encode(in, out);
+
+    struct LzsaTrial
+    {
+        int         minmatch;
+        bool        favorRatio;
+        size_t      encodedSize;
+        uint64_t    cycles;
+        std::vector<uint8_t> output;
+    };
+    std::vector<LzsaTrial> trials;
+    for (int minmatch = (version == 1) ? 3 : 2; minmatch <= ((version == 1) ? 5 : 3); minmatch++)
+    {
+        for (int favor = 1; favor >= 0; favor--)
+        {
+            LzsaTrial trial;
+            trial.minmatch = minmatch;
+            trial.favorRatio = favor != 0;
+            trial.encodedSize = 0;
+            trial.cycles = 0;
+            trials.push_back(trial);
+        }
+    }
+
+    size_t threads = ws.IsPoolWorker() ? 1 : std::thread::hardware_concurrency();
+    if (threads == 0 || threads > trials.size())
+        threads = trials.size();
+    for (size_t i = 0; i < threads; i++)
+        ws.GetLzsaPacker(version, i)->SetDictionary(codec.GetDictionary());
+
+    std::atomic<size_t> next(0);
+    auto worker = [&](size_t workerIndex)
+    {
+        CLzsaCodec& packer = *ws.GetLzsaPacker(version, workerIndex);
+        for (;;)
+        {
+            size_t index = next++;
+            if (index >= trials.size())
+                break;
+            LzsaTrial& trial = trials[index];
+            trial.output.resize(out.size);
+            packer.SetParameters(trial.minmatch, trial.favorRatio);
+            trial.encodedSize = packer.Encode(in, CodecSpan(trial.output.data(), trial.output.size()));
+            CodecStats stats;
+            if (trial.encodedSize <= out.size && packer.Analyze(CodecSpan(trial.output.data(), trial.encodedSize), &stats))
+                trial.cycles = (uint64_t)CalcLoaderCycles(model, stats, (trial.encodedSize + 1) / 2);
+        }
+    };
+    if (threads == 1)
+        worker(0);
+    else
+    {
+        std::vector<std::thread> pool;
+        for (size_t i = 0; i < threads; i++)
+            pool.push_back(std::thread(worker, i));
+        for (size_t i = 0; i < pool.size(); i++)
+            pool[i].join();
+    }
+
+    int selected = -1;
+    for (int i = 0; i < (int)trials.size(); i++)
+    {
+        const LzsaTrial& trial = trials[i];
+        if (trial.encodedSize > out.size)
+            continue;
+        bool fits = trial.encodedSize <= 24576 - 512;
+        if (selected < 0)
+        {
+            selected = i;
+            continue;
+        }
+        const LzsaTrial& best = trials[selected];
+        bool bestFits = best.encodedSize <= 24576 - 512;
+        if (fits != bestFits ? fits :
+            fits ? (trial.cycles < best.cycles || (trial.cycles == best.cycles && trial.encodedSize < best.encodedSize)) :
+                   trial.encodedSize < best.encodedSize)
+            selected = i;
+    }
+    for (int i = 0; i < (int)trials.size(); i++)
+    {
+        const LzsaTrial& trial = trials[i];
+        printf("%s min match %d, %s: size %lu. bytes, %llu. cycles%s\n", name, trial.minmatch,
+               trial.favorRatio ? "ratio" : "speed", (unsigned long)trial.encodedSize,
+               (unsigned long long)trial.cycles, (i == selected) ? "  <= selected" : "");
+    }
+    if (selected < 0)
+        return (size_t)-1;
+
+    ::memcpy(out.data, trials[selected].output.data(), trials[selected].encodedSize);
+    return trials[selected].encodedSize;
+}
+
+// Backward LZSA, same as LZSA_FLAG_RAW_BACKWARD: the reversed image is packed, and the stream is reversed.
+// The loader unpacks it from the end to the start in place: the stream end is placed below the program end
+// by the max lead of the decoded bytes over the read ones, so the output never overtakes the input;
+// the stream start goes a few bytes below 01000, the loader stack is put below the stream.
+static size_t PrepareCartLZSABackward(const char* name, int option, int version, const LoaderCostModel& model,
+                                      const uint16_t* pLoader, size_t backLoaderSize,
+                                      const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles)
+{
+    CCodec& codec = *ws.GetCodec(option);
+    codec.SetDictionary(CodecSpan());
+    uint8_t* pReversed = ws.GetImageCopy(1, sav.imageSize);
+    if (pReversed == nullptr)
+    {
+        printf("Failed to allocate memory.");
+        return 0;
+    }
+    std::reverse_copy(sav.pFileImage + 512, sav.pFileImage + 512 + sav.imageSize, pReversed);
+    size_t encodedSize = EncodeLZSA(name, version, model, ws, codec, CodecSpan(pReversed, sav.imageSize), CodecSpan(pCartImage + 512, 65536 - 512));
+    *pEncodedSize = encodedSize;
+    printf("%s backward output size %lu. bytes (%1.2f %%)\n", name, encodedSize, encodedSize * 100.0 / sav.imageSize);
+    if (encodedSize > 24576 - 512)
+    {
+        printf("%s encoded size too big: %lu. bytes, max %d. bytes\n", name, encodedSize, 24576 - 512);
+        return 0;
+    }
+    FillCartTail(pCartImage, 512 + encodedSize, 0xff);
+
+    // Trying to decode to make sure encoder works fine
+    uint8_t* pTempBuffer = ws.GetTempBuffer();
+    if (pTempBuffer == NULL)
+    {
+        printf("Failed to allocate memory.");
+        return 0;
+    }
+    size_t decodedSize = codec.Decode(CodecSpan(pCartImage + 512, encodedSize), CodecSpan(pTempBuffer, 65536));
+    if (decodedSize != sav.imageSize || memcmp(pTempBuffer, pReversed, sav.imageSize) != 0)
+    {
+        printf("%s backward decode failed, decoded size = %lu (must be: %lu)\n", name, decodedSize, sav.imageSize);
+        return 0;
+    }
+    printf("%s decode check done, decoded size %lu. bytes\n", name, decodedSize);
+    CodecStats stats;
+    codec.Analyze(CodecSpan(pCartImage + 512, encodedSize), &stats);
+    std::reverse(pCartImage + 512, pCartImage + 512 + encodedSize);
+
+    uint16_t wLZWords = (uint16_t)((encodedSize + 1) / 2);  // How many words to copy from the cartridge
+    uint16_t wImageEnd = (uint16_t)(01000 + sav.imageSize);
+    long lzstart = ((long)wImageEnd - (long)stats.maxLead - (long)encodedSize) & ~1L;
+    long lzlimit = pdpFilter ? FILTER_STUB_ADDRESS + (long)loaderFilterSize : (long)backLoaderSize;
+    if (lzstart < lzlimit + 16)  // Loader code, filter stub and a few words of the stack
+    {
+        printf("%s backward safety gap too big: %ld. bytes\n", name, 01000 - lzstart);
+        ws.SetNoRoom(true);
+        return 0;
+    }
+    uint16_t wLZStart = (uint16_t)lzstart;  // Address where to copy to from the cartridge
+    uint16_t wLZEnd = (uint16_t)(wLZStart + encodedSize);
+    printf("%s backward stream at %06o-%06o, safety gap %d. bytes\n", name, wLZStart, wLZEnd, 01000 - wLZStart);
+    *pCycles = EstimateLoaderCycles(name, model, stats, wLZWords);
+
+    ::memcpy(pCartImage, sav.pFileImage, 512);
+
+    // Prepare the loader
+    memcpy(pCartImage, pLoader, backLoaderSize);
+    *((uint16_t*)(pCartImage + 0050)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0054)) = wLZWords;
+    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), wLZWords);
+    *((uint16_t*)(pCartImage + 0074)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0100)) = wLZEnd;
+    *((uint16_t*)(pCartImage + 0104)) = wImageEnd;
+    *((uint16_t*)(pCartImage + 0114)) = sav.wStackAddr;
+    *((uint16_t*)(pCartImage + 0120)) = sav.wStartAddr;
+    *((uint16_t*)(pCartImage + 0130)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0132)) = wLZWords;
+
+    return encodedSize;
+}
+
+size_t PrepareCartLZSA1(const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles)
+{
+    if (lzsaBackward)
+        return PrepareCartLZSABackward("LZSA1", OPTION_COMPRESSION_LZSA1, 1, g_costLZSA1, loaderLZSA1B, loaderLZSA1BSize,
+                                       sav, ws, pCartImage, pEncodedSize, pCycles);
+
+    CCodec& codec = *ws.GetCodec(OPTION_COMPRESSION_LZSA1);
+    CodecSpan dict = GetLoaderDictionary("LZSA1", loaderLZSA1Size);
+    codec.SetDictionary(dict);
+    size_t encodedSize = EncodeLZSA("LZSA1", 1, g_costLZSA1, ws, codec, CodecSpan(sav.pFileImage + 512, sav.imageSize), CodecSpan(pCartImage + 512, 65536 - 512));
+    *pEncodedSize = encodedSize;
+    printf("LZSA1 output size %lu. bytes (%1.2f %%)\n", encodedSize, encodedSize * 100.0 / sav.imageSize);
+    if (encodedSize > 24576 - 512)
+    {
+        printf("LZSA1 encoded size too big: %lu. bytes, max %d. bytes\n", encodedSize, 24576 - 512);
+        return 0;
+    }
+    FillCartTail(pCartImage, 512 + encodedSize, 0xff);
+
+    // Trying to decode to make sure encoder works fine
+    uint8_t* pTempBuffer = ws.GetTempBuffer();
+    if (pTempBuffer == NULL)
+    {
+        printf("Failed to allocate memory.");
+        return 0;
+    }
+    size_t decodedSize = codec.Decode(CodecSpan(pCartImage + 512, encodedSize), CodecSpan(pTempBuffer, 65536));
+    if (decodedSize != sav.imageSize)
+    {
+        printf("LZSA1 decode failed, decoded size = %lu (must be: %lu)\n", decodedSize, sav.imageSize);
+        return 0;
+    }
+    for (size_t offset = 0; offset < sav.imageSize; offset++)
+    {
+        if (pTempBuffer[offset] == sav.pFileImage[512 + offset])
+            continue;
+
+        printf("LZSA1 decode failed at offset %06ho 0x%04x (%02x != %02x)\n", (uint16_t)(512 + offset),
+               (uint16_t)(512 + offset), pTempBuffer[offset], sav.pFileImage[512 + offset]);
+        return 0;
+    }
+    printf("LZSA1 decode check done, decoded size %lu. bytes\n", decodedSize);
+    uint16_t wLZWords = (encodedSize + 1) / 2;  // How many words to copy from the cartridge
+    uint16_t wLZStart = 0160000 - wLZWords * 2 - 0100;  // Address where to copy to from the cartridge
+    CodecStats stats;
+    codec.Analyze(CodecSpan(pCartImage + 512, encodedSize), &stats);
+    if (!CheckStreamRoom("LZSA1", ws, stats, sav.imageSize, wLZStart))
+        return 0;
+    *pCycles = EstimateLoaderCycles("LZSA1", g_costLZSA1, stats, (encodedSize + 1) / 2);
+
+    ::memcpy(pCartImage, sav.pFileImage, 512);
+
+    // Prepare the loader
+    memcpy(pCartImage, loaderLZSA1, loaderLZSA1Size);
+    if (dict.size > 0)
+        memcpy(pCartImage + 01000 - dict.size, dict.data, dict.size);  // The loader stack is above the stream
+    *((uint16_t*)(pCartImage + 0050)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0054)) = wLZWords;
+    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), 027400);
+    *((uint16_t*)(pCartImage + 0076)) = sav.wStackAddr;
+    *((uint16_t*)(pCartImage + 0102)) = sav.wStartAddr;
+    *((uint16_t*)(pCartImage + 0112)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0114)) = wLZWords;
+    *((uint16_t*)(pCartImage + 0124)) = wLZStart;
+
+    return encodedSize;  // Finished encoding with LZSA1
+}
+
+size_t PrepareCartLZSA2(const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles)
+{
+    if (lzsaBackward)
+        return PrepareCartLZSABackward("LZSA2", OPTION_COMPRESSION_LZSA2, 2, g_costLZSA2, loaderLZSA2B, loaderLZSA2BSize,
+                                       sav, ws, pCartImage, pEncodedSize, pCycles);
+
+    CCodec& codec = *ws.GetCodec(OPTION_COMPRESSION_LZSA2);
+    size_t encodedSize = EncodeLZSA("LZSA2", 2, g_costLZSA2, ws, codec, CodecSpan(sav.pFileImage + 512, sav.imageSize), CodecSpan(pCartImage + 512, 65536 - 512));
+    *pEncodedSize = encodedSize;
+    printf("LZSA2 output size %lu. bytes (%1.2f %%)\n", encodedSize, encodedSize * 100.0 / sav.imageSize);
+    if (encodedSize > 24576 - 512)
+    {
+        printf("LZSA2 encoded size too big: %lu. bytes, max %d. bytes\n", encodedSize, 24576 - 512);
+        return 0;
+    }
+    FillCartTail(pCartImage, 512 + encodedSize, 0xff);
+
+    // Trying to decode to make sure encoder works fine
+    uint8_t* pTempBuffer = ws.GetTempBuffer();
+    if (pTempBuffer == NULL)
+    {
+        printf("Failed to allocate memory.");
+        return 0;
+    }
+    size_t decodedSize = codec.Decode(CodecSpan(pCartImage + 512, encodedSize), CodecSpan(pTempBuffer, 65536));
+    if (decodedSize != sav.imageSize)
+    {
+        printf("LZSA2 decode failed, decoded size = %lu (must be: %lu)\n", decodedSize, sav.imageSize);
+        return 0;
+    }
+    for (size_t offset = 0; offset < sav.imageSize; offset++)
+    {
+        if (pTempBuffer[offset] == sav.pFileImage[512 + offset])
+            continue;
+
+        printf("LZSA2 decode failed at offset %06ho 0x%04x (%02x != %02x)\n", (uint16_t)(512 + offset),
+               (uint16_t)(512 + offset), pTempBuffer[offset], sav.pFileImage[512 + offset]);
+        return 0;
+    }
+    printf("LZSA2 decode check done, decoded size %lu. bytes\n", decodedSize);
+    uint16_t wLZWords = (encodedSize + 1) / 2;  // How many words to copy from the cartridge
+    uint16_t wLZStart = 0160000 - wLZWords * 2 - 0100;  // Address where to copy to from the cartridge
+    CodecStats stats;
+    codec.Analyze(CodecSpan(pCartImage + 512, encodedSize), &stats);
+    if (!CheckStreamRoom("LZSA2", ws, stats, sav.imageSize, wLZStart))
+        return 0;
+    *pCycles = EstimateLoaderCycles("LZSA2", g_costLZSA2, stats, (encodedSize + 1) / 2);
+
+    ::memcpy(pCartImage, sav.pFileImage, 512);
+
+    // Prepare the loader
+    memcpy(pCartImage, loaderLZSA2, loaderLZSA2Size);
+    *((uint16_t*)(pCartImage + 0050)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0054)) = wLZWords;
+    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), wLZWords);
+    *((uint16_t*)(pCartImage + 0074)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0110)) = sav.wStackAddr;
+    *((uint16_t*)(pCartImage + 0114)) = sav.wStartAddr;
+    *((uint16_t*)(pCartImage + 0124)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0126)) = wLZWords;
+
+    return encodedSize;  // Finished encoding with LZSA2
+}
+
+size_t PrepareCartZX0(const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles)
+{
+    CCodec& codec = *ws.GetCodec(OPTION_COMPRESSION_ZX0);
+    size_t encodedSize = codec.Encode(CodecSpan(sav.pFileImage + 512, sav.imageSize), CodecSpan(pCartImage + 512, 65536 - 512));
+    *pEncodedSize = encodedSize;
+    if (encodedSize > 24576 - 512)
+    {
+        printf("ZX0 encoded size too big: %lu. bytes, max %d. bytes\n", encodedSize, 24576 - 512);
+        return 0;
+    }
+    FillCartTail(pCartImage, 512 + encodedSize, 0xff);
+
+    // Trying to decode to make sure encoder works fine
+    uint8_t* pTempBuffer = ws.GetTempBuffer();
+    if (pTempBuffer == NULL)
+    {
+        printf("Failed to allocate memory.");
+        return 0;
+    }
+    size_t decodedSize = codec.Decode(CodecSpan(pCartImage + 512, encodedSize), CodecSpan(pTempBuffer, 65536));
+    if (decodedSize != sav.imageSize)
+    {
+        printf("ZX0 decode failed, decoded size = %lu (must be: %lu)\n", decodedSize, sav.imageSize);
+        return 0;
+    }
+    for (size_t offset = 0; offset < sav.imageSize; offset++)
+    {
+        if (pTempBuffer[offset] == sav.pFileImage[512 + offset])
+            continue;
+
+        printf("ZX0 decode failed at offset %06ho 0x%04x (%02x != %02x)\n", (uint16_t)(512 + offset),
+               (uint16_t)(512 + offset), pTempBuffer[offset], sav.pFileImage[512 + offset]);
+        return 0;
+    }
+    printf("ZX0 decode check done, decoded size %lu. bytes\n", decodedSize);
+    uint16_t wLZWords = (encodedSize + 1) / 2;  // How many words to copy from the cartridge
+    uint16_t wLZStart = 0160000 - wLZWords * 2 - 0100;  // Address where to copy to from the cartridge
+    CodecStats stats;
+    codec.Analyze(CodecSpan(pCartImage + 512, encodedSize), &stats);
+    if (!CheckStreamRoom("ZX0", ws, stats, sav.imageSize, wLZStart))
+        return 0;
+    *pCycles = EstimateLoaderCycles("ZX0", g_costZX0, stats, (encodedSize + 1) / 2);
+
+    ::memcpy(pCartImage, sav.pFileImage, 512);
+
+    // Prepare the loader
+    memcpy(pCartImage, loaderZX0, loaderZX0Size);
+    *((uint16_t*)(pCartImage + 0050)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0054)) = wLZWords;
+    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), wLZWords);
+    *((uint16_t*)(pCartImage + 0074)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0110)) = sav.wStackAddr;
+    *((uint16_t*)(pCartImage + 0114)) = sav.wStartAddr;
+    *((uint16_t*)(pCartImage + 0124)) = wLZStart;
+    *((uint16_t*)(pCartImage + 0126)) = wLZWords;
+
+    return encodedSize;  // Finished encoding with ZX0
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+// Fragment of the image split over two cartridges
+struct MultiCartChunk
+{
+    size_t      encodedSize;  // 0 = failed
+    double      cycles;       // Loader time estimate
+};
+
+// Encode the fragment of the SAV image with LZSA1, into the buffer if given
+static MultiCartChunk EncodeMultiCartChunk(const SavImage& sav, CCartWorkspace& ws, size_t offset, size_t size, uint8_t* pBuffer = nullptr)
+{
+    MultiCartChunk chunk;
+    CCodec& codec = *ws.GetCodec(OPTION_COMPRESSION_LZSA1);
+    uint8_t* pOutput = (pBuffer != nullptr) ? pBuffer : ws.GetTempBuffer();
+    chunk.encodedSize = codec.Encode(CodecSpan(sav.pFileImage + 512 + offset, size), CodecSpan(pOutput, 65536));
+    CodecStats stats;
+    if (chunk.encodedSize == 0 || chunk.encodedSize > 65536 || !codec.Analyze(CodecSpan(pOutput, chunk.encodedSize), &stats))
+        chunk.encodedSize = 0;
+    chunk.cycles = CalcLoaderCycles(g_costLZSA1, stats, (chunk.encodedSize + 1) / 2);
+    return chunk;
+}
+
+// Split the image at the given offset and check the fit; returns the estimate, or -1 if doesn't fit;
+// pHeadroom: the smaller of the free spaces left on the cartridges
+static double EvaluateMultiCartSplit(const SavImage& sav, CCartWorkspace& ws, size_t split,
+                                     std::map<size_t, MultiCartChunk>* pFirst, std::map<size_t, MultiCartChunk>* pSecond,
+                                     size_t* pHeadroom)
+{
+    if (pFirst->find(split) == pFirst->end())
+        (*pFirst)[split] = EncodeMultiCartChunk(sav, ws, 0, split);
+    if (pSecond->find(split) == pSecond->end())
+        (*pSecond)[split] = EncodeMultiCartChunk(sav, ws, split, sav.imageSize - split);
+    const MultiCartChunk& first = (*pFirst)[split];
+    const MultiCartChunk& second = (*pSecond)[split];
+    size_t secondStart = 0160000 - 0100 - (second.encodedSize + 1) / 2 * 2;  // The second fragment is read above the first one unpacked
+    if (first.encodedSize == 0 || first.encodedSize > 24576 - 512 ||
+        second.encodedSize == 0 || second.encodedSize > 24576 || secondStart < 01000 + split)
+        return -1.0;
+    *pHeadroom = std::min(24576 - 512 - first.encodedSize, 24576 - second.encodedSize);
+    return first.cycles + second.cycles;
+}
+
+// Split the image over two cartridges, both fragments packed with LZSA1: the partitioner looks for the split
+// where both fragments fit and the estimated unpacking time is minimal, on a grid and then closer to the best point;
+// the time changes little with the split, so of the splits within 0.5 % of time the more balanced one is taken
+bool PrepareMultiCart(const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage1, uint8_t* pCartImage2, MultiCartInfo* pInfo)
+{
+    printf("Splitting the image over two cartridges, LZSA1\n");
+    ws.GetCodec(OPTION_COMPRESSION_LZSA1)->SetDictionary(CodecSpan());
+    std::map<size_t, MultiCartChunk> first, second;
+    const int gridSteps = 8;
+    size_t bestSplit = 0, bestHeadroom = 0;
+    double bestCycles = -1.0;
+    auto trysplit = [&](size_t split)
+    {
+        split &= ~(size_t)1;  // Fragments are read by words
+        if (split < 2 || split > sav.imageSize - 2)
+            return;
+        size_t headroom = 0;
+        double cycles = EvaluateMultiCartSplit(sav, ws, split, &first, &second, &headroom);
+        if (cycles < 0)
+            return;
+        if (bestCycles < 0 || cycles < bestCycles * 0.995 ||
+            (cycles < bestCycles * 1.005 && headroom > bestHeadroom))
+        {
+            bestSplit = split;
+            bestCycles = cycles;
+            bestHeadroom = headroom;
+        }
+    };
+    for (int i = 1; i < gridSteps; i++)
+        trysplit(sav.imageSize * i / gridSteps);
+    if (bestCycles < 0)
+    {
+        // Nothing fits on the grid: the largest first fragment leaves the most room for the second one
+        size_t low = 2, high = sav.imageSize - 2;
+        while (high - low > 2)
+        {
+            size_t middle = (low + high) / 2 & ~(size_t)1;
+            if (EncodeMultiCartChunk(sav, ws, 0, middle).encodedSize <= 24576 - 512)
+                low = middle;
+            else
+                high = middle;
+        }
+        trysplit(low);
+    }
+    if (bestCycles < 0)
+    {
+        printf("Split image does not fit two cartridges\n");
+        return false;
+    }
+    for (size_t step = sav.imageSize / gridSteps / 2; step >= 1024; step /= 2)
+    {
+        size_t center = bestSplit;
+        trysplit(center - step);
+        trysplit(center + step);
+    }
+
+    // Encode the chosen split to the cartridge images
+    MultiCartChunk chunk1 = EncodeMultiCartChunk(sav, ws, 0, bestSplit, pCartImage1 + 512);
+    MultiCartChunk chunk2 = EncodeMultiCartChunk(sav, ws, bestSplit, sav.imageSize - bestSplit, pCartImage2);
+    FillCartTail(pCartImage1, 512 + chunk1.encodedSize, 0xff);
+    FillCartTail(pCartImage2, chunk2.encodedSize, 0xff);
+    pInfo->split = bestSplit;
+    pInfo->encodedSize1 = chunk1.encodedSize;
+    pInfo->encodedSize2 = chunk2.encodedSize;
+    printf("Split at %06ho: %lu. + %lu. bytes, packed %lu. + %lu. bytes\n", (uint16_t)(01000 + bestSplit),
+           (unsigned long)bestSplit, (unsigned long)(sav.imageSize - bestSplit),
+           (unsigned long)chunk1.encodedSize, (unsigned long)chunk2.encodedSize);
+
+    // Trying to decode to make sure encoder works fine
+    CCodec& codec = *ws.GetCodec(OPTION_COMPRESSION_LZSA1);
+    uint8_t* pTempBuffer = ws.GetTempBuffer();
+    if (pTempBuffer == NULL)
+    {
+        printf("Failed to allocate memory.");
+        return false;
+    }
+    size_t decodedSize1 = codec.Decode(CodecSpan(pCartImage1 + 512, chunk1.encodedSize), CodecSpan(pTempBuffer, 65536));
+    size_t decodedSize2 = codec.Decode(CodecSpan(pCartImage2, chunk2.encodedSize), CodecSpan(pTempBuffer + bestSplit, 65536 - bestSplit));
+    size_t decodedSize = (decodedSize1 == bestSplit && decodedSize2 == sav.imageSize - bestSplit) ? sav.imageSize : 0;
+    if (decodedSize != sav.imageSize || memcmp(pTempBuffer, sav.pFileImage + 512, sav.imageSize) != 0)
+    {
+        printf("Split image decode failed, decoded size %lu. bytes\n", (unsigned long)decodedSize);
+        return false;
+    }
+    printf("Split image decode check done, decoded size %lu. bytes\n", (unsigned long)decodedSize);
+    pInfo->cycles = (uint64_t)(chunk1.cycles + chunk2.cycles);
+    printf("Split image loader estimate %llu. cycles (%1.1f ms at 8 MHz)\n",
+           (unsigned long long)pInfo->cycles, pInfo->cycles / 8000.0);
+
+    ::memcpy(pCartImage1, sav.pFileImage, 512);
+
+    // Prepare the loader and the fragment table
+    memcpy(pCartImage1, loaderMultiLZSA1, loaderMultiLZSA1Size);
+    uint16_t wWords1 = (uint16_t)((chunk1.encodedSize + 1) / 2);
+    uint16_t wWords2 = (uint16_t)((chunk2.encodedSize + 1) / 2);
+    uint16_t* pChunks = (uint16_t*)(pCartImage1 + 0214);
+    *((uint16_t*)(pCartImage1 + 0162)) = sav.wStackAddr;
+    *((uint16_t*)(pCartImage1 + 0166)) = sav.wStartAddr;
+    pChunks[0] = 0;  // Boot cartridge
+    pChunks[1] = 01000;
+    pChunks[2] = 0160000 - 0100 - wWords1 * 2;
+    pChunks[3] = wWords1;
+    pChunks[4] = CalcCheckum((uint16_t*)(pCartImage1 + 01000), wWords1);
+    pChunks[5] = 01000;
+    pChunks[6] = 1;  // The other cartridge
+    pChunks[7] = 0;
+    pChunks[8] = 0160000 - 0100 - wWords2 * 2;
+    pChunks[9] = wWords2;
+    pChunks[10] = CalcCheckum((uint16_t*)pCartImage2, wWords2);
+    pChunks[11] = (uint16_t)(01000 + bestSplit);
+
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+// PDP-11 code filter, like x86 BCJ filters: the PC-relative operand of JSR PC,addr is replaced with
+// its own address added, that is the target address - 2, so all the calls of a subroutine give the same words.
+// Opcode words are never changed, so the undo scans the words exactly the same way.
+// JMP addr is left as is: it is rare, and one more compare costs the loader ~20 cycles per word of the image.
+size_t FilterPdpCode(uint8_t* data, size_t size, uint16_t address, bool encode)
+{
+    if (size < 4)
+        return 0;
+    size_t count = 0;
+    size_t offset = 0;
+    do
+    {
+        uint16_t opcode = (uint16_t)(data[offset] | (data[offset + 1] << 8));
+        offset += 2;
+        if (opcode == 004767)  // JSR PC,addr
+        {
+            uint16_t operand = (uint16_t)(data[offset] | (data[offset + 1] << 8));
+            uint16_t operandAddress = (uint16_t)(address + offset);
+            operand = encode ? (uint16_t)(operand + operandAddress) : (uint16_t)(operand - operandAddress);
+            data[offset] = (uint8_t)operand;
+            data[offset + 1] = (uint8_t)(operand >> 8);
+            offset += 2;
+            count++;
+        }
+    }
+    while (offset < size - 2);  // Same as CMP R1,R2; BLO in loaderFilter
+    return count;
+}
+
+size_t PrepareCart(const CodecInfo& codec, const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles)
+{
+    ws.SetNoRoom(false);
+    if (!pdpFilter || codec.option == OPTION_COMPRESSION_NONE)
+        return codec.prepare(sav, ws, pCartImage, pEncodedSize, pCycles);
+
+    uint8_t* pImage = ws.GetImageCopy(0, sav.fileSize);
+    if (pImage == nullptr)
+    {
+        printf("Failed to allocate memory.");
+        return 0;
+    }
+    ::memcpy(pImage, sav.pFileImage, sav.fileSize);
+    size_t count = FilterPdpCode(pImage + 512, sav.imageSize, 01000, true);
+    printf("PDP-11 filter: %lu. operands of JSR PC made absolute\n", (unsigned long)count);
+    SavImage filtered = sav;
+    filtered.pFileImage = pImage;
+    filtered.wStartAddr = FILTER_STUB_ADDRESS;
+    size_t result = codec.prepare(filtered, ws, pCartImage, pEncodedSize, pCycles);
+    if (result == 0)
+        return 0;
+
+    memcpy(pCartImage + FILTER_STUB_ADDRESS, loaderFilter, loaderFilterSize);
+    *((uint16_t*)(pCartImage + FILTER_STUB_ADDRESS + 006)) = (uint16_t)(01000 + sav.imageSize - 2);
+    *((uint16_t*)(pCartImage + FILTER_STUB_ADDRESS + 026)) = sav.wStartAddr;
+    CodecStats stats;
+    stats.matches = count;
+    *pCycles += (uint64_t)CalcLoaderCycles(g_costFilter, stats, sav.imageSize / 2);
+    return result;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+
+// All the codecs, in order of sequential trying
+const CodecInfo g_codecs[] =
+{
+    { OPTION_COMPRESSION_NONE,  "none",  PrepareCartPlain },
+    { OPTION_COMPRESSION_RLE,   "RLE",   PrepareCartRLE   },
+    { OPTION_COMPRESSION_LZSS,  "LZSS",  PrepareCartLZSS  },
+    { OPTION_COMPRESSION_LZ4,   "LZ4",   PrepareCartLZ4   },
+    { OPTION_COMPRESSION_LZSA1, "LZSA1", PrepareCartLZSA1 },
+    { OPTION_COMPRESSION_LZSA2, "LZSA2", PrepareCartLZSA2 },
+    { OPTION_COMPRESSION_ZX0,   "ZX0",   PrepareCartZX0   },
+};
+const int g_codecCount = sizeof(g_codecs) / sizeof(g_codecs[0]);
+
+CCodec* CreateCodec(int option)
+{
+    switch (option)
+    {
+    case OPTION_COMPRESSION_RLE:   return new CRleCodec();
+    case OPTION_COMPRESSION_LZSS:  return new CLzssCodec(lzssMaxChain, lzssOptimal);
+    case OPTION_COMPRESSION_LZ4:   return new CLz4Codec(lz4MaxChain);
+    case OPTION_COMPRESSION_LZSA1: return new CLzsaCodec(1, lzsaMinMatch, lzsaFavorRatio);
+    case OPTION_COMPRESSION_LZSA2: return new CLzsaCodec(2, lzsaMinMatch, lzsaFavorRatio);
+    case OPTION_COMPRESSION_ZX0:   return new CZx0Codec();
+    default:                       return nullptr;
+    }
+}
+
+CCartWorkspace::CCartWorkspace()
+    : m_pTempBuffer(nullptr), m_pInput(nullptr), m_inputCapacity(0), m_noRoom(false), m_poolWorker(false)
+{
+    m_pImageCopies[0] = m_pImageCopies[1] = nullptr;
+    m_imageCopyCapacities[0] = m_imageCopyCapacities[1] = 0;
+    for (int i = 0; i < 8; i++)
+        m_codecs[i] = nullptr;
+}
+
+CCartWorkspace::~CCartWorkspace()
+{
+    for (int i = 0; i < 8; i++)
+        delete m_codecs[i];
+    for (int v = 0; v < 2; v++)
+    {
+        for (size_t i = 0; i < m_lzsaPackers[v].size(); i++)
+            delete m_lzsaPackers[v][i];
+    }
+    ::free(m_pTempBuffer);
+    ::free(m_pInput);
+    ::free(m_pImageCopies[0]);
+    ::free(m_pImageCopies[1]);
+    for (size_t i = 0; i < m_cartImages.size(); i++)
+        ::free(m_cartImages[i]);
+}
+
+uint8_t* CCartWorkspace::GetTempBuffer()
+{
+    if (m_pTempBuffer == nullptr)
+        m_pTempBuffer = (uint8_t*) ::malloc(65536);
+    return m_pTempBuffer;
+}
+
+CCodec* CCartWorkspace::GetCodec(int option)
+{
+    int index = 0;  // Bit number in OPTION_COMPRESSION_MASK
+    while (index < 7 && (option & (0x0100 << index)) == 0)
+        index++;
+    if (m_codecs[index] == nullptr)
+        m_codecs[index] = CreateCodec(option);
+    return m_codecs[index];
+}
+
+CLzsaCodec* CCartWorkspace::GetLzsaPacker(int version, size_t index)
+{
+    std::vector<CLzsaCodec*>& packers = m_lzsaPackers[version - 1];
+    if (index >= packers.size())
+        packers.resize(index + 1, nullptr);
+    if (packers[index] == nullptr)
+        packers[index] = new CLzsaCodec(version);
+    return packers[index];
+}
+
+uint8_t* CCartWorkspace::GetCartImage(int index)
+{
+    if ((size_t)index >= m_cartImages.size())
+        m_cartImages.resize(index + 1, nullptr);
+    if (m_cartImages[index] == nullptr)
+        m_cartImages[index] = (uint8_t*) ::calloc(65536, 1);
+    return m_cartImages[index];
+}
+
+// Grown with the reserve, so the next files of the batch usually fit without a new allocation
+static uint8_t* GrowBuffer(uint8_t*& pBuffer, size_t& capacity, size_t size)
+{
+    if (pBuffer == nullptr || capacity < size)
+    {
+        ::free(pBuffer);
+        capacity = size + size / 4;
+        pBuffer = (uint8_t*) ::malloc(capacity);
+        if (pBuffer == nullptr)
+            capacity = 0;
+    }
+    return pBuffer;
+}
+
+uint8_t* CCartWorkspace::GetInputBuffer(size_t size)
+{
+    return GrowBuffer(m_pInput, m_inputCapacity, size);
+}
+
+uint8_t* CCartWorkspace::GetImageCopy(int index, size_t size)
+{
+    return GrowBuffer(m_pImageCopies[index], m_imageCopyCapacities[index], size);
+}
+
+// Read the SAV file and get the addresses from its header
+bool LoadSavImage(const char* filename, SavImage* pSav, CCartWorkspace& ws)
+{
+    FILE* inputfile = fopen(filename, "rb");
+    if (inputfile == nullptr)
+    {
+        printf("Failed to open the input file (%d).", errno);
+        return false;
+    }
+    ::fseek(inputfile, 0, SEEK_END);
+    pSav->fileSize = ::ftell(inputfile);
+
+    pSav->pFileImage = ws.GetInputBuffer(pSav->fileSize);
+    if (pSav->pFileImage == nullptr)
+    {
+        printf("Failed to allocate memory.");
+        ::fclose(inputfile);
+        return false;
+    }
+
+    ::fseek(inputfile, 0, SEEK_SET);
+    size_t bytesRead = ::fread(pSav->pFileImage, 1, pSav->fileSize, inputfile);
+    ::fclose(inputfile);
+    if (bytesRead != pSav->fileSize)
+    {
+        printf("Failed to read the input file.");
+        pSav->pFileImage = nullptr;
+        return false;
+    }
+    printf("Input file size %u. bytes\n", pSav->fileSize);
+
+    pSav->wStartAddr = *((uint16_t*)(pSav->pFileImage + 040));
+    pSav->wStackAddr = *((uint16_t*)(pSav->pFileImage + 042));
+    pSav->wTopAddr = *((uint16_t*)(pSav->pFileImage + 050));
+    printf("SAV Start\t%06ho  %04x  %5d\n", pSav->wStartAddr, pSav->wStartAddr, pSav->wStartAddr);
+    printf("SAV Stack\t%06ho  %04x  %5d\n", pSav->wStackAddr, pSav->wStackAddr, pSav->wStackAddr);
+    printf("SAV Top  \t%06ho  %04x  %5d\n", pSav->wTopAddr, pSav->wTopAddr, pSav->wTopAddr);
+    pSav->imageSize = ((size_t)pSav->wTopAddr + 2 - 01000);
+    printf("SAV image size\t%06ho  %04lx  %5lu\n", (uint16_t)pSav->imageSize, pSav->imageSize, pSav->imageSize);
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////
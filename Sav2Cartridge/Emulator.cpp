@@ -0,0 +1,666 @@
+﻿/*  This file is part of UKNCBTL.
+UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// Emulator.cpp : KM1801VM2 interpreter to run the cartridge loaders
+
+#include <stdio.h>
+#include <string.h>
+#include "Sav2Cart.h"
+
+
+//////////////////////////////////////////////////////////////////////
+
+// Approximate KM1801VM2 timing, in CPU clock ticks: a flat cost per instruction and per bus cycle,
+// not the per-instruction figures of the processor; good to compare the loaders with each other,
+// the absolute time of the real machine differs
+const int TIMING_INSTRUCTION = 8;   // Decode and execute, register operands
+const int TIMING_BUS         = 8;   // Every bus cycle: instruction fetch, operand read or write
+const int TIMING_SHIFT       = 2;   // ASH/ASHC, per bit
+const int TIMING_MUL         = 40;
+const int TIMING_DIV         = 80;
+
+const uint32_t MAX_INSTRUCTIONS = 100000000;  // Loader is stuck if not finished after that
+
+const uint16_t IOPAGE_START   = 0160000;
+const uint16_t CHANNEL2_STATE = 0176674;
+const uint16_t CHANNEL2_DATA  = 0176676;
+
+// CPU with 56K RAM, I/O page with channel 2 only; the PPU side of channel 2 reads the cartridges
+class CEmulator
+{
+public:
+    uint16_t        R[8];
+    bool            N, Z, V, C;
+    uint32_t        instructions;
+    uint64_t        cycles;
+    const char*     error;      // Not null when stopped by an error
+    uint16_t        errorpc;
+    uint8_t         memory[65536];
+
+private:
+    const uint8_t*  m_pCarts[2];  // Cartridges 1 and 2, nullptr if the slot is empty
+    size_t          m_cartSize;
+    uint8_t         m_channelBytes[4];
+    int             m_channelCount;
+
+public:
+    CEmulator(const uint8_t* pCartImage1, const uint8_t* pCartImage2, size_t cartSize);
+    // Run from the current PC until PC leaves the loader area; false on error
+    bool RunLoader(uint16_t loaderEnd);
+
+private:
+    void Fail(const char* message);
+    uint16_t ReadWord(uint16_t address);
+    uint8_t  ReadByte(uint16_t address);
+    void WriteWord(uint16_t address, uint16_t value);
+    void WriteByte(uint16_t address, uint8_t value);
+    uint16_t Fetch();
+    uint16_t OperandAddress(int spec, bool byte);
+    uint16_t ReadOperand(int spec, bool byte, uint16_t* pAddress);
+    void WriteOperand(int spec, bool byte, uint16_t address, uint16_t value);
+    void Push(uint16_t value);
+    uint16_t Pop();
+    void SetNZ(uint16_t value, bool byte);
+    void ChannelWrite(uint8_t value);
+    void Execute();
+};
+
+CEmulator::CEmulator(const uint8_t* pCartImage1, const uint8_t* pCartImage2, size_t cartSize)
+{
+    memset(R, 0, sizeof(R));
+    N = Z = V = C = false;
+    instructions = 0;
+    cycles = 0;
+    error = nullptr;
+    errorpc = 0;
+    memset(memory, 0, sizeof(memory));
+    m_pCarts[0] = pCartImage1;
+    m_pCarts[1] = pCartImage2;
+    m_cartSize = cartSize;
+    m_channelCount = 0;
+}
+
+void CEmulator::Fail(const char* message)
+{
+    if (error == nullptr)
+    {
+        error = message;
+        errorpc = R[7];
+    }
+}
+
+// Word access ignores the lowest address bit, like on 1801 series processors
+uint16_t CEmulator::ReadWord(uint16_t address)
+{
+    cycles += TIMING_BUS;
+    address &= ~1;
+    if (address >= IOPAGE_START)
+    {
+        if (address == CHANNEL2_STATE)
+            return 0200;  // Always ready
+        Fail("read from unknown I/O port");
+        return 0;
+    }
+    return (uint16_t)(memory[address] | (memory[address + 1] << 8));
+}
+
+uint8_t CEmulator::ReadByte(uint16_t address)
+{
+    if (address >= IOPAGE_START)
+        return (uint8_t)(ReadWord(address) >> ((address & 1) * 8));
+    cycles += TIMING_BUS;
+    return memory[address];
+}
+
+void CEmulator::WriteWord(uint16_t address, uint16_t value)
+{
+    cycles += TIMING_BUS;
+    address &= ~1;
+    if (address >= IOPAGE_START)
+    {
+        if (address == CHANNEL2_DATA)
+            ChannelWrite((uint8_t)value);
+        else
+            Fail("write to unknown I/O port");
+        return;
+    }
+    memory[address] = (uint8_t)value;
+    memory[address + 1] = (uint8_t)(value >> 8);
+}
+
+void CEmulator::WriteByte(uint16_t address, uint8_t value)
+{
+    if (address >= IOPAGE_START)
+    {
+        WriteWord(address, value);
+        return;
+    }
+    cycles += TIMING_BUS;
+    memory[address] = value;
+}
+
+// Channel 2 gets the address of the parameter block and 377, 377;
+// then PPU executes the command and puts the result in the low byte of the block
+void CEmulator::ChannelWrite(uint8_t value)
+{
+    m_channelBytes[m_channelCount++] = value;
+    if (m_channelCount < 4)
+        return;
+    m_channelCount = 0;
+    if (m_channelBytes[2] != 0377 || m_channelBytes[3] != 0377)
+    {
+        Fail("wrong channel 2 sequence");
+        return;
+    }
+
+    uint16_t block = (uint16_t)(m_channelBytes[0] | (m_channelBytes[1] << 8));
+    const uint8_t* pBlock = memory + block;
+    int command = pBlock[1];
+    int cartNumber = pBlock[3];
+    size_t cartAddress = (size_t)(pBlock[4] | (pBlock[5] << 8));
+    uint16_t ramAddress = (uint16_t)(pBlock[6] | (pBlock[7] << 8));
+    size_t wordCount = (size_t)(pBlock[8] | (pBlock[9] << 8));
+    uint8_t result = 0;
+    if (command != 010 || cartNumber < 1 || cartNumber > 2 || m_pCarts[cartNumber - 1] == nullptr ||
+        cartAddress + wordCount * 2 > m_cartSize || (size_t)ramAddress + wordCount * 2 > IOPAGE_START)
+        result = 0377;
+    else
+        memcpy(memory + ramAddress, m_pCarts[cartNumber - 1] + cartAddress, wordCount * 2);
+    memory[block] = result;
+}
+
+uint16_t CEmulator::Fetch()
+{
+    uint16_t value = ReadWord(R[7]);
+    R[7] += 2;
+    return value;
+}
+
+// Address of the operand for modes 1..7
+uint16_t CEmulator::OperandAddress(int spec, bool byte)
+{
+    int mode = (spec >> 3) & 7;
+    int reg = spec & 7;
+    uint16_t step = (byte && reg < 6) ? 1 : 2;
+    uint16_t address;
+    switch (mode)
+    {
+    case 1:
+        return R[reg];
+    case 2:
+        address = R[reg];  R[reg] += step;
+        return address;
+    case 3:
+        address = R[reg];  R[reg] += 2;
+        return ReadWord(address);
+    case 4:
+        R[reg] -= step;
+        return R[reg];
+    case 5:
+        R[reg] -= 2;
+        return ReadWord(R[reg]);
+    case 6:
+        address = Fetch();
+        return (uint16_t)(address + R[reg]);
+    default:  // 7
+        address = Fetch();
+        return ReadWord((uint16_t)(address + R[reg]));
+    }
+}
+
+uint16_t CEmulator::ReadOperand(int spec, bool byte, uint16_t* pAddress)
+{
+    if ((spec & 070) == 0)
+        return byte ? (uint16_t)(R[spec & 7] & 0377) : R[spec & 7];
+    uint16_t address = OperandAddress(spec, byte);
+    if (pAddress != nullptr)
+        *pAddress = address;
+    return byte ? ReadByte(address) : ReadWord(address);
+}
+
+void CEmulator::WriteOperand(int spec, bool byte, uint16_t address, uint16_t value)
+{
+    if ((spec & 070) == 0)
+    {
+        if (byte)
+            R[spec & 7] = (uint16_t)((R[spec & 7] & 0177400) | (value & 0377));
+        else
+            R[spec & 7] = value;
+        return;
+    }
+    if (byte)
+        WriteByte(address, (uint8_t)value);
+    else
+        WriteWord(address, value);
+}
+
+void CEmulator::Push(uint16_t value)
+{
+    R[6] -= 2;
+    WriteWord(R[6], value);
+}
+
+uint16_t CEmulator::Pop()
+{
+    uint16_t value = ReadWord(R[6]);
+    R[6] += 2;
+    return value;
+}
+
+void CEmulator::SetNZ(uint16_t value, bool byte)
+{
+    N = byte ? (value & 0200) != 0 : (value & 0100000) != 0;
+    Z = byte ? (value & 0377) == 0 : value == 0;
+}
+
+void CEmulator::Execute()
+{
+    uint16_t instr = Fetch();
+    instructions++;
+    cycles += TIMING_INSTRUCTION;
+
+    bool byte = (instr & 0100000) != 0;
+    uint16_t sign = byte ? 0200 : 0100000;
+    uint16_t mask = byte ? 0377 : 0177777;
+    int src = (instr >> 6) & 077;
+    int dst = instr & 077;
+    uint16_t address = 0, srcval, dstval, result;
+
+    // Double operand instructions
+    int opcode = (instr >> 12) & 7;
+    if (opcode >= 1 && opcode <= 6)
+    {
+        srcval = ReadOperand(src, byte && opcode != 6, nullptr);
+        if (opcode == 6)  // ADD, SUB
+        {
+            dstval = ReadOperand(dst, false, &address);
+            if (!byte)
+            {
+                result = (uint16_t)(srcval + dstval);
+                V = ((~(srcval ^ dstval) & (srcval ^ result)) & 0100000) != 0;
+                C = (uint32_t)srcval + dstval > 0177777;
+            }
+            else
+            {
+                result = (uint16_t)(dstval - srcval);
+                V = (((srcval ^ dstval) & (dstval ^ result)) & 0100000) != 0;
+                C = dstval < srcval;
+            }
+            SetNZ(result, false);
+            WriteOperand(dst, false, address, result);
+            return;
+        }
+        if (opcode == 1)  // MOV, MOVB
+        {
+            result = srcval & mask;
+            if ((dst & 070) == 0 && byte)
+                R[dst & 7] = (uint16_t)(int16_t)(int8_t)result;  // MOVB to register: sign extension
+            else
+            {
+                if ((dst & 070) != 0)
+                    address = OperandAddress(dst, byte);
+                WriteOperand(dst, byte, address, result);
+            }
+            SetNZ(result, byte);
+            V = false;
+            return;
+        }
+        dstval = ReadOperand(dst, byte, &address);
+        switch (opcode)
+        {
+        case 2:  // CMP
+            result = (uint16_t)((srcval - dstval) & mask);
+            SetNZ(result, byte);
+            V = (((srcval ^ dstval) & (srcval ^ result)) & sign) != 0;
+            C = (srcval & mask) < (dstval & mask);
+            return;
+        case 3:  // BIT
+            SetNZ(srcval & dstval, byte);
+            V = false;
+            return;
+        case 4:  // BIC
+            result = dstval & ~srcval;
+            break;
+        default:  // 5: BIS
+            result = dstval | srcval;
+            break;
+        }
+        SetNZ(result, byte);
+        V = false;
+        WriteOperand(dst, byte, address, result);
+        return;
+    }
+
+    // EIS instructions, XOR, SOB
+    if ((instr & 0170000) == 0070000)
+    {
+        int reg = (instr >> 6) & 7;
+        switch ((instr >> 9) & 7)
+        {
+        case 0:  // MUL
+            {
+                int32_t product = (int32_t)(int16_t)R[reg] * (int16_t)ReadOperand(dst, false, nullptr);
+                cycles += TIMING_MUL;
+                if ((reg & 1) == 0)
+                {
+                    R[reg] = (uint16_t)(product >> 16);  R[reg | 1] = (uint16_t)product;
+                }
+                else
+                    R[reg] = (uint16_t)product;
+                N = product < 0;  Z = product == 0;  V = false;
+                C = product < -32768 || product > 32767;
+                return;
+            }
+        case 1:  // DIV
+            {
+                int16_t divisor = (int16_t)ReadOperand(dst, false, nullptr);
+                int32_t dividend = (int32_t)(((uint32_t)R[reg] << 16) | R[reg | 1]);
+                cycles += TIMING_DIV;
+                if (divisor == 0)
+                {
+                    V = C = true;
+                    return;
+                }
+                int32_t quotient = dividend / divisor;
+                if (quotient < -32768 || quotient > 32767)
+                {
+                    V = true;  C = false;
+                    return;
+                }
+                R[reg] = (uint16_t)quotient;  R[reg | 1] = (uint16_t)(dividend % divisor);
+                N = quotient < 0;  Z = quotient == 0;  V = C = false;
+                return;
+            }
+        case 2:  // ASH
+            {
+                int shift = ReadOperand(dst, false, nullptr) & 077;
+                int16_t value = (int16_t)R[reg];
+                int16_t result16 = value;
+                if (shift & 040)  // Right
+                {
+                    shift = 64 - shift;
+                    C = ((value >> (shift - 1)) & 1) != 0;
+                    result16 = (shift < 32) ? (int16_t)(value >> shift) : (int16_t)((value < 0) ? -1 : 0);
+                }
+                else if (shift > 0)
+                {
+                    C = ((((uint32_t)(uint16_t)value) << shift) & 0200000) != 0;
+                    result16 = (int16_t)(uint16_t)(((uint32_t)(uint16_t)value) << shift);
+                }
+                cycles += shift * TIMING_SHIFT;
+                V = ((value ^ result16) & 0100000) != 0;
+                R[reg] = (uint16_t)result16;
+                SetNZ(R[reg], false);
+                return;
+            }
+        case 3:  // ASHC
+            {
+                int shift = ReadOperand(dst, false, nullptr) & 077;
+                int32_t value = (int32_t)(((uint32_t)R[reg] << 16) | R[reg | 1]);
+                int32_t result32 = value;
+                if (shift & 040)  // Right
+                {
+                    shift = 64 - shift;
+                    C = ((value >> (shift - 1)) & 1) != 0;
+                    result32 = (shift < 32) ? value >> shift : ((value < 0) ? -1 : 0);  // Shift by 32 is undefined in C++
+                }
+                else if (shift > 0)
+                {
+                    C = ((((uint64_t)(uint32_t)value) << shift) & 0x100000000ULL) != 0;
+                    result32 = (int32_t)(uint32_t)(((uint64_t)(uint32_t)value) << shift);
+                }
+                cycles += shift * TIMING_SHIFT;
+                V = ((value ^ result32) & 0x80000000) != 0;
+                if ((reg & 1) == 0)
+                {
+                    R[reg] = (uint16_t)(result32 >> 16);  R[reg | 1] = (uint16_t)result32;
+                }
+                else  // Odd register: the result is the low word
+                    R[reg] = (uint16_t)result32;
+                N = result32 < 0;  Z = result32 == 0;
+                return;
+            }
+        case 4:  // XOR
+            dstval = ReadOperand(dst, false, &address);
+            result = dstval ^ R[reg];
+            SetNZ(result, false);
+            V = false;
+            WriteOperand(dst, false, address, result);
+            return;
+        case 7:  // SOB
+            if (--R[reg] != 0)
+                R[7] -= (uint16_t)((instr & 077) * 2);
+            return;
+        default:
+            Fail("unknown instruction");
+            return;
+        }
+    }
+
+    // Branches
+    if ((instr & 0074000) == 0 && (instr & 0103400) != 0)
+    {
+        bool condition;
+        switch (instr & 0103400)
+        {
+        case 0000400: condition = true; break;                 // BR
+        case 0001000: condition = !Z; break;                   // BNE
+        case 0001400: condition = Z; break;                    // BEQ
+        case 0002000: condition = N == V; break;               // BGE
+        case 0002400: condition = N != V; break;               // BLT
+        case 0003000: condition = !Z && N == V; break;         // BGT
+        case 0003400: condition = Z || N != V; break;          // BLE
+        case 0100000: condition = !N; break;                   // BPL
+        case 0100400: condition = N; break;                    // BMI
+        case 0101000: condition = !C && !Z; break;             // BHI
+        case 0101400: condition = C || Z; break;               // BLOS
+        case 0102000: condition = !V; break;                   // BVC
+        case 0102400: condition = V; break;                    // BVS
+        case 0103000: condition = !C; break;                   // BCC
+        default:      condition = C; break;                    // BCS
+        }
+        if (condition)
+            R[7] += (uint16_t)((int16_t)(int8_t)(instr & 0377) * 2);
+        return;
+    }
+
+    // JSR
+    if ((instr & 0177000) == 0004000)
+    {
+        if ((dst & 070) == 0)
+        {
+            Fail("JSR to register");
+            return;
+        }
+        int reg = (instr >> 6) & 7;
+        address = OperandAddress(dst, false);
+        Push(R[reg]);
+        R[reg] = R[7];
+        R[7] = address;
+        return;
+    }
+
+    // Single operand instructions
+    int singleop = instr & 0077700;
+    if (singleop >= 0005000 && singleop <= 0006300)
+    {
+        dstval = ReadOperand(dst, byte, &address) & mask;
+        switch (singleop)
+        {
+        case 0005000:  // CLR
+            result = 0;  V = C = false;
+            break;
+        case 0005100:  // COM
+            result = ~dstval & mask;  V = false;  C = true;
+            break;
+        case 0005200:  // INC
+            result = (dstval + 1) & mask;  V = dstval == (sign - 1);
+            break;
+        case 0005300:  // DEC
+            result = (dstval - 1) & mask;  V = dstval == sign;
+            break;
+        case 0005400:  // NEG
+            result = (0 - dstval) & mask;  V = result == sign;  C = result != 0;
+            break;
+        case 0005500:  // ADC
+            result = (dstval + (C ? 1 : 0)) & mask;
+            V = C && dstval == (sign - 1);  C = C && dstval == mask;
+            break;
+        case 0005600:  // SBC
+            result = (dstval - (C ? 1 : 0)) & mask;
+            V = dstval == sign;  C = C && dstval == 0;
+            break;
+        case 0005700:  // TST
+            SetNZ(dstval, byte);  V = C = false;
+            return;
+        case 0006000:  // ROR
+            result = (uint16_t)((dstval >> 1) | (C ? sign : 0));  C = (dstval & 1) != 0;
+            SetNZ(result, byte);  V = N != C;
+            WriteOperand(dst, byte, address, result);
+            return;
+        case 0006100:  // ROL
+            result = (uint16_t)(((dstval << 1) | (C ? 1 : 0)) & mask);  C = (dstval & sign) != 0;
+            SetNZ(result, byte);  V = N != C;
+            WriteOperand(dst, byte, address, result);
+            return;
+        case 0006200:  // ASR
+            result = (uint16_t)((dstval >> 1) | (dstval & sign));  C = (dstval & 1) != 0;
+            SetNZ(result, byte);  V = N != C;
+            WriteOperand(dst, byte, address, result);
+            return;
+        default:  // 0006300: ASL
+            result = (uint16_t)((dstval << 1) & mask);  C = (dstval & sign) != 0;
+            SetNZ(result, byte);  V = N != C;
+            WriteOperand(dst, byte, address, result);
+            return;
+        }
+        SetNZ(result, byte);
+        WriteOperand(dst, byte, address, result);
+        return;
+    }
+
+    switch (instr & 0177700)
+    {
+    case 0000100:  // JMP
+        if ((dst & 070) == 0)
+        {
+            Fail("JMP to register");
+            return;
+        }
+        R[7] = OperandAddress(dst, false);
+        return;
+    case 0000300:  // SWAB
+        dstval = ReadOperand(dst, false, &address);
+        result = (uint16_t)((dstval << 8) | (dstval >> 8));
+        SetNZ(result, true);  V = C = false;
+        WriteOperand(dst, false, address, result);
+        return;
+    case 0006700:  // SXT
+        ReadOperand(dst, false, &address);
+        result = N ? 0177777 : 0;
+        Z = !N;  V = false;
+        WriteOperand(dst, false, address, result);
+        return;
+    }
+
+    if ((instr & 0177770) == 0000200)  // RTS
+    {
+        int reg = instr & 7;
+        R[7] = R[reg];
+        R[reg] = Pop();
+        return;
+    }
+    if ((instr & 0177740) == 0000240)  // Condition codes, NOP
+    {
+        bool set = (instr & 020) != 0;
+        if (instr & 010) N = set;
+        if (instr & 004) Z = set;
+        if (instr & 002) V = set;
+        if (instr & 001) C = set;
+        return;
+    }
+
+    Fail("unknown instruction");
+}
+
+bool CEmulator::RunLoader(uint16_t loaderEnd)
+{
+    while (error == nullptr)
+    {
+        if (R[7] >= loaderEnd)
+            return true;  // Jumped to the loaded program
+        if (instructions >= MAX_INSTRUCTIONS)
+        {
+            Fail("loader does not finish");
+            break;
+        }
+        if (R[7] == 0 && instructions > 0)
+        {
+            Fail("loader restarted, checksum or cartridge read failed");
+            break;
+        }
+        Execute();
+    }
+    return false;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+bool EmulateLoader(const char* name, const SavImage& sav, const uint8_t* pCartImage, LoaderRunInfo* pInfo, const uint8_t* pCartImage2)
+{
+    static const int cartNumber = 1;
+    CEmulator* pEmulator = new CEmulator(pCartImage, pCartImage2, 24576);
+    CEmulator& emu = *pEmulator;
+
+    // The first block of the cartridge is at address 0, started with R0 = cartridge number
+    memcpy(emu.memory, pCartImage, 01000);
+    emu.R[0] = cartNumber;
+    emu.R[6] = 01000;
+    emu.R[7] = 0;
+
+    bool result = emu.RunLoader(01000);
+    pInfo->instructions = emu.instructions;
+    pInfo->cycles = emu.cycles;
+    if (!result)
+        printf("%s loader emulation failed: %s at %06o\n", name, emu.error, emu.errorpc);
+    else if (emu.R[7] != sav.wStartAddr)
+    {
+        printf("%s loader emulation failed: started at %06o (must be: %06o)\n", name, emu.R[7], sav.wStartAddr);
+        result = false;
+    }
+    else if (emu.R[6] != sav.wStackAddr)
+    {
+        printf("%s loader emulation failed: SP = %06o (must be: %06o)\n", name, emu.R[6], sav.wStackAddr);
+        result = false;
+    }
+    else
+    {
+        for (size_t offset = 0; offset < sav.imageSize; offset++)
+        {
+            if (emu.memory[01000 + offset] == sav.pFileImage[512 + offset])
+                continue;
+
+            printf("%s loader emulation failed: memory differs at %06o (%03o != %03o)\n", name,
+                   (uint16_t)(01000 + offset), emu.memory[01000 + offset], sav.pFileImage[512 + offset]);
+            result = false;
+            break;
+        }
+    }
+    if (result)
+        printf("%s loader emulation done, %u. instructions, ~%llu. cycles (~%1.1f ms at 8 MHz, approximate timing)\n", name,
+               pInfo->instructions, (unsigned long long)pInfo->cycles, pInfo->cycles / 8000.0);
+
+    delete pEmulator;
+    return result;
+}
+
+
+//////////////////////////////////////////////////////////////////////
@@ -0,0 +1,329 @@
+﻿/*  This file is part of UKNCBTL.
+UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// Inspect.cpp : Cartridge image inspector, the reverse of the conversion: the loader is recognized by its code,
+// the fields patched by the PrepareCartXxx functions are read back, and the program is unpacked to SAV
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "Sav2Cart.h"
+
+
+//////////////////////////////////////////////////////////////////////
+
+// Loader and the offsets of the fields set by the PrepareCartXxx function; the checksum is at 0066 in all of them
+struct CartLoaderLayout
+{
+    const char*     name;
+    int             option;         // OPTION_COMPRESSION_XXX
+    bool            backward;       // LZSA unpacked from the end
+    const uint16_t* pLoader;
+    const size_t*   pLoaderSize;
+    uint16_t        stackField;
+    uint16_t        startField;
+    uint16_t        wordsField;     // Words of the stream read from the cartridge; 0 = no field, the whole cartridge is read
+    bool            checkAll;       // Checksum of the whole cartridge even with the words field
+    uint16_t        endField;       // Image end address: CTOP of LZSS, the end of the backward unpacking; 0 = by the decoder
+    uint16_t        patched[5];     // Other fields, stream addresses and copies of the fields above; 0 = end of the list
+};
+
+static const CartLoaderLayout g_loaderLayouts[] =
+{
+    { "none",   OPTION_COMPRESSION_NONE,  false, loader,      &loaderSize,      0074, 0100,    0, true,     0, { 0 } },
+    { "RLE",    OPTION_COMPRESSION_RLE,   false, loaderRLE,   &loaderRLESize,   0076, 0102,    0, true,     0, { 0 } },
+    { "LZSS",   OPTION_COMPRESSION_LZSS,  false, loaderLZSS,  &loaderLZSSSize,  0076, 0102,    0, true,  0212, { 0 } },
+    { "LZ4",    OPTION_COMPRESSION_LZ4,   false, loaderLZ4,   &loaderLZ4Size,   0076, 0102,    0, true,     0, { 0 } },
+    { "LZSA1",  OPTION_COMPRESSION_LZSA1, false, loaderLZSA1, &loaderLZSA1Size, 0076, 0102, 0054, true,     0, { 0050, 0112, 0114, 0124 } },
+    { "LZSA2",  OPTION_COMPRESSION_LZSA2, false, loaderLZSA2, &loaderLZSA2Size, 0110, 0114, 0054, false,    0, { 0050, 0074, 0124, 0126 } },
+    { "ZX0",    OPTION_COMPRESSION_ZX0,   false, loaderZX0,   &loaderZX0Size,   0110, 0114, 0054, false,    0, { 0050, 0074, 0124, 0126 } },
+    { "LZSA1B", OPTION_COMPRESSION_LZSA1, true,  loaderLZSA1B, &loaderLZSA1BSize, 0114, 0120, 0054, false, 0104, { 0050, 0074, 0100, 0130, 0132 } },
+    { "LZSA2B", OPTION_COMPRESSION_LZSA2, true,  loaderLZSA2B, &loaderLZSA2BSize, 0114, 0120, 0054, false, 0104, { 0050, 0074, 0100, 0130, 0132 } },
+};
+
+// Split image loader: the addresses, then the table of two fragments, 6 words each:
+// cartridge number, offset on the cartridge, stream address, words, checksum, unpacking address
+static const uint16_t MULTICART_STACK_FIELD = 0162;
+static const uint16_t MULTICART_START_FIELD = 0166;
+static const uint16_t MULTICART_TABLE       = 0214;
+
+static inline uint16_t GetWord(const uint8_t* pCartImage, size_t offset)
+{
+    return (uint16_t)(pCartImage[offset] | (pCartImage[offset + 1] << 8));
+}
+
+// Loader code matches the cartridge, the words at the patched offsets skipped
+static bool MatchLoader(const uint8_t* pCartImage, const uint16_t* pLoader, size_t loaderSize,
+                        const uint16_t* pPatched, int patchedCount, uint16_t skipFrom = 0, uint16_t skipTo = 0)
+{
+    for (size_t offset = 0; offset < loaderSize; offset += 2)
+    {
+        if (offset >= skipFrom && offset < skipTo)
+            continue;
+        if (std::find(pPatched, pPatched + patchedCount, (uint16_t)offset) != pPatched + patchedCount)
+            continue;
+        if (GetWord(pCartImage, offset) != pLoader[offset / 2])
+            return false;
+    }
+    return true;
+}
+
+static const CartLoaderLayout* FindLoaderLayout(const uint8_t* pCartImage)
+{
+    for (size_t i = 0; i < sizeof(g_loaderLayouts) / sizeof(g_loaderLayouts[0]); i++)
+    {
+        const CartLoaderLayout& layout = g_loaderLayouts[i];
+        uint16_t patched[10] = { 0066, layout.stackField, layout.startField, layout.wordsField, layout.endField };
+        int count = 5;
+        for (int j = 0; j < 5 && layout.patched[j] != 0; j++)
+            patched[count++] = layout.patched[j];
+        if (MatchLoader(pCartImage, layout.pLoader, *layout.pLoaderSize, patched, count))
+            return &layout;
+    }
+    return nullptr;
+}
+
+// Cartridge bytes up to the last one different from the fill value
+static size_t GetCartUsedSize(const uint8_t* pCartImage, uint8_t fill)
+{
+    size_t used = 24576;
+    while (used > 512 && pCartImage[used - 1] == fill)
+        used--;
+    return used;
+}
+
+static bool CheckChecksum(const char* name, uint16_t wStored, const uint8_t* pData, uint16_t wWords)
+{
+    uint16_t wChecksum = CalcCheckum((const uint16_t*)pData, wWords);
+    if (wChecksum == wStored)
+    {
+        printf("%s checksum %06ho of %u. words is correct\n", name, wStored, (unsigned)wWords);
+        return true;
+    }
+    printf("%s checksum mismatch: stored %06ho, calculated %06ho of %u. words\n", name, wStored, wChecksum, (unsigned)wWords);
+    return false;
+}
+
+// The split image: both fragments checked and unpacked with LZSA1 one after another
+static bool UnpackMultiCart(const uint8_t* pCartImage, const uint8_t* pCartImage2, CCartWorkspace& ws,
+                            uint8_t* pImage, CartInspectInfo* pInfo)
+{
+    CCodec& codec = *ws.GetCodec(OPTION_COMPRESSION_LZSA1);
+    size_t imageEnd = 01000;
+    for (int i = 0; i < 2; i++)
+    {
+        uint16_t wCart   = GetWord(pCartImage, MULTICART_TABLE + i * 12 + 0);
+        uint16_t wOffset = GetWord(pCartImage, MULTICART_TABLE + i * 12 + 2);
+        uint16_t wWords  = GetWord(pCartImage, MULTICART_TABLE + i * 12 + 6);
+        uint16_t wStored = GetWord(pCartImage, MULTICART_TABLE + i * 12 + 8);
+        uint16_t wDest   = GetWord(pCartImage, MULTICART_TABLE + i * 12 + 10);
+        const uint8_t* pCart = (wCart == 0) ? pCartImage : pCartImage2;
+        pInfo->usedSize[i] = (size_t)wOffset + wWords * 2;
+        if (wCart > 1 || (size_t)wOffset + wWords * 2 > 24576 || wDest != imageEnd)
+        {
+            printf("Split image fragment %d: bad table entry\n", i + 1);
+            return false;
+        }
+        if (pCart == nullptr)
+        {
+            printf("Split image fragment %d: the second cartridge image not found\n", i + 1);
+            return false;
+        }
+        char name[32];
+        sprintf(name, "Fragment %d", i + 1);
+        if (!CheckChecksum(name, wStored, pCart + wOffset, wWords))
+        {
+            pInfo->checksumOk = false;
+            return false;
+        }
+        size_t decodedSize = codec.Decode(CodecSpan((uint8_t*)pCart + wOffset, wWords * 2),
+                                          CodecSpan(pImage + (imageEnd - 01000), 0160000 - imageEnd));
+        if (decodedSize == 0 || decodedSize > 0160000 - imageEnd)  // (size_t)-1 on bad input
+        {
+            printf("Split image fragment %d: LZSA1 decode failed\n", i + 1);
+            return false;
+        }
+        imageEnd += decodedSize;
+    }
+    pInfo->imageSize = imageEnd - 01000;
+    return true;
+}
+
+// Recognize the loader and unpack the program to the temp buffer of the workspace
+static bool UnpackCartImage(const uint8_t* pCartImage, const uint8_t* pCartImage2, CCartWorkspace& ws,
+                            uint8_t* pImage, CartInspectInfo* pInfo)
+{
+    const CartLoaderLayout* pLayout = FindLoaderLayout(pCartImage);
+    if (pLayout == nullptr)
+    {
+        uint16_t patched[2] = { MULTICART_STACK_FIELD, MULTICART_START_FIELD };
+        if (!MatchLoader(pCartImage, loaderMultiLZSA1, loaderMultiLZSA1Size, patched, 2, MULTICART_TABLE, MULTICART_TABLE + 24))
+        {
+            printf("Unknown loader\n");
+            return false;
+        }
+        pInfo->loaderName = "LZSA1 split";
+        pInfo->codecOption = OPTION_COMPRESSION_LZSA1;
+        pInfo->split = true;
+        pInfo->loaderSize = loaderMultiLZSA1Size;
+        pInfo->wStackAddr = GetWord(pCartImage, MULTICART_STACK_FIELD);
+        pInfo->wStartAddr = GetWord(pCartImage, MULTICART_START_FIELD);
+        printf("Loader %s, stack %06ho, start %06ho\n", pInfo->loaderName, pInfo->wStackAddr, pInfo->wStartAddr);
+        pInfo->checksumOk = true;
+        return UnpackMultiCart(pCartImage, pCartImage2, ws, pImage, pInfo);
+    }
+
+    pInfo->loaderName = pLayout->name;
+    pInfo->loaderSize = *pLayout->pLoaderSize;
+    pInfo->codecOption = pLayout->option;
+    pInfo->wStackAddr = GetWord(pCartImage, pLayout->stackField);
+    pInfo->wStartAddr = GetWord(pCartImage, pLayout->startField);
+    uint16_t wWords = (pLayout->wordsField != 0) ? GetWord(pCartImage, pLayout->wordsField) : 027400;
+    printf("Loader %s, stack %06ho, start %06ho, %u. words read\n", pLayout->name, pInfo->wStackAddr, pInfo->wStartAddr, (unsigned)wWords);
+    if (wWords > 027400)
+    {
+        printf("Bad stream size: %u. words, max 12032. words\n", (unsigned)wWords);
+        return false;
+    }
+    if (pLayout->wordsField != 0)
+        pInfo->usedSize[0] = 512 + wWords * 2;
+    else
+        pInfo->usedSize[0] = GetCartUsedSize(pCartImage, (pLayout->option == OPTION_COMPRESSION_LZ4) ? 0xff : 0);
+    pInfo->checksumOk = CheckChecksum(pLayout->name, GetWord(pCartImage, 0066), pCartImage + 01000, pLayout->checkAll ? 027400 : wWords);
+    if (!pInfo->checksumOk)
+        return false;
+
+    CodecSpan stream((uint8_t*)pCartImage + 01000, wWords * 2);
+    CodecSpan output(pImage, 0160000 - 01000);
+    size_t imageSize = 0;
+    if (pLayout->endField != 0)
+    {
+        uint16_t wImageEnd = GetWord(pCartImage, pLayout->endField);
+        if (wImageEnd <= 01000 || wImageEnd > 0160000)
+        {
+            printf("Bad image end address %06ho\n", wImageEnd);
+            return false;
+        }
+        imageSize = output.size = wImageEnd - 01000;
+    }
+    switch (pLayout->option)
+    {
+    case OPTION_COMPRESSION_NONE:
+        // Copied as is, the cartridge tail is zeroes; the top address is under the loader,
+        // the image goes up to the last block of the RT-11 block bitmap, or to the last non-zero byte
+        imageSize = (GetCartUsedSize(pCartImage, 0) - 01000 + 1) & ~(size_t)1;
+        for (size_t block = 0; block < 128; block++)
+        {
+            if ((pCartImage[0360 + block / 8] & (0200 >> (block % 8))) != 0 && block * 512 > imageSize)
+                imageSize = std::min(block * 512, (size_t)24576 - 512);
+        }
+        pInfo->imageSize = imageSize;
+        ::memcpy(pImage, pCartImage + 01000, pInfo->imageSize);
+        return true;
+    case OPTION_COMPRESSION_RLE:
+        // Decoded up to the zero command, the size may be a byte short of the image
+        pInfo->imageSize = (ws.GetCodec(pLayout->option)->Decode(stream, output) + 1) & ~(size_t)1;
+        return pInfo->imageSize > 0;
+    default:
+        break;
+    }
+
+    size_t decodedSize;
+    if (pLayout->backward)
+    {
+        // The stream is reversed on the cartridge, its exact size is the difference of the stream addresses
+        size_t encodedSize = (uint16_t)(GetWord(pCartImage, 0100) - GetWord(pCartImage, 0074));
+        uint8_t* pReversed = ws.GetImageCopy(1, encodedSize);
+        if (encodedSize > stream.size || pReversed == nullptr)
+        {
+            printf("Bad backward stream size %lu. bytes\n", (unsigned long)encodedSize);
+            return false;
+        }
+        std::reverse_copy(stream.data, stream.data + encodedSize, pReversed);
+        decodedSize = ws.GetCodec(pLayout->option)->Decode(CodecSpan(pReversed, encodedSize), output);
+        if (decodedSize <= output.size)
+            std::reverse(pImage, pImage + decodedSize);
+    }
+    else
+    {
+        // The forward loaders unpack right after the loader block, the -dict dictionary is at its end
+        CCodec& codec = *ws.GetCodec(pLayout->option);
+        codec.SetDictionary(CodecSpan((uint8_t*)pCartImage, 01000));
+        decodedSize = codec.Decode(stream, output);
+        codec.SetDictionary(CodecSpan());
+    }
+    if (decodedSize == 0 || decodedSize > output.size || (imageSize != 0 && decodedSize != imageSize))
+    {
+        printf("%s decode failed, decoded size %lu. bytes\n", pLayout->name, (unsigned long)decodedSize);
+        return false;
+    }
+    pInfo->imageSize = decodedSize;
+    return true;
+}
+
+bool InspectCartImage(const uint8_t* pCartImage, const uint8_t* pCartImage2, CCartWorkspace& ws, CartInspectInfo* pInfo, SavImage* pSav)
+{
+    ::memset(pInfo, 0, sizeof(CartInspectInfo));
+    uint8_t* pImage = ws.GetTempBuffer();
+    if (pImage == nullptr)
+    {
+        printf("Failed to allocate memory.");
+        return false;
+    }
+    if (!UnpackCartImage(pCartImage, pCartImage2, ws, pImage, pInfo))
+        return false;
+
+    // The loader jumps to the filter undo stub, the stub goes to the program start
+    uint16_t stubPatched[2] = { 006, 026 };
+    if (pInfo->wStartAddr == FILTER_STUB_ADDRESS &&
+        MatchLoader(pCartImage + FILTER_STUB_ADDRESS, loaderFilter, loaderFilterSize, stubPatched, 2))
+    {
+        pInfo->filtered = true;
+        pInfo->wStartAddr = GetWord(pCartImage, FILTER_STUB_ADDRESS + 026);
+        size_t count = FilterPdpCode(pImage, pInfo->imageSize, 01000, false);
+        printf("PDP-11 filter: %lu. operands of JSR PC made relative back, start %06ho\n", (unsigned long)count, pInfo->wStartAddr);
+    }
+    printf("Unpacked image %06ho-%06ho, %lu. bytes\n", (uint16_t)01000, (uint16_t)(01000 + pInfo->imageSize),
+           (unsigned long)pInfo->imageSize);
+
+    // SAV file: block 0 from the cartridge, the loader area cleared, then the image up to the whole block
+    size_t fileSize = (512 + pInfo->imageSize + 511) & ~(size_t)511;
+    uint8_t* pFile = ws.GetImageCopy(0, fileSize);
+    if (pFile == nullptr)
+    {
+        printf("Failed to allocate memory.");
+        return false;
+    }
+    ::memcpy(pFile, pCartImage, 512);
+    ::memset(pFile, 0, pInfo->loaderSize);
+    if (pInfo->filtered)
+        ::memset(pFile + FILTER_STUB_ADDRESS, 0, loaderFilterSize);
+    ::memcpy(pFile + 512, pImage, pInfo->imageSize);
+    ::memset(pFile + 512 + pInfo->imageSize, 0, fileSize - 512 - pInfo->imageSize);
+    pSav->pFileImage = pFile;
+    pSav->fileSize = (uint32_t)fileSize;
+    pSav->imageSize = pInfo->imageSize;
+    pSav->wStartAddr = pInfo->wStartAddr;
+    pSav->wStackAddr = pInfo->wStackAddr;
+    pSav->wTopAddr = (uint16_t)(01000 + pInfo->imageSize - 2);
+    *((uint16_t*)(pFile + 040)) = pSav->wStartAddr;
+    *((uint16_t*)(pFile + 042)) = pSav->wStackAddr;
+    *((uint16_t*)(pFile + 050)) = pSav->wTopAddr;
+    if (pInfo->loaderSize > 0360)
+    {
+        // RT-11 block bitmap under the loader: the blocks of the file, the high bit of 0360 is block 0
+        for (size_t block = 0; block < fileSize / 512 && block < 128; block++)
+            pFile[0360 + block / 8] |= (uint8_t)(0200 >> (block % 8));
+    }
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////
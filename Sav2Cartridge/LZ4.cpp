@@ -20,6 +20,7 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 #include <memory.h>
 #include <string.h>
 #include <stdint.h>
+#include "Sav2Cart.h"
 
 
 //////////////////////////////////////////////////////////////////////
@@ -29,39 +30,25 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 #include <cstdlib>    // size_t
 #include <vector>
 
-/// LZ4 compression with optimal parsing
-/** see smallz4.cpp for a basic I/O interface
-you can easily replace it by a in-memory version
-then all you have to do is:
-#include "smallz4.h"
-smallz4::lz4(GET_BYTES, SEND_BYTES);
-// for more advanced stuff, you can call lz4 with four parameters (incl. max chain length and a dictionary)
+/// LZ4 compression with optimal parsing, smallz4 by Stephan Brumme
+/** in-memory version: the whole input is one raw LZ4 block, no frame, no block size;
+the match finder tables are kept in the object and reused by the next calls;
+the data may go after a dictionary, the matches then can refer to it
+    smallz4 packer(maxChainLength);
+    size_t blockSize = packer.compressBlock(data, size, out, outSize);
 **/
 class smallz4
 {
 public:
-    // read  several bytes, see getBytesFromIn() in smallz4.cpp for a basic implementation
-    typedef size_t(*GET_BYTES) (void* data, size_t numBytes);
-    // write several bytes, see sendBytesToOut() in smallz4.cpp for a basic implementation
-    typedef void(*SEND_BYTES)(const void* data, size_t numBytes);
-
-    /// compress everything in input stream (accessed via getByte) and write to output stream (via send)
-    static void lz4(GET_BYTES getBytes, SEND_BYTES sendBytes,
-            unsigned int maxChainLength = MaxChainLength,
-            bool useLegacyFormat = false)  // this function exists for compatibility reasons
+    /// create new compressor, maxChainLength is the compression level: 1..3 greedy, 4..6 lazy, more = optimal parsing
+    explicit smallz4(unsigned int newMaxChainLength = MaxChainLength)
+        : maxChainLength(newMaxChainLength)
     {
-        lz4(getBytes, sendBytes, maxChainLength, std::vector<unsigned char>());
     }
 
-    /// compress everything in input stream (accessed via getByte) and write to output stream (via send)
-    static void lz4(GET_BYTES getBytes, SEND_BYTES sendBytes,
-            unsigned int maxChainLength,
-            const std::vector<unsigned char>& dictionary, // predefined dictionary
-            bool useLegacyFormat = false)                 // old format is 7 bytes smaller if input < 8 MB
-    {
-        smallz4 obj(maxChainLength);
-        obj.compress(getBytes, sendBytes, dictionary, useLegacyFormat);
-    }
+    /// compress the buffer (up to 64k) to one raw LZ4 block, the last token has literals only
+    /** the dictionary is dictSize bytes right before data; returns the block size, 0 if the output buffer is too small **/
+    size_t compressBlock(const unsigned char* data, size_t size, unsigned char* out, size_t outSize, size_t dictSize = 0);
 
     // compression level thresholds, made public because I display them in the help screen ...
     enum
@@ -90,15 +77,12 @@ private:
         /// match finder's hash table size (2^HashBits entries, must be less than 32)
         HashBits = 20,
 
-        /// input buffer size, can be any number but zero ;-)
-        BufferSize = 64 * 1024,
-
         /// maximum match distance
         MaxDistance = 65535,
         /// marker for "no match"
         NoPrevious = 0,
         /// stop match finding after MaxChainLength steps (default is unlimited => optimal parsing)
-        MaxChainLength = NoPrevious,
+        MaxChainLength = 65536,
 
         /// significantly speed up parsing if the same byte is repeated a lot, may cause sub-optimal compression
         MaxSameLetter = 19 + 255 * 256, // was: 19 + 255,
@@ -106,14 +90,8 @@ private:
         /// refer to location of the previous match (implicit hash chain)
         PreviousSize = 1 << 16,
 
-        /// maximum block size as defined in LZ4 spec: { 0,0,0,0,64*1024,256*1024,1024*1024,4*1024*1024 }
-        /// I only work with the biggest maximum block size (7)
-        //  note: xxhash header checksum is precalculated only for 7, too
-        MaxBlockSizeId = 7,
-        MaxBlockSize = 4 * 1024 * 1024,
-
-        /// legacy format has a fixed block size of 8 MB
-        MaxBlockSizeLegacy = 8 * 1024 * 1024
+        /// the whole input is one block, the matches can reach any byte of it
+        MaxBlockSize = 64 * 1024
     };
 
     /// how many matches are checked in findLongestMatch, lower values yield faster encoding at the cost of worse compression ratio
@@ -136,12 +114,6 @@ private:
         Distance distance;
     };
 
-    /// create new compressor (only invoked by lz4)
-    explicit smallz4(unsigned int newMaxChainLength = MaxChainLength)
-        : maxChainLength(newMaxChainLength) // => no limit, but can be changed by setMaxChainLength
-    {
-    }
-
     /// return true, if the four bytes at *a and *b match
     inline static bool match4(const void* const a, const void* const b)
     {
@@ -236,14 +208,21 @@ private:
         return result;
     }
 
+    /// last time we saw a hash, previous positions which start with the same bytes, kept for the next calls
+    std::vector<uint32_t> lastHash;
+    std::vector<Distance> previousHash;   // long chains based on my simple hash
+    std::vector<Distance> previousExact;  // shorter chains based on exact matching of the first four bytes
+    std::vector<Match>    matches;
+    std::vector<uint32_t> cost;
+
     /// create shortest output
-    /** data points to block's begin; we need it to extract literals **/
-    static std::vector<unsigned char> selectBestMatches(const std::vector<Match>& matches,
-            const unsigned char* const data)
+    /** data points to block's begin; we need it to extract literals; returns 0 if the output buffer is too small **/
+    static size_t selectBestMatches(const std::vector<Match>& matches,
+            const unsigned char* const data, unsigned char* out, size_t outSize)
     {
         // store encoded data
-        std::vector<unsigned char> result;
-        result.reserve(MaxBlockSize);
+        unsigned char* result = out;
+        unsigned char* const resultEnd = out + outSize;
 
         // indices of current literal run
         size_t literalsFrom = 0;
@@ -279,6 +258,11 @@ private:
             // count literals
             size_t numLiterals = literalsTo - literalsFrom;
 
+            // the longest token: token, literal length bytes, literals, offset, match length bytes
+            size_t matchBytes = lastToken ? 0 : 2 + match.length / 255 + 1;
+            if ((size_t)(resultEnd - result) < 1 + numLiterals / 255 + 1 + numLiterals + matchBytes)
+                return 0;
+
             // store literals' length
             unsigned char token = (numLiterals < 15) ? (unsigned char)numLiterals : 15;
             token <<= 4;
@@ -288,7 +272,7 @@ private:
             if (!lastToken)
                 token |= (matchLength < 15) ? matchLength : 15;
 
-            result.push_back(token);
+            *result++ = token;
 
             // >= 15 literals ? (extra bytes to store length)
             if (numLiterals >= 15)
@@ -298,16 +282,17 @@ private:
                 // emit 255 until remainder is below 255
                 while (numLiterals >= 255)
                 {
-                    result.push_back(255);
+                    *result++ = 255;
                     numLiterals -= 255;
                 }
                 // and the last byte (can be zero, too)
-                result.push_back((unsigned char)numLiterals);
+                *result++ = (unsigned char)numLiterals;
             }
             // copy literals
             if (literalsFrom != literalsTo)
             {
-                result.insert(result.end(), data + literalsFrom, data + literalsTo);
+                ::memcpy(result, data + literalsFrom, literalsTo - literalsFrom);
+                result += literalsTo - literalsFrom;
                 literalsFrom = literalsTo = 0;
             }
 
@@ -316,8 +301,8 @@ private:
                 break;
 
             // distance stored in 16 bits / little endian
-            result.push_back(match.distance & 0xFF);
-            result.push_back((match.distance >> 8) & 0xFF);
+            *result++ = match.distance & 0xFF;
+            *result++ = (match.distance >> 8) & 0xFF;
 
             // >= 15+4 bytes matched (4 is implied because it's the minimum match length)
             if (matchLength >= 15)
@@ -327,26 +312,26 @@ private:
                 // emit 255 until remainder is below 255
                 while (matchLength >= 255)
                 {
-                    result.push_back(255);
+                    *result++ = 255;
                     matchLength -= 255;
                 }
                 // and the last byte (can be zero, too)
-                result.push_back((unsigned char)matchLength);
+                *result++ = (unsigned char)matchLength;
             }
         }
 
-        return result;
+        return result - out;
     }
 
     /// walk backwards through all matches and compute number of compressed bytes from current position to the end of the block
     /** note: matches are modified (shortened length) if necessary **/
-    static void estimateCosts(std::vector<Match>& matches)
+    void estimateCosts()
     {
         const size_t blockEnd = matches.size();
 
         typedef uint32_t Cost;
         // minimum cost from this position to the end of the current block
-        std::vector<Cost> cost(matches.size(), 0);
+        cost.assign(matches.size(), 0);
         // "cost" represents the number of bytes needed
 
         // backwards optimal parsing
@@ -426,429 +411,305 @@ private:
             //       which could be more cache-friendly (=> faster decoding)
         }
     }
+};
 
-    /// compress everything in input stream (accessed via getByte) and write to output stream (via send), improve compression with a predefined dictionary
-    void compress(GET_BYTES getBytes, SEND_BYTES sendBytes, const std::vector<unsigned char>& dictionary, bool useLegacyFormat) const
-    {
-        // ==================== write header ====================
-        // magic bytes
-        const unsigned char magic[4] = { 0x04, 0x22, 0x4D, 0x18 };
-        const unsigned char magicLegacy[4] = { 0x02, 0x21, 0x4C, 0x18 };
-        if (useLegacyFormat)
-        {
-            sendBytes(magicLegacy, sizeof(magicLegacy));
-        }
-        else
-        {
-            sendBytes(magic, sizeof(magic));
-
-            // flags
-            const unsigned char flags = 1 << 6;
-            sendBytes(&flags, 1);
-            // max blocksize
-            const unsigned char maxBlockSizeId = MaxBlockSizeId << 4;
-            sendBytes(&maxBlockSizeId, 1);
-            // header checksum (precomputed)
-            const unsigned char checksum = 0xDF;
-            sendBytes(&checksum, 1);
-        }
-
-        // ==================== declarations ====================
-        // read the file in chunks/blocks, data will contain only bytes which are relevant for the current block
-        std::vector<unsigned char> data;
-        // file position corresponding to data[0]
-        size_t dataZero = 0;
-        // last already read position
-        size_t numRead = 0;
-
-        // passthru data (but still wrap in LZ4 format)
-        const bool uncompressed = (maxChainLength == 0);
-
-        // last time we saw a hash
-        const uint32_t HashSize = 1 << HashBits;
-        const size_t   NoLastHash = 0x7FFFFFFF;
-        std::vector<size_t> lastHash(HashSize, NoLastHash);
-        const uint64_t HashMultiplier = 22695477; // taken from https://en.wikipedia.org/wiki/Linear_congruential_generator
-        const uint8_t  HashShift = 32 - HashBits;
-
-        // previous position which starts with the same bytes
-        std::vector<Distance> previousHash(PreviousSize, Distance(NoPrevious)); // long chains based on my simple hash
-        std::vector<Distance> previousExact(PreviousSize, Distance(NoPrevious)); // shorter chains based on exact matching of the first four bytes
-
-        // change buffer size as you like
-        std::vector<unsigned char> buffer(BufferSize);
-
-        // first and last offset of a block (next is end-of-block plus 1)
-        size_t lastBlock = 0;
-        size_t nextBlock = 0;
-        bool parseDictionary = !dictionary.empty();
-        while (true)
-        {
-            // ==================== start new block ====================
-            // first byte of the currently processed block (std::vector data may contain the last 64k of the previous block, too)
-            const unsigned char* dataBlock = NULL;
 
-            // prepend dictionary
-            if (parseDictionary)
-            {
-                // prepend exactly 64k
-                const size_t MaxDictionary = 65536;
-                if (dictionary.size() < MaxDictionary)
-                {
-                    // add garbage data
-                    size_t unused = 65536 - dictionary.size();
-                    data.resize(unused, 0);
-                    data.insert(data.end(), dictionary.begin(), dictionary.end());
-                }
-                else
-                    // copy only the most recent 64k of the dictionary
-                    data.insert(data.end(), dictionary.begin() + dictionary.size() - MaxDictionary, dictionary.end());
+//////////////////////////////////////////////////////////////////////
 
-                nextBlock = data.size();
-                numRead = data.size();
-            }
 
-            // read more bytes from input
-            size_t maxBlockSize = useLegacyFormat ? MaxBlockSizeLegacy : MaxBlockSize;
-            while (numRead - nextBlock < maxBlockSize)
+size_t smallz4::compressBlock(const unsigned char* block, size_t size, unsigned char* out, size_t outSize, size_t dictSize)
+{
+    // the match finder walks the dictionary and the block together, the matches are stored for the block only
+    const unsigned char* data = block - dictSize;
+
+    // ==================== full match finder ====================
+
+    const uint32_t HashSize = 1 << HashBits;
+    const uint32_t NoLastHash = 0x7FFFFFFF;
+    const uint64_t HashMultiplier = 22695477; // taken from https://en.wikipedia.org/wiki/Linear_congruential_generator
+    const uint8_t  HashShift = 32 - HashBits;
+    lastHash.assign(HashSize, NoLastHash);
+    previousHash.assign(PreviousSize, Distance(NoPrevious));
+    previousExact.assign(PreviousSize, Distance(NoPrevious));
+    matches.assign(size, Match());
+    const size_t windowSize = dictSize + size;
+
+    // greedy mode is much faster but produces larger output
+    const bool isGreedy = (maxChainLength <= ShortChainsGreedy);
+    // lazy evaluation: if there is a match, then try running match finder on next position, too, but not after that
+    const bool isLazy = !isGreedy && (maxChainLength <= ShortChainsLazy);
+    // skip match finding on the next x bytes in greedy mode
+    size_t skipMatches = 0;
+    // allow match finding on the next byte but skip afterwards (in lazy mode)
+    bool   lazyEvaluation = false;
+
+    // find longest matches for each position, no matches at the end of the block
+    for (int i = 0; i + BlockEndNoMatch <= (int)windowSize; i++)
+    {
+        // detect self-matching
+        if (i > (int)dictSize && data[i] == data[i - 1])
+        {
+            Match prevMatch = matches[i - dictSize - 1];
+            // predecessor had the same match ?
+            if (prevMatch.distance == 1 && prevMatch.length > MaxSameLetter) // TODO: handle very long self-referencing matches
             {
-                // buffer can be significantly smaller than MaxBlockSize, that's the only reason for this while-block
-                size_t incoming = getBytes(&buffer[0], buffer.size());
-                if (incoming == 0)
-                    break;
-
-                numRead += incoming;
-                data.insert(data.end(), buffer.begin(), buffer.begin() + incoming);
+                // just copy predecessor without further (expensive) optimizations
+                prevMatch.length--;
+                matches[i - dictSize] = prevMatch;
+                continue;
             }
+        }
 
-            // no more data ? => WE'RE DONE !
-            if (nextBlock == numRead)
-                break;
-
-            // determine block borders
-            lastBlock = nextBlock;
-            nextBlock += maxBlockSize;
-            // not beyond end-of-file
-            if (nextBlock > numRead)
-                nextBlock = numRead;
-
-            // first byte of the currently processed block (std::vector data may contain the last 64k of the previous block, too)
-            dataBlock = &data[lastBlock - dataZero];
-
-            const size_t blockSize = nextBlock - lastBlock;
-
-            // ==================== full match finder ====================
-
-            // greedy mode is much faster but produces larger output
-            const bool isGreedy = (maxChainLength <= ShortChainsGreedy);
-            // lazy evaluation: if there is a match, then try running match finder on next position, too, but not after that
-            const bool isLazy = !isGreedy && (maxChainLength <= ShortChainsLazy);
-            // skip match finding on the next x bytes in greedy mode
-            size_t skipMatches = 0;
-            // allow match finding on the next byte but skip afterwards (in lazy mode)
-            bool   lazyEvaluation = false;
-
-            // the last literals of the previous block skipped matching, so they are missing from the hash chains
-            int lookback = (int)dataZero;
-            if (lookback > BlockEndNoMatch && !parseDictionary)
-                lookback = BlockEndNoMatch;
-            if (parseDictionary)
-                lookback = (int)dictionary.size();
-            // so let's go back a few bytes
-            lookback = -lookback;
-            // ... but not in legacy mode
-            if (useLegacyFormat)
-                lookback = 0;
-
-            std::vector<Match> matches(blockSize);
-            // find longest matches for each position
-            for (int i = lookback; i < (int)blockSize; i++)
-            {
-                // no matches at the end of the block (or matching disabled by command-line option -0 )
-                if (i + BlockEndNoMatch > (int)blockSize || uncompressed)
-                    continue;
-
-                // detect self-matching
-                if (i > 0 && dataBlock[i] == dataBlock[i - 1])
-                {
-                    Match prevMatch = matches[i - 1];
-                    // predecessor had the same match ?
-                    if (prevMatch.distance == 1 && prevMatch.length > MaxSameLetter) // TODO: handle very long self-referencing matches
-                    {
-                        // just copy predecessor without further (expensive) optimizations
-                        prevMatch.length--;
-                        matches[i] = prevMatch;
-                        continue;
-                    }
-                }
-
-                // read next four bytes
-                uint32_t four = *(uint32_t*)(dataBlock + i);
-                // convert to a shorter hash
-                uint32_t hash = ((four * HashMultiplier) >> HashShift) & (HashSize - 1);
-
-                // get last occurrence of these bits
-                size_t last = lastHash[hash];
-                // and store current position
-                lastHash[hash] = i + lastBlock;
-
-                // remember: i could be negative, too
-                int prevIndex = (i + PreviousSize) % PreviousSize;
-
-                // no predecessor or too far away ?
-                size_t distance = i + lastBlock - last;
-                if (last == NoLastHash || distance > MaxDistance)
-                {
-                    previousHash[prevIndex] = NoPrevious;
-                    previousExact[prevIndex] = NoPrevious;
-                    continue;
-                }
-
-                // build hash chain, i.e. store distance to last match
-                previousHash[prevIndex] = (Distance)distance;
-
-                // skip pseudo-matches (hash collisions) and build a second chain where the first four bytes must match exactly
-                while (distance != NoPrevious)
-                {
-                    uint32_t curFour = *(uint32_t*)(&data[last - dataZero]); // may be in the previous block, too
-                    // actual match found, first 4 bytes are identical
-                    if (curFour == four)
-                        break;
-
-                    // prevent from accidently hopping on an old, wrong hash chain
-                    uint32_t curHash = ((curFour * HashMultiplier) >> HashShift) & (HashSize - 1);
-                    if (curHash != hash)
-                    {
-                        distance = NoPrevious;
-                        break;
-                    }
-
-                    // try next pseudo-match
-                    Distance next = previousHash[last % PreviousSize];
-
-                    // pointing to outdated hash chain entry ?
-                    distance += next;
-                    if (distance > MaxDistance)
-                    {
-                        previousHash[last % PreviousSize] = NoPrevious;
-                        distance = NoPrevious;
-                        break;
-                    }
-
-                    // closest match is out of range ?
-                    last -= next;
-                    if (next == NoPrevious || last < dataZero)
-                    {
-                        distance = NoPrevious;
-                        break;
-                    }
-                }
+        // read next four bytes
+        uint32_t four = *(const uint32_t*)(data + i);
+        // convert to a shorter hash
+        uint32_t hash = ((four * HashMultiplier) >> HashShift) & (HashSize - 1);
 
-                // no match at all ?
-                if (distance == NoPrevious)
-                {
-                    previousExact[prevIndex] = NoPrevious;
-                    continue;
-                }
+        // get last occurrence of these bits
+        uint32_t last = lastHash[hash];
+        // and store current position
+        lastHash[hash] = i;
 
-                // store distance to previous match
-                previousExact[prevIndex] = (Distance)distance;
+        int prevIndex = i % PreviousSize;
 
-                // no matching if crossing block boundary, just update hash tables
-                if (i < 0)
-                    continue;
+        // no predecessor or too far away ?
+        size_t distance = i - last;
+        if (last == NoLastHash || distance > MaxDistance)
+        {
+            previousHash[prevIndex] = NoPrevious;
+            previousExact[prevIndex] = NoPrevious;
+            continue;
+        }
 
-                // skip match finding if in greedy mode
-                if (skipMatches > 0)
-                {
-                    skipMatches--;
-                    if (!lazyEvaluation)
-                        continue;
-                    lazyEvaluation = false;
-                }
+        // build hash chain, i.e. store distance to last match
+        previousHash[prevIndex] = (Distance)distance;
 
-                // and look for longest match
-                Match longest = findLongestMatch(&data[0], i + lastBlock, dataZero, nextBlock - BlockEndLiterals + 1, &previousExact[0]);
-                matches[i] = longest;
+        // skip pseudo-matches (hash collisions) and build a second chain where the first four bytes must match exactly
+        while (distance != NoPrevious)
+        {
+            uint32_t curFour = *(const uint32_t*)(data + last);
+            // actual match found, first 4 bytes are identical
+            if (curFour == four)
+                break;
 
-                // no match finding needed for the next few bytes in greedy/lazy mode
-                if (longest.isMatch() && (isLazy || isGreedy))
-                {
-                    lazyEvaluation = (skipMatches == 0);
-                    skipMatches = longest.length;
-                }
+            // prevent from accidently hopping on an old, wrong hash chain
+            uint32_t curHash = ((curFour * HashMultiplier) >> HashShift) & (HashSize - 1);
+            if (curHash != hash)
+            {
+                distance = NoPrevious;
+                break;
             }
 
-            // dictionary applies only to the first block
-            parseDictionary = false;
-
-            // ==================== estimate costs (number of compressed bytes) ====================
-
-            // not needed in greedy mode and/or very short blocks
-            if (matches.size() > BlockEndNoMatch && maxChainLength > ShortChainsGreedy)
-                estimateCosts(matches);
-
-            // ==================== select best matches ====================
-
-            std::vector<unsigned char> block;
-            if (!uncompressed)
-                block = selectBestMatches(matches, &data[lastBlock - dataZero]);
+            // try next pseudo-match
+            Distance next = previousHash[last % PreviousSize];
 
-            // ==================== output ====================
+            // pointing to outdated hash chain entry ?
+            distance += next;
+            if (distance > MaxDistance)
+            {
+                previousHash[last % PreviousSize] = NoPrevious;
+                distance = NoPrevious;
+                break;
+            }
 
-            // automatically decide whether compressed or uncompressed
-            size_t uncompressedSize = nextBlock - lastBlock;
-            // did compression do harm ?
-            bool   useCompression = block.size() < uncompressedSize && !uncompressed;
-            // legacy format is always compressed
-            useCompression |= useLegacyFormat;
+            // closest match is out of range ?
+            if (next == NoPrevious || next > last)
+            {
+                distance = NoPrevious;
+                break;
+            }
+            last -= next;
+        }
 
-            // block size
-            uint32_t numBytes = uint32_t(useCompression ? block.size() : uncompressedSize);
-            uint32_t numBytesTagged = numBytes | (useCompression ? 0 : 0x80000000);
-            unsigned char num1 = numBytesTagged & 0xFF; sendBytes(&num1, 1);
-            unsigned char num2 = (numBytesTagged >> 8) & 0xFF; sendBytes(&num2, 1);
-            unsigned char num3 = (numBytesTagged >> 16) & 0xFF; sendBytes(&num3, 1);
-            unsigned char num4 = (numBytesTagged >> 24) & 0xFF; sendBytes(&num4, 1);
+        // no match at all ?
+        if (distance == NoPrevious)
+        {
+            previousExact[prevIndex] = NoPrevious;
+            continue;
+        }
 
-            if (useCompression)
-                sendBytes(&block[0], numBytes);
-            else // uncompressed ? => copy input data
-                sendBytes(&data[lastBlock - dataZero], numBytes);
+        // store distance to previous match
+        previousExact[prevIndex] = (Distance)distance;
 
-            // legacy format: no matching across blocks
-            if (useLegacyFormat)
-            {
-                dataZero += data.size();
-                data.clear();
+        // the dictionary only feeds the chains
+        if (i < (int)dictSize)
+            continue;
 
-                // clear hash tables
-                for (size_t i = 0; i < previousHash.size(); i++)
-                {
-                    previousHash[i] = NoPrevious;
-                    previousExact[i] = NoPrevious;
-                }
-                for (size_t i = 0; i < lastHash.size(); i++)
-                    lastHash[i] = NoLastHash;
-            }
-            else
-            {
-                // remove already processed data except for the last 64kb which could be used for intra-block matches
-                if (data.size() > MaxDistance)
-                {
-                    size_t remove = data.size() - MaxDistance;
-                    dataZero += remove;
-                    data.erase(data.begin(), data.begin() + remove);
-                }
-            }
+        // skip match finding if in greedy mode
+        if (skipMatches > 0)
+        {
+            skipMatches--;
+            if (!lazyEvaluation)
+                continue;
+            lazyEvaluation = false;
         }
 
-        // add an empty block
-        if (!useLegacyFormat)
+        // and look for longest match
+        Match longest = findLongestMatch(data, i, 0, windowSize - BlockEndLiterals + 1, &previousExact[0]);
+        matches[i - dictSize] = longest;
+
+        // no match finding needed for the next few bytes in greedy/lazy mode
+        if (longest.isMatch() && (isLazy || isGreedy))
         {
-            uint32_t zero = 0;
-            sendBytes(&zero, 4);
+            lazyEvaluation = (skipMatches == 0);
+            skipMatches = longest.length;
         }
     }
-};
 
+    // ==================== estimate costs (number of compressed bytes) ====================
 
-//////////////////////////////////////////////////////////////////////
+    // not needed in greedy mode and/or very short blocks
+    if (matches.size() > BlockEndNoMatch && maxChainLength > ShortChainsGreedy)
+        estimateCosts();
 
+    // ==================== select best matches ====================
 
-unsigned char *indata = NULL;
-unsigned char *outdata = NULL;
+    return selectBestMatches(matches, block, out, outSize);
+}
 
-size_t  inpos = 0, inposmax = 0;
-size_t outpos = 0, outposmax = 0, skip_counter = 0;
 
-/// read a block of bytes
-size_t getBytesFromIn(void* data, size_t numBytes)
-{
-    if (data && numBytes > 0)
-    {
-        if ((inpos + numBytes) > inposmax) numBytes = (inposmax - inpos);
+//////////////////////////////////////////////////////////////////////
 
-        ::memcpy(data, &indata[inpos], numBytes);
-        inpos += numBytes;
-        return numBytes;
-    }
-    return 0;
-}
 
-/// write a block of bytes
-void sendBytesToOut(const void* data, size_t numBytes)
+CLz4Codec::CLz4Codec(int maxchain)
 {
-    // Skip header
-    if (numBytes > skip_counter)
-    {
-        numBytes -= skip_counter;
-        if (data && numBytes > 0)
-        {
-            if ((outpos + numBytes) > outposmax) numBytes = (outposmax - outpos);
-
-            ::memcpy(&outdata[outpos], (const char *)data + skip_counter, numBytes);
-            outpos += numBytes;
-            skip_counter = 0;
-        }
-    }
-    else
-    {
-        skip_counter -= numBytes;
-        return;
-    }
+    m_pPacker = new smallz4(maxchain > 0 ? maxchain : 65536);
 }
 
+CLz4Codec::~CLz4Codec()
+{
+    delete m_pPacker;
+}
 
-size_t lz4_encode(unsigned char *inbuffer, size_t insize, unsigned char *outbuffer, size_t outsize)
+size_t CLz4Codec::Encode(CodecSpan in, CodecSpan out)
 {
-    inpos = 0;
-    indata = inbuffer;
-    inposmax = insize;
+    printf("LZ4 input size %lu. bytes\n", (unsigned long)in.size);
 
-    skip_counter = 13; // Skip header
-    outpos = 0;
-    outdata = outbuffer;
-    outposmax = outsize;
+    // With the dictionary, the input goes right after it in the window
+    const uint8_t* block = in.data;
+    if (m_dictionary.size > 0)
+    {
+        m_window.assign(m_dictionary.data, m_dictionary.data + m_dictionary.size);
+        m_window.insert(m_window.end(), in.data, in.data + in.size);
+        block = m_window.data() + m_dictionary.size;
+    }
 
-    smallz4::lz4(getBytesFromIn, sendBytesToOut, 65536);
+    // One raw block, then the zero offset as the end mark for the loader
+    size_t outpos = (out.size >= 2) ? m_pPacker->compressBlock(block, in.size, out.data, out.size - 2, m_dictionary.size) : 0;
+    if (outpos == 0 && in.size > 0)
+    {
+        printf("LZ4 output is too big, max %lu. bytes\n", (unsigned long)out.size);
+        return out.size + 1;
+    }
+    out.data[outpos++] = 0;
+    out.data[outpos++] = 0;
 
-    printf("LZ4 input size %lu. bytes\n", insize);
-    printf("LZ4 output size %lu. bytes (%1.2f %%)\n", outpos, outpos * 100.0 / insize);
+    printf("LZ4 output size %lu. bytes (%1.2f %%)\n", (unsigned long)outpos, outpos * 100.0 / in.size);
     return outpos;
 }
 
-size_t lz4_decode(unsigned char *src, size_t insize, unsigned char *dst, size_t outsize)
+// Decodes to window + dictSize, the matches may refer to the dictionary at the window start
+static size_t DecodeLz4Block(CodecSpan in, uint8_t* window, size_t dictSize, size_t outsize)
 {
+    uint8_t *src = in.data, *dst = window + dictSize;
+    size_t insize = in.size;
     uint8_t token, byte;
     size_t len, offset;
     uint8_t *start = dst;
+    uint8_t *srcend = src + insize;
+    uint8_t *dstend = dst + outsize;
 
-    while (1)
+    // Bad input stops the decoding, the size returned then is wrong
+    while (src < srcend)
     {
         token = *src++;
 
         len = (token >> 4) & 0xf;
         if (len == 0xf)
         {
-            do { byte = *src++; len += byte; }
+            do { if (src >= srcend) return (dst - start); byte = *src++; len += byte; }
             while (byte == 0xFF);
         }
+        if (len > (size_t)(srcend - src) || len > (size_t)(dstend - dst)) return (dst - start);
         while (len--) *dst++ = *src++;
 
+        if (srcend - src < 2) return (dst - start);
         offset = *src++;
         offset |= (*src++) << 8;
         if (offset == 0)  return (dst - start);
+        if (offset > (size_t)(dst - window)) return (dst - start);
 
         len = token & 0xf;
         if (len == 0xf)
         {
-            do { byte = *src++; len += byte; }
+            do { if (src >= srcend) return (dst - start); byte = *src++; len += byte; }
             while (byte == 0xFF);
         }
         len += 4;
+        if (len > (size_t)(dstend - dst)) return (dst - start);
         while (len--) { dst[0] = dst[-offset]; dst++; };
     }
+    return (dst - start);
+}
+
+size_t CLz4Codec::Decode(CodecSpan in, CodecSpan out)
+{
+    if (m_dictionary.size == 0)
+        return DecodeLz4Block(in, out.data, 0, out.size);
+
+    m_window.resize(m_dictionary.size + out.size);
+    ::memcpy(m_window.data(), m_dictionary.data, m_dictionary.size);
+    size_t decodedSize = DecodeLz4Block(in, m_window.data(), m_dictionary.size, out.size);
+    ::memcpy(out.data, m_window.data() + m_dictionary.size, decodedSize);
+    return decodedSize;
+}
+
+bool CLz4Codec::Analyze(CodecSpan in, CodecStats* pStats)
+{
+    uint8_t *src = in.data;
+    uint8_t *srcend = src + in.size;
+    uint8_t byte;
+    size_t len;
+    size_t decoded = 0;
+
+    while (src < srcend)
+    {
+        uint8_t token = *src++;
+
+        len = (token >> 4) & 0xf;
+        if (len == 0xf)
+        {
+            do { if (src >= srcend) return false; byte = *src++; len += byte; }
+            while (byte == 0xFF);
+        }
+        if (len > (size_t)(srcend - src)) return false;
+        src += len;
+        decoded += len;
+        if (len > 0)
+        {
+            pStats->literals += len;
+            pStats->literalRuns++;
+        }
+
+        if (srcend - src < 2) return true;
+        size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+        if (offset == 0) return true;  // End mark
+
+        len = token & 0xf;
+        if (len == 0xf)
+        {
+            do { if (src >= srcend) return false; byte = *src++; len += byte; }
+            while (byte == 0xFF);
+        }
+        pStats->matches++;
+        pStats->matchBytes += len + 4;
+        decoded += len + 4;
+        size_t read = src - in.data;
+        if (decoded > read && decoded - read > pStats->maxLead)
+            pStats->maxLead = decoded - read;
+    }
+    return true;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -12,42 +12,230 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include "lzsa/lib.h"
-#include "lzsa/shrink_inmem.h"
+#include "lzsa/format.h"
+#include "lzsa/shrink_context.h"
+#include "Sav2Cart.h"
 
 
 //////////////////////////////////////////////////////////////////////
 
-size_t lzsa1_encode(unsigned char *inbuffer, size_t insize, unsigned char *outbuffer, size_t outsize)
+CLzsaCodec::CLzsaCodec(int version, int minmatch, bool favorRatio)
+    : m_version(version), m_pCompressor(nullptr)
 {
-    const int nFormatVersion = 1;
-    unsigned int nFlags = LZSA_FLAG_RAW_BLOCK | LZSA_FLAG_FAVOR_RATIO;
-    size_t encodedSize = lzsa_compress_inmem(inbuffer, outbuffer, insize, outsize, nFlags, 3, nFormatVersion);
-    return encodedSize;
+    SetParameters(minmatch, favorRatio);
 }
 
-size_t lzsa1_decode(unsigned char *src, size_t insize, unsigned char *dst, size_t outsize)
+CLzsaCodec::~CLzsaCodec()
 {
-    int nFormatVersion = 1;
-    unsigned int nFlags = LZSA_FLAG_RAW_BLOCK | LZSA_FLAG_FAVOR_RATIO;
-    size_t decodedSize = lzsa_decompress_inmem(src, dst, insize, outsize, nFlags, &nFormatVersion);
-    return decodedSize;
+    if (m_pCompressor != nullptr)
+        lzsa_compressor_destroy(m_pCompressor);
+    delete m_pCompressor;
 }
 
-size_t lzsa2_encode(unsigned char *inbuffer, size_t insize, unsigned char *outbuffer, size_t outsize)
+void CLzsaCodec::SetParameters(int minmatch, bool favorRatio)
 {
-    const int nFormatVersion = 2;
-    unsigned int nFlags = LZSA_FLAG_RAW_BLOCK | LZSA_FLAG_FAVOR_RATIO;
-    size_t encodedSize = lzsa_compress_inmem(inbuffer, outbuffer, insize, outsize, nFlags, 3, nFormatVersion);
-    return encodedSize;
+    // Same limits as in lzsa_compressor_init
+    int minMatchForFormat = (m_version == 1) ? MIN_MATCH_SIZE_V1 : MIN_MATCH_SIZE_V2;
+    int maxMinMatchForFormat = (m_version == 1) ? 5 : 3;
+    m_minmatch = (minmatch < minMatchForFormat) ? minMatchForFormat : (minmatch > maxMinMatchForFormat) ? maxMinMatchForFormat : minmatch;
+    m_favorRatio = favorRatio;
+}
+
+// Same as lzsa_compress_inmem for one raw block, but the compression context is kept for the next calls
+size_t CLzsaCodec::Encode(CodecSpan in, CodecSpan out)
+{
+    if (in.size > BLOCK_SIZE)
+        return (size_t)-1;
+    unsigned int nFlags = LZSA_FLAG_RAW_BLOCK | (m_favorRatio ? LZSA_FLAG_FAVOR_RATIO : 0);
+    if (m_pCompressor == nullptr)
+    {
+        m_pCompressor = new lzsa_compressor;
+        if (lzsa_compressor_init(m_pCompressor, BLOCK_SIZE * 2, m_minmatch, m_version, nFlags) != 0)
+        {
+            delete m_pCompressor;  // Already destroyed by lzsa_compressor_init
+            m_pCompressor = nullptr;
+            return (size_t)-1;
+        }
+    }
+    m_pCompressor->min_match_size = m_minmatch;
+    m_pCompressor->flags = nFlags;
+    m_pCompressor->safe_dist = 0;
+
+    // With the dictionary, the input goes right after it in the window, as after the previous block
+    uint8_t* window = in.data;
+    if (m_dictionary.size > 0)
+    {
+        m_window.assign(m_dictionary.data, m_dictionary.data + m_dictionary.size);
+        m_window.insert(m_window.end(), in.data, in.data + in.size);
+        window = m_window.data();
+    }
+
+    int maxOutSize = (out.size > BLOCK_SIZE) ? BLOCK_SIZE : (int)out.size;
+    int encodedSize = lzsa_compressor_shrink_block(m_pCompressor, window, (int)m_dictionary.size, (int)in.size, out.data, maxOutSize);
+    return (encodedSize < 0) ? (size_t)-1 : (size_t)encodedSize;
 }
 
-size_t lzsa2_decode(unsigned char *src, size_t insize, unsigned char *dst, size_t outsize)
+size_t CLzsaCodec::Decode(CodecSpan in, CodecSpan out)
 {
-    int nFormatVersion = 2;
+    int nFormatVersion = m_version;
     unsigned int nFlags = LZSA_FLAG_RAW_BLOCK | LZSA_FLAG_FAVOR_RATIO;
-    size_t decodedSize = lzsa_decompress_inmem(src, dst, insize, outsize, nFlags, &nFormatVersion);
-    return decodedSize;
+    if (m_dictionary.size == 0)
+        return lzsa_decompress_inmem(in.data, out.data, in.size, out.size, nFlags, &nFormatVersion);
+
+    // Same as a block after the previous one; the max size is counted from the offset by the expand_block functions
+    m_window.resize(m_dictionary.size + out.size);
+    ::memcpy(m_window.data(), m_dictionary.data, m_dictionary.size);
+    int decodedSize = lzsa_decompressor_expand_block(in.data, (int)in.size, m_window.data(), (int)m_dictionary.size,
+                                                     (int)out.size, nFormatVersion, nFlags);
+    if (decodedSize < 0)
+        return (size_t)-1;
+    ::memcpy(out.data, m_window.data() + m_dictionary.size, decodedSize);
+    return (size_t)decodedSize;
+}
+
+// Walks the raw block the same way as lzsa_decompressor_expand_block_v1/v2, without the output
+bool CLzsaCodec::Analyze(CodecSpan in, CodecStats* pStats)
+{
+    const uint8_t* p = in.data;
+    const uint8_t* end = in.data + in.size;
+    size_t decoded = 0;
+    int nibbleflag = 0;
+    uint8_t nibbles = 0;
+    // Next nibble of LZSA2, the high one first
+    auto getnibble = [&](unsigned int* pValue) -> bool
+    {
+        if ((nibbleflag ^= 1) != 0)
+        {
+            if (p >= end) return false;
+            nibbles = *p++;
+            *pValue = nibbles >> 4;
+        }
+        else
+            *pValue = nibbles & 0x0f;
+        return true;
+    };
+    // Extended length of LZSA2
+    auto getlength = [&](unsigned int* pLength) -> bool
+    {
+        unsigned int value;
+        if (!getnibble(&value)) return false;
+        *pLength += value;
+        if (value != 15)
+            return true;
+        if (p >= end) return false;
+        *pLength += *p++;
+        if (*pLength == 257)
+        {
+            if (p + 1 >= end) return false;
+            *pLength = p[0] | (p[1] << 8);  p += 2;
+        }
+        else if (*pLength == 256)
+            *pLength = 0;
+        return true;
+    };
+
+    while (p < end)
+    {
+        uint8_t token = *p++;
+        unsigned int literals, matchlen;
+        if (m_version == 1)
+        {
+            literals = (token & 0x70) >> 4;
+            if (literals == 7)
+            {
+                if (p >= end) return false;
+                uint8_t value = *p++;
+                literals += value;
+                if (value == 250)
+                {
+                    if (p >= end) return false;
+                    literals = 256 + *p++;
+                }
+                else if (value == 249)
+                {
+                    if (p + 1 >= end) return false;
+                    literals = p[0] | (p[1] << 8);  p += 2;
+                }
+            }
+        }
+        else
+        {
+            literals = (token & 0x18) >> 3;
+            if (literals == 3 && !getlength(&literals))
+                return false;
+        }
+        if (literals > 0)
+        {
+            if (p + literals > end) return false;
+            p += literals;
+            pStats->literals += literals;
+            pStats->literalRuns++;
+            decoded += literals;
+            if (decoded > (size_t)(p - in.data) && decoded - (p - in.data) > pStats->maxLead)
+                pStats->maxLead = decoded - (p - in.data);
+        }
+
+        // The last token in the block does not include match information
+        if (m_version == 1)
+        {
+            if (p + 1 >= end)
+                break;
+            p += (token & 0x80) ? 2 : 1;
+            matchlen = (token & 0x0f) + 3;
+            if (matchlen == 15 + 3)
+            {
+                if (p >= end) return false;
+                uint8_t value = *p++;
+                matchlen += value;
+                if (value == 239)
+                {
+                    if (p >= end) return false;
+                    matchlen = 256 + *p++;
+                }
+                else if (value == 238)
+                {
+                    if (p + 1 >= end) return false;
+                    matchlen = p[0] | (p[1] << 8);  p += 2;
+                }
+            }
+        }
+        else
+        {
+            if (p >= end)
+                break;
+            unsigned int value;
+            switch (token & 0xc0)
+            {
+            case 0x00:  // 5 bit offset
+                if (!getnibble(&value)) return false;
+                break;
+            case 0x40:  // 9 bit offset
+                p++;
+                break;
+            case 0x80:  // 13 bit offset
+                if (!getnibble(&value)) return false;
+                p++;
+                break;
+            default:  // 16 bit offset or rep-match
+                if ((token & 0x20) == 0)
+                    p += 2;
+                break;
+            }
+            matchlen = (token & 0x07) + 2;
+            if (matchlen == 7 + 2 && !getlength(&matchlen))
+                return false;
+        }
+        if (matchlen == 0)
+            break;  // End of data
+        pStats->matches++;
+        pStats->matchBytes += matchlen;
+        decoded += matchlen;
+        if (decoded > (size_t)(p - in.data) && decoded - (p - in.data) > pStats->maxLead)
+            pStats->maxLead = decoded - (p - in.data);
+    }
+    return true;
 }
 
 
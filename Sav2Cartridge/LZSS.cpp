@@ -14,6 +14,8 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "Sav2Cart.h"
 
 
 #define EI 12
@@ -21,162 +23,233 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 #define P   2  /* If match length <= P then output one character */
 #define N (1 << EI)  /* buffer size */
 #define F ((1 << EJ) + P)  /* lookahead buffer size */
+#define HASH_BITS 15  /* match finder hash table size, hash of 3 bytes */
 
-int bit_buffer = 0, bit_mask = 1;
-unsigned long codecount = 0, textcount = 0;
-unsigned char buffer[N * 2];
 
-unsigned char *inputbuffer = 0;
-size_t inputsize, inputpos;
-unsigned char *outputbuffer = 0;
-size_t outputsize, outputpos, flagpos;
-
-
-void error(void)
+CLzssCodec::CLzssCodec(int maxchain, bool optimal)
 {
-    printf("LZSS output error; inputpos %lu., outputpos %lu.\n", inputpos, outputpos);
-    exit(1);
+    m_maxchain = maxchain;
+    m_optimal = optimal;
+    m_textend = m_inserted = 0;
 }
 
-void putflagbit(int f)
+void CLzssCodec::putflagbit(int f)
 {
-    if (bit_mask == 1) // allocate byte for flags
+    if (m_bitmask == 1) // allocate byte for flags
     {
-        if (outputpos >= outputsize) error();
-        flagpos = outputpos;
-        outputpos++;  codecount++;
+        m_flagpos = m_outputpos;
+        m_outputpos++;  m_codecount++;
     }
-    if (f) bit_buffer |= bit_mask;
-    if ((bit_mask <<= 1) == 256)  // save flags to allocated position
+    if (f) m_bitbuffer |= m_bitmask;
+    if ((m_bitmask <<= 1) == 256)  // save flags to allocated position
     {
-        outputbuffer[flagpos] = bit_buffer;
-        bit_buffer = 0;  bit_mask = 1;
+        if (m_flagpos < m_out.size) m_out.data[m_flagpos] = m_bitbuffer;
+        m_bitbuffer = 0;  m_bitmask = 1;
     }
 }
 
-void flush_bit_buffer(void)
+void CLzssCodec::flush_bit_buffer(void)
 {
-    if (bit_mask != 1)
+    if (m_bitmask != 1)
     {
-        outputbuffer[flagpos] = bit_buffer;
+        if (m_flagpos < m_out.size) m_out.data[m_flagpos] = m_bitbuffer;
     }
 }
 
-void putbyte(int c)
+/* Output overflow is not an error: the count goes on, and the caller sees the size greater than the buffer */
+void CLzssCodec::putbyte(int c)
 {
-    if (outputpos >= outputsize) error();
-    outputbuffer[outputpos++] = c;  codecount++;
+    if (m_outputpos < m_out.size) m_out.data[m_outputpos] = c;
+    m_outputpos++;  m_codecount++;
 }
 
-void output1(int c)
+void CLzssCodec::output1(int c)
 {
     putflagbit(0);
-    //printf("LZSS 0x%04X output1 0x%02x\n", outputpos, c);
+    //printf("LZSS 0x%04X output1 0x%02x\n", m_outputpos, c);
     putbyte(c);
 }
 
-void output2(int x, int y)
+void CLzssCodec::output2(int x, int y)
 {
     putflagbit(1);
     int value = (y << 12) | x;
-    //printf("LZSS 0x%04X output2 x=%d, y=%d, value=0x%04X\n", outputpos, x, y, value);
+    //printf("LZSS 0x%04X output2 x=%d, y=%d, value=0x%04X\n", m_outputpos, x, y, value);
     putbyte((value >> 8) & 0xff);
     putbyte(value & 0xff);
 }
 
-unsigned long encode(void)
+/* Hash of 3 bytes at the position, for the match finder */
+inline int hash3(const unsigned char *p)
 {
-    codecount = 0;
-    textcount = 0;
-    flagpos = 0;  bit_buffer = 0;  bit_mask = 1;
-    outputpos = 0;
+    return (int)((((unsigned)p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16)) * 2654435761u) >> (32 - HASH_BITS));
+}
 
-    int i, j, r, s, bufferend, c;
+/* Longest match for position r, nearest of the longest ones; returns the length, 1 if no match longer than P.
+   The window is N - F spaces followed by the whole input, matches are looked up in hash chains
+   of 3-byte sequences, nearest first. A match never starts in the spaces: the PDP-11 loader has no such
+   prefill, a reference there would read the loader block below 01000. */
+int CLzssCodec::find_match(int r, int *px)
+{
+    int i, j;
+    const unsigned char *text = m_text.data();
 
-    for (i = 0; i < N - F; i++) buffer[i] = ' ';
-    for (i = N - F; i < N * 2; i++)
+    for (; m_inserted < r; m_inserted++)
     {
-        if (inputpos >= inputsize) break;
-        c = inputbuffer[inputpos++];
-        buffer[i] = c;  textcount++;
+        int h = hash3(text + m_inserted);
+        m_prev[m_inserted] = m_head[h];  m_head[h] = m_inserted;
     }
-    bufferend = i;  r = N - F;  s = 0;
-    while (r < bufferend)
+
+    int f1 = (F <= m_textend - r) ? F : m_textend - r;
+    int s = (r - (N - F) > N - F) ? r - (N - F) : N - F;  /* window start, not before the input */
+    int x = 0;  int y = 1;
+    if (f1 > P)  /* shorter matches are coded as a literal anyway */
     {
-        int f1 = (F <= bufferend - r) ? F : bufferend - r;
-        int x = 0;  int y = 1;  c = buffer[r];
-        for (i = r - 1; i >= s; i--)
-            if (buffer[i] == c)
+        int chain = m_maxchain;
+        for (i = m_head[hash3(text + r)]; i >= s; i = m_prev[i])
+        {
+            for (j = 0; j < f1; j++)
+                if (text[i + j] != text[r + j]) break;
+            if (j > y)
             {
-                for (j = 1; j < f1; j++)
-                    if (buffer[i + j] != buffer[r + j]) break;
-                if (j > y)
-                {
-                    x = i;  y = j;
-                }
+                x = i;  y = j;
+                if (y == f1) break;
             }
-        if (y <= P)
-        {
-            y = 1; output1(c);
+            if (chain > 0 && --chain == 0) break;
         }
+    }
+    *px = x;
+    return (y <= P) ? 1 : y;
+}
+
+/* Greedy parse: the longest match at every step, same output as of the plain backward scan over the input in the window */
+void CLzssCodec::encode_greedy(void)
+{
+    int r = N - F;
+    while (r < m_textend)
+    {
+        int x;
+        int y = find_match(r, &x);
+        if (y == 1)
+            output1(m_text[r]);
         else
             output2((r - x) & (N - 1), y - P - 1);
-        r += y;  s += y;
-        if (r >= N * 2 - F)
+        r += y;
+    }
+}
+
+/* Optimal parse: shortest path over the positions, a literal costs 9 bits and a match 17 bits;
+   every length from P + 1 up to the longest match is possible at a position, with the same offset */
+void CLzssCodec::encode_optimal(void)
+{
+    int r, y;
+    int count = m_textend - (N - F);
+    m_lengths.resize(count + 1);
+    m_positions.resize(count + 1);
+    m_cost.resize(count + 1);
+    int *lengths = m_lengths.data();
+    int *positions = m_positions.data();
+    unsigned long *cost = m_cost.data();
+
+    for (r = 0; r < count; r++)
+        lengths[r] = find_match(N - F + r, positions + r);
+
+    /* Greedy size for comparison: literals, match words and flag bytes */
+    unsigned long greedycodes = 0, greedysize = 0;
+    for (r = 0; r < count; r += lengths[r], greedycodes++)
+        greedysize += (lengths[r] == 1) ? 1 : 2;
+    greedysize += (greedycodes + 7) / 8;
+
+    cost[count] = 0;
+    for (r = count - 1; r >= 0; r--)
+    {
+        cost[r] = cost[r + 1] + 9;  positions[r] = (positions[r] << 5) | 1;
+        for (y = P + 1; y <= lengths[r]; y++)
         {
-            for (i = 0; i < N; i++) buffer[i] = buffer[i + N];
-            bufferend -= N;  r -= N;  s -= N;
-            while (bufferend < N * 2)
+            if (cost[r + y] + 17 < cost[r])
             {
-                if (inputpos >= inputsize) break;
-                c = inputbuffer[inputpos++];
-                buffer[bufferend++] = c;  textcount++;
+                cost[r] = cost[r + y] + 17;  positions[r] = (positions[r] & ~31) | y;
             }
         }
     }
-    flush_bit_buffer();
 
-    //printf("LZSS inputpos %ld., outputpos %ld.\n", inputpos, outputpos);
-    printf("LZSS input size %lu. bytes\n", textcount);
-    printf("LZSS output size %lu. bytes (%1.2f %%)\n", codecount, codecount * 100.0 / textcount);
+    for (r = 0; r < count; r += y)
+    {
+        y = positions[r] & 31;
+        if (y == 1)
+            output1(m_text[N - F + r]);
+        else
+            output2((N - F + r - (positions[r] >> 5)) & (N - 1), y - P - 1);
+    }
 
-    return codecount;
+    printf("LZSS optimal parse %lu. bytes, greedy %lu. bytes, gain %ld. bytes (%1.2f %%)\n",
+           m_codecount, greedysize, (long)greedysize - (long)m_codecount,
+           greedysize > 0 ? ((long)greedysize - (long)m_codecount) * 100.0 / greedysize : 0.0);
 }
 
-unsigned long decode(void)
+size_t CLzssCodec::Encode(CodecSpan in, CodecSpan out)
 {
-    textcount = 0;
+    m_out = out;
+    m_codecount = 0;
+    m_flagpos = 0;  m_bitbuffer = 0;  m_bitmask = 1;
+    m_outputpos = 0;
+
+    m_textend = (int)(N - F + in.size);
+    m_text.resize(m_textend + F);
+    m_head.assign(1 << HASH_BITS, -1);
+    m_prev.resize(m_textend);
+    memset(m_text.data(), ' ', N - F);
+    memcpy(m_text.data() + N - F, in.data, in.size);
+    memset(m_text.data() + m_textend, 0, F);
+    m_inserted = 0;
+
+    if (m_optimal)
+        encode_optimal();
+    else
+        encode_greedy();
+    flush_bit_buffer();
+
+    printf("LZSS input size %lu. bytes\n", (unsigned long)in.size);
+    printf("LZSS output size %lu. bytes (%1.2f %%)\n", m_codecount, m_codecount * 100.0 / in.size);
+
+    return m_codecount;
+}
 
+size_t CLzssCodec::Decode(CodecSpan in, CodecSpan out)
+{
+    size_t inputpos = 0, outputpos = 0;
+    unsigned char buffer[N];
     int i, j, k, r, c;
 
     for (i = 0; i < N - F; i++) buffer[i] = ' ';
     r = N - F;
     while (1)
     {
-        if (inputpos >= inputsize) break;
-        int flags = inputbuffer[inputpos++];
+        if (inputpos >= in.size) break;
+        int flags = in.data[inputpos++];
         for (int b = 0; b < 8; b++)
         {
             if ((flags & 1) == 0)
             {
-                if (inputpos >= inputsize) break;
-                c = inputbuffer[inputpos++];
-                outputbuffer[outputpos++] = c;  textcount++;
+                if (inputpos >= in.size) break;
+                c = in.data[inputpos++];
+                if (outputpos >= out.size) return outputpos;
+                out.data[outputpos++] = c;
                 buffer[r++] = c;  r &= (N - 1);
             }
             else
             {
-                if (inputpos >= inputsize) break;
-                int value = (inputbuffer[inputpos++] << 8);
-                if (inputpos >= inputsize) break;
-                value = value | inputbuffer[inputpos++];
+                if (inputpos >= in.size) break;
+                int value = (in.data[inputpos++] << 8);
+                if (inputpos >= in.size) break;
+                value = value | in.data[inputpos++];
                 i = value & 0xfff;  // 12 bits
                 j = (value >> 12);  // 4 bits
                 for (k = 0; k <= j + P; k++)
                 {
                     c = buffer[(r - i) & (N - 1)];
-                    if (outputpos >= outputsize) error();
-                    outputbuffer[outputpos++] = c;  textcount++;
+                    if (outputpos >= out.size) return outputpos;
+                    out.data[outputpos++] = c;
                     buffer[r++] = c;  r &= (N - 1);
                 }
             }
@@ -187,38 +260,43 @@ unsigned long decode(void)
 
     //printf("LZSS decode inputpos %ld., outputpos %ld.\n", inputpos, outputpos);
 
-    return textcount;
-}
-
-size_t lzss_encode(unsigned char *inbuffer, size_t insize, unsigned char *outbuffer, size_t outsize)
-{
-    inputbuffer = inbuffer;
-    inputsize = insize;
-    inputpos = 0;
-    outputbuffer = outbuffer;
-    outputsize = outsize;
-
-    unsigned long result = encode();
-
-    inputbuffer = 0;
-    outputbuffer = 0;
-
-    return (size_t) result;
+    return outputpos;
 }
 
-size_t lzss_decode(unsigned char *inbuffer, size_t insize, unsigned char *outbuffer, size_t outsize)
+bool CLzssCodec::Analyze(CodecSpan in, CodecStats* pStats)
 {
-    inputbuffer = inbuffer;
-    inputsize = insize;
-    inputpos = 0;
-    outputbuffer = outbuffer;
-    outputsize = outsize;
-    outputpos = 0;
-
-    unsigned long result = decode();
-
-    inputbuffer = 0;
-    outputbuffer = 0;
+    size_t inputpos = 0;
+    size_t decoded = 0;
+    bool literalrun = false;
+    while (inputpos < in.size)
+    {
+        int flags = in.data[inputpos++];
+        for (int b = 0; b < 8 && inputpos < in.size; b++)
+        {
+            if ((flags & 1) == 0)
+            {
+                inputpos++;
+                decoded++;
+                pStats->literals++;
+                if (!literalrun)
+                    pStats->literalRuns++;
+                literalrun = true;
+            }
+            else
+            {
+                if (inputpos + 2 > in.size) return false;
+                int j = in.data[inputpos] >> 4;
+                inputpos += 2;
+                decoded += j + P + 1;
+                pStats->matches++;
+                pStats->matchBytes += j + P + 1;
+                literalrun = false;
+                if (decoded > inputpos && decoded - inputpos > pStats->maxLead)
+                    pStats->maxLead = decoded - inputpos;
+            }
 
-    return result;
+            flags = flags >> 1;
+        }
+    }
+    return true;
 }
@@ -288,8 +288,8 @@ uint16_t const loaderLZ4[] =
     0000104,  // 000116
     0177777,  // 000120
     // LZ4 unpacker for PDP11/EIS by Alexander Troosh
-    0012705, 0001000, // 000122  012705 ??????'          MOV     #dst, R5
-    0012700, 0000000, // 000126  012700 ??????'          MOV     #src, R0
+    0012705, 0001000, // 000122  012705 001000           MOV     #1000, R5       ; Куда распаковываем
+    0012700, 0100600, // 000126  012700 100600           MOV     #100600, R0     ; Откуда: LZ4TA
     0012704, 0177774, // 000132  012704 177774           MOV     #-4,  R4        ; Нет лучше места под константу -4, чем R4
     //
     0005002,          // 000136  005002                  CLR     R2
@@ -311,23 +311,28 @@ uint16_t const loaderLZ4[] =
     0077102,          // 000172  077102                    SOB     R1, copylits
     //
     //                   000174                  noliterals:
-    0012003,          // 000174  012003                  MOV     (R0)+, R3       ; Получаем два байт смещения
-    0001702,          // 000176  001702                  BEQ     LAUNCH          ; Нулевое смещение - конец сжатого блока
     //                                                         ; R1=0, как бы мы сюда не попали
-    0042702, 0177760, // 000200  042702 177760           BIC     #^X0fff0, R2    ; Младший полубайт - число копируемых байт
-    0022702, 0000017, // 000204  022702 000017           CMP     #^X0f, R2       ; Признак большой длины?
-    0001004,          // 000210  001004                  BNE     shortstr
-    0152001,          // 000212  152001          2$:       BISB  (R0)+, R1       ; Уточняем длину...
-    0060102,          // 000214  060102                    ADD   R1, R2
-    0105201,          // 000216  105201                    INCB  R1              ; бесконечно долго, пока приходят 0xFF
-    0001774,          // 000220  001774                    BEQ   2$
-    //                   000222                  shortstr:
-    0160402,          // 000222  160402                  SUB     R4, R2          ; Минимальный размер строки - 4 байта
-    0010501,          // 000224  010501                  MOV     R5, R1
-    0160301,          // 000226  160301                  SUB     R3, R1
-    0112125,          // 000230  112125          copystr:  MOVB  (R1)+, (R5)+    ; Копируем строку из
-    0077202,          // 000232  077202                    SOB   R2, copystr     ; уже распакованных данных
-    0000741           // 000234  000741                  BR      gettoken
+    0005003,          // 000174  005003                  CLR     R3              ; Получаем два байта смещения,
+    0152003,          // 000176  152003                  BISB    (R0)+, R3       ; по байту: адрес может быть нечётным
+    0152001,          // 000200  152001                  BISB    (R0)+, R1
+    0000301,          // 000202  000301                  SWAB    R1
+    0050103,          // 000204  050103                  BIS     R1, R3
+    0001732,          // 000206  001732                  BEQ     LAUNCH          ; Нулевое смещение - конец сжатого блока
+    0005001,          // 000210  005001                  CLR     R1
+    0042702, 0177760, // 000212  042702 177760           BIC     #^X0fff0, R2    ; Младший полубайт - число копируемых байт
+    0022702, 0000017, // 000216  022702 000017           CMP     #^X0f, R2       ; Признак большой длины?
+    0001004,          // 000222  001004                  BNE     shortstr
+    0152001,          // 000224  152001          2$:       BISB  (R0)+, R1       ; Уточняем длину...
+    0060102,          // 000226  060102                    ADD   R1, R2
+    0105201,          // 000230  105201                    INCB  R1              ; бесконечно долго, пока приходят 0xFF
+    0001774,          // 000232  001774                    BEQ   2$
+    //                   000234                  shortstr:
+    0160402,          // 000234  160402                  SUB     R4, R2          ; Минимальный размер строки - 4 байта
+    0010501,          // 000236  010501                  MOV     R5, R1
+    0160301,          // 000240  160301                  SUB     R3, R1
+    0112125,          // 000242  112125          copystr:  MOVB  (R1)+, (R5)+    ; Копируем строку из
+    0077202,          // 000244  077202                    SOB   R2, copystr     ; уже распакованных данных
+    0000734           // 000246  000734                  BR      gettoken
 };
 size_t const loaderLZ4Size = sizeof(loaderLZ4);
 
@@ -366,7 +371,7 @@ uint16_t const loaderLZSA1[] =
     0020327,  // 000064  020327  CMP     R3, #CHKSUM
     0000000,  // 000066  ?????? <= CHKSUM
     0001343,  // 000070  001343  BNE     000000
-    0000413,  // 000072  000413  BR      000122        ; Переход на unpacker
+    0000540,  // 000072  000540  BR      000374        ; Переход на установку стека и unpacker
     // Запуск загруженной программы на выполнение
     0012706,  // 000074  016706  MOV	#STACK, SP
     0001000,  // 000076  ?????? <= STACK
@@ -457,6 +462,10 @@ uint16_t const loaderLZSA1[] =
     0000207,          // 000366  000207 					rts pc
     0000000,          // 000370  000000 	Counter:	.WORD 0
     0000000,          // 000372  000000 	Offset:		.WORD 0
+    // Стек над упакованными данными, ниже 001000 может быть словарь (-dict)
+    0012706,          // 000374  012706  MOV    #160000, SP
+    0160000,          // 000376  160000
+    0000650,          // 000400  000650  BR     000122
 };
 size_t const loaderLZSA1Size = sizeof(loaderLZSA1);
 
@@ -645,4 +654,606 @@ uint16_t const loaderLZSA2[] =
 size_t const loaderLZSA2Size = sizeof(loaderLZSA2);
 
 
+//////////////////////////////////////////////////////////////////////
+
+uint16_t const loaderZX0[] =
+{
+    0000240,  // 000000  000240  NOP
+    0012702,  // 000002  012702  MOV     #000116, R2    ; Адрес массива параметров
+    0000116,
+    0110062,  // 000006  110062  MOVB    R0, 000003(R2)
+    0000003,
+    0012701,  // 000012  012701  MOV     #000005, R1
+    0000005,
+    0012703,  // 000016  012703  MOV     #000130, R3
+    0000130,
+    0000402,  // 000022  000402  BR      000030
+    0112337,  // 000024  112337  MOVB    (R3)+, @#176676
+    0176676,
+    0105737,  // 000030  105737  TSTB    @#176674
+    0176674,
+    0100375,  // 000034  100375  BPL     000030
+    0077106,  // 000036  077106  SOB     R1, 000024
+    0105712,  // 000040  105712  TSTB    (R2)
+    0001356,  // 000042  001356  BNE     000000
+    // Подсчёт контрольной суммы
+    0005003,  // 000044  005003  CLR     R3
+    0012701,  // 000046  012701  MOV     #100600, R1
+    0100600,  // 000050  100600 <= ZXSTART
+    0012702,  // 000052  012702  MOV     #027400, R2
+    0027400,  // 000054  027400 <= ZXWORDS
+    0062103,  // 000056  062103  ADD     (R1)+, R3
+    0005503,  // 000060  005503  ADC     R3
+    0077203,  // 000062  077203  SOB     R2, 000056
+    0020327,  // 000064  020327  CMP     R3, #CHKSUM
+    0000000,  // 000066  ?????? <= CHKSUM
+    0001343,  // 000070  001343  BNE     000000
+    // Выполняем распаковку
+    0012700,  // 000072  012700  MOV     #ZXSTART, R0
+    0100600,  // 000074  ?????? <= ZXSTART
+    0012701,  // 000076  012701  MOV     #1000, R1
+    0001000,  // 000100  001000
+    0004767,  // 000102  004767  CALL    UNZX0
+    0000026,  // 000104  000026
+    // Распаковали, выполняем запуск
+    0012706,  // 000106  012706  MOV     #STACK, SP
+    0001000,  // 000110  ?????? <= STACK
+    0000137,  // 000112  000137  JMP     START   ; Переход на загруженный код
+    0001000,  // 000114  ?????? <= START
+    // Массив параметров для получения данных с кассеты ПЗУ через канал 2
+    0004000,  // 000116  004000   ; Команда (10) и ответ
+    0000021,  // 000120  000021   ; Номер кассеты и номер устройства
+    0001000,  // 000122  001000   ; Адрес от начала кассеты ПЗУ
+    0100600,  // 000124  100600   ; Адрес в ОЗУ <= ZXSTART
+    0027400,  // 000126  027400   ; Количество слов <= ZXWORDS
+    0000116,  // 000130
+    0177777,  // 000132
+    // ZX0-style decompressor: R0 = source, R1 = destination, R2 = last offset, R4 = bit buffer
+    //                   000134          UNZX0:
+    0012704, 0000200, // 000134  012704 000200           MOV     #200, R4        ; Буфер битов пуст
+    0012702, 0000001, // 000140  012702 000001           MOV     #1, R2
+    //                   000144          LITS:
+    0004767, 0000106, // 000144  004767 000106           CALL    GAMMA           ; Число литералов
+    0112021,          // 000150  112021          1$:     MOVB    (R0)+, (R1)+
+    0077302,          // 000152  077302                  SOB     R3, 1$
+    0004767, 0000062, // 000154  004767 000062           CALL    GETBIT
+    0103411,          // 000160  103411                  BCS     NEWOFF
+    0004767, 0000070, // 000162  004767 000070           CALL    GAMMA           ; Повтор с прежним смещением
+    //                   000166          COPY:
+    0010105,          // 000166  010105                  MOV     R1, R5
+    0160205,          // 000170  160205                  SUB     R2, R5
+    0112521,          // 000172  112521          2$:     MOVB    (R5)+, (R1)+
+    0077302,          // 000174  077302                  SOB     R3, 2$
+    0004767, 0000040, // 000176  004767 000040           CALL    GETBIT
+    0103360,          // 000202  103360                  BCC     LITS
+    //                   000204          NEWOFF:
+    0004767, 0000046, // 000204  004767 000046           CALL    GAMMA           ; Старшая часть смещения + 1
+    0005303,          // 000210  005303                  DEC     R3
+    0120327, 0000377, // 000212  120327 000377           CMPB    R3, #377        ; Признак конца данных?
+    0001410,          // 000216  001410                  BEQ     DONE
+    0000303,          // 000220  000303                  SWAB    R3
+    0152003,          // 000222  152003                  BISB    (R0)+, R3       ; Младший байт смещения
+    0005203,          // 000224  005203                  INC     R3
+    0010302,          // 000226  010302                  MOV     R3, R2
+    0004767, 0000022, // 000230  004767 000022           CALL    GAMMA           ; Длина - 1
+    0005203,          // 000234  005203                  INC     R3
+    0000753,          // 000236  000753                  BR      COPY
+    //                   000240          DONE:
+    0000207,          // 000240  000207                  RTS     PC
+    //                   000242          GETBIT:                                 ; Следующий бит в C
+    0106304,          // 000242  106304                  ASLB    R4
+    0001003,          // 000244  001003                  BNE     1$
+    0112004,          // 000246  112004                  MOVB    (R0)+, R4
+    0000261,          // 000250  000261                  SEC
+    0106104,          // 000252  106104                  ROLB    R4
+    0000207,          // 000254  000207          1$:     RTS     PC
+    //                   000256          GAMMA:                                  ; Гамма-код Элиаса в R3
+    0012703, 0000001, // 000256  012703 000001           MOV     #1, R3
+    0004767, 0177754, // 000262  004767 177754   1$:     CALL    GETBIT
+    0103404,          // 000266  103404                  BCS     2$
+    0004767, 0177746, // 000270  004767 177746           CALL    GETBIT
+    0006103,          // 000274  006103                  ROL     R3
+    0000771,          // 000276  000771                  BR      1$
+    0000207,          // 000300  000207          2$:     RTS     PC
+};
+size_t const loaderZX0Size = sizeof(loaderZX0);
+
+
+//////////////////////////////////////////////////////////////////////
+
+// Loader for the image split over two cartridges: every fragment is read from its cartridge,
+// checked and unpacked with LZSA1 one after another
+uint16_t const loaderMultiLZSA1[] =
+{
+    0000240,  // 000000  000240  NOP
+    0010037,  // 000002  010037  MOV     R0, @#BOOT     ; Номер загрузочной кассеты
+    0000170,
+    0012737,  // 000006  012737  MOV     #CHUNKS, @#PTR
+    0000214,
+    0000172,
+    // Чтение очередного фрагмента с кассеты ПЗУ
+    0013705,  // 000014  013705  MOV     @#PTR, R5      ; Описание фрагмента
+    0000172,
+    0013700,  // 000020  013700  MOV     @#BOOT, R0
+    0000170,
+    0005725,  // 000024  005725  TST     (R5)+          ; Фрагмент на другой кассете?
+    0001403,  // 000026  001403  BEQ     000036
+    0005400,  // 000030  005400  NEG     R0
+    0062700,  // 000032  062700  ADD     #3, R0         ; 1 <-> 2
+    0000003,
+    0110037,  // 000036  110037  MOVB    R0, @#PARAMS+3
+    0000201,
+    0012702,  // 000042  012702  MOV     #PARAMS+4, R2
+    0000202,
+    0012522,  // 000046  012522  MOV     (R5)+, (R2)+   ; Адрес от начала кассеты ПЗУ
+    0012522,  // 000050  012522  MOV     (R5)+, (R2)+   ; Адрес в ОЗУ
+    0012522,  // 000052  012522  MOV     (R5)+, (R2)+   ; Количество слов
+    0012701,  // 000054  012701  MOV     #000005, R1
+    0000005,
+    0012703,  // 000060  012703  MOV     #SEND, R3
+    0000210,
+    0000402,  // 000064  000402  BR      000072
+    0112337,  // 000066  112337  MOVB    (R3)+, @#176676
+    0176676,
+    0105737,  // 000072  105737  TSTB    @#176674
+    0176674,
+    0100375,  // 000076  100375  BPL     000072
+    0077106,  // 000100  077106  SOB     R1, 000066
+    0105737,  // 000102  105737  TSTB    @#PARAMS
+    0000176,
+    0001342,  // 000106  001342  BNE     000014         ; Ошибка, повторяем фрагмент
+    // Подсчёт контрольной суммы фрагмента
+    0005003,  // 000110  005003  CLR     R3
+    0013701,  // 000112  013701  MOV     @#PARAMS+6, R1
+    0000204,
+    0013702,  // 000116  013702  MOV     @#PARAMS+10, R2
+    0000206,
+    0062103,  // 000122  062103  ADD     (R1)+, R3
+    0005503,  // 000124  005503  ADC     R3
+    0077203,  // 000126  077203  SOB     R2, 000122
+    0022503,  // 000130  022503  CMP     (R5)+, R3      ; Контрольная сумма из описания
+    0001330,  // 000132  001330  BNE     000014
+    // Распаковка фрагмента
+    0012502,  // 000134  012502  MOV     (R5)+, R2      ; Адрес назначения
+    0010537,  // 000136  010537  MOV     R5, @#PTR
+    0000172,
+    0013701,  // 000142  013701  MOV     @#PARAMS+6, R1
+    0000204,
+    0004767,  // 000146  004767  CALL    unlzsa1
+    0000072,
+    0005337,  // 000152  005337  DEC     @#COUNT
+    0000174,
+    0001316,  // 000156  001316  BNE     000014
+    // Все фрагменты распакованы, запуск загруженной программы на выполнение
+    0012706,  // 000160  012706  MOV     #STACK, SP
+    0001000,  // 000162  ?????? <= STACK
+    0000137,  // 000164  000137  JMP     START   ; Переход на загруженный код
+    0001000,  // 000166  ?????? <= START
+    0000000,  // 000170  BOOT:   номер загрузочной кассеты
+    0000000,  // 000172  PTR:    описание очередного фрагмента
+    0000002,  // 000174  COUNT:  число фрагментов
+    // Массив параметров для получения данных с кассеты ПЗУ через канал 2
+    0004000,  // 000176  004000   ; Команда (10) и ответ
+    0000021,  // 000200  000021   ; Номер кассеты и номер устройства
+    0000000,  // 000202  ??????   ; Адрес от начала кассеты ПЗУ
+    0000000,  // 000204  ??????   ; Адрес в ОЗУ
+    0000000,  // 000206  ??????   ; Количество слов
+    0000176,  // 000210  SEND
+    0177777,  // 000212
+    // Описания фрагментов, по 6 слов: другая кассета (0/1), адрес на кассете, адрес в ОЗУ,
+    // количество слов, контрольная сумма, адрес назначения
+    0000000, 0001000, 0000000, 0000000, 0000000, 0001000,  // 000214  CHUNKS: фрагмент 1 <= ...
+    0000001, 0000000, 0000000, 0000000, 0000000, 0000000,  // 000230  фрагмент 2 <= ...
+    // LZSA1 unpacker for PDP11 by Ivan Gorodetsky, same as in loaderLZSA1
+    // https://gitlab.com/ivagor/lzsa8080/-/blob/master/PDP11/LZSA1/lzsa1.asm
+    //                   000244				unlzsa1:
+    //                   000244				ReadToken:
+    0105067, 0000225, // 000244  105067 000225 				clrb Counter+1
+    0112100,          // 000250  112100 					movb (r1)+,r0
+    0010005,          // 000252  010005 					mov r0,r5
+    0042700, 0177617, // 000254  042700 177617 				bic #177617,r0
+    0001417,          // 000260  001417 					beq NoLiterals
+    0006200,          // 000262  006200 					asr r0
+    0006200,          // 000264  006200 					asr r0
+    0006200,          // 000266  006200 					asr r0
+    0006200,          // 000270  006200 					asr r0
+    0022700, 0000007, // 000272  022700 000007 				cmp #7,r0
+    0001002,          // 000276  001002 					bne m1
+    0004767, 0000114, // 000300  004767 000114 				jsr pc,ReadLong
+    //                   000304				m1:
+    0110067, 0000164, // 000304  110067 000164 				movb r0,Counter+0
+    0016703, 0000160, // 000310  016703 000160 				mov Counter,r3
+    //                   000314				bc1:
+    0112122,          // 000314  112122 					movb (r1)+,(r2)+
+    0077302,          // 000316  077302 					sob r3,bc1
+    //                   000320				NoLiterals:
+    0112167, 0000152, // 000320  112167 000152 				movb (r1)+,Offset+0
+    0112767, 0000377, 0000145, // 000324  112767 000377 000145 		movb #377,Offset+1
+    0110500,          // 000332  110500 					movb r5,r0
+    0100002,          // 000334  100002 					bpl ShortOffset
+    //                   000336				LongOffset:
+    0112167, 0000135, // 000336  112167 000135 				movb (r1)+,Offset+1
+    //                   000342				ShortOffset:
+    0105067, 0000127, // 000342  105067 000127 				clrb Counter + 1
+    0042700, 0177760, // 000346  042700 177760 				bic #177760,r0
+    0062700, 0000003, // 000352  062700 000003 				add #3,r0
+    0022700, 0000022, // 000356  022700 000022 				cmp #18.,r0
+    0001002,          // 000362  001002 					bne m2
+    0004767, 0000030, // 000364  004767 000030 				jsr pc,ReadLong
+    //                   000370				m2:
+    0110067, 0000100, // 000370  110067 000100 				movb r0,Counter+0
+    0010104,          // 000374  010104 					mov r1,r4
+    0016701, 0000074, // 000376  016701 000074 				mov Offset,r1
+    0060201,          // 000402  060201 					add r2,r1
+    0016703, 0000064, // 000404  016703 000064 				mov Counter,r3
+    //                   000410				bc2:
+    0112122,          // 000410  112122 					movb (r1)+,(r2)+
+    0077302,          // 000412  077302 					sob r3,bc2
+    0010401,          // 000414  010401 					mov r4,r1
+    0000712,          // 000416  000712 					br ReadToken
+    //                   000420				ReadLong:
+    0112104,          // 000420  112104 					movb (r1)+,r4
+    0052704, 0177400, // 000422  052704 177400 				bis #177400,r4	;FF00h
+    0060400,          // 000426  060400 					add r4,r0
+    0103006,          // 000430  103006 					bcc m3
+    0110067, 0000037, // 000432  110067 000037 				movb r0,Counter+1
+    0112100,          // 000436  112100 					movb (r1)+,r0
+    0105767, 0000031, // 000440  105767 000031 				tstb Counter+1
+    0001401,          // 000444  001401 					beq m4
+    //                   000446				m3:
+    0000207,          // 000446  000207 					rts pc
+    //                   000450				m4:
+    0110067, 0000020, // 000450  110067 000020 				movb r0,Counter+0
+    0112167, 0000015, // 000454  112167 000015 				movb (r1)+,Counter+1
+    0005767, 0000010, // 000460  005767 000010 				tst Counter
+    0001401,          // 000464  001401 					beq m5
+    0000207,          // 000466  000207 					rts pc
+    //                   000470				m5:
+    0012604,          // 000470  012604 					mov (sp)+,r4
+    0000207,          // 000472  000207 					rts pc
+    0000000,          // 000474  000000 	Counter:	.WORD 0
+    0000000,          // 000476  000000 	Offset:		.WORD 0
+};
+size_t const loaderMultiLZSA1Size = sizeof(loaderMultiLZSA1);
+
+
+//////////////////////////////////////////////////////////////////////
+
+// Backward LZSA1: the stream is read to the place right below the end of the program
+// with the safety gap, and unpacked from the end to the start, in place
+uint16_t const loaderLZSA1B[] =
+{
+    0000240,  // 000000  000240  NOP
+    0012702,  // 000002  012702  MOV     #000122, R2    ; Адрес массива параметров
+    0000122,
+    0110062,  // 000006  110062  MOVB    R0, 000003(R2)
+    0000003,
+    0012701,  // 000012  012701  MOV     #000005, R1
+    0000005,
+    0012703,  // 000016  012703  MOV     #000134, R3
+    0000134,
+    0000402,  // 000022  000402  BR      000030
+    0112337,  // 000024  112337  MOVB    (R3)+, @#176676
+    0176676,
+    0105737,  // 000030  105737  TSTB    @#176674
+    0176674,
+    0100375,  // 000034  100375  BPL     000030
+    0077106,  // 000036  077106  SOB     R1, 000024
+    0105712,  // 000040  105712  TSTB    (R2)
+    0001356,  // 000042  001356  BNE     000000
+    // Подсчёт контрольной суммы
+    0005003,  // 000044  005003  CLR     R3
+    0012701,  // 000046  012701  MOV     #LZSTART, R1
+    0000000,  // 000050  ?????? <= LZSTART
+    0012702,  // 000052  012702  MOV     #LZWORDS, R2
+    0000000,  // 000054  ?????? <= LZWORDS
+    0062103,  // 000056  062103  ADD     (R1)+, R3
+    0005503,  // 000060  005503  ADC     R3
+    0077203,  // 000062  077203  SOB     R2, 000056
+    0020327,  // 000064  020327  CMP     R3, #CHKSUM
+    0000000,  // 000066  ?????? <= CHKSUM
+    0001343,  // 000070  001343  BNE     000000
+    // Распаковка с конца на месте, стек ниже упакованных данных
+    0012706,  // 000072  012706  MOV     #LZSTART, SP
+    0000000,  // 000074  ?????? <= LZSTART
+    0012701,  // 000076  012701  MOV     #LZEND, R1     ; Конец упакованных данных
+    0000000,  // 000100  ?????? <= LZEND
+    0012702,  // 000102  012702  MOV     #IMGEND, R2    ; Конец программы
+    0000000,  // 000104  ?????? <= IMGEND
+    0004767,  // 000106  004767  CALL    unlzsa1
+    0000026,  // 000110  000026
+    // Распаковали, выполняем запуск
+    0012706,  // 000112  012706  MOV     #STACK, SP
+    0001000,  // 000114  ?????? <= STACK
+    0000137,  // 000116  000137  JMP     START   ; Переход на загруженный код
+    0001000,  // 000120  ?????? <= START
+    // Массив параметров для получения данных с кассеты ПЗУ через канал 2
+    0004000,  // 000122  004000   ; Команда (10) и ответ
+    0000021,  // 000124  000021   ; Номер кассеты и номер устройства
+    0001000,  // 000126  001000   ; Адрес от начала кассеты ПЗУ
+    0000000,  // 000130  ??????   ; Адрес в ОЗУ <= LZSTART
+    0000000,  // 000132  ??????   ; Количество слов <= LZWORDS
+    0000122,  // 000134
+    0177777,  // 000136
+    // LZSA1 unpacker for PDP11 by Ivan Gorodetsky, reading and writing backward
+    // https://gitlab.com/ivagor/lzsa8080/-/blob/master/PDP11/LZSA1/lzsa1.asm
+    //                   000140				unlzsa1:
+    //                   000140				ReadToken:
+    0105067, 0000225, // 000140  105067 000225 				clrb Counter+1
+    0114100,          // 000144  114100 					movb -(r1),r0
+    0010005,          // 000146  010005 					mov r0,r5
+    0042700, 0177617, // 000150  042700 177617 				bic #177617,r0
+    0001417,          // 000154  001417 					beq NoLiterals
+    0006200,          // 000156  006200 					asr r0
+    0006200,          // 000160  006200 					asr r0
+    0006200,          // 000162  006200 					asr r0
+    0006200,          // 000164  006200 					asr r0
+    0022700, 0000007, // 000166  022700 000007 				cmp #7,r0
+    0001002,          // 000172  001002 					bne m1
+    0004767, 0000114, // 000174  004767 000114 				jsr pc,ReadLong
+    //                   000200				m1:
+    0110067, 0000164, // 000200  110067 000164 				movb r0,Counter+0
+    0016703, 0000160, // 000204  016703 000160 				mov Counter,r3
+    //                   000210				bc1:
+    0114142,          // 000210  114142 					movb -(r1),-(r2)
+    0077302,          // 000212  077302 					sob r3,bc1
+    //                   000214				NoLiterals:
+    0114167, 0000152, // 000214  114167 000152 				movb -(r1),Offset+0
+    0112767, 0000377, 0000145, // 000220  112767 000377 000145 		movb #377,Offset+1
+    0110500,          // 000226  110500 					movb r5,r0
+    0100002,          // 000230  100002 					bpl ShortOffset
+    //                   000232				LongOffset:
+    0114167, 0000135, // 000232  114167 000135 				movb -(r1),Offset+1
+    //                   000236				ShortOffset:
+    0105067, 0000127, // 000236  105067 000127 				clrb Counter + 1
+    0042700, 0177760, // 000242  042700 177760 				bic #177760,r0
+    0062700, 0000003, // 000246  062700 000003 				add #3,r0
+    0022700, 0000022, // 000252  022700 000022 				cmp #18.,r0
+    0001002,          // 000256  001002 					bne m2
+    0004767, 0000030, // 000260  004767 000030 				jsr pc,ReadLong
+    //                   000264				m2:
+    0110067, 0000100, // 000264  110067 000100 				movb r0,Counter+0
+    0010104,          // 000270  010104 					mov r1,r4
+    0010201,          // 000272  010201 					mov r2,r1
+    0166701, 0000072, // 000274  166701 000072 				sub Offset,r1
+    0016703, 0000064, // 000300  016703 000064 				mov Counter,r3
+    //                   000304				bc2:
+    0114142,          // 000304  114142 					movb -(r1),-(r2)
+    0077302,          // 000306  077302 					sob r3,bc2
+    0010401,          // 000310  010401 					mov r4,r1
+    0000712,          // 000312  000712 					br ReadToken
+    //                   000314				ReadLong:
+    0114104,          // 000314  114104 					movb -(r1),r4
+    0052704, 0177400, // 000316  052704 177400 				bis #177400,r4	;FF00h
+    0060400,          // 000322  060400 					add r4,r0
+    0103006,          // 000324  103006 					bcc m3
+    0110067, 0000037, // 000326  110067 000037 				movb r0,Counter+1
+    0114100,          // 000332  114100 					movb -(r1),r0
+    0105767, 0000031, // 000334  105767 000031 				tstb Counter+1
+    0001401,          // 000340  001401 					beq m4
+    //                   000342				m3:
+    0000207,          // 000342  000207 					rts pc
+    //                   000344				m4:
+    0110067, 0000020, // 000344  110067 000020 				movb r0,Counter+0
+    0114167, 0000015, // 000350  114167 000015 				movb -(r1),Counter+1
+    0005767, 0000010, // 000354  005767 000010 				tst Counter
+    0001401,          // 000360  001401 					beq m5
+    0000207,          // 000362  000207 					rts pc
+    //                   000364				m5:
+    0012604,          // 000364  012604 					mov (sp)+,r4
+    0000207,          // 000366  000207 					rts pc
+    0000000,          // 000370  000000 	Counter:	.WORD 0
+    0000000,          // 000372  000000 	Offset:		.WORD 0
+};
+size_t const loaderLZSA1BSize = sizeof(loaderLZSA1B);
+
+
+//////////////////////////////////////////////////////////////////////
+
+// Backward LZSA2, the same as loaderLZSA1B
+uint16_t const loaderLZSA2B[] =
+{
+    0000240,  // 000000  000240  NOP
+    0012702,  // 000002  012702  MOV     #000122, R2    ; Адрес массива параметров
+    0000122,
+    0110062,  // 000006  110062  MOVB    R0, 000003(R2)
+    0000003,
+    0012701,  // 000012  012701  MOV     #000005, R1
+    0000005,
+    0012703,  // 000016  012703  MOV     #000134, R3
+    0000134,
+    0000402,  // 000022  000402  BR      000030
+    0112337,  // 000024  112337  MOVB    (R3)+, @#176676
+    0176676,
+    0105737,  // 000030  105737  TSTB    @#176674
+    0176674,
+    0100375,  // 000034  100375  BPL     000030
+    0077106,  // 000036  077106  SOB     R1, 000024
+    0105712,  // 000040  105712  TSTB    (R2)
+    0001356,  // 000042  001356  BNE     000000
+    // Подсчёт контрольной суммы
+    0005003,  // 000044  005003  CLR     R3
+    0012701,  // 000046  012701  MOV     #LZSTART, R1
+    0000000,  // 000050  ?????? <= LZSTART
+    0012702,  // 000052  012702  MOV     #LZWORDS, R2
+    0000000,  // 000054  ?????? <= LZWORDS
+    0062103,  // 000056  062103  ADD     (R1)+, R3
+    0005503,  // 000060  005503  ADC     R3
+    0077203,  // 000062  077203  SOB     R2, 000056
+    0020327,  // 000064  020327  CMP     R3, #CHKSUM
+    0000000,  // 000066  ?????? <= CHKSUM
+    0001343,  // 000070  001343  BNE     000000
+    // Распаковка с конца на месте, стек ниже упакованных данных
+    0012706,  // 000072  012706  MOV     #LZSTART, SP
+    0000000,  // 000074  ?????? <= LZSTART
+    0012701,  // 000076  012701  MOV     #LZEND, R1     ; Конец упакованных данных
+    0000000,  // 000100  ?????? <= LZEND
+    0012702,  // 000102  012702  MOV     #IMGEND, R2    ; Конец программы
+    0000000,  // 000104  ?????? <= IMGEND
+    0004767,  // 000106  004767  CALL    unlzsa2
+    0000026,  // 000110  000026
+    // Распаковали, выполняем запуск
+    0012706,  // 000112  012706  MOV     #STACK, SP
+    0001000,  // 000114  ?????? <= STACK
+    0000137,  // 000116  000137  JMP     START   ; Переход на загруженный код
+    0001000,  // 000120  ?????? <= START
+    // Массив параметров для получения данных с кассеты ПЗУ через канал 2
+    0004000,  // 000122  004000   ; Команда (10) и ответ
+    0000021,  // 000124  000021   ; Номер кассеты и номер устройства
+    0001000,  // 000126  001000   ; Адрес от начала кассеты ПЗУ
+    0000000,  // 000130  ??????   ; Адрес в ОЗУ <= LZSTART
+    0000000,  // 000132  ??????   ; Количество слов <= LZWORDS
+    0000122,  // 000134
+    0177777,  // 000136
+    // LZSA2 PDP-11 decompressor by Ivan Gorodetsky, reading and writing backward
+    // https://gitlab.com/ivagor/lzsa8080/-/blob/master/PDP11/LZSA2/lzsa2.asm
+    //                   000140				unlzsa2:
+    0005004,          // 000140  005004 					clr r4
+    0005067, 0000434, // 000142  005067 000434 				clr Counter
+    0000461,          // 000146  000461 					br ReadToken
+    //                   000150				C00x:
+    0004767, 0000364, // 000150  004767 000364 				jsr pc, ReadNibble
+    0110067, 0000424, // 000154  110067 000424 				movb r0,Offset
+    0005000,          // 000160  005000 					clr r0
+    0156700, 0000414, // 000162  156700 000414 				bisb Counter,r0
+    0020027, 0000040, // 000166  020027 000040 				cmp r0,#40
+    0106167, 0000406, // 000172  106167 000406 				rolb Offset
+    0000414,          // 000176  000414 					br SaveOffset
+    //                   000200				C0xx:
+    0112767, 0000377, 0000377, // 000200  112767 000377 000377 		movb #377,Offset+1
+    0020027, 0000100, // 000206  020027 000100 				cmp r0,#100
+    0103756,          // 000212  103756 					bcs C00x
+    //                   000214				C01x:
+    0020027, 0000140, // 000214  020027 000140 				cmp r0,#140
+    0106167, 0000361, // 000220  106167 000361 				rolb Offset+1
+    //                   000224				OffReadLow:
+    0114167, 0000354, // 000224  114167 000354 				movb -(r1),Offset
+    //                   000230				SaveOffset:
+    0016767, 0000350, 0000350, // 000230  016767 000350 000350 		mov Offset,SavedOffset
+    //                   000236				MatchLen:
+    0042700, 0177770, // 000236  042700 177770 				bic #177770,r0
+    0062700, 0000002, // 000242  062700 000002 				add #2,r0
+    0020027, 0000011, // 000246  020027 000011 				cmp r0,#9.
+    0001002,          // 000252  001002 					bne CopyMatch
+    0004767, 0000174, // 000254  004767 000174 				jsr pc,ExtendedCode
+    //                   000260				CopyMatch:
+    0110067, 0000316, // 000260  110067 000316 				movb r0,Counter
+    0010105,          // 000264  010105 					mov r1,r5
+    0010201,          // 000266  010201 					mov r2,r1
+    0166701, 0000310, // 000270  166701 000310 				sub Offset,r1
+    0016703, 0000302, // 000274  016703 000302 				mov Counter,r3
+    //                   000300				bc2:
+    0114142,          // 000300  114142 					movb -(r1),-(r2)
+    0077302,          // 000302  077302 					sob r3,bc2
+    0005067, 0000272, // 000304  005067 000272 				clr Counter
+    0010501,          // 000310  010501 					mov r5,r1
+    //                   000312				ReadToken:
+    0114100,          // 000312  114100 					movb -(r1),r0
+    0010005,          // 000314  010005 					mov r0,r5
+    0042700, 0177747, // 000316  042700 177747 				bic #177747,r0
+    0001420,          // 000322  001420 					beq NoLiterals
+    0006200,          // 000324  006200 					asr r0
+    0006200,          // 000326  006200 					asr r0
+    0006200,          // 000330  006200 					asr r0
+    0022700, 0000003, // 000332  022700 000003 				cmp #3,r0
+    0001002,          // 000336  001002 					bne m1
+    0004767, 0000110, // 000340  004767 000110 				jsr pc,ExtendedCode
+    //                   000344				m1:
+    0110067, 0000232, // 000344  110067 000232 				movb r0,Counter
+    0016703, 0000226, // 000350  016703 000226 				mov Counter,r3
+    //                   000354				bc1:
+    0114142,          // 000354  114142 					movb -(r1),-(r2)
+    0077302,          // 000356  077302 					sob r3,bc1
+    0005067, 0000216, // 000360  005067 000216 				clr Counter
+    //                   000364				NoLiterals:
+    0010500,          // 000364  010500 					mov r5,r0
+    0100304,          // 000366  100304 					bpl C0xx
+    //                   000370				C1xx:
+    0020027, 0177700, // 000370  020027 177700 				cmp r0,#177700
+    0103020,          // 000374  103020 					bcc C11x
+    //                   000376				C10x:
+    0004767, 0000136, // 000376  004767 000136 				jsr pc,ReadNibble
+    0110067, 0000177, // 000402  110067 000177 				movb r0,Offset+1
+    0116700, 0000170, // 000406  116700 000170 				movb Counter,r0
+    0020027, 0177640, // 000412  020027 177640 				cmp r0,#177640
+    0105367, 0000163, // 000416  105367 000163 				decb Offset+1
+    0106167, 0000157, // 000422  106167 000157 				rolb Offset+1
+    0000676,          // 000426  000676 					br OffsetReadLow
+    //                   000430				C110:
+    0114167, 0000151, // 000430  114167 000151 				movb -(r1),Offset+1
+    0000673,          // 000434  000673 					br OffsetReadLow
+    //                   000436				C11x:
+    0020027, 0177740, // 000436  020027 177740 				cmp r0,#177740
+    0103772,          // 000442  103772 					bcs C110
+    //                   000444				C111:
+    0016767, 0000136, 0000132, // 000444  016767 000136 000132 			mov SavedOffset,Offset
+    0000671,          // 000452  000671 					br MatchLen
+    //                   000454				ExtendedCode:
+    0004767, 0000060, // 000454  004767 000060 				jsr pc,ReadNibble
+    0005200,          // 000460  005200 					inc r0
+    0001405,          // 000462  001405 					beq ExtraByte
+    0162700, 0177761, // 000464  162700 177761 				sub #177761,r0
+    0066700, 0000106, // 000470  066700 000106 				add Counter,r0
+    0000207,          // 000474  000207 					rts pc
+    //                   000476				ExtraByte:
+    0012700, 0000017, // 000476  012700 000017 				mov #15.,r0
+    0066700, 0000074, // 000502  066700 000074 				add Counter,r0
+    0052700, 0177400, // 000506  052700 177400 				bis #177400,r0
+    0005003,          // 000512  005003 					clr r3
+    0154103,          // 000514  154103 					bisb -(r1),r3
+    0060300,          // 000516  060300 					add r3,r0
+    0103004,          // 000520  103004 					bcc m2
+    0001404,          // 000522  001404 					beq Exit
+    0114100,          // 000524  114100 					movb -(r1),r0
+    0114167, 0000051, // 000526  114167 000051 				movb -(r1),Counter+1
+    //                   000532				m2:
+    0000207,          // 000532  000207 					rts pc
+    //                   000534				Exit:
+    0012605,          // 000534  012605 					mov (sp)+,r5
+    0000207,          // 000536  000207 					rts pc
+    //                   000540				ReadNibble:
+    0110067, 0000036, // 000540  110067 000036 				movb r0,Counter
+    0110400,          // 000544  110400 					movb r4,r0
+    0100002,          // 000546  100002 					bpl NewNibble
+    0005004,          // 000550  005004 					clr r4
+    0000207,          // 000552  000207 					rts pc
+    //                   000554				NewNibble:
+    0114104,          // 000554  114104 					movb -(r1),r4
+    0110400,          // 000556  110400 					movb r4,r0
+    0052704, 0177760, // 000560  052704 177760 				bis #177760,r4
+    0006200,          // 000564  006200 					asr r0
+    0006200,          // 000566  006200 					asr r0
+    0006200,          // 000570  006200 					asr r0
+    0006200,          // 000572  006200 					asr r0
+    0052700, 0177760, // 000574  052700 177760 				bis #177760,r0
+    0000207,          // 000600  000207 					rts pc
+    0000000,          // 000602  000000 	Counter:	    .WORD 0
+    0000000,          // 000604  000000 	Offset:		    .WORD 0
+    0000000,          // 000606  000000 	SavedOffset:	.WORD 0
+};
+size_t const loaderLZSA2BSize = sizeof(loaderLZSA2B);
+
+
+//////////////////////////////////////////////////////////////////////
+
+// PDP-11 code filter undo, placed at FILTER_STUB_ADDRESS; the loader jumps here instead of the program start.
+// The operands of JSR PC,addr were made absolute by FilterPdpCode(), made relative back here
+uint16_t const loaderFilter[] =
+{
+    0012701,  // 000640  012701  MOV     #001000, R1
+    0001000,
+    0012702,  // 000644  012702  MOV     #IMGEND-2, R2
+    0000000,  // 000646  ?????? <= IMGEND-2
+    0022127,  // 000650  022127  CMP     (R1)+, #004767 ; JSR PC,addr
+    0004767,
+    0001001,  // 000654  001001  BNE     000660
+    0160121,  // 000656  160121  SUB     R1, (R1)+      ; Адрес цели - 2 => смещение
+    0020102,  // 000660  020102  CMP     R1, R2
+    0103772,  // 000662  103772  BLO     000650
+    0000137,  // 000664  000137  JMP     START   ; Переход на загруженный код
+    0001000,  // 000666  ?????? <= START
+};
+size_t const loaderFilterSize = sizeof(loaderFilter);
+
+
 //////////////////////////////////////////////////////////////////////
@@ -20,11 +20,26 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 #include <memory.h>
 #include <string.h>
 #include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #ifndef WIN32
 #include <string.h>
+#include <unistd.h>
 #define sprintf_s snprintf
 #define _stricmp  strcasecmp
+#define _strnicmp strncasecmp
+#define _dup      dup
+#define _dup2     dup2
+#define _fdopen   fdopen
+#define _fileno   fileno
+#else
+#include <io.h>
 #endif
 
 #ifdef _MSC_VER
@@ -41,179 +56,136 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 //////////////////////////////////////////////////////////////////////
 
 
-size_t EncodeRLE(const uint8_t * source, size_t sourceLength, uint8_t * buffer, size_t bufferLength)
+enum
 {
-    size_t destOffset = 0;
-    size_t seqBlockOffset = 0;
-    size_t seqBlockSize = 1;
-    size_t varBlockOffset = 0;
-    size_t varBlockSize = 1;
-    uint8_t prevByte = source[0];
-    size_t currOffset = 0;
-    size_t codedSizeTotal = 0;
-    while (currOffset < sourceLength)
-    {
-        currOffset++;
-        uint8_t currByte = (currOffset < sourceLength) ? source[currOffset] : ~prevByte;
+    OPTION_SELECT_SMALLEST   = 0x0001,  // Run all codecs concurrently, pick the smallest output
+    OPTION_SELECT_FASTEST    = 0x0002,  // Run all codecs concurrently, pick the fastest to decompress
+    OPTION_SELECT_MASK       = 0x0003
+};
 
-        if ((currOffset == sourceLength) ||
-            (currByte != prevByte && seqBlockSize > 31) ||
-            (currByte != prevByte && seqBlockSize > 1 && prevByte == 0) ||
-            (currByte != prevByte && seqBlockSize > 1 && prevByte == 0xff) ||
-            (seqBlockSize == 0x1fff || varBlockSize - seqBlockSize == 0x1fff))
-        {
-            if (varBlockOffset < seqBlockOffset)
-            {
-                size_t varSize = varBlockSize - seqBlockSize;
-                if (currOffset == sourceLength && seqBlockSize < 2)
-                    varSize = varBlockSize;  // Special case at the end of input stream
-                size_t codedSize = varSize + ((varSize < 256 / 8) ? 1 : 2);
-                //printf("RLE  at\t%06o\tVAR  %06o  %06o  %06o\t", varBlockOffset + 512, destOffset, varSize, codedSize);
-                codedSizeTotal += codedSize;
-                if (destOffset + codedSize < bufferLength)
-                {
-                    uint8_t flagByte = 0x40;
-                    if (varSize < 256 / 8)
-                    {
-                        //printf("%02x ", (uint8_t)(flagByte | varSize));
-                        buffer[destOffset++] = (uint8_t)(flagByte | varSize);
-                    }
-                    else
-                    {
-                        //printf("%02x ", (uint8_t)(0x80 | flagByte | ((varSize & 0x1f00) >> 8)));
-                        buffer[destOffset++] = (uint8_t)(0x80 | flagByte | ((varSize & 0x1f00) >> 8));
-                        //printf("%02x ", (uint8_t)(varSize & 0xff));
-                        buffer[destOffset++] = (uint8_t)(varSize & 0xff);
-                    }
-                    for (size_t offset = varBlockOffset; offset < varBlockOffset + varSize; offset++)
-                    {
-                        //printf("%02x ", source[offset]);
-                        buffer[destOffset++] = source[offset];
-                    }
-                }
-                //printf("\n");
-            }
-            if ((varBlockOffset < seqBlockOffset && seqBlockSize > 1) ||
-                (varBlockOffset == seqBlockOffset && varBlockSize == seqBlockSize))
-            {
-                size_t codedSize = ((seqBlockSize < 256 / 8) ? 1 : 2) + ((prevByte == 0 || prevByte == 255) ? 0 : 1);
-                //printf("RLE  at\t%06o\tSEQ  %06o  %06o  %06o\t%02x\n", seqBlockOffset + 512, destOffset, seqBlockSize, codedSize, prevByte);
-                codedSizeTotal += codedSize;
-                if (destOffset + codedSize < bufferLength)
-                {
-                    uint8_t flagByte = ((prevByte == 0) ? 0 : ((prevByte == 255) ? 0x60 : 0x20));
-                    if (seqBlockSize < 256 / 8)
-                        buffer[destOffset++] = (uint8_t)(flagByte | seqBlockSize);
-                    else
-                    {
-                        buffer[destOffset++] = (uint8_t)(0x80 | flagByte | ((seqBlockSize & 0x1f00) >> 8));
-                        buffer[destOffset++] = (uint8_t)(seqBlockSize & 0xff);
-                    }
-                    if (prevByte != 0 && prevByte != 255)
-                        buffer[destOffset++] = prevByte;
-                }
-            }
+enum
+{
+    COMMAND_CONVERT,    // SAV files to cartridge images
+    COMMAND_INSPECT,    // Cartridge images recognized and checked, nothing written
+    COMMAND_UNPACK      // Cartridge images back to SAV files
+};
 
-            seqBlockOffset = varBlockOffset = currOffset;
-            seqBlockSize = varBlockSize = 1;
+// Result of a file or of a codec attempt; the exit code of the run is the worst result of the files
+enum
+{
+    STATUS_OK       = 0,
+    STATUS_NOFIT    = 1,    // Doesn't fit the cartridge with any of the codecs tried
+    STATUS_VERIFY   = 2,    // Fits, but the decode check or the loader emulation failed; -inspect: not recognized or bad
+    STATUS_IOERROR  = 3,    // Failed to read the input or to write the output
+    STATUS_USAGE    = 255   // Bad command line
+};
 
-            prevByte = currByte;
-            continue;
-        }
+int options = 0;
+int command = COMMAND_CONVERT;
+int threadCount = 0;  // 0 = by the number of CPU cores
+const char* cachedirname = nullptr;
+int cacheSizeMB = 64;
+const char* dictfilename = nullptr;
+bool reportJson = false;  // -report=json: the report to stdout, the messages to stderr
+
+// Result of one codec, of the concurrent run or of the one-by-one attempts
+struct CodecCandidate
+{
+    const CodecInfo*    codec;
+    uint8_t*            pCartImage;   // Own 64K output buffer, from the workspace
+    size_t              encodedSize;  // Encoded size, even if doesn't fit
+    size_t              result;       // PrepareCartXxx result, 0 = failed or doesn't fit
+    bool                noRoom;       // The unpacked program doesn't fit the memory with the stream
+    uint64_t            cycles;       // Loader time estimate
+    double              seconds;      // Encoding + decode check time
+    LoaderRunInfo       run;          // Loader emulation, when the result fits
+};
 
-        varBlockSize++;
-        if (currByte == prevByte)
-        {
-            seqBlockSize++;
-        }
-        else
-        {
-            seqBlockSize = 1;  seqBlockOffset = currOffset;
-        }
+// One input/output pair of the run
+struct ConvertJob
+{
+    std::string         inputfilename;
+    std::string         outputfilename;
+    const CodecInfo*    codec;        // Chosen codec, nullptr if failed
+    int                 status;       // STATUS_XXX
+    size_t              imageSize;    // SAV image size, for the ratio
+    size_t              encodedSize;
+    double              seconds;
+    bool                cached;       // Taken from the cache
+    size_t              encodedSize2; // Second cartridge of the split image, 0 = single cartridge
+    std::vector<CodecCandidate> attempts;  // Codecs tried, for the report
+    CartInspectInfo     cart;         // -inspect / -unpack result, cart.loaderName is nullptr if failed
+};
 
-        prevByte = currByte;
-    }
+std::vector<ConvertJob> jobs;
 
-    //printf("RLE Source size: %d  Coded size: %d  Dest offset: %d\n", sourceLength, codedSizeTotal, destOffset);
-    printf("RLE input size %lu. bytes\n", sourceLength);
-    printf("RLE output size %lu. bytes (%1.2f %%)\n", codedSizeTotal, codedSizeTotal * 100.0 / sourceLength);
-    return codedSizeTotal;
+void AddJob(const char* inputfilename, const char* outputfilename)
+{
+    ConvertJob job;
+    job.inputfilename = inputfilename;
+    job.outputfilename = outputfilename;
+    job.codec = nullptr;
+    job.status = STATUS_OK;
+    job.imageSize = 0;
+    job.encodedSize = 0;
+    job.seconds = 0.0;
+    job.cached = false;
+    job.encodedSize2 = 0;
+    ::memset(&job.cart, 0, sizeof(job.cart));
+    jobs.push_back(job);
 }
 
-size_t DecodeRLE(const uint8_t * source, size_t sourceLength, uint8_t * buffer, size_t bufferLength)
-{
-    size_t currOffset = 0;
-    size_t destOffset = 0;
-    uint8_t filler = 0;
-    while (currOffset < sourceLength)
-    {
-        uint8_t first = source[currOffset++];
-        if (first == 0)
-            break;
-        size_t count = 0;
-        if ((first & 0x80) == 0)  // 1-byte command
-            count = first & 0x1f;
-        else  // 2-byte command
-            count = (((size_t)first & 0x1f) << 8) | source[currOffset++];
-        switch (first & 0x60)
+// Manifest: one "input output" pair per line, only the input for -inspect; empty lines and lines started with '#' are skipped
+bool ReadManifest(const char* filename)
+{
+    FILE* manifestfile = fopen(filename, "rt");
+    if (manifestfile == nullptr)
+    {
+        printf("Failed to open the manifest file %s (%d).\n", filename, errno);
+        return false;
+    }
+    char line[1024];
+    int lineno = 0;
+    while (::fgets(line, sizeof(line), manifestfile) != nullptr)
+    {
+        lineno++;
+        char input[512], output[512];
+        int count = sscanf(line, "%511s %511s", input, output);
+        if (count <= 0 || input[0] == '#')
+            continue;
+        if (count != 2 && command != COMMAND_INSPECT)
         {
-        case 0x00:
-            filler = 0;
-            for (size_t i = 0; i < count; i++)
-                buffer[destOffset++] = filler;
-            break;
-        case 0x60:
-            filler = 0xff;
-            for (size_t i = 0; i < count; i++)
-                buffer[destOffset++] = filler;
-            break;
-        case 0x20:
-            filler = source[currOffset++];
-            for (size_t i = 0; i < count; i++)
-                buffer[destOffset++] = filler;
-            break;
-        case 0x40:
-            for (size_t i = 0; i < count; i++)
-                buffer[destOffset++] = source[currOffset++];
-            break;
+            printf("Manifest %s line %d: input and output file names expected.\n", filename, lineno);
+            ::fclose(manifestfile);
+            return false;
         }
+        AddJob(input, (command == COMMAND_INSPECT) ? "" : output);
     }
-
-    return destOffset;
+    ::fclose(manifestfile);
+    return true;
 }
 
-
-//////////////////////////////////////////////////////////////////////
-
-
-enum
+// Dictionary for LZ4 and LZSA1: only the head of the file that fits the loader block is used
+bool ReadDictionary(const char* filename)
 {
-    OPTION_COMPRESSION_NONE  = 0x0100,
-    OPTION_COMPRESSION_RLE   = 0x0200,
-    OPTION_COMPRESSION_LZSS  = 0x0400,
-    OPTION_COMPRESSION_LZ4   = 0x0800,
-    OPTION_COMPRESSION_LZSA1 = 0x1000,
-    OPTION_COMPRESSION_LZSA2 = 0x2000,
-    OPTION_COMPRESSION_MASK  = 0xff00
-};
-
-int options = 0;
-
-char inputfilename[256] = { 0 };
-char outputfilename[256] = { 0 };
-
-FILE* inputfile = nullptr;
-FILE* outputfile = nullptr;
-uint8_t* pFileImage = nullptr;
-uint8_t* pCartImage = nullptr;
-uint32_t inputfileSize = 0;
-size_t savImageSize = 0;
-uint16_t wStartAddr = 01000;
-uint16_t wStackAddr = 0;
-uint16_t wTopAddr = 0;
+    FILE* dictfile = fopen(filename, "rb");
+    if (dictfile == nullptr)
+    {
+        printf("Failed to open the dictionary file %s (%d).\n", filename, errno);
+        return false;
+    }
+    dictionary.resize(512);
+    size_t bytesRead = ::fread(dictionary.data(), 1, dictionary.size(), dictfile);
+    ::fclose(dictfile);
+    dictionary.resize(bytesRead);
+    printf("Dictionary file: %s, %lu. bytes taken\n", filename, (unsigned long)bytesRead);
+    return true;
+}
 
 bool ParseCommandLine(int argc, char* argv[])
 {
+    std::vector<const char*> filenames;
+    const char* manifestfilename = nullptr;
     for (int argn = 1; argn < argc; argn++)
     {
         const char* arg = argv[argn];
@@ -231,6 +203,88 @@ bool ParseCommandLine(int argc, char* argv[])
                 options |= OPTION_COMPRESSION_LZSA1;
             else if (_stricmp(arg + 1, "lzsa2") == 0)
                 options |= OPTION_COMPRESSION_LZSA2;
+            else if (_stricmp(arg + 1, "zx0") == 0)
+                options |= OPTION_COMPRESSION_ZX0;
+            else if (_stricmp(arg + 1, "lzssopt") == 0)
+                lzssOptimal = true;
+            else if (_stricmp(arg + 1, "lzsaback") == 0)
+                lzsaBackward = true;
+            else if (_stricmp(arg + 1, "lzsaspeed") == 0)
+                lzsaFavorRatio = false;
+            else if (_stricmp(arg + 1, "lzsaall") == 0)
+                lzsaExhaustive = true;
+            else if (_strnicmp(arg + 1, "lzsamin", 7) == 0)
+            {
+                if (sscanf(arg + 8, "%d", &lzsaMinMatch) != 1 || lzsaMinMatch < 2 || lzsaMinMatch > 5)
+                {
+                    printf("Failed to parse option argument: %s\n", arg);
+                    return false;
+                }
+            }
+            else if (_stricmp(arg + 1, "pdpfilter") == 0)
+                pdpFilter = true;
+            else if (_stricmp(arg + 1, "report=json") == 0)
+                reportJson = true;
+            else if (_stricmp(arg + 1, "dict") == 0)
+            {
+                if (++argn >= argc)
+                    return false;
+                dictfilename = argv[argn];
+            }
+            else if (_strnicmp(arg + 1, "lzsschain", 9) == 0)
+            {
+                if (sscanf(arg + 10, "%d", &lzssMaxChain) != 1 || lzssMaxChain < 0)
+                {
+                    printf("Failed to parse option argument: %s\n", arg);
+                    return false;
+                }
+            }
+            else if (_strnicmp(arg + 1, "lz4chain", 8) == 0)
+            {
+                if (sscanf(arg + 9, "%d", &lz4MaxChain) != 1 || lz4MaxChain < 0)
+                {
+                    printf("Failed to parse option argument: %s\n", arg);
+                    return false;
+                }
+            }
+            else if (_stricmp(arg + 1, "smallest") == 0)
+                options = (options & ~OPTION_SELECT_MASK) | OPTION_SELECT_SMALLEST;
+            else if (_stricmp(arg + 1, "fastest") == 0)
+                options = (options & ~OPTION_SELECT_MASK) | OPTION_SELECT_FASTEST;
+            else if (_stricmp(arg + 1, "manifest") == 0)
+            {
+                if (++argn >= argc)
+                    return false;
+                manifestfilename = argv[argn];
+            }
+            else if (_stricmp(arg + 1, "inspect") == 0)
+                command = COMMAND_INSPECT;
+            else if (_stricmp(arg + 1, "unpack") == 0)
+                command = COMMAND_UNPACK;
+            else if (_stricmp(arg + 1, "multicart") == 0)
+                multicart = true;
+            else if (_stricmp(arg + 1, "cache") == 0)
+            {
+                if (++argn >= argc)
+                    return false;
+                cachedirname = argv[argn];
+            }
+            else if (_strnicmp(arg + 1, "cachesize", 9) == 0)
+            {
+                if (sscanf(arg + 10, "%d", &cacheSizeMB) != 1 || cacheSizeMB < 0)
+                {
+                    printf("Failed to parse option argument: %s\n", arg);
+                    return false;
+                }
+            }
+            else if (_strnicmp(arg + 1, "threads", 7) == 0)
+            {
+                if (sscanf(arg + 8, "%d", &threadCount) != 1 || threadCount < 0)
+                {
+                    printf("Failed to parse option argument: %s\n", arg);
+                    return false;
+                }
+            }
             else
             {
                 printf("Unknown option: %s\n", arg);
@@ -238,422 +292,776 @@ bool ParseCommandLine(int argc, char* argv[])
             }
         }
         else
-        {
-            if (inputfilename[0] == 0)
-                strcpy(inputfilename, arg);
-            else if (outputfilename[0] == 0)
-                strcpy(outputfilename, arg);
-        }
+            filenames.push_back(arg);
     }
 
+    // Input/output pairs, or only the inputs for -inspect; the manifest is read when the command is known
+    size_t step = (command == COMMAND_INSPECT) ? 1 : 2;
+    for (size_t i = 0; i + step <= filenames.size(); i += step)
+        AddJob(filenames[i], (step == 1) ? "" : filenames[i + 1]);
+    if (manifestfilename != nullptr && !ReadManifest(manifestfilename))
+        return false;
+
     if ((options & OPTION_COMPRESSION_MASK) == 0)
         options |= OPTION_COMPRESSION_MASK;  // Compression is not specified => try all of them
 
     // Validate options
-    if (inputfilename[0] == 0 || outputfilename[0] == 0)
+    if (filenames.size() % step != 0 || jobs.empty())
         return false;
 
     return true;
 }
 
-uint16_t CalcCheckum(const uint16_t* pData, int nWords)
+// Cartridge bytes taken: uncompressed SAV goes to the cartridge as is, compressed data follows the 512-byte loader block
+size_t GetCartSize(const CodecInfo& codec, size_t encodedSize)
 {
-    uint16_t wChecksum = 0;
-    for (int i = 0; i < nWords; i++)
-    {
-        uint16_t src = wChecksum;
-        uint16_t src2 = *pData;
-        wChecksum += src2;
-        if (((src & src2) | ((src ^ src2) & ~wChecksum)) & 0100000)  // if Carry
-            wChecksum++;
-        pData++;
-    }
-    return wChecksum;
+    return (codec.option == OPTION_COMPRESSION_NONE) ? encodedSize : 512 + encodedSize;
+}
+
+// The codec result that fits the cartridge and still failed is a failed decode check or loader emulation
+int GetCandidateStatus(const CodecCandidate& candidate)
+{
+    if (candidate.result > 0)
+        return STATUS_OK;
+    if (candidate.noRoom)
+        return STATUS_NOFIT;
+    bool fits = candidate.encodedSize <= 24576 && GetCartSize(*candidate.codec, candidate.encodedSize) <= 24576;
+    return fits ? STATUS_VERIFY : STATUS_NOFIT;
 }
 
-size_t PrepareCartPlain()
+// All the codecs failed: an attempt that fits and failed the check makes it a verification failure
+void SetAttemptsFailedStatus(ConvertJob& job)
 {
-    if (inputfileSize > 24576)
+    job.status = STATUS_NOFIT;
+    for (size_t i = 0; i < job.attempts.size(); i++)
+        job.status = std::max(job.status, GetCandidateStatus(job.attempts[i]));
+}
+
+const char* GetStatusText(int status)
+{
+    switch (status)
     {
-        printf("Input file is too big for cartridge: %u. bytes, max 24576. bytes\n", inputfileSize);
-        return 0;
+    case STATUS_OK:      return "ok";
+    case STATUS_NOFIT:   return "doesn't fit";
+    case STATUS_VERIFY:  return "verification failed";
+    case STATUS_IOERROR: return "I/O error";
+    default:             return "failed";
     }
+}
 
-    // Copy SAV image as is
-    ::memcpy(pCartImage, pFileImage, inputfileSize);
-
-    // Prepare the loader
-    memcpy(pCartImage, loader, loaderSize);
-    *((uint16_t*)(pCartImage + 0074)) = wStackAddr;
-    *((uint16_t*)(pCartImage + 0100)) = wStartAddr;
-    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), 027400);
+// Loader time of the candidate for -fastest: measured on the emulator, the cost model estimate if not emulated
+uint64_t GetCandidateCycles(const CodecCandidate& candidate)
+{
+    return (candidate.run.cycles > 0) ? candidate.run.cycles : candidate.cycles;
+}
 
-    return inputfileSize;  // Finished encoding with plain copy
+// true if the candidate is better than the selected one by the criterion
+bool IsBetterCandidate(size_t encodedSize, uint64_t cycles, size_t selectedEncodedSize, uint64_t selectedCycles)
+{
+    if (options & OPTION_SELECT_FASTEST)
+        return cycles < selectedCycles;
+    return encodedSize < selectedEncodedSize;
 }
 
-size_t PrepareCartRLE()
+// Workspaces of the codec pool threads but the first one, which works in the workspace of the caller;
+// kept for the whole run, so the codec contexts and buffers are allocated once
+static std::vector<std::unique_ptr<CCartWorkspace>> g_codecWorkspaces;
+
+// Run all the selected codecs on a thread pool, every codec with its own output buffer from the workspace;
+// returns index of the selected candidate, or -1 if nothing fits
+int RunCodecsConcurrently(const SavImage& sav, CCartWorkspace& ws, std::vector<CodecCandidate>& candidates)
 {
-    ::memset(pCartImage, 0, 65536);
-    size_t rleCodedSize = EncodeRLE(pFileImage + 512, savImageSize, pCartImage + 512, 24576 - 512);
-    if (rleCodedSize > 24576 - 512)
+    for (int i = 0; i < g_codecCount; i++)
     {
-        printf("RLE encoded size too big: %lu. bytes, max %d. bytes\n", rleCodedSize, 24576 - 512);
-        return 0;
+        if ((options & g_codecs[i].option) == 0)
+            continue;
+        CodecCandidate candidate;
+        candidate.codec = g_codecs + i;
+        candidate.pCartImage = ws.GetCartImage(2 + (int)candidates.size());
+        candidate.encodedSize = candidate.result = 0;
+        candidate.noRoom = false;
+        candidate.cycles = 0;
+        candidate.seconds = 0.0;
+        candidate.run.instructions = 0;  candidate.run.cycles = 0;
+        if (candidate.pCartImage == NULL)
+        {
+            printf("Failed to allocate memory.");
+            return -1;
+        }
+        candidates.push_back(candidate);
     }
 
-    // Trying to decode to make sure encoder works fine
-    uint8_t* pTempBuffer = (uint8_t*) ::calloc(savImageSize, 1);
-    if (pTempBuffer == NULL)
+    size_t threads = (threadCount > 0) ? threadCount : std::thread::hardware_concurrency();
+    if (threads == 0 || threads > candidates.size())
+        threads = candidates.size();
+    while (g_codecWorkspaces.size() + 1 < threads)
+        g_codecWorkspaces.push_back(std::unique_ptr<CCartWorkspace>(new CCartWorkspace()));
+
+    // Worker threads take the candidates one by one
+    std::atomic<size_t> next(0);
+    auto worker = [&](size_t workerIndex)
     {
-        printf("Failed to allocate memory.");
-        return 0;
-    }
-    size_t decodedSize = DecodeRLE(pCartImage + 512, 24576 - 512, pTempBuffer, savImageSize);
-    if (decodedSize != savImageSize)
-        printf("failed, RLE decoded size = %lu (must be: %lu)\n", decodedSize, savImageSize);
-    for (size_t offset = 0; offset < savImageSize; offset++)
+        CCartWorkspace& workerWs = (workerIndex == 0) ? ws : *g_codecWorkspaces[workerIndex - 1];
+        for (;;)
+        {
+            size_t index = next++;
+            if (index >= candidates.size())
+                break;
+            CodecCandidate& candidate = candidates[index];
+            auto starttime = std::chrono::steady_clock::now();
+            candidate.result = PrepareCart(*candidate.codec, sav, workerWs, candidate.pCartImage, &candidate.encodedSize, &candidate.cycles);
+            candidate.noRoom = workerWs.IsNoRoom();
+            if (candidate.result > 0 && !EmulateLoader(candidate.codec->name, sav, candidate.pCartImage, &candidate.run))
+                candidate.result = 0;
+            candidate.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < threads; i++)
+        pool.push_back(std::thread(worker, i));
+    for (size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+
+    // Select by the criterion
+    int selected = -1;
+    for (int i = 0; i < (int)candidates.size(); i++)
     {
-        if (pTempBuffer[offset] == pFileImage[512 + offset])
+        if (candidates[i].result == 0)
             continue;
-
-        printf("RLE decode failed at offset %06ho (%02x != %02x)\n", (uint16_t)(512 + offset), pTempBuffer[offset], pFileImage[512 + offset]);
-        return 0;
+        if (selected < 0 ||
+            IsBetterCandidate(candidates[i].encodedSize, GetCandidateCycles(candidates[i]),
+                              candidates[selected].encodedSize, GetCandidateCycles(candidates[selected])))
+            selected = i;
     }
-    ::free(pTempBuffer);
-    printf("RLE decode check done, decoded size %lu. bytes\n", decodedSize);
 
-    ::memcpy(pCartImage, pFileImage, 512);
-
-    // Prepare the loader
-    memcpy(pCartImage, loaderRLE, loaderRLESize);
-    *((uint16_t*)(pCartImage + 0076)) = wStackAddr;
-    *((uint16_t*)(pCartImage + 0102)) = wStartAddr;
-    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), 027400);
+    // Report every candidate
+    printf("\nCodec  Encoded  Ratio    Fits  Time, ms  Est. cycles  Loader cycles\n");
+    printf("-----  -------  -------  ----  --------  -----------  -------------\n");
+    for (int i = 0; i < (int)candidates.size(); i++)
+    {
+        const CodecCandidate& candidate = candidates[i];
+        printf("%-5s  %7lu  %6.2f%%  %-4s  %8.1f  %11llu  %13llu%s\n",
+               candidate.codec->name, (unsigned long)candidate.encodedSize,
+               candidate.encodedSize * 100.0 / sav.imageSize,
+               candidate.result > 0 ? "yes" : "no",
+               candidate.seconds * 1000.0, (unsigned long long)candidate.cycles,
+               (unsigned long long)candidate.run.cycles,
+               (i == selected) ? "  <= selected" : "");
+    }
+    printf("Loader cycles are counted on the emulator with approximate timing\n");
+    if (selected >= 0)
+        printf("Selected %s, %s\n", candidates[selected].codec->name,
+               (options & OPTION_SELECT_FASTEST) ? "fastest to decompress" : "smallest output");
+    printf("\n");
 
-    return rleCodedSize;  // Finished encoding with RLE
+    return selected;
 }
 
-size_t PrepareCartLZSS()
+bool WriteCartImage(const char* outputfilename, const uint8_t* pCartImage)
 {
-    ::memset(pCartImage, 0, 65536);
-    size_t lzssCodedSize = lzss_encode(pFileImage + 512, savImageSize, pCartImage + 512, 65536 - 512);
-    if (lzssCodedSize > 24576 - 512)
+    printf("Output file: %s\n", outputfilename);
+    FILE* outputfile = fopen(outputfilename, "wb");
+    if (outputfile == nullptr)
     {
-        printf("LZSS encoded size too big: %lu. bytes, max %d. bytes\n", lzssCodedSize, 24576 - 512);
-        return 0;
+        printf("Failed to open output file (%d).", errno);
+        return false;
     }
 
-    // Trying to decode to make sure encoder works fine
-    uint8_t* pTempBuffer = (uint8_t*) ::calloc(65536, 1);
-    if (pTempBuffer == NULL)
-    {
-        printf("Failed to allocate memory.");
-        return 0;
-    }
-    size_t decodedSize = lzss_decode(pCartImage + 512, lzssCodedSize, pTempBuffer, 65536);
-    if (decodedSize != savImageSize)
-        printf("failed, LZSS decoded size = %lu (must be: %lu)\n", decodedSize, savImageSize);
-    for (size_t offset = 0; offset < savImageSize; offset++)
+    size_t bytesWrite = ::fwrite(pCartImage, 1, 24576, outputfile);
+    ::fclose(outputfile);
+    if (bytesWrite != 24576)
     {
-        if (pTempBuffer[offset] == pFileImage[512 + offset])
-            continue;
-
-        printf("LZSS decode failed at offset %06ho 0x%04x (%02x != %02x)\n", (uint16_t)(512 + offset), (uint16_t)(512 + offset), pTempBuffer[offset], pFileImage[512 + offset]);
-        return 0;
+        printf("Failed to write to the output file.");
+        return false;
     }
-    ::free(pTempBuffer);
-    printf("LZSS decode check done, decoded size %lu. bytes\n", decodedSize);
-
-    ::memcpy(pCartImage, pFileImage, 512);
-
-    // Prepare the loader
-    memcpy(pCartImage, loaderLZSS, loaderLZSSSize);
-    *((uint16_t*)(pCartImage + 0076)) = wStackAddr;
-    *((uint16_t*)(pCartImage + 0102)) = wStartAddr;
-    *((uint16_t*)(pCartImage + 0212)) = 01000 + savImageSize;  // CTOP
-    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), 027400);
-    //printf("LZSS CTOP = %06o\n", 01000 + savImageSize);
+    return true;
+}
 
-    return lzssCodedSize;  // Finished encoding with LZSS
+// Name of the second cartridge file: "-2" added before the extension
+std::string SecondCartFileName(const std::string& outputfilename)
+{
+    size_t dot = outputfilename.find_last_of('.');
+    size_t slash = outputfilename.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return outputfilename + "-2";
+    return outputfilename.substr(0, dot) + "-2" + outputfilename.substr(dot);
 }
 
-size_t PrepareCartLZ4()
+// The image doesn't fit one cartridge: split it over two, write the output file and the second one;
+// key: the cache key, empty if the cache is off
+bool ConvertSplit(ConvertJob& job, const SavImage& sav, CCartWorkspace& ws, const char* key)
 {
-    ::memset(pCartImage, -1, 65536);
-    size_t lz4CodedSize = lz4_encode(pFileImage + 512, savImageSize, pCartImage + 512, 65536 - 512);
-    if (lz4CodedSize > 24576 - 512)
+    MultiCartInfo info;
+    LoaderRunInfo run;
+    uint8_t* pCartImage1 = ws.GetCartImage(0);
+    uint8_t* pCartImage2 = ws.GetCartImage(1);
+    if (pCartImage1 == nullptr || pCartImage2 == nullptr ||
+        !PrepareMultiCart(sav, ws, pCartImage1, pCartImage2, &info))
     {
-        printf("LZ4 encoded size too big: %lu. bytes, max %d. bytes\n", lz4CodedSize, 24576 - 512);
-        return 0;
+        job.status = std::max(job.status, (int)STATUS_NOFIT);
+        return false;
     }
+    if (!EmulateLoader("Split", sav, pCartImage1, &run, pCartImage2))
+    {
+        job.status = STATUS_VERIFY;
+        return false;
+    }
+    if (key[0] != 0)
+        CacheStore(key, sav, pCartImage1, pCartImage2, OPTION_COMPRESSION_LZSA1, info.encodedSize1, info.encodedSize2);
 
-    // Trying to decode to make sure encoder works fine
-    uint8_t* pTempBuffer = (uint8_t*) ::calloc(65536, 1);
-    if (pTempBuffer == NULL)
+    if (!WriteCartImage(job.outputfilename.c_str(), pCartImage1) ||
+        !WriteCartImage(SecondCartFileName(job.outputfilename).c_str(), pCartImage2))
     {
-        printf("Failed to allocate memory.");
-        return 0;
+        job.status = STATUS_IOERROR;
+        return false;
     }
-    size_t decodedSize = lz4_decode(pCartImage + 512, lz4CodedSize, pTempBuffer, 65536);
-    if (decodedSize != savImageSize)
-        printf("failed, LZ4 decoded size = %lu (must be: %lu)\n", decodedSize, savImageSize);
-    for (size_t offset = 0; offset < savImageSize; offset++)
+    job.status = STATUS_OK;
+    for (int codec = 0; codec < g_codecCount; codec++)
     {
-        if (pTempBuffer[offset] == pFileImage[512 + offset])
-            continue;
-
-        printf("LZ4 decode failed at offset %06ho 0x%04x (%02x != %02x)\n", (uint16_t)(512 + offset),
-               (uint16_t)(512 + offset), pTempBuffer[offset], pFileImage[512 + offset]);
-        return 0;
+        if (g_codecs[codec].option == OPTION_COMPRESSION_LZSA1)
+            job.codec = g_codecs + codec;
     }
-    ::free(pTempBuffer);
-    printf("LZ4 decode check done, decoded size %lu. bytes\n", decodedSize);
-
-    ::memcpy(pCartImage, pFileImage, 512);
-
-    // Prepare the loader
-    memcpy(pCartImage, loaderLZ4, loaderLZ4Size);
-    *((uint16_t*)(pCartImage + 0076)) = wStackAddr;
-    *((uint16_t*)(pCartImage + 0102)) = wStartAddr;
-    *((uint16_t*)(pCartImage + 0130)) = wStartAddr;
-    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), 027400);
+    job.encodedSize = info.encodedSize1;
+    job.encodedSize2 = info.encodedSize2;
+    return true;
+}
 
-    return lz4CodedSize;  // Finished encoding with LZ4
+// Take the cartridge image from the cache, both images for a split one, and write the output files;
+// false if not found, or failed to write with job.status set
+bool ConvertFromCache(ConvertJob& job, const SavImage& sav, const char* key, uint8_t* pCartImage, uint8_t* pCartImage2)
+{
+    int codecOption = 0;
+    size_t encodedSize = 0, encodedSize2 = 0;
+    if (!CacheLookup(key, sav, pCartImage, pCartImage2, &codecOption, &encodedSize, &encodedSize2))
+        return false;
+    for (int codec = 0; codec < g_codecCount; codec++)
+    {
+        if (g_codecs[codec].option != codecOption)
+            continue;
+        if (encodedSize2 > 0)
+            printf("Cache hit %s: split %s, encoded size %lu. + %lu. bytes\n", key, g_codecs[codec].name,
+                   (unsigned long)encodedSize, (unsigned long)encodedSize2);
+        else
+            printf("Cache hit %s: %s, encoded size %lu. bytes\n", key, g_codecs[codec].name, (unsigned long)encodedSize);
+        job.codec = g_codecs + codec;
+        job.encodedSize = encodedSize;
+        job.encodedSize2 = encodedSize2;
+        job.cached = true;
+        if (!WriteCartImage(job.outputfilename.c_str(), pCartImage) ||
+            (encodedSize2 > 0 && !WriteCartImage(SecondCartFileName(job.outputfilename).c_str(), pCartImage2)))
+        {
+            job.status = STATUS_IOERROR;
+            job.codec = nullptr;
+        }
+        return true;
+    }
+    return false;
 }
 
-size_t PrepareCartLZSA1()
+// Convert one file with the buffers and codecs of the worker thread: try the codecs one-by-one until fit,
+// or try all of them and keep the best one for -smallest / -fastest
+bool ConvertFile(ConvertJob& job, CCartWorkspace& ws)
 {
-    ::memset(pCartImage, -1, 65536);
-    size_t encodedSize = lzsa1_encode(pFileImage + 512, savImageSize, pCartImage + 512, 65536 - 512);
-    printf("LZSA1 output size %lu. bytes (%1.2f %%)\n", encodedSize, encodedSize * 100.0 / savImageSize);
-    if (encodedSize > 24576 - 512)
+    printf("Input file: %s\n", job.inputfilename.c_str());
+
+    SavImage sav;
+    if (!LoadSavImage(job.inputfilename.c_str(), &sav, ws))
     {
-        printf("LZSA1 encoded size too big: %lu. bytes, max %d. bytes\n", encodedSize, 24576 - 512);
-        return 0;
+        job.status = STATUS_IOERROR;
+        return false;
     }
+    job.imageSize = sav.imageSize;
 
-    // Trying to decode to make sure encoder works fine
-    uint8_t* pTempBuffer = (uint8_t*) ::calloc(65536, 1);
-    if (pTempBuffer == NULL)
+    int current = 0;  // Cartridge image buffer for the next attempt; the other one keeps the best result
+    uint8_t* pCartImage = ws.GetCartImage(0);
+    if (pCartImage == nullptr || ws.GetCartImage(1) == nullptr)
     {
         printf("Failed to allocate memory.");
-        return 0;
+        job.status = STATUS_IOERROR;
+        return false;
     }
-    size_t decodedSize = lzsa1_decode(pCartImage + 512, encodedSize, pTempBuffer, 65536);
-    if (decodedSize != savImageSize)
-        printf("failed, LZSA1 decoded size = %lu (must be: %lu)\n", decodedSize, savImageSize);
-    for (size_t offset = 0; offset < savImageSize; offset++)
+
+    char key[33] = { 0 };
+    if (CacheIsEnabled())
     {
-        if (pTempBuffer[offset] == pFileImage[512 + offset])
-            continue;
+        CacheMakeKey(sav, options, key);
+        if (ConvertFromCache(job, sav, key, pCartImage, ws.GetCartImage(1)))
+            return job.codec != nullptr;
+    }
 
-        printf("LZSA1 decode failed at offset %06ho 0x%04x (%02x != %02x)\n", (uint16_t)(512 + offset),
-               (uint16_t)(512 + offset), pTempBuffer[offset], pFileImage[512 + offset]);
-        return 0;
-    }
-    ::free(pTempBuffer);
-    printf("LZSA1 decode check done, decoded size %lu. bytes\n", decodedSize);
-
-    ::memcpy(pCartImage, pFileImage, 512);
-
-    // Prepare the loader
-    memcpy(pCartImage, loaderLZSA1, loaderLZSA1Size);
-    uint16_t wLZWords = (encodedSize + 1) / 2;  // How many words to copy from the cartridge
-    uint16_t wLZStart = 0160000 - wLZWords * 2 - 0100;  // Address where to copy to from the cartridge
-    *((uint16_t*)(pCartImage + 0050)) = wLZStart;
-    *((uint16_t*)(pCartImage + 0054)) = wLZWords;
-    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), 027400);
-    *((uint16_t*)(pCartImage + 0076)) = wStackAddr;
-    *((uint16_t*)(pCartImage + 0102)) = wStartAddr;
-    *((uint16_t*)(pCartImage + 0112)) = wLZStart;
-    *((uint16_t*)(pCartImage + 0114)) = wLZWords;
-    *((uint16_t*)(pCartImage + 0124)) = wLZStart;
-
-    return encodedSize;  // Finished encoding with LZSA1
+    uint64_t selectedCycles = 0;
+    for (int codec = 0; codec < g_codecCount; codec++)
+    {
+        if ((options & g_codecs[codec].option) == 0)
+            continue;
+        CodecCandidate attempt;
+        attempt.codec = g_codecs + codec;
+        attempt.pCartImage = ws.GetCartImage(current);
+        attempt.encodedSize = 0;
+        attempt.noRoom = false;
+        attempt.cycles = 0;
+        attempt.run.instructions = 0;  attempt.run.cycles = 0;
+        auto starttime = std::chrono::steady_clock::now();
+        attempt.result = PrepareCart(g_codecs[codec], sav, ws, attempt.pCartImage, &attempt.encodedSize, &attempt.cycles);
+        attempt.noRoom = ws.IsNoRoom();
+        if (attempt.result > 0 && !EmulateLoader(g_codecs[codec].name, sav, attempt.pCartImage, &attempt.run))
+            attempt.result = 0;
+        attempt.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+        job.attempts.push_back(attempt);
+        if (attempt.result == 0)
+            continue;
+        if (job.codec == nullptr || IsBetterCandidate(attempt.encodedSize, GetCandidateCycles(attempt), job.encodedSize, selectedCycles))
+        {
+            job.codec = g_codecs + codec;
+            job.encodedSize = attempt.encodedSize;
+            selectedCycles = GetCandidateCycles(attempt);
+            pCartImage = ws.GetCartImage(current);
+            current ^= 1;
+        }
+        if ((options & OPTION_SELECT_MASK) == 0)
+            break;  // Finished encoding
+    }
+    if (job.codec != nullptr && key[0] != 0)
+        CacheStore(key, sav, pCartImage, nullptr, job.codec->option, job.encodedSize, 0);
+    if (job.codec == nullptr)
+    {
+        SetAttemptsFailedStatus(job);
+        if (multicart)
+            return ConvertSplit(job, sav, ws, key);
+        return false;
+    }
+    if (!WriteCartImage(job.outputfilename.c_str(), pCartImage))
+    {
+        job.status = STATUS_IOERROR;
+        job.codec = nullptr;
+        return false;
+    }
+    return true;
 }
 
-size_t PrepareCartLZSA2()
+// Convert one file with all the selected codecs running concurrently, for -smallest / -fastest with one file
+bool ConvertFileCodecsConcurrently(ConvertJob& job, CCartWorkspace& ws)
 {
-    ::memset(pCartImage, -1, 65536);
-    size_t encodedSize = lzsa2_encode(pFileImage + 512, savImageSize, pCartImage + 512, 65536 - 512);
-    printf("LZSA2 output size %lu. bytes (%1.2f %%)\n", encodedSize, encodedSize * 100.0 / savImageSize);
-    if (encodedSize > 24576 - 512)
+    printf("Input file: %s\n", job.inputfilename.c_str());
+
+    SavImage sav;
+    if (!LoadSavImage(job.inputfilename.c_str(), &sav, ws))
     {
-        printf("LZSA2 encoded size too big: %lu. bytes, max %d. bytes\n", encodedSize, 24576 - 512);
-        return 0;
+        job.status = STATUS_IOERROR;
+        return false;
     }
-
-    // Trying to decode to make sure encoder works fine
-    uint8_t* pTempBuffer = (uint8_t*) ::calloc(65536, 1);
-    if (pTempBuffer == NULL)
+    job.imageSize = sav.imageSize;
+
+    char key[33] = { 0 };
+    if (CacheIsEnabled())
+        CacheMakeKey(sav, options, key);
+    uint8_t* pCartImage = ws.GetCartImage(0);
+    uint8_t* pCartImage2 = ws.GetCartImage(1);
+    if (key[0] != 0 && pCartImage != nullptr && pCartImage2 != nullptr && ConvertFromCache(job, sav, key, pCartImage, pCartImage2))
+        return job.codec != nullptr;
+
+    int selected = RunCodecsConcurrently(sav, ws, job.attempts);
+    if (selected < 0)
     {
-        printf("Failed to allocate memory.");
-        return 0;
+        SetAttemptsFailedStatus(job);
+        if (multicart)
+            return ConvertSplit(job, sav, ws, key);
+        return false;  // All attempts failed
     }
-    size_t decodedSize = lzsa2_decode(pCartImage + 512, encodedSize, pTempBuffer, 65536);
-    if (decodedSize != savImageSize)
-        printf("failed, LZSA2 decoded size = %lu (must be: %lu)\n", decodedSize, savImageSize);
-    for (size_t offset = 0; offset < savImageSize; offset++)
+    const CodecCandidate& candidate = job.attempts[selected];
+    if (key[0] != 0)
+        CacheStore(key, sav, candidate.pCartImage, nullptr, candidate.codec->option, candidate.encodedSize, 0);
+    if (!WriteCartImage(job.outputfilename.c_str(), candidate.pCartImage))
     {
-        if (pTempBuffer[offset] == pFileImage[512 + offset])
-            continue;
-
-        printf("LZSA2 decode failed at offset %06ho 0x%04x (%02x != %02x)\n", (uint16_t)(512 + offset),
-               (uint16_t)(512 + offset), pTempBuffer[offset], pFileImage[512 + offset]);
-        return 0;
+        job.status = STATUS_IOERROR;
+        return false;
     }
-    ::free(pTempBuffer);
-    printf("LZSA2 decode check done, decoded size %lu. bytes\n", decodedSize);
-
-    ::memcpy(pCartImage, pFileImage, 512);
-
-    // Prepare the loader
-    memcpy(pCartImage, loaderLZSA2, loaderLZSA2Size);
-    uint16_t wLZWords = (encodedSize + 1) / 2;  // How many words to copy from the cartridge
-    uint16_t wLZStart = 0160000 - wLZWords * 2 - 0100;  // Address where to copy to from the cartridge
-    *((uint16_t*)(pCartImage + 0050)) = wLZStart;
-    *((uint16_t*)(pCartImage + 0054)) = wLZWords;
-    *((uint16_t*)(pCartImage + 0066)) = CalcCheckum((uint16_t*)(pCartImage + 01000), wLZWords);
-    *((uint16_t*)(pCartImage + 0074)) = wLZStart;
-    *((uint16_t*)(pCartImage + 0110)) = wStackAddr;
-    *((uint16_t*)(pCartImage + 0124)) = wLZStart;
-    *((uint16_t*)(pCartImage + 0126)) = wLZWords;
-
-    return encodedSize;  // Finished encoding with LZSA2
+    job.codec = candidate.codec;
+    job.encodedSize = candidate.encodedSize;
+    return true;
 }
 
-int main(int argc, char* argv[])
+// Read the cartridge image to the 64K buffer, a shorter file is padded with 0xff as the empty ROM;
+// false if failed to open, the message is up to the caller
+bool ReadCartImage(const char* filename, uint8_t* pCartImage)
 {
-    if (!ParseCommandLine(argc, argv))
+    FILE* cartfile = fopen(filename, "rb");
+    if (cartfile == nullptr)
+        return false;
+    size_t bytesRead = ::fread(pCartImage, 1, 24576 + 1, cartfile);
+    ::fclose(cartfile);
+    if (bytesRead > 24576)
     {
-        printf(
-            "Usage: Sav2Cart [options] <inputfile.SAV> <outputfile.BIN>\n"
-            "Options:\n"
-            "\t" OPTIONSTR "none  - use to fit non-compressed\n"
-            "\t" OPTIONSTR "rle   - use RLE compression\n"
-            "\t" OPTIONSTR "lzss  - use LZSS compression\n"
-            "\t" OPTIONSTR "lz4   - use LZ4 compression\n"
-            "\t" OPTIONSTR "lzsa1 - use LZSA1 compression\n"
-            "\t" OPTIONSTR "lzsa2 - use LZSA2 compression\n"
-            "\t(no compression options) - try all on-by-one until fit\n");
-        return 255;
+        printf("Not a cartridge image %s, the file is bigger than 24576. bytes\n", filename);
+        return false;
     }
+    ::memset(pCartImage + bytesRead, 0xff, 65536 - bytesRead);
+    return true;
+}
 
-    printf("Input file: %s\n", inputfilename);
-
-    inputfile = fopen(inputfilename, "rb");
-    if (inputfile == nullptr)
+bool WriteSavFile(const char* outputfilename, const SavImage& sav)
+{
+    printf("Output file: %s\n", outputfilename);
+    FILE* outputfile = fopen(outputfilename, "wb");
+    if (outputfile == nullptr)
     {
-        printf("Failed to open the input file (%d).", errno);
-        return 255;
+        printf("Failed to open output file (%d).", errno);
+        return false;
     }
-    ::fseek(inputfile, 0, SEEK_END);
-    inputfileSize = ::ftell(inputfile);
-
-    pFileImage = (uint8_t*) ::malloc(inputfileSize);
 
-    ::fseek(inputfile, 0, SEEK_SET);
-    size_t bytesRead = ::fread(pFileImage, 1, inputfileSize, inputfile);
-    if (bytesRead != inputfileSize)
+    size_t bytesWrite = ::fwrite(sav.pFileImage, 1, sav.fileSize, outputfile);
+    ::fclose(outputfile);
+    if (bytesWrite != sav.fileSize)
     {
-        printf("Failed to read the input file.");
-        return 255;
+        printf("Failed to write to the output file.");
+        return false;
     }
-    ::fclose(inputfile);  inputfile = nullptr;
-    printf("Input file size %u. bytes\n", inputfileSize);
+    return true;
+}
 
-    wStartAddr = *((uint16_t*)(pFileImage + 040));
-    wStackAddr = *((uint16_t*)(pFileImage + 042));
-    wTopAddr = *((uint16_t*)(pFileImage + 050));
-    printf("SAV Start\t%06ho  %04x  %5d\n", wStartAddr, wStartAddr, wStartAddr);
-    printf("SAV Stack\t%06ho  %04x  %5d\n", wStackAddr, wStackAddr, wStackAddr);
-    printf("SAV Top  \t%06ho  %04x  %5d\n", wTopAddr, wTopAddr, wTopAddr);
-    savImageSize = ((size_t)wTopAddr + 2 - 01000);
-    printf("SAV image size\t%06ho  %04lx  %5lu\n", (uint16_t)savImageSize, savImageSize, savImageSize);
+// Inspect the cartridge image, and write the SAV file for -unpack; the second cartridge of the split image
+// is taken from the file with "-2" added to the name, if there is one
+bool UnpackFile(ConvertJob& job, CCartWorkspace& ws)
+{
+    printf("Input file: %s\n", job.inputfilename.c_str());
 
-    pCartImage = (uint8_t*) ::calloc(65536, 1);
-    if (pCartImage == NULL)
+    uint8_t* pCartImage = ws.GetCartImage(0);
+    uint8_t* pCartImage2 = ws.GetCartImage(1);
+    if (pCartImage == nullptr || pCartImage2 == nullptr)
     {
         printf("Failed to allocate memory.");
-        return 255;
+        job.status = STATUS_IOERROR;
+        return false;
     }
+    if (!ReadCartImage(job.inputfilename.c_str(), pCartImage))
+    {
+        printf("Failed to open the input file (%d).\n", errno);
+        job.status = STATUS_IOERROR;
+        return false;
+    }
+    if (!ReadCartImage(SecondCartFileName(job.inputfilename).c_str(), pCartImage2))
+        pCartImage2 = nullptr;
 
-    for (;;)  // breaking the block when we prepared the output image somehow
+    SavImage sav;
+    if (!InspectCartImage(pCartImage, pCartImage2, ws, &job.cart, &sav))
+    {
+        job.status = STATUS_VERIFY;
+        return false;
+    }
+    if (command == COMMAND_UNPACK && !WriteSavFile(job.outputfilename.c_str(), sav))
+    {
+        job.status = STATUS_IOERROR;
+        return false;
+    }
+    for (int codec = 0; codec < g_codecCount; codec++)
     {
-        // Plain copy
-        if (options & OPTION_COMPRESSION_NONE)
+        if (g_codecs[codec].option == job.cart.codecOption)
+            job.codec = g_codecs + codec;
+    }
+    return true;
+}
+
+// Convert all the jobs on a thread pool, every worker with its own workspace
+void ConvertFilesConcurrently()
+{
+    bool (*process)(ConvertJob& job, CCartWorkspace& ws) = (command == COMMAND_CONVERT) ? ConvertFile : UnpackFile;
+    std::atomic<size_t> next(0);
+    size_t threads = (threadCount > 0) ? threadCount : std::thread::hardware_concurrency();
+    if (threads == 0 || threads > jobs.size())
+        threads = jobs.size();
+    auto worker = [&]()
+    {
+        CCartWorkspace ws;
+        ws.SetPoolWorker(threads > 1);
+        for (;;)
         {
-            size_t encodedSize = PrepareCartPlain();
-            if (encodedSize > 0)
-                break;  // Finished encoding with plain copy
+            size_t index = next++;
+            if (index >= jobs.size())
+                break;
+            auto starttime = std::chrono::steady_clock::now();
+            process(jobs[index], ws);
+            jobs[index].seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
         }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < threads; i++)
+        pool.push_back(std::thread(worker));
+    for (size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+}
 
-        // RLE
-        if (options & OPTION_COMPRESSION_RLE)
+// Summary of all the jobs; returns the number of failed ones
+int PrintJobSummary()
+{
+    int failed = 0;
+    printf("\nCodec  Encoded  Cart size  Headroom  Time, ms  Input -> Output\n");
+    printf("-----  -------  ---------  --------  --------  ---------------\n");
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const ConvertJob& job = jobs[i];
+        if (job.codec == nullptr)
         {
-            size_t encodedSize = PrepareCartRLE();
-            if (encodedSize > 0)
-                break;  // Finished encoding with RLE
+            failed++;
+            printf("%-5s  %7s  %9s  %8s  %8.1f  %s -> %s  (%s)\n", "FAIL", "", "", "", job.seconds * 1000.0,
+                   job.inputfilename.c_str(), job.outputfilename.c_str(), GetStatusText(job.status));
+            continue;
         }
+        size_t cartSize = GetCartSize(*job.codec, job.encodedSize);
+        printf("%-5s  %7lu  %9lu  %8ld  %8.1f  %s -> %s%s\n", job.codec->name,
+               (unsigned long)job.encodedSize, (unsigned long)cartSize, 24576L - (long)cartSize,
+               job.seconds * 1000.0, job.inputfilename.c_str(), job.outputfilename.c_str(),
+               job.cached ? "  (cached)" : "");
+        if (job.encodedSize2 > 0)  // The second cartridge has no loader block
+            printf("%-5s  %7lu  %9lu  %8ld  %8s  %*s -> %s\n", "", (unsigned long)job.encodedSize2,
+                   (unsigned long)job.encodedSize2, 24576L - (long)job.encodedSize2, "",
+                   (int)job.inputfilename.size(), "", SecondCartFileName(job.outputfilename).c_str());
+    }
+    printf("%lu. files converted, %d. failed\n", (unsigned long)(jobs.size() - failed), failed);
+    return failed;
+}
 
-        // LZSS
-        if (options & OPTION_COMPRESSION_LZSS)
+// Summary of the -inspect / -unpack jobs; returns the number of failed ones
+int PrintUnpackSummary()
+{
+    int failed = 0;
+    printf("\nLoader       Filter  Checksum  Start   Stack   Image  Used   Headroom  Time, ms  Input -> Output\n");
+    printf("-----------  ------  --------  ------  ------  -----  -----  --------  --------  ---------------\n");
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const ConvertJob& job = jobs[i];
+        const CartInspectInfo& cart = job.cart;
+        if (job.codec == nullptr)
+            failed++;
+        if (cart.loaderName == nullptr)
         {
-            size_t encodedSize = PrepareCartLZSS();
-            if (encodedSize > 0)
-                break;  // Finished encoding with LZSS
+            printf("%-11s  %6s  %8s  %6s  %6s  %5s  %5s  %8s  %8.1f  %s%s%s\n", "unknown", "", "", "", "", "", "", "",
+                   job.seconds * 1000.0, job.inputfilename.c_str(), job.outputfilename.empty() ? "" : " -> ", job.outputfilename.c_str());
+            continue;
         }
+        printf("%-11s  %-6s  %-8s  %06ho  %06ho  %5lu  %5lu  %8ld  %8.1f  %s%s%s%s\n",
+               cart.loaderName, cart.filtered ? "yes" : "", cart.checksumOk ? "ok" : "BAD", cart.wStartAddr, cart.wStackAddr,
+               (unsigned long)cart.imageSize, (unsigned long)cart.usedSize[0], 24576L - (long)cart.usedSize[0],
+               job.seconds * 1000.0, job.inputfilename.c_str(), job.outputfilename.empty() ? "" : " -> ", job.outputfilename.c_str(),
+               (job.codec == nullptr) ? "  (FAIL)" : "");
+        if (cart.split && cart.usedSize[1] > 0)  // The second cartridge has no loader block
+            printf("%-11s  %6s  %8s  %6s  %6s  %5s  %5lu  %8ld  %8s  %s\n", "", "", "", "", "", "",
+                   (unsigned long)cart.usedSize[1], 24576L - (long)cart.usedSize[1], "",
+                   SecondCartFileName(job.inputfilename).c_str());
+    }
+    printf("%lu. files %s, %d. failed\n", (unsigned long)(jobs.size() - failed),
+           (command == COMMAND_UNPACK) ? "unpacked" : "inspected", failed);
+    return failed;
+}
 
-        // LZ4
-        if (options & OPTION_COMPRESSION_LZ4)
+// JSON string in quotes, for the file names
+std::string JsonString(const std::string& text)
+{
+    std::string result = "\"";
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        char c = text[i];
+        if (c == '"' || c == '\\')
+            result += '\\';
+        if ((unsigned char)c < 0x20)
         {
-            size_t encodedSize = PrepareCartLZ4();
-            if (encodedSize > 0)
-                break;  // Finished encoding with LZ4
+            char escaped[8];
+            sprintf_s(escaped, sizeof(escaped), "\\u%04x", (unsigned)c);
+            result += escaped;
         }
+        else
+            result += c;
+    }
+    return result + "\"";
+}
+
+const char* GetStatusName(int status)
+{
+    switch (status)
+    {
+    case STATUS_OK:      return "ok";
+    case STATUS_NOFIT:   return "nofit";
+    case STATUS_VERIFY:  return "verify";
+    case STATUS_IOERROR: return "ioerror";
+    default:             return "failed";
+    }
+}
 
-        // LZSA1
-        if (options & OPTION_COMPRESSION_LZSA1)
+// -report=json: every file with its result and the codecs tried; sizes in bytes, times in ms, cycles of the loader
+void WriteJsonReport(FILE* report, int exitCode)
+{
+    const char* commandName = (command == COMMAND_CONVERT) ? "convert" : (command == COMMAND_UNPACK) ? "unpack" : "inspect";
+    int failed = 0;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        if (jobs[i].status != STATUS_OK)
+            failed++;
+    }
+    fprintf(report, "{\n  \"command\": \"%s\",\n  \"exitCode\": %d,\n  \"done\": %lu,\n  \"failed\": %d,\n  \"files\": [",
+            commandName, exitCode, (unsigned long)(jobs.size() - failed), failed);
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const ConvertJob& job = jobs[i];
+        fprintf(report, "%s\n    {\n      \"input\": %s,\n", (i > 0) ? "," : "", JsonString(job.inputfilename).c_str());
+        if (!job.outputfilename.empty())
+            fprintf(report, "      \"output\": %s,\n", JsonString(job.outputfilename).c_str());
+        fprintf(report, "      \"status\": \"%s\",\n      \"timeMs\": %.1f", GetStatusName(job.status), job.seconds * 1000.0);
+
+        if (command != COMMAND_CONVERT)
         {
-            size_t encodedSize = PrepareCartLZSA1();
-            if (encodedSize > 0)
-                break;  // Finished encoding with LZSA1
+            const CartInspectInfo& cart = job.cart;
+            if (cart.loaderName != nullptr)
+            {
+                fprintf(report, ",\n      \"loader\": \"%s\",\n      \"filtered\": %s,\n      \"checksumOk\": %s,\n",
+                        cart.loaderName, cart.filtered ? "true" : "false", cart.checksumOk ? "true" : "false");
+                fprintf(report, "      \"startAddress\": %u,\n      \"stackAddress\": %u,\n      \"imageSize\": %lu,\n",
+                        (unsigned)cart.wStartAddr, (unsigned)cart.wStackAddr, (unsigned long)cart.imageSize);
+                fprintf(report, "      \"usedSize\": %lu,\n      \"headroom\": %ld",
+                        (unsigned long)cart.usedSize[0], 24576L - (long)cart.usedSize[0]);
+                if (cart.split && cart.usedSize[1] > 0)
+                    fprintf(report, ",\n      \"usedSize2\": %lu,\n      \"headroom2\": %ld",
+                            (unsigned long)cart.usedSize[1], 24576L - (long)cart.usedSize[1]);
+            }
+            fprintf(report, "\n    }");
+            continue;
         }
 
-        // LZSA2
-        if (options & OPTION_COMPRESSION_LZSA2)
+        fprintf(report, ",\n      \"imageSize\": %lu,\n      \"cached\": %s", (unsigned long)job.imageSize, job.cached ? "true" : "false");
+        if (job.codec != nullptr)
         {
-            size_t encodedSize = PrepareCartLZSA2();
-            if (encodedSize > 0)
-                break;  // Finished encoding with LZSA2
+            size_t cartSize = GetCartSize(*job.codec, job.encodedSize);
+            fprintf(report, ",\n      \"codec\": \"%s\",\n      \"encodedSize\": %lu,\n      \"cartSize\": %lu,\n      \"headroom\": %ld",
+                    job.codec->name, (unsigned long)job.encodedSize, (unsigned long)cartSize, 24576L - (long)cartSize);
+            if (job.encodedSize2 > 0)  // The second cartridge has no loader block
+                fprintf(report, ",\n      \"output2\": %s,\n      \"encodedSize2\": %lu,\n      \"headroom2\": %ld",
+                        JsonString(SecondCartFileName(job.outputfilename)).c_str(),
+                        (unsigned long)job.encodedSize2, 24576L - (long)job.encodedSize2);
         }
-
-        return 255;  // All attempts failed
+        else
+            fprintf(report, ",\n      \"codec\": null");
+        fprintf(report, ",\n      \"codecs\": [");
+        for (size_t j = 0; j < job.attempts.size(); j++)
+        {
+            const CodecCandidate& attempt = job.attempts[j];
+            int status = GetCandidateStatus(attempt);
+            fprintf(report, "%s\n        { \"codec\": \"%s\", \"encodedSize\": %lu, \"ratio\": %.4f, \"fits\": %s, \"verified\": %s, "
+                    "\"status\": \"%s\", \"timeMs\": %.1f, \"estimatedCycles\": %llu, \"loaderCycles\": %llu, \"selected\": %s }",
+                    (j > 0) ? "," : "", attempt.codec->name, (unsigned long)attempt.encodedSize,
+                    (job.imageSize > 0) ? (double)attempt.encodedSize / job.imageSize : 0.0,
+                    (status != STATUS_NOFIT) ? "true" : "false", (status == STATUS_OK) ? "true" : "false",
+                    GetStatusName(status), attempt.seconds * 1000.0,
+                    (unsigned long long)attempt.cycles, (unsigned long long)attempt.run.cycles,
+                    (job.codec == attempt.codec && job.encodedSize2 == 0 && status == STATUS_OK) ? "true" : "false");
+        }
+        fprintf(report, "%s]\n    }", job.attempts.empty() ? "" : "\n      ");
     }
+    fprintf(report, "\n  ]\n}\n");
+}
 
-    ::free(pFileImage);  pFileImage = nullptr;
 
-    printf("Output file: %s\n", outputfilename);
-    outputfile = fopen(outputfilename, "wb");
-    if (outputfile == nullptr)
+int main(int argc, char* argv[])
+{
+    if (!ParseCommandLine(argc, argv))
     {
-        printf("Failed to open output file (%d).", errno);
-        return 255;
+        printf(
+            "Usage: Sav2Cart [options] <inputfile.SAV> <outputfile.BIN> [<inputfile2.SAV> <outputfile2.BIN> ...]\n"
+            "       Sav2Cart [options] " OPTIONSTR "manifest <manifest.txt>\n"
+            "       Sav2Cart " OPTIONSTR "inspect <inputfile.BIN> [<inputfile2.BIN> ...]\n"
+            "       Sav2Cart " OPTIONSTR "unpack <inputfile.BIN> <outputfile.SAV> [<inputfile2.BIN> <outputfile2.SAV> ...]\n"
+            "Options:\n"
+            "\t" OPTIONSTR "none  - use to fit non-compressed\n"
+            "\t" OPTIONSTR "rle   - use RLE compression\n"
+            "\t" OPTIONSTR "lzss  - use LZSS compression\n"
+            "\t" OPTIONSTR "lz4   - use LZ4 compression\n"
+            "\t" OPTIONSTR "lzsa1 - use LZSA1 compression\n"
+            "\t" OPTIONSTR "lzsa2 - use LZSA2 compression\n"
+            "\t" OPTIONSTR "zx0   - use ZX0-style compression\n"
+            "\t" OPTIONSTR "lzssopt - LZSS optimal parse instead of greedy, smaller and slower\n"
+            "\t" OPTIONSTR "lzsschainN - LZSS effort: check up to N matches per position; 0 = all (default)\n"
+            "\t" OPTIONSTR "lz4chainN - LZ4 effort: 1..3 greedy, 4..6 lazy, more = optimal parse with N matches per position; 0 = all (default)\n"
+            "\t" OPTIONSTR "lzsaback - LZSA packed backward and unpacked in place from the end\n"
+            "\t" OPTIONSTR "lzsaminN - LZSA minimum match size: 3..5 for LZSA1, 2..3 for LZSA2; 3 by default\n"
+            "\t" OPTIONSTR "lzsaspeed - LZSA favors unpacking speed over ratio\n"
+            "\t" OPTIONSTR "lzsaall - LZSA tries all the min match sizes for ratio and speed, takes the fastest to unpack of those that fit\n"
+            "\t" OPTIONSTR "pdpfilter - PDP-11 code filter before compression: JSR PC operands made absolute\n"
+            "\t" OPTIONSTR "dict <file> - LZ4 and LZSA1 primed with the data, placed in the loader block: the common runtime code\n"
+            "\t(no compression options) - try all on-by-one until fit\n"
+            "\t" OPTIONSTR "smallest - run the codecs concurrently, choose the smallest output\n"
+            "\t" OPTIONSTR "fastest  - run the codecs concurrently, choose the fastest to decompress\n"
+            "\t" OPTIONSTR "manifest <file> - take input/output pairs from the file, one pair per line\n"
+            "\t" OPTIONSTR "threadsN - use N worker threads; 0 = by the number of CPU cores (default)\n"
+            "\t" OPTIONSTR "multicart - split the image over two cartridges if it doesn't fit one\n"
+            "\t" OPTIONSTR "cache <dir> - keep the results in the directory, reuse them for unchanged SAV files\n"
+            "\t" OPTIONSTR "cachesizeN - cache size limit in MB, least recently used results are removed; 64 by default\n"
+            "\t" OPTIONSTR "inspect - recognize the loader of the cartridge images, check the checksum and unpack in memory\n"
+            "\t" OPTIONSTR "unpack  - same as " OPTIONSTR "inspect, and write the unpacked SAV files\n"
+            "\t" OPTIONSTR "report=json - JSON report to stdout, the messages to stderr\n"
+            "Exit codes: 0 = done, 1 = doesn't fit, 2 = verification failed, 3 = I/O error, 255 = bad command line\n");
+        return STATUS_USAGE;
     }
 
-    size_t bytesWrite = ::fwrite(pCartImage, 1, 24576, outputfile);
-    if (bytesWrite != 24576)
+    FILE* report = nullptr;
+    if (reportJson)
     {
-        printf("Failed to write to the output file.");
-        return 255;
+        // The report takes stdout, all the messages go to stderr
+        fflush(stdout);
+        int reportfd = _dup(_fileno(stdout));
+        if (reportfd >= 0)
+            report = _fdopen(reportfd, "w");
+        if (report == nullptr)
+        {
+            printf("Failed to open the report stream (%d).\n", errno);
+            return STATUS_IOERROR;
+        }
+        _dup2(_fileno(stderr), _fileno(stdout));
+    }
+
+    if (command == COMMAND_CONVERT)
+    {
+        if (dictfilename != nullptr && !ReadDictionary(dictfilename))
+            return STATUS_IOERROR;
+        if (cachedirname != nullptr && !CacheSetDirectory(cachedirname, (uint64_t)cacheSizeMB * 1024 * 1024))
+            return STATUS_IOERROR;
     }
-    ::fclose(outputfile);
 
-    ::free(pCartImage);
+    if (jobs.size() == 1)
+    {
+        // Single file: the codecs run concurrently for -smallest / -fastest
+        CCartWorkspace ws;
+        auto starttime = std::chrono::steady_clock::now();
+        if (command != COMMAND_CONVERT)
+            UnpackFile(jobs[0], ws);
+        else if (options & OPTION_SELECT_MASK)
+            ConvertFileCodecsConcurrently(jobs[0], ws);
+        else
+            ConvertFile(jobs[0], ws);
+        jobs[0].seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+    }
+    else
+    {
+        // Many files: the files run concurrently, the codecs of a file one by one
+        ConvertFilesConcurrently();
+        if (command == COMMAND_CONVERT)
+            PrintJobSummary();
+        else
+            PrintUnpackSummary();
+    }
+    if (command == COMMAND_CONVERT)
+        CacheTrim();
+
+    // The worst result of the files
+    int exitCode = STATUS_OK;
+    for (size_t i = 0; i < jobs.size(); i++)
+        exitCode = std::max(exitCode, jobs[i].status);
+    if (report != nullptr)
+    {
+        WriteJsonReport(report, exitCode);
+        ::fclose(report);
+    }
+    if (exitCode != STATUS_OK)
+        return exitCode;
 
     printf("Done.\n");
     return 0;
 }
 
-
 //////////////////////////////////////////////////////////////////////
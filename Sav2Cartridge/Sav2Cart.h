@@ -12,6 +12,19 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 
 #include <stddef.h>
 #include <stdint.h>
+#include <vector>
+
+
+// SAV file loaded for the conversion
+struct SavImage
+{
+    uint8_t*    pFileImage;
+    uint32_t    fileSize;
+    size_t      imageSize;   // From address 001000 to the top address
+    uint16_t    wStartAddr;
+    uint16_t    wStackAddr;
+    uint16_t    wTopAddr;
+};
 
 
 //////////////////////////////////////////////////////////////////////
@@ -35,33 +48,365 @@ extern size_t const loaderLZSA1Size;
 extern uint16_t const loaderLZSA2[];
 extern size_t const loaderLZSA2Size;
 
+extern uint16_t const loaderZX0[];
+extern size_t const loaderZX0Size;
+
+extern uint16_t const loaderMultiLZSA1[];
+extern size_t const loaderMultiLZSA1Size;
+
+extern uint16_t const loaderLZSA1B[];
+extern size_t const loaderLZSA1BSize;
+
+extern uint16_t const loaderLZSA2B[];
+extern size_t const loaderLZSA2BSize;
+
+extern uint16_t const loaderFilter[];
+extern size_t const loaderFilterSize;
+#define FILTER_STUB_ADDRESS 0640  // Above the loaders, below their stack
+
 
 //////////////////////////////////////////////////////////////////////
+// Codecs
+
+// Memory block given to a codec
+struct CodecSpan
+{
+    uint8_t*    data;
+    size_t      size;
+
+    CodecSpan() : data(nullptr), size(0) { }
+    CodecSpan(uint8_t* pData, size_t nSize) : data(pData), size(nSize) { }
+};
+
+// Token statistics of an encoded stream, for the loader decompression time estimate
+struct CodecStats
+{
+    size_t      literals;     // Bytes copied from the stream
+    size_t      literalRuns;
+    size_t      matches;      // Matches, or RLE fill runs
+    size_t      matchBytes;   // Bytes produced by the matches
+    size_t      bits;         // Bits read one by one, for the bit stream codecs
+    size_t      maxLead;      // Max excess of the decoded bytes over the read ones, for the in-place unpacking
+
+    CodecStats() : literals(0), literalRuns(0), matches(0), matchBytes(0), bits(0), maxLead(0) { }
+};
+
+// Codec context: all the state of encoding/decoding is in the object,
+// so different objects can work in parallel threads
+class CCodec
+{
+public:
+    virtual ~CCodec() { }
+    // Returns the encoded size; the size is greater than out.size when the output doesn't fit, 0 on failure
+    virtual size_t Encode(CodecSpan in, CodecSpan out) = 0;
+    // Returns the decoded size
+    virtual size_t Decode(CodecSpan in, CodecSpan out) = 0;
+    // Adds the token statistics of the encoded stream; false on bad input
+    virtual bool Analyze(CodecSpan in, CodecStats* pStats) = 0;
+    // Dictionary of the next calls: the data that goes right before the input/output, the matches may refer to it;
+    // LZ4 and LZSA use it, the other codecs ignore it
+    void SetDictionary(CodecSpan dictionary) { m_dictionary = dictionary; }
+    CodecSpan GetDictionary() const { return m_dictionary; }
+
+protected:
+    CodecSpan       m_dictionary;
+};
+
+// Cartridge.cpp
+class CRleCodec : public CCodec
+{
+public:
+    virtual size_t Encode(CodecSpan in, CodecSpan out);
+    virtual size_t Decode(CodecSpan in, CodecSpan out);
+    virtual bool Analyze(CodecSpan in, CodecStats* pStats);
+};
+
 // LZSS.cpp
+class CLzssCodec : public CCodec
+{
+public:
+    // maxchain: limit match candidates checked per position; 0 = no limit, output is the same as of the full search
+    // optimal: optimal parse instead of greedy, smaller output for the same loaderLZSS
+    CLzssCodec(int maxchain = 0, bool optimal = false);
+    virtual size_t Encode(CodecSpan in, CodecSpan out);
+    virtual size_t Decode(CodecSpan in, CodecSpan out);
+    virtual bool Analyze(CodecSpan in, CodecStats* pStats);
+
+private:
+    int             m_maxchain;
+    bool            m_optimal;
+    CodecSpan       m_out;
+    int             m_bitbuffer, m_bitmask;
+    unsigned long   m_codecount;
+    size_t          m_outputpos, m_flagpos;
+    // The buffers are kept from one call to another, grown when the input is bigger
+    std::vector<unsigned char> m_text;  // Window: spaces, then the whole input
+    std::vector<int> m_head;     // Last position for the hash, -1 = none
+    std::vector<int> m_prev;     // Previous position with the same hash
+    std::vector<int> m_lengths;  // Optimal parse: longest match length per position
+    std::vector<int> m_positions;  // Optimal parse: match position, then the chosen step
+    std::vector<unsigned long> m_cost;  // Optimal parse: cost in bits from the position to the end
+    int             m_textend;
+    int             m_inserted;  // Positions below are in the hash chains
+
+    void putflagbit(int f);
+    void flush_bit_buffer(void);
+    void putbyte(int c);
+    void output1(int c);
+    void output2(int x, int y);
+    int  find_match(int r, int *px);
+    void encode_greedy(void);
+    void encode_optimal(void);
+};
+
+// LZ4.cpp
+class smallz4;
+// One raw LZ4 block without the frame, then the zero offset as the end mark
+class CLz4Codec : public CCodec
+{
+public:
+    // maxchain: effort, match candidates checked per position; 1..3 greedy, 4..6 lazy, more = optimal parse; 0 = no limit
+    CLz4Codec(int maxchain = 0);
+    virtual ~CLz4Codec();
+    virtual size_t Encode(CodecSpan in, CodecSpan out);
+    virtual size_t Decode(CodecSpan in, CodecSpan out);
+    virtual bool Analyze(CodecSpan in, CodecStats* pStats);
+
+private:
+    smallz4*        m_pPacker;   // Match finder tables, reused from one call to another
+    std::vector<uint8_t> m_window;  // Dictionary and data together, for the calls with the dictionary
+
+    CLz4Codec(const CLz4Codec&);
+    CLz4Codec& operator=(const CLz4Codec&);
+};
+
+// LZSA.cpp
+struct _lzsa_compressor;
+class CLzsaCodec : public CCodec
+{
+public:
+    // version: 1 = LZSA1, 2 = LZSA2; minmatch: minimum match size, 3..5 for LZSA1, 2..3 for LZSA2;
+    // favorRatio: the best ratio, or a bit larger output with fewer tokens, faster to unpack
+    CLzsaCodec(int version, int minmatch = 3, bool favorRatio = true);
+    virtual ~CLzsaCodec();
+    // Parameters of the next Encode calls, the compression context is kept
+    void SetParameters(int minmatch, bool favorRatio);
+    virtual size_t Encode(CodecSpan in, CodecSpan out);
+    virtual size_t Decode(CodecSpan in, CodecSpan out);
+    virtual bool Analyze(CodecSpan in, CodecStats* pStats);
+
+private:
+    int             m_version;
+    int             m_minmatch;
+    bool            m_favorRatio;
+    _lzsa_compressor* m_pCompressor;  // Created on the first use, reused from one call to another
+    std::vector<uint8_t> m_window;  // Dictionary and data together, for the calls with the dictionary
+
+    CLzsaCodec(const CLzsaCodec&);
+    CLzsaCodec& operator=(const CLzsaCodec&);
+};
 
-size_t lzss_encode(unsigned char *inbuffer, size_t insize, unsigned char *outbuffer, size_t outsize);
+// ZX0.cpp
+// ZX0-style LZ: interlaced Elias gamma codes, repeat offset, optimal parse
+class CZx0Codec : public CCodec
+{
+public:
+    CZx0Codec();
+    virtual size_t Encode(CodecSpan in, CodecSpan out);
+    virtual size_t Decode(CodecSpan in, CodecSpan out);
+    virtual bool Analyze(CodecSpan in, CodecStats* pStats);
 
-size_t lzss_decode(unsigned char *inbuffer, size_t insize, unsigned char *outbuffer, size_t outsize);
+private:
+    std::vector<uint8_t> m_output;
+    size_t          m_bitpos;    // Byte for the next bits
+    int             m_bitmask;   // Next bit in the byte, 0 = need a new byte
+
+    void putbit(int bit);
+    void putbyte(uint8_t value);
+    void putgamma(unsigned value);
+};
 
 
 //////////////////////////////////////////////////////////////////////
-// LZ4.cpp
+// Cartridge.cpp
+
+enum
+{
+    OPTION_COMPRESSION_NONE  = 0x0100,
+    OPTION_COMPRESSION_RLE   = 0x0200,
+    OPTION_COMPRESSION_LZSS  = 0x0400,
+    OPTION_COMPRESSION_LZ4   = 0x0800,
+    OPTION_COMPRESSION_LZSA1 = 0x1000,
+    OPTION_COMPRESSION_LZSA2 = 0x2000,
+    OPTION_COMPRESSION_ZX0   = 0x4000,
+    OPTION_COMPRESSION_MASK  = 0xff00
+};
+
+extern int lzssMaxChain;
+extern int lz4MaxChain;
+extern bool lzssOptimal;
+extern bool lzsaBackward;
+extern int lzsaMinMatch;
+extern bool lzsaFavorRatio;
+extern bool lzsaExhaustive;
+extern bool pdpFilter;
+extern bool multicart;
+extern std::vector<uint8_t> dictionary;  // Priming data for LZ4 and LZSA1, placed in the loader block right below 01000
+
+// Buffers and codec contexts of one worker thread, the arena of the conversions: the input file,
+// the image copies for the codecs, the cartridge images and the decode check buffer are allocated on the first use
+// and reused from one codec attempt and one file to another
+class CCartWorkspace
+{
+public:
+    CCartWorkspace();
+    ~CCartWorkspace();
+    // 64K buffer for the decode check, not cleared between the uses; nullptr if failed to allocate
+    uint8_t* GetTempBuffer();
+    // Codec context for OPTION_COMPRESSION_XXX, created on the first use; nullptr for no compression
+    CCodec* GetCodec(int option);
+    // 64K cartridge image buffer: 0 and 1 for the attempts one by one, 2 and more for the concurrent candidates;
+    // only the cartridge part (24K) is filled by the PrepareCartXxx functions; nullptr if failed to allocate
+    uint8_t* GetCartImage(int index);
+    // The SAV file buffer, for LoadSavImage; grown to the size given, the contents are not kept
+    uint8_t* GetInputBuffer(size_t size);
+    // Copy of the SAV image for the codecs: 0 = filtered, 1 = reversed; grown to the size given
+    uint8_t* GetImageCopy(int index, size_t size);
+    // Set by the PrepareCartXxx functions when the unpacked program doesn't fit the memory with the stream,
+    // cleared by PrepareCart; such a result is "doesn't fit", not a failed check
+    void SetNoRoom(bool noRoom) { m_noRoom = noRoom; }
+    bool IsNoRoom() const { return m_noRoom; }
+    // LZSA packer for the -lzsaall trial thread index, version 1 or 2; created on the first use and kept
+    // with its compression context
+    CLzsaCodec* GetLzsaPacker(int version, size_t index);
+    // Set for the workspaces of the batch pool threads: the -lzsaall trials run one by one there, not on a nested pool
+    void SetPoolWorker(bool poolWorker) { m_poolWorker = poolWorker; }
+    bool IsPoolWorker() const { return m_poolWorker; }
+
+private:
+    uint8_t*    m_pTempBuffer;
+    uint8_t*    m_pInput;
+    size_t      m_inputCapacity;
+    uint8_t*    m_pImageCopies[2];
+    size_t      m_imageCopyCapacities[2];
+    std::vector<uint8_t*> m_cartImages;
+    CCodec*     m_codecs[8];    // By the bit number in OPTION_COMPRESSION_MASK
+    std::vector<CLzsaCodec*> m_lzsaPackers[2];  // By the LZSA version, then by the trial thread
+    bool        m_noRoom;
+    bool        m_poolWorker;
+
+    CCartWorkspace(const CCartWorkspace&);
+    CCartWorkspace& operator=(const CCartWorkspace&);
+};
+
+// Encode the SAV image and put it with the loader into the 64K cartridge image buffer;
+// returns the cartridge size to write, 0 if failed or doesn't fit
+typedef size_t (*PrepareCartFunc)(const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles);
+
+struct CodecInfo
+{
+    int             option;     // OPTION_COMPRESSION_XXX
+    const char*     name;
+    PrepareCartFunc prepare;
+};
+
+// All the codecs, in order of the one-by-one attempts
+extern const CodecInfo g_codecs[];
+extern const int g_codecCount;
+
+// Call codec.prepare; with pdpFilter, the image is filtered before the encoding,
+// and the loader goes to the filter undo stub instead of the program start
+size_t PrepareCart(const CodecInfo& codec, const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage, size_t* pEncodedSize, uint64_t* pCycles);
+
+// PDP-11 code filter: operands of JSR PC,addr relative => absolute (encode) or back;
+// returns the number of the operands changed
+size_t FilterPdpCode(uint8_t* data, size_t size, uint16_t address, bool encode);
 
-size_t lz4_encode(unsigned char *inbuffer, size_t insize, unsigned char *outbuffer, size_t outsize);
+// Image split over two cartridges
+struct MultiCartInfo
+{
+    size_t      split;          // Size of the first fragment
+    size_t      encodedSize1;   // Packed fragment on the first cartridge
+    size_t      encodedSize2;   // Packed fragment on the second cartridge
+    uint64_t    cycles;         // Loader time estimate
+};
 
-size_t lz4_decode(unsigned char *src, size_t insize, unsigned char *dst, size_t outsize);
+// Split the SAV image over two 64K cartridge image buffers, loaderMultiLZSA1 on the first one;
+// false if it doesn't fit two cartridges
+bool PrepareMultiCart(const SavImage& sav, CCartWorkspace& ws, uint8_t* pCartImage1, uint8_t* pCartImage2, MultiCartInfo* pInfo);
+
+// New codec context for OPTION_COMPRESSION_XXX, nullptr for no compression
+CCodec* CreateCodec(int option);
+
+// Checksum of the words the same way as the loaders count it, ADD and ADC
+uint16_t CalcCheckum(const uint16_t* pData, int nWords);
+
+// Reads the SAV file and checks its header; prints the SAV info
+// The file goes to the input buffer of the workspace, valid until the next LoadSavImage with it
+bool LoadSavImage(const char* filename, SavImage* pSav, CCartWorkspace& ws);
 
 
 //////////////////////////////////////////////////////////////////////
-// LZSA.cpp
+// Inspect.cpp
+
+// Cartridge image recognized by the loader code
+struct CartInspectInfo
+{
+    const char* loaderName;     // nullptr = unknown loader
+    int         codecOption;    // OPTION_COMPRESSION_XXX
+    bool        split;          // Split image, the first cartridge with loaderMultiLZSA1
+    bool        filtered;       // The loader goes to the PDP-11 filter undo stub
+    bool        checksumOk;
+    uint16_t    wStartAddr;
+    uint16_t    wStackAddr;
+    size_t      loaderSize;     // Loader code at the start of the cartridge
+    size_t      imageSize;      // Unpacked image, from address 001000
+    size_t      usedSize[2];    // Cartridge bytes used, the second one for the split image
+};
+
+// Recognize the loader of the 24K cartridge image, check the checksum and unpack the program with the host decoder;
+// pCartImage2: the second cartridge of a split image, or nullptr. The SAV file is made in the workspace:
+// block 0 from the cartridge with the loader area cleared, the start, stack and top addresses set.
+// Prints the info, returns false if the loader is unknown, the checksum is wrong or the unpacking failed
+bool InspectCartImage(const uint8_t* pCartImage, const uint8_t* pCartImage2, CCartWorkspace& ws, CartInspectInfo* pInfo, SavImage* pSav);
 
-size_t lzsa1_encode(unsigned char *inbuffer, size_t insize, unsigned char *outbuffer, size_t outsize);
 
-size_t lzsa1_decode(unsigned char *src, size_t insize, unsigned char *dst, size_t outsize);
+//////////////////////////////////////////////////////////////////////
+// Cache.cpp
+
+// Increment on any change of the codecs output, to drop the old cache entries
+#define SAV2CART_CACHE_VERSION  2
+
+// Create the cache directory if needed; maxSize: 0 = no size limit
+bool CacheSetDirectory(const char* dirname, uint64_t maxSize);
+bool CacheIsEnabled();
+// Key by the SAV file, the codec options and the loaders, 32 hex digits
+void CacheMakeKey(const SavImage& sav, int codecOptions, char key[33]);
+// Reads the stored 24K cartridge image, and the second one for a split image (*pEncodedSize2 > 0);
+// false if not found or the stored images don't match their hash
+bool CacheLookup(const char* key, const SavImage& sav, uint8_t* pCartImage, uint8_t* pCartImage2,
+                 int* pCodecOption, size_t* pEncodedSize, size_t* pEncodedSize2);
+// pCartImage2: the second cartridge of a split image, nullptr for one cartridge
+void CacheStore(const char* key, const SavImage& sav, const uint8_t* pCartImage, const uint8_t* pCartImage2,
+                int codecOption, size_t encodedSize, size_t encodedSize2);
+// Delete the least recently used entries over the size limit
+void CacheTrim();
+
+
+//////////////////////////////////////////////////////////////////////
+// Emulator.cpp
 
-size_t lzsa2_encode(unsigned char *inbuffer, size_t insize, unsigned char *outbuffer, size_t outsize);
+// Loader run on the emulated KM1801VM2, cartridge read time not counted
+struct LoaderRunInfo
+{
+    uint32_t    instructions;
+    uint64_t    cycles;      // Approximate, in CPU clock ticks
+};
 
-size_t lzsa2_decode(unsigned char *src, size_t insize, unsigned char *dst, size_t outsize);
+// Run the loader of the cartridge image until it starts the program, then check the memory against the SAV image;
+// pCartImage2: the second cartridge, in slot 2, for the split image; prints the result, returns false on any difference
+bool EmulateLoader(const char* name, const SavImage& sav, const uint8_t* pCartImage, LoaderRunInfo* pInfo,
+                   const uint8_t* pCartImage2 = nullptr);
 
 
 //////////////////////////////////////////////////////////////////////
@@ -0,0 +1,397 @@
+﻿/*  This file is part of UKNCBTL.
+UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// ZX0.cpp
+
+/* ZX0-style encoder-decoder, after ZX0 by Einar Saukas, with the format simplified for loaderZX0:
+   - the first block is literals; after literals, bit 0 = match with the last offset, 1 = match with a new offset;
+     after a match, bit 0 = literals, 1 = match with a new offset;
+   - literals: gamma(count), the bytes; match with the last offset: gamma(length);
+   - match with a new offset: gamma(((offset - 1) >> 8) + 1), byte (offset - 1) & 0xff, gamma(length - 1);
+     gamma 256 instead of the offset is the end mark;
+   - gamma: value 1, then pairs of bits (0, next bit of the value) until bit 1;
+     the bits are taken MSB first from the bytes placed in the stream where the decoder needs them.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "Sav2Cart.h"
+
+
+const int ZX0_ARRIVALS = 8;         // Parse states kept per position, with different last offsets
+const int ZX0_MAXCHAIN = 256;       // Match candidates checked per position
+const unsigned ZX0_FULLSCAN = 64;   // Longer matches are tried with the full length only
+const unsigned ZX0_MAXOFFSET = 0xff00;
+const unsigned ZX0_ENDMARK = 256;
+
+// Parse state at a position
+struct Zx0Arrival
+{
+    uint32_t    cost;     // Bits from the stream start
+    uint32_t    rep;      // Last offset
+    uint32_t    run;      // Literal run length, 0 = after a match
+    int32_t     from;     // Previous arrival: position * ZX0_ARRIVALS + slot; -1 = stream start
+    uint32_t    length;   // Step from the previous arrival: literal, or match with the offset
+    uint32_t    offset;
+    bool        newoffset;
+};
+
+static unsigned GammaBits(unsigned value)
+{
+    unsigned bits = 1;
+    for (; value > 1; value >>= 1)
+        bits += 2;
+    return bits;
+}
+
+// Keep the arrivals sorted by cost, one per last offset and state
+static void AddArrival(Zx0Arrival* slots, uint8_t& count, const Zx0Arrival& arrival)
+{
+    bool literal = arrival.run > 0;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if (slots[i].rep == arrival.rep && (slots[i].run > 0) == literal)
+        {
+            if (slots[i].cost <= arrival.cost)
+                return;
+            break;
+        }
+    }
+    if (i == count)  // New state
+    {
+        if (count < ZX0_ARRIVALS)
+            count++;
+        else if (slots[count - 1].cost <= arrival.cost)
+            return;
+        i = count - 1;
+    }
+    while (i > 0 && slots[i - 1].cost > arrival.cost)
+    {
+        slots[i] = slots[i - 1];
+        i--;
+    }
+    slots[i] = arrival;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+CZx0Codec::CZx0Codec()
+{
+    m_bitpos = 0;
+    m_bitmask = 0;
+}
+
+void CZx0Codec::putbit(int bit)
+{
+    if (m_bitmask == 0)
+    {
+        m_bitpos = m_output.size();
+        m_output.push_back(0);
+        m_bitmask = 0x80;
+    }
+    if (bit)
+        m_output[m_bitpos] |= (uint8_t)m_bitmask;
+    m_bitmask >>= 1;
+}
+
+void CZx0Codec::putbyte(uint8_t value)
+{
+    m_output.push_back(value);
+}
+
+void CZx0Codec::putgamma(unsigned value)
+{
+    int bit = 0;
+    while ((value >> bit) > 1)
+        bit++;
+    while (bit-- > 0)
+    {
+        putbit(0);
+        putbit((value >> bit) & 1);
+    }
+    putbit(1);
+}
+
+size_t CZx0Codec::Encode(CodecSpan in, CodecSpan out)
+{
+    const uint8_t* data = in.data;
+    size_t n = in.size;
+    if (n == 0)
+        return 0;
+
+    std::vector<Zx0Arrival> arrivals((n + 1) * ZX0_ARRIVALS);
+    std::vector<uint8_t> counts(n + 1, 0);
+    std::vector<int> head(65536, -1);
+    std::vector<int> prev(n, -1);
+    uint32_t ladderOffset[ZX0_MAXCHAIN], ladderLength[ZX0_MAXCHAIN];
+
+    Zx0Arrival start = { 0, 1, 0, -1, 0, 0, false };
+    arrivals[0] = start;
+    counts[0] = 1;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        Zx0Arrival* slots = &arrivals[i * ZX0_ARRIVALS];
+
+        // Match candidates: the nearest offset for every longer length
+        int ladderCount = 0;
+        if (i + 2 <= n)
+        {
+            int hash = data[i] | (data[i + 1] << 8);
+            uint32_t best = 1;
+            int chain = 0;
+            for (int p = head[hash]; p >= 0 && chain < ZX0_MAXCHAIN; p = prev[p], chain++)
+            {
+                uint32_t offset = (uint32_t)(i - p);
+                if (offset > ZX0_MAXOFFSET)
+                    break;
+                uint32_t maxlength = (uint32_t)(n - i);
+                uint32_t length = 0;
+                while (length < maxlength && data[p + length] == data[i + length])
+                    length++;
+                if (length <= best)
+                    continue;
+                ladderOffset[ladderCount] = offset;
+                ladderLength[ladderCount] = length;
+                ladderCount++;
+                best = length;
+                if (length == maxlength)
+                    break;
+            }
+            prev[i] = head[hash];
+            head[hash] = (int)i;
+        }
+
+        for (int s = 0; s < counts[i]; s++)
+        {
+            const Zx0Arrival& from = slots[s];
+            int32_t fromindex = (int32_t)(i * ZX0_ARRIVALS + s);
+
+            // Next literal
+            Zx0Arrival literal = { 0, from.rep, 0, fromindex, 1, 0, false };
+            if (from.run > 0)
+            {
+                literal.run = from.run + 1;
+                literal.cost = from.cost + 8 + GammaBits(literal.run) - GammaBits(from.run);
+            }
+            else
+            {
+                literal.run = 1;
+                literal.cost = from.cost + (from.from < 0 ? 0 : 1) + 8 + GammaBits(1);
+            }
+            AddArrival(&arrivals[(i + 1) * ZX0_ARRIVALS], counts[i + 1], literal);
+
+            // Match with the last offset, only after literals
+            if (from.run > 0 && from.rep <= i)
+            {
+                uint32_t maxlength = (uint32_t)(n - i);
+                uint32_t replength = 0;
+                while (replength < maxlength && data[i + replength] == data[i + replength - from.rep])
+                    replength++;
+                for (uint32_t length = 1; length <= replength; length++)
+                {
+                    if (length > ZX0_FULLSCAN && length < replength)
+                        length = replength;
+                    Zx0Arrival match = { from.cost + 1 + GammaBits(length), from.rep, 0, fromindex, length, from.rep, false };
+                    AddArrival(&arrivals[(i + length) * ZX0_ARRIVALS], counts[i + length], match);
+                }
+            }
+        }
+
+        // Match with a new offset: the result does not depend on the state, so from the cheapest one only
+        if (ladderCount > 0)
+        {
+            const Zx0Arrival& from = slots[0];
+            int32_t fromindex = (int32_t)(i * ZX0_ARRIVALS);
+            uint32_t length = 2;
+            for (int k = 0; k < ladderCount; k++)
+            {
+                uint32_t offset = ladderOffset[k];
+                uint32_t offsetcost = from.cost + 1 + GammaBits(((offset - 1) >> 8) + 1) + 8;
+                for (; length <= ladderLength[k]; length++)
+                {
+                    if (length > ZX0_FULLSCAN && length < ladderLength[k])
+                        length = ladderLength[k];
+                    Zx0Arrival match = { offsetcost + GammaBits(length - 1), offset, 0, fromindex, length, offset, true };
+                    AddArrival(&arrivals[(i + length) * ZX0_ARRIVALS], counts[i + length], match);
+                }
+            }
+        }
+    }
+
+    // Steps back from the cheapest final state
+    std::vector<int32_t> path;
+    for (int32_t index = (int32_t)(n * ZX0_ARRIVALS); arrivals[index].from >= 0; index = arrivals[index].from)
+        path.push_back(index);
+
+    m_output.clear();
+    m_bitmask = 0;
+    bool first = true;
+    size_t pos = 0;
+    for (size_t k = path.size(); k > 0; )
+    {
+        const Zx0Arrival& step = arrivals[path[k - 1]];
+        if (step.offset == 0)  // Literals till the end of the run
+        {
+            size_t count = 0;
+            while (k > count && arrivals[path[k - 1 - count]].offset == 0)
+                count++;
+            if (!first)
+                putbit(0);
+            putgamma((unsigned)count);
+            for (size_t j = 0; j < count; j++)
+                putbyte(data[pos++]);
+            k -= count;
+        }
+        else
+        {
+            if (!step.newoffset)
+            {
+                putbit(0);
+                putgamma(step.length);
+            }
+            else
+            {
+                putbit(1);
+                putgamma(((step.offset - 1) >> 8) + 1);
+                putbyte((uint8_t)((step.offset - 1) & 0xff));
+                putgamma(step.length - 1);
+            }
+            pos += step.length;
+            k--;
+        }
+        first = false;
+    }
+    putbit(1);
+    putgamma(ZX0_ENDMARK);
+
+    size_t encodedSize = m_output.size();
+    printf("ZX0 input size %lu. bytes, output size %lu. bytes (%1.2f %%)\n",
+           (unsigned long)n, (unsigned long)encodedSize, encodedSize * 100.0 / n);
+    if (encodedSize <= out.size)
+        memcpy(out.data, m_output.data(), encodedSize);
+    return encodedSize;
+}
+
+// Decode, or only walk the stream when out.data is null; returns the decoded size
+static size_t Zx0Walk(CodecSpan in, CodecSpan out, CodecStats* pStats, bool* pOk)
+{
+    size_t inpos = 0, outpos = 0;
+    int bitmask = 0;
+    uint8_t bits = 0;
+    bool ok = true;
+    auto getbit = [&]() -> int
+    {
+        if (bitmask == 0)
+        {
+            if (inpos >= in.size) { ok = false;  return 1; }
+            bits = in.data[inpos++];
+            bitmask = 0x80;
+        }
+        int bit = (bits & bitmask) ? 1 : 0;
+        bitmask >>= 1;
+        if (pStats != nullptr)
+            pStats->bits++;
+        return bit;
+    };
+    auto getgamma = [&]() -> size_t
+    {
+        size_t value = 1;
+        while (ok && !getbit())
+        {
+            value = (value << 1) | getbit();
+            if (value > 0xffff) ok = false;
+        }
+        return value;
+    };
+
+    size_t rep = 1;
+    bool newoffset = false;
+    *pOk = false;
+    for (;;)
+    {
+        size_t length, offset;
+        if (!newoffset)  // Literals, then maybe a match with the last offset
+        {
+            length = getgamma();
+            if (!ok || length > in.size - inpos || (out.data != nullptr && length > out.size - outpos))
+                return outpos;
+            if (out.data != nullptr)
+                memcpy(out.data + outpos, in.data + inpos, length);
+            inpos += length;  outpos += length;
+            if (pStats != nullptr)
+            {
+                pStats->literals += length;
+                pStats->literalRuns++;
+                if (outpos > inpos && outpos - inpos > pStats->maxLead)
+                    pStats->maxLead = outpos - inpos;
+            }
+            if (getbit())
+            {
+                newoffset = true;
+                continue;
+            }
+            offset = rep;
+            length = getgamma();
+        }
+        else
+        {
+            size_t msb = getgamma();
+            if (!ok)
+                return outpos;
+            if (msb == ZX0_ENDMARK)
+                break;
+            if (inpos >= in.size)
+                return outpos;
+            offset = (((msb - 1) << 8) | in.data[inpos++]) + 1;
+            length = getgamma() + 1;
+            rep = offset;
+        }
+        if (!ok || offset > outpos || (out.data != nullptr && length > out.size - outpos))
+            return outpos;
+        if (out.data != nullptr)
+        {
+            for (size_t j = 0; j < length; j++)
+                out.data[outpos + j] = out.data[outpos + j - offset];
+        }
+        outpos += length;
+        if (pStats != nullptr)
+        {
+            pStats->matches++;
+            pStats->matchBytes += length;
+            if (outpos > inpos && outpos - inpos > pStats->maxLead)
+                pStats->maxLead = outpos - inpos;
+        }
+        newoffset = getbit() != 0;
+        if (!ok)
+            return outpos;
+    }
+
+    *pOk = true;
+    return outpos;
+}
+
+size_t CZx0Codec::Decode(CodecSpan in, CodecSpan out)
+{
+    bool ok;
+    return Zx0Walk(in, out, nullptr, &ok);
+}
+
+bool CZx0Codec::Analyze(CodecSpan in, CodecStats* pStats)
+{
+    bool ok;
+    Zx0Walk(in, CodecSpan(nullptr, 0), pStats, &ok);
+    return ok;
+}
+
+
+//////////////////////////////////////////////////////////////////////
@@ -0,0 +1,339 @@
+﻿/*  This file is part of UKNCBTL.
+UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// bench.cpp : Benchmark of all the codecs on a set of SAV files, CSV output, Linux/Mac only
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "Sav2Cart.h"
+
+
+//////////////////////////////////////////////////////////////////////
+
+// One row of the CSV
+struct BenchResult
+{
+    size_t          encodedSize;
+    bool            fits;
+    bool            roundtrip;    // Host decoder gives the same image
+    bool            emulated;     // The loader on the emulator gives the same image; false if not run
+    double          encodeTime;   // Best of the repeats, seconds
+    double          decodeTime;
+    uint64_t        estimate;     // Loader cost model, 0 if doesn't fit
+    LoaderRunInfo   run;          // Loader emulation, 0 if doesn't fit or failed
+};
+
+int     g_nRepeat = 1;
+int     g_nCodecs = 0;         // OPTION_COMPRESSION_XXX, 0 = all
+bool    g_okEmulate = true;
+std::vector<std::string> g_Paths;
+
+static int g_nStdoutSaved = -1;
+
+
+//////////////////////////////////////////////////////////////////////
+
+// The codecs print their progress; the CSV goes to stdout between the codec runs
+static void MuteStdout()
+{
+    fflush(stdout);
+    g_nStdoutSaved = dup(1);
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, 1);
+    close(fd);
+}
+
+static void UnmuteStdout()
+{
+    fflush(stdout);
+    dup2(g_nStdoutSaved, 1);
+    close(g_nStdoutSaved);
+}
+
+static double BenchGetTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool IsSavFileName(const char * name)
+{
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(name + len - 4, ".sav") == 0;
+}
+
+// Collect the SAV files of the directory, sorted by name
+static void ListSavFiles(const char * sDirectory, std::vector<std::string>& files)
+{
+    DIR* dir = opendir(sDirectory);
+    if (dir == nullptr)
+    {
+        fprintf(stderr, "Failed to open directory %s\n", sDirectory);
+        return;
+    }
+    std::vector<std::string> names;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        if (IsSavFileName(entry->d_name))
+            names.push_back(entry->d_name);
+    }
+    closedir(dir);
+
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++)
+        files.push_back(std::string(sDirectory) + "/" + names[i]);
+}
+
+// Encode and decode with the codec context, then prepare the cartridge and run its loader
+static void BenchCodec(const SavImage& sav, const CodecInfo& codec, CCartWorkspace& ws, uint8_t* pEncoded, uint8_t* pDecoded, BenchResult* pResult)
+{
+    memset(pResult, 0, sizeof(BenchResult));
+
+    CCodec* pCodec = ws.GetCodec(codec.option);
+    if (pCodec != nullptr)
+    {
+        CodecSpan image(sav.pFileImage + 512, sav.imageSize);
+        if (pdpFilter)
+        {
+            image.data = ws.GetImageCopy(0, sav.imageSize);  // Used by PrepareCart only after the host roundtrip
+            if (image.data == nullptr)
+                return;
+            ::memcpy(image.data, sav.pFileImage + 512, sav.imageSize);
+            FilterPdpCode(image.data, image.size, 01000, true);
+        }
+        for (int repeat = 0; repeat < g_nRepeat; repeat++)
+        {
+            double starttime = BenchGetTime();
+            pResult->encodedSize = pCodec->Encode(image, CodecSpan(pEncoded, 65536));
+            double encodeTime = BenchGetTime() - starttime;
+            if (repeat == 0 || encodeTime < pResult->encodeTime)
+                pResult->encodeTime = encodeTime;
+        }
+        if (pResult->encodedSize > 0 && pResult->encodedSize <= 65536)
+        {
+            size_t decodedSize = 0;
+            for (int repeat = 0; repeat < g_nRepeat; repeat++)
+            {
+                memset(pDecoded, 0, 65536);
+                double starttime = BenchGetTime();
+                decodedSize = pCodec->Decode(CodecSpan(pEncoded, pResult->encodedSize), CodecSpan(pDecoded, 65536));
+                double decodeTime = BenchGetTime() - starttime;
+                if (repeat == 0 || decodeTime < pResult->decodeTime)
+                    pResult->decodeTime = decodeTime;
+            }
+            pResult->roundtrip = decodedSize == sav.imageSize && memcmp(pDecoded, image.data, sav.imageSize) == 0;
+        }
+    }
+
+    // The estimate and the loader run are for the real cartridge image only
+    size_t encodedSize = 0;
+    uint8_t* pCartImage = ws.GetCartImage(0);
+    if (pCartImage != nullptr && PrepareCart(codec, sav, ws, pCartImage, &encodedSize, &pResult->estimate) > 0)
+    {
+        pResult->fits = true;
+        pResult->emulated = g_okEmulate && EmulateLoader(codec.name, sav, pCartImage, &pResult->run);
+        if (!pResult->emulated)
+            memset(&pResult->run, 0, sizeof(pResult->run));
+    }
+    else
+        pResult->estimate = 0;
+    if (pResult->fits)
+        pResult->encodedSize = encodedSize;  // Of the stream on the cartridge, e.g. picked by -lzsaall
+    if (codec.option == OPTION_COMPRESSION_NONE)
+    {
+        pResult->encodedSize = encodedSize;
+        pResult->roundtrip = true;
+    }
+}
+
+static void PrintUsage()
+{
+    printf("\nUsage: sav2cart-bench [options] <directory or file.SAV>...\n"
+           "  Options:\n"
+           "    -repeatN     Repeat every encoding and decoding N times, take the best time; 1 by default\n"
+           "    -noemu       Do not run the loaders on the emulator\n"
+           "    -none -rle -lzss -lz4 -lzsa1 -lzsa2 -zx0  Codecs to run; all by default\n"
+           "    -lzssopt -lzsschainN  LZSS encoder options, same as for Sav2Cart\n"
+           "    -lz4chainN   LZ4 encoder effort, same as for Sav2Cart\n"
+           "    -lzsaback    LZSA backward in-place variant, same as for Sav2Cart\n"
+           "    -lzsaminN -lzsaspeed -lzsaall  LZSA encoder options, same as for Sav2Cart\n"
+           "    -pdpfilter   PDP-11 code filter before the encoding, same as for Sav2Cart\n"
+           "  CSV goes to stdout: file,codec,input_bytes,encoded_bytes,ratio,fits,roundtrip,\n"
+           "    encode_ms,decode_ms,estimated_cycles,emulated_cycles,emulated_instructions\n");
+}
+
+static bool ParseCommandLine(int argc, char * argv[])
+{
+    for (int argn = 1; argn < argc; argn++)
+    {
+        const char * arg = argv[argn];
+        int value = 0;
+        if (arg[0] != '-')
+        {
+            g_Paths.push_back(arg);
+            continue;
+        }
+
+        int codec = 0;
+        for (; codec < g_codecCount; codec++)
+        {
+            if (strcasecmp(arg + 1, g_codecs[codec].name) == 0)
+                break;
+        }
+        if (codec < g_codecCount)
+            g_nCodecs |= g_codecs[codec].option;
+        else if (1 == sscanf(arg, "-repeat%d", &value) && value > 0)
+            g_nRepeat = value;
+        else if (strcmp(arg, "-noemu") == 0)
+            g_okEmulate = false;
+        else if (strcmp(arg, "-lzssopt") == 0)
+            lzssOptimal = true;
+        else if (strcmp(arg, "-lzsaback") == 0)
+            lzsaBackward = true;
+        else if (strcmp(arg, "-lzsaspeed") == 0)
+            lzsaFavorRatio = false;
+        else if (strcmp(arg, "-lzsaall") == 0)
+            lzsaExhaustive = true;
+        else if (1 == sscanf(arg, "-lzsamin%d", &value) && value >= 2 && value <= 5)
+            lzsaMinMatch = value;
+        else if (strcmp(arg, "-pdpfilter") == 0)
+            pdpFilter = true;
+        else if (1 == sscanf(arg, "-lzsschain%d", &value) && value >= 0)
+            lzssMaxChain = value;
+        else if (1 == sscanf(arg, "-lz4chain%d", &value) && value >= 0)
+            lz4MaxChain = value;
+        else
+        {
+            printf("Unknown option: %s\n", arg);
+            return false;
+        }
+    }
+
+    if (g_nCodecs == 0)
+        g_nCodecs = OPTION_COMPRESSION_MASK;
+
+    return !g_Paths.empty();
+}
+
+int main(int argc, char* argv[])
+{
+    if (!ParseCommandLine(argc, argv))
+    {
+        printf("Sav2Cart Benchmark  [%s %s]\n", __DATE__, __TIME__);
+        PrintUsage();
+        return 255;
+    }
+    fprintf(stderr, "Sav2Cart Benchmark  [%s %s]\n", __DATE__, __TIME__);
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < g_Paths.size(); i++)
+    {
+        struct stat st;
+        if (stat(g_Paths[i].c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+            ListSavFiles(g_Paths[i].c_str(), files);
+        else
+            files.push_back(g_Paths[i]);
+    }
+    if (files.empty())
+    {
+        fprintf(stderr, "No SAV files found.\n");
+        return 255;
+    }
+
+    uint8_t* pEncoded = (uint8_t*) ::malloc(65536);
+    uint8_t* pDecoded = (uint8_t*) ::malloc(65536);
+    if (pEncoded == nullptr || pDecoded == nullptr)
+    {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        return 255;
+    }
+
+    printf("file,codec,input_bytes,encoded_bytes,ratio,fits,roundtrip,encode_ms,decode_ms,estimated_cycles,emulated_cycles,emulated_instructions\n");
+
+    CCartWorkspace ws;  // Codec contexts are reused for all the files
+    std::vector<double> totalBytes(g_codecCount), totalEncodeTime(g_codecCount), totalDecodeTime(g_codecCount);
+    int result = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        const char * filename = files[i].c_str();
+        const char * shortname = strrchr(filename, '/');
+        shortname = (shortname != nullptr) ? shortname + 1 : filename;
+        fprintf(stderr, "%s\n", filename);
+
+        SavImage sav;
+        MuteStdout();
+        bool okLoaded = LoadSavImage(filename, &sav, ws);
+        UnmuteStdout();
+        if (!okLoaded || sav.wTopAddr < 01000 || 512 + sav.imageSize > sav.fileSize)
+        {
+            fprintf(stderr, "Failed to load SAV file %s\n", filename);
+            result = 255;
+            continue;
+        }
+
+        for (int codec = 0; codec < g_codecCount; codec++)
+        {
+            if ((g_nCodecs & g_codecs[codec].option) == 0)
+                continue;
+
+            BenchResult row;
+            MuteStdout();
+            BenchCodec(sav, g_codecs[codec], ws, pEncoded, pDecoded, &row);
+            UnmuteStdout();
+
+            printf("%s,%s,%lu,%lu,%.4f,%s,%s,%.3f,%.3f,%llu,%llu,%lu\n",
+                   shortname, g_codecs[codec].name,
+                   (unsigned long)sav.imageSize, (unsigned long)row.encodedSize,
+                   row.encodedSize / (double)sav.imageSize,
+                   row.fits ? "yes" : "no", row.roundtrip ? "yes" : "no",
+                   row.encodeTime * 1000.0, row.decodeTime * 1000.0,
+                   (unsigned long long)row.estimate, (unsigned long long)row.run.cycles,
+                   (unsigned long)row.run.instructions);
+            fflush(stdout);
+            if (!row.roundtrip || (row.fits && g_okEmulate && !row.emulated))
+            {
+                // A broken stream is an error of the run, e.g. a match the loader can't follow
+                fprintf(stderr, "%s %s: %s check failed\n", shortname, g_codecs[codec].name, row.roundtrip ? "loader emulation" : "host decode");
+                result = 1;
+            }
+
+            totalBytes[codec] += sav.imageSize;
+            totalEncodeTime[codec] += row.encodeTime;
+            totalDecodeTime[codec] += row.decodeTime;
+        }
+    }
+
+    ::free(pEncoded);
+    ::free(pDecoded);
+
+    // Host throughput summary, by the best times
+    for (int codec = 0; codec < g_codecCount; codec++)
+    {
+        if (totalEncodeTime[codec] <= 0.0 || totalDecodeTime[codec] <= 0.0)
+            continue;
+        fprintf(stderr, "%-6s encode %8.1f MB/s, decode %8.1f MB/s\n", g_codecs[codec].name,
+                totalBytes[codec] / totalEncodeTime[codec] / 1e6, totalBytes[codec] / totalDecodeTime[codec] / 1e6);
+    }
+
+    return result;
+}
+
+
+//////////////////////////////////////////////////////////////////////
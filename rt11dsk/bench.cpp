@@ -0,0 +1,457 @@
+﻿/*  This file is part of UKNCBTL.
+    UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// bench.cpp : Benchmark for disk image operations on synthetic images, Linux/Mac only
+
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include "rt11dsk.h"
+#include "diskimage.h"
+#include "hardimage.h"
+#include "rt11date.h"
+
+
+//////////////////////////////////////////////////////////////////////
+
+struct BenchImage
+{
+    const char* title;
+    const char* templatename;   // Generated image, never changed
+    const char* workname;       // Copy of the generated image used by the operations
+    bool        okHard;         // true - partition 0 of hard disk image, false - floppy image
+    int         blocks;         // Volume size in blocks
+    int         files;          // Number of files to generate
+    char        middlename[11]; // File used for extract-one and delete operations
+};
+
+enum BenchOperation
+{
+    BENCH_LIST = 0,
+    BENCH_EXTRACT_ONE,
+    BENCH_EXTRACT_ALL,
+    BENCH_ADD,
+    BENCH_DELETE,
+    BENCH_FLUSH,
+    BENCH_OPERATION_COUNT
+};
+
+static const char * g_BenchOperationNames[BENCH_OPERATION_COUNT] =
+{
+    "list", "extract-one", "extract-all", "add", "delete", "flush"
+};
+
+static const char * g_sAddFileName = "NEWFIL.DAT";
+static const int    g_nAddFileBlocks = 4;
+
+int     g_nFloppyFiles = 100;
+int     g_nPartitionFiles = 500;
+int     g_nFragmentation = 25;  // Percent of files followed by a free area
+int     g_nRepeat = 3;
+std::vector<int> g_CacheSizes;
+
+static uint32_t g_nRandomSeed = 1;
+static int g_nStdoutSaved = -1;
+
+
+//////////////////////////////////////////////////////////////////////
+
+// Reproducible pseudo-random numbers, same sequence on every platform
+static int BenchRandom()
+{
+    g_nRandomSeed = g_nRandomSeed * 1103515245 + 12345;
+    return (int)((g_nRandomSeed >> 16) & 0x7fff);
+}
+
+static void MuteStdout()
+{
+    fflush(stdout);
+    g_nStdoutSaved = dup(1);
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, 1);
+    close(fd);
+}
+
+static void UnmuteStdout()
+{
+    fflush(stdout);
+    dup2(g_nStdoutSaved, 1);
+    close(g_nStdoutSaved);
+}
+
+static bool CopyImageFile(const char * sSource, const char * sDest)
+{
+    FILE* fpSource = ::fopen(sSource, "rb");
+    if (fpSource == nullptr)
+        return false;
+    FILE* fpDest = ::fopen(sDest, "wb");
+    if (fpDest == nullptr)
+    {
+        ::fclose(fpSource);
+        return false;
+    }
+    static uint8_t buffer[65536];
+    size_t count;
+    while ((count = ::fread(buffer, 1, sizeof(buffer), fpSource)) > 0)
+        ::fwrite(buffer, 1, count, fpDest);
+    ::fclose(fpSource);
+    ::fclose(fpDest);
+    return true;
+}
+
+// Write the volume with files and free areas at the given offset of the file.
+// Every catalog segment keeps one spare entry, so the add operation can split a free area.
+static bool GenerateVolume(FILE* fpFile, long offset, BenchImage* pImage)
+{
+    const int nEntriesPerSegment = (512 - 5) / 7;
+    const int nEntriesUsable = nEntriesPerSegment - 2;  // Spare entry and end-of-segment mark
+
+    g_nRandomSeed = 1;
+
+    // Build the list of entries: files, some of them followed by a free area
+    std::vector<CVolumeCatalogEntry> entries;
+    int nHoles = pImage->files * g_nFragmentation / 100;
+    int nSegments = (pImage->files + nHoles + 1 + nEntriesUsable - 1) / nEntriesUsable;
+    if (nSegments > RT11_MAX_CATALOG_SEGMENTS)
+    {
+        printf("Too many files for %s: %d, catalog limit exceeded.\n", pImage->title, pImage->files);
+        return false;
+    }
+    int nDataStart = RT11_FIRST_CATALOG_BLOCK + nSegments * 2;
+    int nDataBlocks = pImage->blocks - nDataStart;
+    int nAverage = nDataBlocks * 3 / 4 / (pImage->files + nHoles);  // Keep a quarter free at the end
+    if (nAverage < 1)
+    {
+        printf("Too many files for %s: %d, volume size exceeded.\n", pImage->title, pImage->files);
+        return false;
+    }
+    uint16_t datepac = clock2rt11date((time_t)1000000000);
+    int nBlock = nDataStart;
+    for (int i = 0; i < pImage->files; i++)
+    {
+        CVolumeCatalogEntry entry;
+        entry.status = RT11_STATUS_PERM;
+        entry.datepac = datepac;
+        entry.start = (uint16_t)nBlock;
+        entry.length = (uint16_t)(1 + BenchRandom() % (nAverage * 2 - 1));
+        snprintf(entry.name, sizeof(entry.name), "F%05u", (unsigned)i % 100000u);
+        strcpy(entry.ext, "DAT");
+        nBlock += entry.length;
+        entries.push_back(entry);
+
+        if ((i + 1) * g_nFragmentation / 100 > i * g_nFragmentation / 100)  // Spread the free areas evenly
+        {
+            CVolumeCatalogEntry hole;
+            hole.status = RT11_STATUS_EMPTY;
+            hole.start = (uint16_t)nBlock;
+            hole.length = (uint16_t)(1 + BenchRandom() % (nAverage * 2 - 1));
+            nBlock += hole.length;
+            entries.push_back(hole);
+        }
+    }
+    CVolumeCatalogEntry rest;
+    rest.status = RT11_STATUS_EMPTY;
+    rest.start = (uint16_t)nBlock;
+    rest.length = (uint16_t)(pImage->blocks - nBlock);
+    entries.push_back(rest);
+    snprintf(pImage->middlename, sizeof(pImage->middlename), "F%05u.DAT", (unsigned)(pImage->files / 2) % 100000u);
+
+    // Home block and the catalog
+    uint16_t segment[512];
+    memset(segment, 0, sizeof(segment));
+    StatsFSeek(fpFile, offset, SEEK_SET);
+    for (int block = 0; block < RT11_FIRST_CATALOG_BLOCK; block++)
+    {
+        if (block == 1)
+        {
+            segment[0724 / 2] = RT11_FIRST_CATALOG_BLOCK;
+            memcpy((uint8_t*)segment + 0730, "BENCH       ", 12);
+        }
+        StatsFWrite(segment, 1, RT11_BLOCK_SIZE, fpFile);
+        memset(segment, 0, sizeof(segment));
+    }
+    size_t index = 0;
+    for (int seg = 0; seg < nSegments; seg++)
+    {
+        memset(segment, 0, sizeof(segment));
+        segment[0] = (uint16_t)nSegments;
+        segment[1] = (uint16_t)((seg + 1 < nSegments) ? seg + 2 : 0);
+        segment[2] = (uint16_t)nSegments;
+        segment[4] = entries[index].start;
+        uint16_t* pData = segment + 5;
+        for (int i = 0; i < nEntriesUsable && index < entries.size(); i++, index++)
+        {
+            entries[index].Pack(pData);
+            pData += 7;
+        }
+        CVolumeCatalogEntry endmark;
+        endmark.status = RT11_STATUS_ENDMARK;
+        endmark.Pack(pData);
+        StatsFWrite(segment, 1, RT11_BLOCK_SIZE * 2, fpFile);
+    }
+
+    // Data area: every block is marked with its number
+    for (int block = nDataStart; block < pImage->blocks; block++)
+    {
+        for (int i = 0; i < 256; i++)
+            segment[i] = (uint16_t)(block + i);
+        StatsFWrite(segment, 1, RT11_BLOCK_SIZE, fpFile);
+    }
+
+    return true;
+}
+
+static bool GenerateImage(BenchImage* pImage)
+{
+    long offset = 0;
+    if (pImage->okHard)
+    {
+        CHardImage hardimage;
+        MuteStdout();
+        bool okCreated = hardimage.Create(pImage->templatename, HDD_DRIVER_ID, 1, pImage->blocks, false);
+        UnmuteStdout();
+        if (!okCreated)
+            return false;
+        offset = RT11_BLOCK_SIZE;  // ID layout: partition follows the home block
+    }
+
+    FILE* fpFile = ::fopen(pImage->templatename, pImage->okHard ? "r+b" : "wb");
+    if (fpFile == nullptr)
+        return false;
+    bool result = GenerateVolume(fpFile, offset, pImage);
+    ::fclose(fpFile);
+    return result;
+}
+
+static bool AttachImage(const BenchImage& image, int cache, CDiskImage* pDiskImage, CHardImage* pHardImage)
+{
+    pDiskImage->SetCacheSize(cache);
+    if (image.okHard)
+        return pHardImage->Attach(image.workname, false) && pHardImage->PrepareDiskImage(0, pDiskImage);
+    return pDiskImage->Attach(image.workname);
+}
+
+static bool RunOperation(const BenchImage& image, int cache, BenchOperation operation)
+{
+    CDiskImage diskimage;
+    CHardImage hardimage;
+    if (!AttachImage(image, cache, &diskimage, &hardimage))
+        return false;
+
+    diskimage.DecodeImageCatalog();
+    switch (operation)
+    {
+    case BENCH_LIST:
+        diskimage.PrintCatalogDirectory();
+        break;
+    case BENCH_EXTRACT_ONE:
+        diskimage.SaveEntryToExternalFile(image.middlename, false);
+        break;
+    case BENCH_EXTRACT_ALL:
+        diskimage.SaveAllEntriesToExternalFiles();
+        break;
+    case BENCH_ADD:
+        diskimage.AddFileToImage(g_sAddFileName);
+        break;
+    case BENCH_DELETE:
+        diskimage.DeleteFileFromImage(image.middlename);
+        break;
+    case BENCH_FLUSH:  // Rewrite half of the cache
+        {
+            int blocks = cache / 2;
+            if (blocks > diskimage.GetBlockCount() - 100)
+                blocks = diskimage.GetBlockCount() - 100;
+            for (int block = 0; block < blocks; block++)
+            {
+                uint8_t* pData = (uint8_t*)diskimage.GetBlock(100 + block);
+                if (pData == nullptr)
+                    break;
+                pData[0] ^= 0xff;
+                diskimage.MarkBlockChanged(100 + block);
+            }
+        }
+        diskimage.FlushChanges();
+        break;
+    default:
+        break;
+    }
+
+    diskimage.Detach();
+    hardimage.Detach();
+    return true;
+}
+
+static void BenchImageOperations(const BenchImage& image, int cache)
+{
+    for (int op = 0; op < BENCH_OPERATION_COUNT; op++)
+    {
+        BenchOperation operation = (BenchOperation)op;
+        bool okChanging = (operation == BENCH_ADD || operation == BENCH_DELETE || operation == BENCH_FLUSH);
+        CImageStats total;
+        memset(&total, 0, sizeof(total));
+        double seconds = 0.0;
+        for (int rep = 0; rep < g_nRepeat; rep++)
+        {
+            if (rep == 0 || okChanging)
+                CopyImageFile(image.templatename, image.workname);
+
+            memset(&g_stats, 0, sizeof(g_stats));
+            MuteStdout();
+            double starttime = StatsGetTime();
+            bool result = RunOperation(image, cache, operation);
+            seconds += StatsGetTime() - starttime;
+            UnmuteStdout();
+            if (!result)
+            {
+                printf("Failed to attach image %s\n", image.workname);
+                return;
+            }
+
+            total.cachehits += g_stats.cachehits;
+            total.cachemisses += g_stats.cachemisses;
+            total.seekcalls += g_stats.seekcalls;
+            total.readcalls += g_stats.readcalls;
+            total.writecalls += g_stats.writecalls;
+            total.bytesread += g_stats.bytesread;
+            total.byteswritten += g_stats.byteswritten;
+        }
+
+        double bytes = (double)(total.bytesread + total.byteswritten);
+        printf("%-10s %6d  %-12s %9.3f %9.1f %8lu %8lu %8lu %9lu %9lu\n",
+               image.title, cache, g_BenchOperationNames[op],
+               seconds * 1000.0 / g_nRepeat, (seconds > 0.0) ? bytes / seconds / 1048576.0 : 0.0,
+               total.seekcalls / g_nRepeat, total.readcalls / g_nRepeat, total.writecalls / g_nRepeat,
+               total.cachehits / g_nRepeat, total.cachemisses / g_nRepeat);
+    }
+}
+
+static void CleanupDirectory(const char * sDirName)
+{
+    DIR* dir = opendir(sDirName);
+    if (dir == nullptr)
+        return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        unlink(entry->d_name);
+    }
+    closedir(dir);
+}
+
+static void PrintUsage()
+{
+    printf("\nUsage: rt11dsk-bench [options]\n"
+           "  Options:\n"
+           "    -filesN      Number of files on the floppy image; 100 by default\n"
+           "    -partfilesN  Number of files on the 65535-block partition; 500 by default\n"
+           "    -fragN       Percent of files followed by a free area; 25 by default\n"
+           "    -cacheN      Cache size in blocks, can be repeated; 64, 1600 and 16384 by default\n"
+           "    -repeatN     Repeat every operation N times; 3 by default\n");
+}
+
+static bool ParseCommandLine(int argc, char * argv[])
+{
+    for (int argn = 1; argn < argc; argn++)
+    {
+        const char * arg = argv[argn];
+        int value = 0;
+        if (1 == sscanf(arg, "-files%d", &value) && value > 0)
+            g_nFloppyFiles = value;
+        else if (1 == sscanf(arg, "-partfiles%d", &value) && value > 0)
+            g_nPartitionFiles = value;
+        else if (1 == sscanf(arg, "-frag%d", &value) && value >= 0 && value <= 100)
+            g_nFragmentation = value;
+        else if (1 == sscanf(arg, "-cache%d", &value) && value >= 32)
+            g_CacheSizes.push_back(value);
+        else if (1 == sscanf(arg, "-repeat%d", &value) && value > 0)
+            g_nRepeat = value;
+        else
+        {
+            printf("Unknown option: %s\n", arg);
+            return false;
+        }
+    }
+
+    if (g_CacheSizes.empty())
+    {
+        g_CacheSizes.push_back(64);
+        g_CacheSizes.push_back(1600);
+        g_CacheSizes.push_back(16384);
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    printf("RT11DSK Benchmark  [%s %s]\n\n", __DATE__, __TIME__);
+
+    if (!ParseCommandLine(argc, argv))
+    {
+        PrintUsage();
+        return 255;
+    }
+
+    // All the files are created in the temporary directory
+    char sWorkDir[] = "/tmp/rt11dsk-bench-XXXXXX";
+    if (mkdtemp(sWorkDir) == nullptr || chdir(sWorkDir) != 0)
+    {
+        printf("Failed to create temporary directory.\n");
+        return 255;
+    }
+
+    BenchImage images[2] =
+    {
+        { "floppy",    "floppy.dsk", "floppy-work.dsk", false, 1600,  g_nFloppyFiles },
+        { "partition", "hard.img",   "hard-work.img",   true,  65535, g_nPartitionFiles },
+    };
+
+    // The file to add: a few blocks, fits to a free area of any image
+    FILE* fpAdd = ::fopen(g_sAddFileName, "wb");
+    uint8_t block[RT11_BLOCK_SIZE];
+    memset(block, 0x55, sizeof(block));
+    for (int i = 0; fpAdd != nullptr && i < g_nAddFileBlocks; i++)
+        ::fwrite(block, 1, sizeof(block), fpAdd);
+    if (fpAdd != nullptr)
+        ::fclose(fpAdd);
+
+    printf("Fragmentation %d%%, %d repeats; time and counters are per operation\n\n", g_nFragmentation, g_nRepeat);
+    printf("Image       Cache  Operation           ms      MB/s    seeks    reads   writes      hits    misses\n"
+           "---------- ------  ------------ --------- --------- -------- -------- -------- --------- ---------\n");
+
+    int result = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        double starttime = StatsGetTime();
+        if (!GenerateImage(images + i))
+        {
+            printf("Failed to generate image %s\n", images[i].templatename);
+            result = 255;
+            break;
+        }
+        printf("%-10s %d blocks, %d files generated in %.3f ms\n",
+               images[i].title, images[i].blocks, images[i].files, (StatsGetTime() - starttime) * 1000.0);
+
+        for (size_t cache = 0; cache < g_CacheSizes.size(); cache++)
+            BenchImageOperations(images[i], g_CacheSizes[cache]);
+    }
+
+    CleanupDirectory(".");
+    if (chdir("/") == 0)
+        rmdir(sWorkDir);
+
+    return result;
+}
+
+
+//////////////////////////////////////////////////////////////////////
@@ -0,0 +1,183 @@
+﻿/*  This file is part of UKNCBTL.
+    UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// blockdevice.cpp : Storage for disk and hard disk images
+
+#include "rt11dsk.h"
+#include "blockdevice.h"
+#ifndef _MSC_VER
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+//////////////////////////////////////////////////////////////////////
+
+CFileBlockDevice::CFileBlockDevice(FILE* fpFile, bool readonly, bool okCloseFile)
+{
+    m_fpFile = fpFile;
+    m_okReadOnly = readonly;
+    m_okCloseFile = okCloseFile;
+
+    StatsFSeek(m_fpFile, 0, SEEK_END);
+    m_lFileSize = ::ftell(m_fpFile);
+}
+
+CFileBlockDevice::~CFileBlockDevice()
+{
+    if (m_okCloseFile)
+        ::fclose(m_fpFile);
+}
+
+CFileBlockDevice* CFileBlockDevice::Open(const char * sFileName)
+{
+    // Try to open as Normal first, then as ReadOnly
+    bool readonly = false;
+    FILE* fpFile = ::fopen(sFileName, "r+b");
+    if (fpFile == nullptr)
+    {
+        readonly = true;
+        fpFile = ::fopen(sFileName, "rb");
+        if (fpFile == nullptr)
+            return nullptr;
+    }
+
+    return new CFileBlockDevice(fpFile, readonly, true);
+}
+
+bool CFileBlockDevice::Read(long offset, void* buffer, size_t size)
+{
+    if (StatsFSeek(m_fpFile, offset, SEEK_SET) != 0)
+        return false;
+    return StatsFRead(buffer, 1, size, m_fpFile) == size;
+}
+
+bool CFileBlockDevice::Write(long offset, const void* buffer, size_t size)
+{
+    if (m_okReadOnly)
+        return false;
+    if (StatsFSeek(m_fpFile, offset, SEEK_SET) != 0)
+        return false;
+    if (StatsFWrite(buffer, 1, size, m_fpFile) != size)
+        return false;
+
+    if (offset + (long)size > m_lFileSize)
+        m_lFileSize = offset + (long)size;
+    return true;
+}
+
+bool CFileBlockDevice::Flush()
+{
+    return ::fflush(m_fpFile) == 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+CMemoryBlockDevice::CMemoryBlockDevice(long size)
+{
+    m_pData = (uint8_t*) ::calloc(size, 1);
+    m_lSize = (m_pData == nullptr) ? 0 : size;
+    m_okReadOnly = false;
+    m_okFreeData = true;
+}
+
+CMemoryBlockDevice::CMemoryBlockDevice(void* pData, long size, bool readonly)
+{
+    m_pData = (uint8_t*) pData;
+    m_lSize = size;
+    m_okReadOnly = readonly;
+    m_okFreeData = false;
+}
+
+CMemoryBlockDevice::~CMemoryBlockDevice()
+{
+    if (m_okFreeData)
+        ::free(m_pData);
+}
+
+bool CMemoryBlockDevice::Read(long offset, void* buffer, size_t size)
+{
+    if (offset < 0 || offset + (long)size > m_lSize)
+        return false;
+    memcpy(buffer, m_pData + offset, size);
+    return true;
+}
+
+bool CMemoryBlockDevice::Write(long offset, const void* buffer, size_t size)
+{
+    if (m_okReadOnly || offset < 0 || offset + (long)size > m_lSize)
+        return false;
+    memcpy(m_pData + offset, buffer, size);
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+#ifndef _MSC_VER
+
+CMmapBlockDevice::CMmapBlockDevice(int fd, void* pData, long size, bool readonly)
+    : CMemoryBlockDevice(pData, size, readonly)
+{
+    m_nFile = fd;
+}
+
+CMmapBlockDevice::~CMmapBlockDevice()
+{
+    if (m_pData != nullptr)
+        ::munmap(m_pData, m_lSize);
+    ::close(m_nFile);
+}
+
+CMmapBlockDevice* CMmapBlockDevice::Open(const char * sFileName)
+{
+    // Try to open as Normal first, then as ReadOnly
+    bool readonly = false;
+    int fd = ::open(sFileName, O_RDWR);
+    if (fd < 0)
+    {
+        readonly = true;
+        fd = ::open(sFileName, O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return nullptr;
+    }
+
+    int prot = readonly ? PROT_READ : (PROT_READ | PROT_WRITE);
+    void* pData = ::mmap(nullptr, st.st_size, prot, MAP_SHARED, fd, 0);
+    if (pData == MAP_FAILED)
+    {
+        ::close(fd);
+        return nullptr;
+    }
+
+    return new CMmapBlockDevice(fd, pData, (long)st.st_size, readonly);
+}
+
+bool CMmapBlockDevice::Flush()
+{
+    if (m_okReadOnly)
+        return true;
+    return ::msync(m_pData, m_lSize, MS_SYNC) == 0;
+}
+
+#endif
+
+
+//////////////////////////////////////////////////////////////////////
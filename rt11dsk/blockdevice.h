@@ -0,0 +1,96 @@
+﻿/*  This file is part of UKNCBTL.
+    UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// blockdevice.h : Storage for disk and hard disk images
+
+#pragma once
+
+//////////////////////////////////////////////////////////////////////
+
+// Byte-addressed storage under CDiskImage and CHardImage
+class CBlockDevice
+{
+public:
+    virtual ~CBlockDevice() { }
+    virtual long GetSize() const = 0;  // Size in bytes
+    virtual bool IsReadOnly() const = 0;
+    virtual bool Read(long offset, void* buffer, size_t size) = 0;
+    virtual bool Write(long offset, const void* buffer, size_t size) = 0;
+    virtual bool Flush() { return true; }
+};
+
+// Image file accessed with fread/fwrite
+class CFileBlockDevice : public CBlockDevice
+{
+protected:
+    FILE*           m_fpFile;
+    bool            m_okReadOnly;
+    bool            m_okCloseFile;  // true - close m_fpFile in destructor
+    long            m_lFileSize;
+
+public:
+    CFileBlockDevice(FILE* fpFile, bool readonly, bool okCloseFile);
+    virtual ~CFileBlockDevice();
+    // Open the file for read/write, or for read only; nullptr on failure
+    static CFileBlockDevice* Open(const char * sFileName);
+
+public:
+    FILE* GetFile() const { return m_fpFile; }
+    virtual long GetSize() const { return m_lFileSize; }
+    virtual bool IsReadOnly() const { return m_okReadOnly; }
+    virtual bool Read(long offset, void* buffer, size_t size);
+    virtual bool Write(long offset, const void* buffer, size_t size);
+    virtual bool Flush();
+};
+
+// Image in memory: own zero-filled buffer, or the buffer given by caller
+class CMemoryBlockDevice : public CBlockDevice
+{
+protected:
+    uint8_t*        m_pData;
+    long            m_lSize;
+    bool            m_okReadOnly;
+    bool            m_okFreeData;   // true - free m_pData in destructor
+
+public:
+    CMemoryBlockDevice(long size);
+    CMemoryBlockDevice(void* pData, long size, bool readonly);
+    virtual ~CMemoryBlockDevice();
+
+public:
+    uint8_t* GetData() const { return m_pData; }
+    virtual long GetSize() const { return m_lSize; }
+    virtual bool IsReadOnly() const { return m_okReadOnly; }
+    virtual bool Read(long offset, void* buffer, size_t size);
+    virtual bool Write(long offset, const void* buffer, size_t size);
+};
+
+#ifndef _MSC_VER
+// Image file mapped to memory, Linux/Mac only
+class CMmapBlockDevice : public CMemoryBlockDevice
+{
+protected:
+    int             m_nFile;
+
+public:
+    virtual ~CMmapBlockDevice();
+    // Map the file for read/write, or for read only; nullptr on failure
+    static CMmapBlockDevice* Open(const char * sFileName);
+
+public:
+    virtual bool Flush();
+
+private:
+    CMmapBlockDevice(int fd, void* pData, long size, bool readonly);
+};
+#endif
+
+
+//////////////////////////////////////////////////////////////////////
@@ -17,12 +17,15 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 #include <time.h>
 #ifdef _MSC_VER
 #include <stdio.h>
+#include <io.h>
 #define unlink(fn) _unlink(fn)
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #endif
 #include <assert.h>
 #include "rt11dsk.h"
+#include "blockdevice.h"
 #include "diskimage.h"
 #include "rt11date.h"
 #include "hostfile.h"
@@ -44,7 +47,7 @@ static const char * g_forbiddenFileNames[] =
 
 static uint16_t g_segmentBuffer[512];
 
-void CVolumeCatalogEntry::Store(CHostFile* hf_p, CDiskImage* di_p)
+bool CVolumeCatalogEntry::Store(CHostFile* hf_p, CDiskImage* di_p)
 {
     // Изменяем существующую запись каталога
     length = hf_p->rt11_sz;
@@ -61,21 +64,27 @@ void CVolumeCatalogEntry::Store(CHostFile* hf_p, CDiskImage* di_p)
     {
         uint8_t* pFileBlockData = ((uint8_t*) hf_p->data) + block * RT11_BLOCK_SIZE;
         uint8_t* pData = (uint8_t*) di_p->GetBlock(nBlock);
+        if (pData == nullptr)
+            return false;
         ::memcpy(pData, pFileBlockData, RT11_BLOCK_SIZE);
         // Сообщаем что блок был изменен
         di_p->MarkBlockChanged(nBlock);
         nBlock++;
     }
+    return true;
 }
 
-void CDiskImage::UpdateCatalogSegment(int segm_idx)
+bool CDiskImage::UpdateCatalogSegment(int segm_idx)
 {
-    printf("Updating catalog segment #%d...\n", segm_idx);
     assert(segm_idx < m_volumeinfo.catalogsegmentcount && segm_idx >= 0);
     CVolumeCatalogSegment* pSegment = m_volumeinfo.catalogsegments + segm_idx;
     uint8_t* pBlock1 = (uint8_t*) GetBlock(pSegment->segmentblock);
+    if (pBlock1 == nullptr)
+        return false;
     memcpy(g_segmentBuffer, pBlock1, 512);
     uint8_t* pBlock2 = (uint8_t*) GetBlock(pSegment->segmentblock + 1);
+    if (pBlock2 == nullptr)
+        return false;
     memcpy(g_segmentBuffer + 256, pBlock2, 512);
     uint16_t* pData = g_segmentBuffer;
 
@@ -93,6 +102,7 @@ void CDiskImage::UpdateCatalogSegment(int segm_idx)
     MarkBlockChanged(pSegment->segmentblock);
     memcpy(pBlock2, g_segmentBuffer + 256, 512);
     MarkBlockChanged(pSegment->segmentblock + 1);
+    return true;
 }
 
 #if 0
@@ -104,7 +114,7 @@ static void ParseFileName63(const char * sFileName, char * filename, char * file
     const char * sFilenamePath = strrchr(sFileName, '/');
     if (sFilenameExt == nullptr)
     {
-        printf("Wrong filename format: %s\n", sFileName);
+        fprintf(stderr, "Wrong filename format: %s\n", sFileName);
         return;
     }
     if (sFilenamePath != nullptr)
@@ -114,13 +124,13 @@ static void ParseFileName63(const char * sFileName, char * filename, char * file
     size_t nFilenameLength = sFilenameExt - sFileName;
     if (nFilenameLength == 0 || nFilenameLength > 6)
     {
-        printf("Wrong filename format: %s\n", sFileName);
+        fprintf(stderr, "Wrong filename format: %s\n", sFileName);
         return;
     }
     size_t nFileextLength = strlen(sFileName) - nFilenameLength - 1;
     if (nFileextLength == 0 || nFileextLength > 3)
     {
-        printf("Wrong filename format: %s\n", sFileName);
+        fprintf(stderr, "Wrong filename format: %s\n", sFileName);
         return;
     }
     for (int i = 0; i < 6; i++) filename[i] = ' ';
@@ -134,14 +144,65 @@ static void ParseFileName63(const char * sFileName, char * filename, char * file
 
 //////////////////////////////////////////////////////////////////////
 
+const char * RT11ErrorString(int error)
+{
+    switch (error)
+    {
+    case RT11_OK:                   return "No error";
+    case RT11_ERROR_NOT_ATTACHED:   return "Image is not attached";
+    case RT11_ERROR_IO:             return "Failed to read or write the image";
+    case RT11_ERROR_NO_MEMORY:      return "Not enough memory";
+    case RT11_ERROR_BLOCK_RANGE:    return "Block number is out of the volume";
+    case RT11_ERROR_CACHE_FULL:     return "Cache is full";
+    case RT11_ERROR_BAD_CATALOG:    return "Home block or catalog segment header is out of range";
+    case RT11_ERROR_BAD_HOME_BLOCK: return "Hard disk home block is incorrect";
+    case RT11_ERROR_BAD_PARAMETER:  return "Wrong parameter";
+    case RT11_ERROR_READ_ONLY:      return "Image is read-only";
+    case RT11_ERROR_FILE_NOT_FOUND: return "File not found";
+    case RT11_ERROR_SIZE_MISMATCH:  return "File exists with different size";
+    case RT11_ERROR_NO_SPACE:       return "No free space for the file";
+    case RT11_ERROR_SEGMENT_FULL:   return "New catalog segment needed";
+    case RT11_ERROR_HOST_FILE:      return "Failed to read or write the host file";
+    case RT11_ERROR_BAD_SECTORS:    return "Hard disk home block Sectors per Track value is invalid";
+    case RT11_ERROR_BAD_SIDES:      return "Hard disk home block Sectors per Side value is invalid";
+    default:                        return "Unknown error";
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+bool PrepareImageFileSize(FILE* fpFile, long size, bool okAllocate)
+{
+    ::fflush(fpFile);
+#ifdef _MSC_VER
+    (void)okAllocate;  // _chsize_s() fills the new area with zeroes anyway
+    return ::_chsize_s(::_fileno(fpFile), size) == 0;
+#else
+    int fd = ::fileno(fpFile);
+    if (::ftruncate(fd, size) != 0)
+        return false;
+#ifdef __linux__
+    if (okAllocate && ::posix_fallocate(fd, 0, size) != 0)
+        return false;
+#else
+    (void)okAllocate;
+#endif
+    return true;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+
 CDiskImage::CDiskImage()
 {
     m_okReadOnly = false;
-    m_fpFile = nullptr;
-    m_okCloseFile = true;
+    m_pDevice = nullptr;
+    m_okOwnDevice = true;
     m_lStartOffset = 0;
     m_nTotalBlocks = m_nCacheBlocks = 0;
+    m_nCacheSize = 1600;  //NOTE: For up to 1600 blocks, for 800K of data
     m_pCache = nullptr;
+    m_nLastError = RT11_OK;
 }
 
 CDiskImage::~CDiskImage()
@@ -152,22 +213,15 @@ CDiskImage::~CDiskImage()
 // Open the specified disk image file
 bool CDiskImage::Attach(const char * sImageFileName, long offset, bool interleaving)
 {
-    m_okInterleaving = interleaving;
-
-    // Try to open as Normal first, then as ReadOnly
-    m_okReadOnly = false;
-    m_fpFile = ::fopen(sImageFileName, "r+b");
-    if (m_fpFile == nullptr)
+    CBlockDevice* pDevice = CFileBlockDevice::Open(sImageFileName);
+    if (pDevice == nullptr)
     {
-        m_okReadOnly = true;
-        m_fpFile = ::fopen(sImageFileName, "rb");
-        if (m_fpFile == nullptr)
-            return false;
+        m_nLastError = RT11_ERROR_IO;
+        return false;
     }
 
-    ::fseek(m_fpFile, 0, SEEK_END);
-    long lFileSize = ::ftell(m_fpFile);
-    m_nTotalBlocks = lFileSize / RT11_BLOCK_SIZE;
+    long lFileSize = pDevice->GetSize();
+    int blocks = lFileSize / RT11_BLOCK_SIZE;
 
     if (offset > 0)
         m_lStartOffset = offset;
@@ -177,12 +231,11 @@ bool CDiskImage::Attach(const char * sImageFileName, long offset, bool interleav
 
         // Читаем начало файла, чтобы найти 0-й блок
         uint8_t buffer[RT11_BLOCK_SIZE];
-        ::fseek(m_fpFile, 0, SEEK_SET);
-        size_t lBytesRead = ::fread(buffer, 1, RT11_BLOCK_SIZE, m_fpFile);
-        if (lBytesRead != RT11_BLOCK_SIZE)
+        if (!pDevice->Read(0, buffer, RT11_BLOCK_SIZE))
         {
-            printf("Failed to read the file.\n");
-            exit(-1);
+            delete pDevice;
+            m_nLastError = RT11_ERROR_IO;
+            return false;
         }
 
         if (buffer[0] == 0xA0 && buffer[1] == 0)  // Нашли 000240 по смещению 0
@@ -195,54 +248,91 @@ bool CDiskImage::Attach(const char * sImageFileName, long offset, bool interleav
 
     // Calculate m_TotalBlocks
     if (interleaving)
-        m_nTotalBlocks -= 10;
-
-    this->PostAttach();
+        blocks -= 10;
 
-    return true;
+    return Attach(pDevice, m_lStartOffset, interleaving, blocks, true);
 }
 
-// Use the given area of the file as a disk image; do not close the file in Detach() method.
-bool CDiskImage::Attach(FILE* fpfile, long offset, bool interleaving, int blocks, bool readonly)
+// Use the given area of the device as a disk image; delete the device in Detach() method when okOwnDevice is set.
+bool CDiskImage::Attach(CBlockDevice* pDevice, long offset, bool interleaving, int blocks, bool okOwnDevice)
 {
-    m_fpFile = fpfile;
-    m_okCloseFile = false;
-    m_okReadOnly = readonly;
+    m_pDevice = pDevice;
+    m_okOwnDevice = okOwnDevice;
+    m_okReadOnly = pDevice->IsReadOnly();
     m_lStartOffset = offset;
     m_nTotalBlocks = blocks;
     m_okInterleaving = interleaving;
+    m_nLastError = RT11_OK;
 
-    this->PostAttach();
+    if (!this->PostAttach())
+    {
+        int error = m_nLastError;
+        Detach();
+        m_nLastError = error;
+        return false;
+    }
 
     return true;
 }
 
+// Create new image file for the volume of the given size, and attach to it
+bool CDiskImage::Create(const char * sImageFileName, int blocks, long offset, bool interleaving, bool okAllocate)
+{
+    FILE* fpFile = ::fopen(sImageFileName, "w+b");
+    if (fpFile == nullptr)
+    {
+        m_nLastError = RT11_ERROR_IO;
+        return false;
+    }
+
+    // MS0515 image has 10 more blocks, see Attach()
+    long lFileSize = offset + ((long)(interleaving ? blocks + 10 : blocks)) * RT11_BLOCK_SIZE;
+    if (!PrepareImageFileSize(fpFile, lFileSize, okAllocate))
+    {
+        ::fclose(fpFile);
+        m_nLastError = RT11_ERROR_IO;
+        return false;
+    }
+
+    return Attach(new CFileBlockDevice(fpFile, false, true), offset, interleaving, blocks, true);
+}
+
 // Actions at the end of Attach() method
-void CDiskImage::PostAttach()
+bool CDiskImage::PostAttach()
 {
     // Allocate memory for the cache
-    m_nCacheBlocks = 1600;  //NOTE: For up to 1600 blocks, for 800K of data
+    m_nCacheBlocks = m_nCacheSize;
     if (m_nCacheBlocks > m_nTotalBlocks) m_nCacheBlocks = m_nTotalBlocks;
     m_pCache = (CCachedBlock*) ::calloc(m_nCacheBlocks, sizeof(CCachedBlock));
+    if (m_pCache == nullptr && m_nCacheBlocks > 0)
+    {
+        m_nCacheBlocks = 0;
+        m_nLastError = RT11_ERROR_NO_MEMORY;
+        return false;
+    }
 
     // Initial read: fill half of the cache
     int nBlocks = 10;
-    if (nBlocks > m_nTotalBlocks) nBlocks = m_nTotalBlocks;
+    if (nBlocks > m_nTotalBlocks - 1) nBlocks = m_nTotalBlocks - 1;
     for (int i = 1; i <= nBlocks; i++)
     {
-        GetBlock(i);
+        if (GetBlock(i) == nullptr)
+            return false;
     }
+
+    return true;
 }
 
 void CDiskImage::Detach()
 {
-    if (m_fpFile != nullptr)
+    if (m_pDevice != nullptr)
     {
         FlushChanges();
+        m_pDevice->Flush();
 
-        if (m_okCloseFile)
-            ::fclose(m_fpFile);
-        m_fpFile = nullptr;
+        if (m_okOwnDevice)
+            delete m_pDevice;
+        m_pDevice = nullptr;
 
         // Free cached blocks data
         for (int i = 0; i < m_nCacheBlocks; i++)
@@ -252,6 +342,8 @@ void CDiskImage::Detach()
         }
 
         ::free(m_pCache);
+        m_pCache = nullptr;
+        m_nCacheBlocks = 0;
     }
 }
 
@@ -275,41 +367,60 @@ long CDiskImage::GetBlockOffset(int nBlock) const
     return foffset;
 }
 
-void CDiskImage::FlushChanges()
+bool CDiskImage::FlushChanges()
 {
+    double starttime = StatsGetTime();
+    bool result = true;
+
     for (int i = 0; i < m_nCacheBlocks; i++)
     {
         if (!m_pCache[i].bChanged) continue;
 
         // Вычисляем смещение в файле образа
         long foffset = GetBlockOffset(m_pCache[i].nBlock);
-        ::fseek(m_fpFile, foffset, SEEK_SET);
 
-        // Записываем блок
-        size_t lBytesWritten = ::fwrite(m_pCache[i].pData, 1, RT11_BLOCK_SIZE, m_fpFile);
-        if (lBytesWritten != RT11_BLOCK_SIZE)
+        // Записываем блок; блок остаётся изменённым, если записать не удалось
+        if (!m_pDevice->Write(foffset, m_pCache[i].pData, RT11_BLOCK_SIZE))
         {
-            printf("Failed to write block number %d.\n", m_pCache[i].nBlock);
-            exit(-1);
+            m_nLastError = RT11_ERROR_IO;
+            result = false;
+            break;
         }
 
         m_pCache[i].bChanged = false;
+        g_stats.blocksflushed++;
     }
+
+    g_stats.phaseseconds[STATS_PHASE_FLUSH] += StatsGetTime() - starttime;
+    return result;
 }
 
 // Каждый блок - 256 слов, 512 байт
 // nBlock = 1..???
 void* CDiskImage::GetBlock(int nBlock)
 {
+    if (m_pDevice == nullptr)
+    {
+        m_nLastError = RT11_ERROR_NOT_ATTACHED;
+        return nullptr;
+    }
+    if (nBlock <= 0 || nBlock >= m_nTotalBlocks)  // Block 0 is never cached, nBlock == 0 marks a free slot
+    {
+        m_nLastError = RT11_ERROR_BLOCK_RANGE;
+        return nullptr;
+    }
+
     // First lookup the cache
     for (int i = 0; i < m_nCacheBlocks; i++)
     {
         if (m_pCache[i].nBlock == nBlock)
         {
             m_pCache[i].cLastUsage = ::clock();
+            g_stats.cachehits++;
             return m_pCache[i].pData;
         }
     }
+    g_stats.cachemisses++;
 
     // Find a free cache slot
     int iEmpty = -1;
@@ -328,12 +439,13 @@ void* CDiskImage::GetBlock(int nBlock)
         // Find a non-changed cached block with oldest usage time
         int iCand = -1;
         time_t maxdiff = 0;
+        time_t now = ::clock();  // clock() is a system call, do not call it for every slot
         for (int i = 0; i < m_nCacheBlocks; i++)
         {
             if (!m_pCache[i].bChanged)
             {
-                time_t diff = ::clock() - m_pCache[i].cLastUsage;
-                if (diff > maxdiff)
+                time_t diff = now - m_pCache[i].cLastUsage;
+                if (iCand == -1 || diff > maxdiff)
                 {
                     maxdiff = diff;
                     iCand = i;
@@ -347,34 +459,45 @@ void* CDiskImage::GetBlock(int nBlock)
             m_pCache[iEmpty].pData = nullptr;
             m_pCache[iEmpty].nBlock = 0;
             m_pCache[iEmpty].bChanged = false;
+            g_stats.cacheevictions++;
         }
     }
 
+    // All the cached blocks are changed: write them back, then reuse the first slot
+    if (iEmpty == -1 && m_nCacheBlocks > 0 && FlushChanges())
+    {
+        iEmpty = 0;
+        ::free(m_pCache[iEmpty].pData);
+        m_pCache[iEmpty].pData = nullptr;
+        m_pCache[iEmpty].nBlock = 0;
+        g_stats.cacheevictions++;
+    }
+
     if (iEmpty == -1)
     {
-        fprintf(stderr, "Cache is full.\n");
-        exit(-1);
+        m_nLastError = RT11_ERROR_CACHE_FULL;
+        return nullptr;
     }
 
-    m_pCache[iEmpty].nBlock = nBlock;
     m_pCache[iEmpty].bChanged = false;
     m_pCache[iEmpty].pData = ::calloc(1, RT11_BLOCK_SIZE);
     if (m_pCache[iEmpty].pData == nullptr)
     {
-        printf("Failed to allocate memory for block number %d.\n", nBlock);
-        exit(-1);
+        m_nLastError = RT11_ERROR_NO_MEMORY;
+        return nullptr;
     }
     m_pCache[iEmpty].cLastUsage = ::clock();
 
     // Load the block data
     long foffset = GetBlockOffset(nBlock);
-    ::fseek(m_fpFile, foffset, SEEK_SET);
-    size_t lBytesRead = ::fread(m_pCache[iEmpty].pData, 1, RT11_BLOCK_SIZE, m_fpFile);
-    if (lBytesRead != RT11_BLOCK_SIZE)
+    if (!m_pDevice->Read(foffset, m_pCache[iEmpty].pData, RT11_BLOCK_SIZE))
     {
-        printf("Failed to read block number %d.\n", nBlock);
-        exit(-1);
+        ::free(m_pCache[iEmpty].pData);
+        m_pCache[iEmpty].pData = nullptr;
+        m_nLastError = RT11_ERROR_IO;
+        return nullptr;
     }
+    m_pCache[iEmpty].nBlock = nBlock;
 
     return m_pCache[iEmpty].pData;
 }
@@ -391,17 +514,21 @@ void CDiskImage::MarkBlockChanged(int nBlock)
     }
 }
 
-void CDiskImage::DecodeImageCatalog()
+bool CDiskImage::DecodeImageCatalog()
 {
+    double starttime = StatsGetTime();
+
     memset(&m_volumeinfo, 0, sizeof(m_volumeinfo));
 
     // Разбор Home Block
     uint8_t* pHomeSector = (uint8_t*) GetBlock(1);
+    if (pHomeSector == nullptr)
+        return false;
     uint16_t nFirstCatalogBlock = pHomeSector[0724];  // Это должен быть блок номер 6
     if (nFirstCatalogBlock > 10)
     {
-        printf("First catalog block is %d, out of range.\n", nFirstCatalogBlock);
-        exit(-1);
+        m_nLastError = RT11_ERROR_BAD_CATALOG;
+        return false;
     }
     if (nFirstCatalogBlock == 0) nFirstCatalogBlock = 6;
     m_volumeinfo.firstcatalogblock = nFirstCatalogBlock;
@@ -415,8 +542,12 @@ void CDiskImage::DecodeImageCatalog()
 
     // Разбор первого блока каталога
     uint8_t* pBlock1 = (uint8_t*) GetBlock(nFirstCatalogBlock);
+    if (pBlock1 == nullptr)
+        return false;
     memcpy(g_segmentBuffer, pBlock1, 512);
     uint8_t* pBlock2 = (uint8_t*) GetBlock(nFirstCatalogBlock + 1);
+    if (pBlock2 == nullptr)
+        return false;
     memcpy(g_segmentBuffer + 256, pBlock2, 512);
     uint16_t* pCatalogSector = g_segmentBuffer;
     m_volumeinfo.catalogsegmentcount = pCatalogSector[0];
@@ -430,13 +561,18 @@ void CDiskImage::DecodeImageCatalog()
     m_volumeinfo.catalogentriespersegment = nEntriesPerSegment;
     if (m_volumeinfo.catalogsegmentcount == 0 || m_volumeinfo.catalogsegmentcount > 31)
     {
-        printf("Catalog segment count is %d, out of range (1..31).\n", m_volumeinfo.catalogsegmentcount);
-        exit(-1);
+        m_nLastError = RT11_ERROR_BAD_CATALOG;
+        return false;
     }
 
     // Получаем память под список сегментов
     m_volumeinfo.catalogsegments = (CVolumeCatalogSegment*) ::calloc(
             m_volumeinfo.catalogsegmentcount, sizeof(CVolumeCatalogSegment));
+    if (m_volumeinfo.catalogsegments == nullptr)
+    {
+        m_nLastError = RT11_ERROR_NO_MEMORY;
+        return false;
+    }
 
     //TODO: Для заголовка самого первого сегмента каталога существует правило:
     //      если удвоить содержимое слова 1 и к результату прибавить начальный блок каталога (обычно 6),
@@ -460,6 +596,11 @@ void CDiskImage::DecodeImageCatalog()
         // Выделяем память под записи сегмента
         pSegment->catalogentries = (CVolumeCatalogEntry*) ::calloc(
                 nEntriesPerSegment, sizeof(CVolumeCatalogEntry));
+        if (pSegment->catalogentries == nullptr)
+        {
+            m_nLastError = RT11_ERROR_NO_MEMORY;
+            return false;
+        }
 
         CVolumeCatalogEntry* pEntry = pSegment->catalogentries;
         uint16_t* pCatalog = pCatalogSector + 5;  // Начало описаний файлов
@@ -483,12 +624,22 @@ void CDiskImage::DecodeImageCatalog()
         pSegment->entriesused = entriesused;
 
         if (pSegment->nextsegment == 0) break;  // Конец цепочки сегментов
+        if (pSegment->nextsegment > m_volumeinfo.catalogsegmentcount ||
+            pSegment + 1 >= m_volumeinfo.catalogsegments + m_volumeinfo.catalogsegmentcount)
+        {
+            m_nLastError = RT11_ERROR_BAD_CATALOG;
+            return false;
+        }
 
         // Переходим к следующему сегменту каталога
         nCatalogBlock = nFirstCatalogBlock + (pSegment->nextsegment - 1) * 2;
         pBlock1 = (uint8_t*) GetBlock(nCatalogBlock);
+        if (pBlock1 == nullptr)
+            return false;
         memcpy(g_segmentBuffer, pBlock1, 512);
         pBlock2 = (uint8_t*) GetBlock(nCatalogBlock + 1);
+        if (pBlock2 == nullptr)
+            return false;
         memcpy(g_segmentBuffer + 256, pBlock2, 512);
         pCatalogSector = g_segmentBuffer;
         nCatalogSegmentNumber = pSegment->nextsegment;
@@ -496,6 +647,87 @@ void CDiskImage::DecodeImageCatalog()
     }
 
     m_volumeinfo.catalogentriescount = nCatalogEntriesCount;
+
+    g_stats.phaseseconds[STATS_PHASE_CATALOG] += StatsGetTime() - starttime;
+    return true;
+}
+
+// Initialize an empty volume: home block and catalog with one free area entry.
+// The data area is not written, so it stays sparse in a freshly created image file.
+bool CDiskImage::FormatVolume(int segments, int extrawords)
+{
+    if (segments < 1 || segments > RT11_MAX_CATALOG_SEGMENTS)
+    {
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
+        return false;
+    }
+    uint16_t nEntryLength = (uint16_t)(7 + extrawords);
+    if (extrawords < 0 || (512 - 5) / nEntryLength < 2)
+    {
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
+        return false;
+    }
+    uint16_t nFirstCatalogBlock = RT11_FIRST_CATALOG_BLOCK;
+    uint16_t nDataStartBlock = (uint16_t)(nFirstCatalogBlock + segments * 2);
+    int nVolumeBlocks = (m_nTotalBlocks > 65535) ? 65535 : m_nTotalBlocks;
+    if (nVolumeBlocks <= nDataStartBlock)
+    {
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
+        return false;
+    }
+
+    // Clean up home block, reserved blocks and the catalog
+    for (int block = 1; block < nDataStartBlock; block++)
+    {
+        void* pData = GetBlock(block);
+        if (pData == nullptr)
+            return false;
+        ::memset(pData, 0, RT11_BLOCK_SIZE);
+        MarkBlockChanged(block);
+    }
+
+    // Home block
+    uint8_t* pHomeSector = (uint8_t*) GetBlock(1);
+    if (pHomeSector == nullptr)
+        return false;
+    uint16_t* pwHomeSector = (uint16_t*) pHomeSector;
+    pwHomeSector[0722 / 2] = 1;  // Pack cluster size
+    pwHomeSector[0724 / 2] = nFirstCatalogBlock;
+    pwHomeSector[0726 / 2] = 0107123;  // System version: "V05" in RADIX50
+    memcpy(pHomeSector + 0730, "RT11A       ", 12);  // Volume id
+    memcpy(pHomeSector + 0744, "            ", 12);  // Owner name
+    memcpy(pHomeSector + 0760, "DECRT11A    ", 12);  // System id
+    uint16_t wChecksum = 0;
+    for (int i = 0; i < 0776 / 2; i++)
+        wChecksum += pwHomeSector[i];
+    pwHomeSector[0776 / 2] = wChecksum;
+
+    // First catalog segment: one empty entry for all the data area, then end-of-segment mark
+    memset(g_segmentBuffer, 0, sizeof(g_segmentBuffer));
+    g_segmentBuffer[0] = (uint16_t)segments;  // Total segments
+    g_segmentBuffer[1] = 0;  // Next segment
+    g_segmentBuffer[2] = 1;  // Highest segment in use
+    g_segmentBuffer[3] = (uint16_t)(extrawords * 2);  // Extra bytes per entry
+    g_segmentBuffer[4] = nDataStartBlock;
+    CVolumeCatalogEntry entry;
+    entry.status = RT11_STATUS_EMPTY;
+    entry.start = nDataStartBlock;
+    entry.length = (uint16_t)(nVolumeBlocks - nDataStartBlock);
+    entry.Pack(g_segmentBuffer + 5);
+    CVolumeCatalogEntry endmark;
+    endmark.status = RT11_STATUS_ENDMARK;
+    endmark.Pack(g_segmentBuffer + 5 + nEntryLength);
+
+    for (int i = 0; i < 2; i++)
+    {
+        void* pData = GetBlock(nFirstCatalogBlock + i);
+        if (pData == nullptr)
+            return false;
+        memcpy(pData, g_segmentBuffer + 256 * i, 512);
+        MarkBlockChanged(nFirstCatalogBlock + i);
+    }
+
+    return FlushChanges();
 }
 
 void CDiskImage::PrintTableHeader()
@@ -515,13 +747,18 @@ struct d_print
     uint16_t nFilesCount;
     uint16_t nBlocksCount;
     uint16_t nFreeBlocksCount;
+    int      format;
+    CDiskImage* di_p;
 };
 
 EIterOp cb_print_entries(CVolumeCatalogEntry* pEntry, void* opaque)
 {
     struct d_print* p = (struct d_print*)opaque;
 
-    pEntry->Print();
+    if (p->format == OUTPUT_FORMAT_TEXT)
+        pEntry->Print();
+    else
+        pEntry->PrintRecord(p->format, p->di_p->iterSegmentIdx(), p->di_p->iterFileIdx());
     if (pEntry->status == RT11_STATUS_EMPTY || pEntry->status == RT11_STATUS_TENTATIVE)
         p->nFreeBlocksCount += pEntry->length;
     else
@@ -561,8 +798,21 @@ bool CDiskImage::Iterate(lookup_fn_t lookup, void* opaque)
     return false;
 }
 
-void CDiskImage::PrintCatalogDirectory()
+void CDiskImage::PrintCatalogDirectory(int format)
 {
+    if (format != OUTPUT_FORMAT_TEXT)  // Records only, no header and totals
+    {
+        if (format == OUTPUT_FORMAT_CSV)
+            printf("segment,index,status,type,protected,rad50_0,rad50_1,rad50_2,name,ext,start,length,datepac,date\n");
+
+        struct d_print  res;
+        memset(&res, 0, sizeof(res));
+        res.format = format;
+        res.di_p = this;
+        Iterate(cb_print_entries, (void*)&res);
+        return;
+    }
+
     printf(" Volume: %s\n", m_volumeinfo.volumeid);
     printf(" Owner:  %s\n", m_volumeinfo.ownername);
     printf(" System: %s\n", m_volumeinfo.systemid);
@@ -634,12 +884,18 @@ EIterOp cb_save_one(CVolumeCatalogEntry* pEntry, void* opaque)
     if (foutput == nullptr)
     {
         fprintf(stderr, "Failed to open output file %s: error %d\n", r->hf_p->host_fn, errno);
+        r->di_p->SetLastError(RT11_ERROR_HOST_FILE);
         return IT_STOP;
     }
 
     for (uint16_t blockpos = 0; blockpos < filelength; blockpos++)
     {
         uint8_t* pData = (uint8_t*) r->di_p->GetBlock(filestart + blockpos);
+        if (pData == nullptr)
+        {
+            ::fclose(foutput);
+            return IT_STOP;
+        }
 
         size_t sizeToSave = RT11_BLOCK_SIZE;
         if (r->okTrimZeroes && blockpos == filelength - 1)  // Need to trim zeroes in the last block
@@ -654,12 +910,13 @@ EIterOp cb_save_one(CVolumeCatalogEntry* pEntry, void* opaque)
                 sizeToSave = RT11_BLOCK_SIZE;
         }
 
-        size_t nBytesWritten = ::fwrite(pData, sizeof(uint8_t), sizeToSave, foutput);
+        size_t nBytesWritten = StatsFWrite(pData, sizeof(uint8_t), sizeToSave, foutput);
         if (nBytesWritten < sizeToSave)
         {
             fprintf(stderr, "Failed to write output file\n");  //TODO: Show error number
             ::fclose(foutput);
             ::unlink(r->hf_p->host_fn);
+            r->di_p->SetLastError(RT11_ERROR_HOST_FILE);
             return IT_STOP;
         }
     }
@@ -668,7 +925,7 @@ EIterOp cb_save_one(CVolumeCatalogEntry* pEntry, void* opaque)
     return IT_STOP;
 }
 
-void CDiskImage::SaveEntryToExternalFile(const char * sFileName, bool trimZeroes)
+bool CDiskImage::SaveEntryToExternalFile(const char * sFileName, bool trimZeroes)
 {
     CHostFile hf(sFileName);
     struct d_save_one res;
@@ -676,18 +933,28 @@ void CDiskImage::SaveEntryToExternalFile(const char * sFileName, bool trimZeroes
     res.di_p = this;
     res.okTrimZeroes = trimZeroes;
 
+    m_nLastError = RT11_OK;
     if (!hf.ParseFileName63())
-        return; // error
+    {
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
+        return false;
+    }
     if (!Iterate(cb_save_one, &res))
     {
         fprintf(stderr, "Filename not found: %s\n", sFileName);
-        return;
+        m_nLastError = RT11_ERROR_FILE_NOT_FOUND;
+        return false;
     }
+    if (m_nLastError != RT11_OK)
+        return false;
+
     printf("\nDone.\n");
+    return true;
 }
 
-void CDiskImage::SaveAllEntriesToExternalFiles()
+bool CDiskImage::SaveAllEntriesToExternalFiles()
 {
+    m_nLastError = RT11_OK;
     printf("Extracting files:\n\n");
     PrintTableHeader();
 
@@ -735,19 +1002,26 @@ void CDiskImage::SaveAllEntriesToExternalFiles()
             FILE* foutput = fopen(filename, "wb");
             if (foutput == nullptr)
             {
-                printf("Failed to open output file %s: error %d\n", filename, errno);
-                return;
+                fprintf(stderr, "Failed to open output file %s: error %d\n", filename, errno);
+                m_nLastError = RT11_ERROR_HOST_FILE;
+                return false;
             }
 
             for (uint16_t blockpos = 0; blockpos < filelength; blockpos++)
             {
                 uint8_t* pData = (uint8_t*)GetBlock(filestart + blockpos);
-                size_t nBytesWritten = fwrite(pData, sizeof(uint8_t), RT11_BLOCK_SIZE, foutput);
+                if (pData == nullptr)
+                {
+                    fclose(foutput);
+                    return false;
+                }
+                size_t nBytesWritten = StatsFWrite(pData, sizeof(uint8_t), RT11_BLOCK_SIZE, foutput);
                 if (nBytesWritten < RT11_BLOCK_SIZE)
                 {
-                    printf("Failed to write output file\n");  //TODO: Show error number
+                    fprintf(stderr, "Failed to write output file\n");  //TODO: Show error number
                     fclose(foutput);
-                    return;
+                    m_nLastError = RT11_ERROR_HOST_FILE;
+                    return false;
                 }
             }
 
@@ -757,6 +1031,7 @@ void CDiskImage::SaveAllEntriesToExternalFiles()
     PrintTableDivider();
 
     printf("\nDone.\n");
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -779,9 +1054,10 @@ EIterOp cb_replace_one(CVolumeCatalogEntry* pEntry, void* opaque)
     // Проверить имя файла
     if (pEntry->length != r->hf_p->rt11_sz)
     {
-        fprintf(stderr, "File exists with different size (%d): %.6s.%.3s",
+        fprintf(stderr, "File exists with different size (%d): %.6s.%.3s\n",
                 pEntry->length, r->hf_p->name(), r->hf_p->ext());
-        exit(-1);
+        r->di_p->SetLastError(RT11_ERROR_SIZE_MISMATCH);
+        return IT_STOP;
     }
     // ok, меняем контент
     printf("\nCatalog entries to update:\n\n");
@@ -790,8 +1066,10 @@ EIterOp cb_replace_one(CVolumeCatalogEntry* pEntry, void* opaque)
     r->di_p->PrintTableDivider();
 
     printf("\nWriting file data...\n");
-    pEntry->Store(r->hf_p, r->di_p);
+    if (!pEntry->Store(r->hf_p, r->di_p))
+        return IT_STOP;
     // Сохраняем сегмент каталога на диск
+    printf("Updating catalog segment #%d...\n", r->di_p->iterSegmentIdx());
     r->di_p->UpdateCatalogSegment(r->di_p->iterSegmentIdx());
     return IT_STOP;
 }
@@ -814,7 +1092,8 @@ EIterOp cb_new_one(CVolumeCatalogEntry* pEntry, void* opaque)
     {
         // FIXME
         fprintf(stderr, "New catalog segment needed - not implemented now, sorry.\n");
-        exit(-1);
+        r->di_p->SetLastError(RT11_ERROR_SEGMENT_FULL);
+        return IT_STOP;
     }
 
     printf("\nCatalog entries to update:\n\n");
@@ -839,8 +1118,10 @@ EIterOp cb_new_one(CVolumeCatalogEntry* pEntry, void* opaque)
     }
 
     printf("\nWriting file data...\n");
-    pEntry->Store(r->hf_p, r->di_p);
+    if (!pEntry->Store(r->hf_p, r->di_p))
+        return IT_STOP;
     // Сохраняем сегмент каталога на диск
+    printf("Updating catalog segment #%d...\n", r->di_p->iterSegmentIdx());
     r->di_p->UpdateCatalogSegment(r->di_p->iterSegmentIdx());
     return IT_STOP;
 }
@@ -856,30 +1137,49 @@ EIterOp cb_new_one(CVolumeCatalogEntry* pEntry, void* opaque)
 //NOTE: Пока НЕ обрабатываем ситуацию открытия нового блока каталога - выходим по ошибке
 //NOTE: Проверяем что файл с таким именем уже есть,
 //      если длина не совпадает, то выходим по ошибке
-void CDiskImage::AddFileToImage(const char * sFileName)
+bool CDiskImage::AddFileToImage(const char * sFileName)
 {
     CHostFile   hfile(sFileName);
-    struct d_add_one   res;
-    res.hf_p = &hfile;
-    res.di_p = this;
-
 
     if (!hfile.ParseFileName63())
-        return; // error
+    {
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
+        return false;
+    }
     if (!hfile.read())
-        return; // error
+    {
+        m_nLastError = RT11_ERROR_HOST_FILE;
+        return false;
+    }
+
+    return AddFileToImage(&hfile);
+}
+
+// Помещение в образ файла, уже прочитанного в память; имя файла должно быть разобрано ParseFileName63()
+bool CDiskImage::AddFileToImage(CHostFile* pFile)
+{
+    struct d_add_one   res;
+    res.hf_p = pFile;
+    res.di_p = this;
+
+    m_nLastError = RT11_OK;
     // попытаемся заменить существующий файл
     if (!Iterate(cb_replace_one, &res))
     {
         // ищем пустое место и вставляем там файл
         if (!Iterate(cb_new_one, &res))
         {
-            fprintf(stderr, "Unable to find empty space for: %s\n", sFileName);
-            return;
+            fprintf(stderr, "Unable to find empty space for: %s\n", pFile->host_fn);
+            m_nLastError = RT11_ERROR_NO_SPACE;
+            return false;
         }
     }
-    FlushChanges();
+    if (m_nLastError != RT11_OK)
+        return false;
+    if (!FlushChanges())
+        return false;
     printf("\nDone.\n");
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -909,7 +1209,7 @@ EIterOp cb_remove_one(CVolumeCatalogEntry* pEntry, void* opaque)
     pEntry->status = RT11_STATUS_EMPTY;
 
     // Сохраняем сегмент каталога на диск
-    printf("Updating catalog segment...\n");
+    printf("Updating catalog segment #%d...\n", r->di_p->iterSegmentIdx());
     r->di_p->UpdateCatalogSegment(r->di_p->iterSegmentIdx());
 
     return IT_STOP;
@@ -919,23 +1219,30 @@ EIterOp cb_remove_one(CVolumeCatalogEntry* pEntry, void* opaque)
 // Алгоритм:
 //   Перебираются все записи каталога, пока не будет найдена запись данного файла
 //   Запись каталога помечается как удалённая
-void CDiskImage::DeleteFileFromImage(const char * sFileName)
+bool CDiskImage::DeleteFileFromImage(const char * sFileName)
 {
     CHostFile   hf(sFileName);
     struct d_remove_one   res;
     res.hf_p = &hf;
     res.di_p = this;
 
+    m_nLastError = RT11_OK;
     if (!hf.ParseFileName63())
-        return; // error
+    {
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
+        return false;
+    }
     if (!Iterate(cb_remove_one, &res))
     {
         fprintf(stderr, "Filename not found: %s\n", sFileName);
-        return;
+        m_nLastError = RT11_ERROR_FILE_NOT_FOUND;
+        return false;
     }
-    FlushChanges();
+    if (m_nLastError != RT11_OK || !FlushChanges())
+        return false;
 
     printf("\nDone.\n");
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -965,6 +1272,7 @@ EIterOp cb_save_unused(CVolumeCatalogEntry* pEntry, void* opaque)
     if (foutput == nullptr)
     {
         fprintf(stderr, "Failed to open output file %s: error %d\n", filename, errno);
+        r->di_p->SetLastError(RT11_ERROR_HOST_FILE);
         return IT_STOP;
     }
 
@@ -975,14 +1283,21 @@ EIterOp cb_save_unused(CVolumeCatalogEntry* pEntry, void* opaque)
         {
             fprintf(stderr, "WARNING: For file %s block %d is beyond the end "
                     "of the image file.\n", filename, blockno);
+            ::fclose(foutput);
             return IT_STOP;
         }
         uint8_t* pData = (uint8_t*)r->di_p->GetBlock(blockno);
-        size_t nBytesWritten = ::fwrite(pData, sizeof(uint8_t), RT11_BLOCK_SIZE, foutput);
+        if (pData == nullptr)
+        {
+            ::fclose(foutput);
+            return IT_STOP;
+        }
+        size_t nBytesWritten = StatsFWrite(pData, sizeof(uint8_t), RT11_BLOCK_SIZE, foutput);
         if (nBytesWritten < RT11_BLOCK_SIZE)
         {
             fprintf(stderr, "Failed to write output file\n");  //TODO: Show error number
             ::fclose(foutput);
+            r->di_p->SetLastError(RT11_ERROR_HOST_FILE);
             return IT_STOP;
         }
     }
@@ -990,21 +1305,24 @@ EIterOp cb_save_unused(CVolumeCatalogEntry* pEntry, void* opaque)
     return IT_NEXT;
 }
 
-void CDiskImage::SaveAllUnusedEntriesToExternalFiles()
+bool CDiskImage::SaveAllUnusedEntriesToExternalFiles()
 {
     struct d_save_unused    res;
     res.di_p = this;
     res.unusedno = 0;
 
+    m_nLastError = RT11_OK;
     printf("Extracting files:\n\n");
     PrintTableHeader();
 
     Iterate(cb_save_unused, &res);
 
     PrintTableDivider();
-    FlushChanges();
+    if (m_nLastError != RT11_OK)
+        return false;
 
     printf("\nDone.\n");
+    return true;
 }
 
 
@@ -1098,5 +1416,51 @@ void CVolumeCatalogEntry::Print()
     }
 }
 
+// Copy the string without leading and trailing spaces
+static void TrimSpaces(const char * src, char * dest, size_t sz)
+{
+    while (*src == ' ') src++;
+    size_t len = strlen(src);
+    while (len > 0 && src[len - 1] == ' ') len--;
+    if (len >= sz) len = sz - 1;
+    memcpy(dest, src, len);
+    dest[len] = 0;
+}
+
+void CVolumeCatalogEntry::PrintRecord(int format, int segment, int index)
+{
+    const char * type = "perm";
+    if (status & RT11_STATUS_EMPTY)
+        type = "empty";
+    else if (status & RT11_STATUS_TENTATIVE)
+        type = "tentative";
+    bool okProtected = (status & RT11_STATUS_PROTECTED) != 0;
+
+    char sname[8], sext[4], datestr[16];
+    sname[0] = sext[0] = datestr[0] = 0;
+    if ((status & (RT11_STATUS_EMPTY | RT11_STATUS_TENTATIVE)) == 0)
+    {
+        TrimSpaces(name, sname, sizeof(sname));
+        TrimSpaces(ext, sext, sizeof(sext));
+        char buffer[16];
+        rt11date_str(datepac, buffer, sizeof(buffer));
+        TrimSpaces(buffer, datestr, sizeof(datestr));
+    }
+
+    // RADIX50 characters and the date need no escaping neither in JSON nor in CSV
+    if (format == OUTPUT_FORMAT_JSON)
+        printf("{\"segment\":%d,\"index\":%d,\"status\":%u,\"type\":\"%s\",\"protected\":%s,"
+               "\"rad50\":[%u,%u,%u],\"name\":\"%s\",\"ext\":\"%s\",\"start\":%u,\"length\":%u,"
+               "\"datepac\":%u,\"date\":\"%s\"}\n",
+               segment, index, status, type, okProtected ? "true" : "false",
+               namerad50[0], namerad50[1], namerad50[2], sname, sext, start, length,
+               datepac, datestr);
+    else
+        printf("%d,%d,%u,%s,%d,%u,%u,%u,%s,%s,%u,%u,%u,%s\n",
+               segment, index, status, type, okProtected ? 1 : 0,
+               namerad50[0], namerad50[1], namerad50[2], sname, sext, start, length,
+               datepac, datestr);
+}
+
 
 //////////////////////////////////////////////////////////////////////
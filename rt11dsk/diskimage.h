@@ -25,6 +25,10 @@ class CDiskImage;
 
 #define NETRT11_IMAGE_HEADER_SIZE  256
 
+/* Catalog limits, see DecodeImageCatalog() */
+#define RT11_FIRST_CATALOG_BLOCK    6
+#define RT11_MAX_CATALOG_SEGMENTS   31
+
 
 //////////////////////////////////////////////////////////////////////
 
@@ -55,7 +59,8 @@ public:
     void Unpack(uint16_t const * pSrc, uint16_t filestartblock);  // Распаковка записи из каталога
     void Pack(uint16_t* pDest);   // Упаковка записи в каталог
     void Print();  // Печать строки каталога на консоль
-    void Store(CHostFile* hf_p, CDiskImage* di_p); // Сохранить файл в образ диска
+    void PrintRecord(int format, int segment, int index);  // Print the entry as JSON or CSV record
+    bool Store(CHostFile* hf_p, CDiskImage* di_p); // Сохранить файл в образ диска
 };
 
 // Структура данных для сегмента каталога
@@ -106,23 +111,32 @@ enum EIterOp
 
 typedef EIterOp (*lookup_fn_t)(CVolumeCatalogEntry* pEntry, void* opaque);
 
+//////////////////////////////////////////////////////////////////////
+
+// Set the image file size; the data area is left sparse, or reserved on disk when okAllocate is set
+bool PrepareImageFileSize(FILE* fpFile, long size, bool okAllocate);
+
 //////////////////////////////////////////////////////////////////////
 // Образ диска в формате .dsk либо .rtd
 
+class CBlockDevice;
+
 class CDiskImage
 {
 protected:
-    FILE*           m_fpFile;
-    bool            m_okCloseFile;   // true - close m_fpFile in Detach(), false - do not close it
+    CBlockDevice*   m_pDevice;
+    bool            m_okOwnDevice;   // true - delete m_pDevice in Detach(), false - do not delete it
     bool            m_okReadOnly;
     long            m_lStartOffset;  // First block start offset in the image file
     bool            m_okInterleaving;  // Sector interleaving used for MS0515 disks
     int             m_nTotalBlocks;  // Total blocks in the image
     int             m_nCacheBlocks;  // Cache size in blocks
+    int             m_nCacheSize;    // Cache size limit in blocks, applied in Attach()
     int             m_seg_idx; // current segment number in the iterator
     int             m_file_idx; // current file index in the iterator
     CCachedBlock*   m_pCache;
     CVolumeInformation m_volumeinfo;
+    int             m_nLastError;    // RT11_ERROR_xxx of the last failed operation
 
 public:
     CDiskImage();
@@ -130,12 +144,17 @@ public:
 
 public:
     bool Attach(const char * sFileName, long offset = 0, bool interleaving = false);
-    bool Attach(FILE* fpfile, long offset, bool interleaving, int blocks, bool readonly);
+    bool Attach(CBlockDevice* pDevice, long offset, bool interleaving, int blocks, bool okOwnDevice);
+    bool Create(const char * sFileName, int blocks, long offset, bool interleaving, bool okAllocate);
     void Detach();
+    bool IsAttached() const { return m_pDevice != nullptr; }
+    int GetLastError() const { return m_nLastError; }
+    const CVolumeInformation& GetVolumeInfo() const { return m_volumeinfo; }
 
 public:
     int IsReadOnly() const { return m_okReadOnly; }
     int GetBlockCount() const { return m_nTotalBlocks; }
+    void SetCacheSize(int blocks) { m_nCacheSize = blocks; }
     int iterSegmentIdx(void) const { return m_seg_idx; }
     int iterFileIdx(void) const { return m_file_idx; }
     int getEntriesPerSegment(void) const
@@ -148,23 +167,26 @@ public:
                m_volumeinfo.catalogentriespersegment;
     }
 public:
-    void PrintCatalogDirectory();
+    void PrintCatalogDirectory(int format = OUTPUT_FORMAT_TEXT);
     void PrintTableHeader();
     void PrintTableDivider();
-    void* GetBlock(int nBlock);
+    void* GetBlock(int nBlock);  // nullptr on error, see GetLastError()
     void MarkBlockChanged(int nBlock);
-    void FlushChanges();
-    void DecodeImageCatalog();
-    void UpdateCatalogSegment(int segno);
-    void SaveEntryToExternalFile(const char * sFileName, bool trimZeroes);
-    void SaveAllEntriesToExternalFiles();
-    void AddFileToImage(const char * sFileName);
-    void DeleteFileFromImage(const char * sFileName);
-    void SaveAllUnusedEntriesToExternalFiles();
+    bool FlushChanges();
+    bool DecodeImageCatalog();
+    bool FormatVolume(int segments, int extrawords);
+    bool UpdateCatalogSegment(int segno);
+    bool SaveEntryToExternalFile(const char * sFileName, bool trimZeroes);
+    bool SaveAllEntriesToExternalFiles();
+    bool AddFileToImage(const char * sFileName);
+    bool AddFileToImage(CHostFile* pFile);
+    bool DeleteFileFromImage(const char * sFileName);
+    bool SaveAllUnusedEntriesToExternalFiles();
     bool Iterate(lookup_fn_t, void* opaque);
+    void SetLastError(int error) { m_nLastError = error; }
 
 private:
-    void PostAttach();
+    bool PostAttach();
     long GetBlockOffset(int nBlock) const;
 };
 
@@ -12,6 +12,7 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 
 #include "rt11dsk.h"
 #include "hardimage.h"
+#include "blockdevice.h"
 #include "diskimage.h"
 
 
@@ -62,12 +63,14 @@ static uint8_t g_hardbuffer[512];
 CHardImage::CHardImage()
 {
     m_okReadOnly = m_okInverted = false;
-    m_fpFile = nullptr;
+    m_pDevice = nullptr;
+    m_okOwnDevice = true;
     m_lFileSize = 0;
     m_drivertype = HDD_DRIVER_UNKNOWN;
     m_nSectorsPerTrack = 0;  m_nSidesPerTrack = 0;  m_nPartitions = 0;
     m_pPartitionInfos = nullptr;
     m_okChecksum = false;
+    m_nLastError = RT11_OK;
 }
 
 CHardImage::~CHardImage()
@@ -77,28 +80,33 @@ CHardImage::~CHardImage()
 
 bool CHardImage::Attach(const char * sImageFileName, bool okHard32M)
 {
-    // Try to open as Normal first, then as ReadOnly
-    m_okReadOnly = false;
-    m_fpFile = ::fopen(sImageFileName, "r+b");
-    if (m_fpFile == nullptr)
+    CBlockDevice* pDevice = CFileBlockDevice::Open(sImageFileName);
+    if (pDevice == nullptr)
     {
-        m_okReadOnly = true;
-        m_fpFile = ::fopen(sImageFileName, "rb");
-        if (m_fpFile == nullptr)
-            return false;
+        m_nLastError = RT11_ERROR_IO;
+        return false;
     }
 
+    return Attach(pDevice, okHard32M, true);
+}
+
+// Use the device as a hard disk image; delete the device in Detach() method when okOwnDevice is set.
+bool CHardImage::Attach(CBlockDevice* pDevice, bool okHard32M, bool okOwnDevice)
+{
+    m_pDevice = pDevice;
+    m_okOwnDevice = okOwnDevice;
+    m_okReadOnly = pDevice->IsReadOnly();
+    m_nLastError = RT11_OK;
+
     // Get file size
-    ::fseek(m_fpFile, 0, SEEK_END);
-    m_lFileSize = ::ftell(m_fpFile);
+    m_lFileSize = pDevice->GetSize();
 
     // Read first 512 bytes
-    ::fseek(m_fpFile, 0, SEEK_SET);
-    size_t lBytesRead = ::fread(g_hardbuffer, 1, 512, m_fpFile);
-    if (lBytesRead != 512)
+    if (!pDevice->Read(0, g_hardbuffer, 512))
     {
-        printf("Failed to read first 512 bytes of the hard disk image file.\n");
-        exit(-1);
+        Detach();
+        m_nLastError = RT11_ERROR_IO;
+        return false;
     }
 
     m_drivertype = HDD_DRIVER_UNKNOWN;
@@ -135,13 +143,15 @@ bool CHardImage::Attach(const char * sImageFileName, bool okHard32M)
         m_nSectorsPerTrack = pwHardBuffer[4];
         if (m_nSectorsPerTrack == 0)
         {
-            printf("Home block Sector per Side value invalid.\n");
+            Detach();
+            m_nLastError = RT11_ERROR_BAD_SECTORS;
             return false;
         }
         m_nSidesPerTrack = (uint8_t)(pwHardBuffer[5] / m_nSectorsPerTrack);
         if (m_nSidesPerTrack == 0)
         {
-            printf("Home block Sector per Track value invalid.\n");
+            Detach();
+            m_nLastError = RT11_ERROR_BAD_SIDES;
             return false;
         }
 
@@ -183,9 +193,7 @@ bool CHardImage::Attach(const char * sImageFileName, bool okHard32M)
         // Calculate and verify checksum
         uint32_t checksum = CheckHomeBlockChecksum(g_hardbuffer);
         //wprintf(_T("Home block checksum is 0x%08lx.\n"), checksum);
-        m_okChecksum = checksum == 0;
-        if (checksum != 0)
-            printf("Home block checksum is incorrect!\n");
+        m_okChecksum = checksum == 0;  // Not fatal: see IsChecksum(), the commands that need it refuse to work
 
         m_nSectorsPerTrack = g_hardbuffer[0];
         m_nSidesPerTrack = g_hardbuffer[1];
@@ -228,22 +236,110 @@ bool CHardImage::Attach(const char * sImageFileName, bool okHard32M)
     return true;
 }
 
+// Create new image file with the partition table in the given layout, and attach to it.
+// Partitions are not initialized; the file is allocated without writing the data.
+bool CHardImage::Create(const char * sImageFileName, HDDDriverType drivertype, int partitions, int partblocks, bool okAllocate)
+{
+    int maxpartitions = (drivertype == HDD_DRIVER_HD) ? 8 : ((drivertype == HDD_DRIVER_HZ) ? 24 : 23);
+    if (partitions < 1 || partitions > maxpartitions)
+    {
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
+        return false;
+    }
+    if (drivertype == HDD_DRIVER_HZ)
+        partblocks = 65536;  // Разделы по 32 МБ
+    else if (partblocks < 1 || partblocks > 65535)
+    {
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
+        return false;
+    }
+
+    // Prepare the home block
+    memset(g_hardbuffer, 0, sizeof(g_hardbuffer));
+    uint16_t * pwHardBuffer = (uint16_t*)g_hardbuffer;
+    long lFileSize = 0;
+    if (drivertype == HDD_DRIVER_HZ)  // No home block, partitions follow one by one
+    {
+        lFileSize = ((long)partitions) * partblocks * RT11_BLOCK_SIZE;
+    }
+    else if (drivertype == HDD_DRIVER_HD)  // Partitions start at cylinder boundary
+    {
+        int cylblocks = HDD_CREATE_SECTORS * HDD_CREATE_HEADS;
+        pwHardBuffer[0] = 0x54A9;  pwHardBuffer[1] = 0xFFEF;  pwHardBuffer[2] = 0xFEFF;
+        pwHardBuffer[4] = HDD_CREATE_SECTORS;
+        pwHardBuffer[5] = cylblocks;
+        int cylinder = 1;
+        for (int i = 0; i < partitions; i++)
+        {
+            pwHardBuffer[6 + i] = (uint16_t)cylinder;
+            pwHardBuffer[14 + i] = (uint16_t)partblocks;
+            cylinder += (partblocks + cylblocks - 1) / cylblocks;
+        }
+        lFileSize = ((long)cylinder) * cylblocks * RT11_BLOCK_SIZE;
+    }
+    else  // ID or WD
+    {
+        g_hardbuffer[0] = HDD_CREATE_SECTORS;
+        g_hardbuffer[1] = HDD_CREATE_HEADS;
+        for (int i = 0; i < partitions; i++)
+            pwHardBuffer[1 + i] = (uint16_t)partblocks;
+        if (drivertype == HDD_DRIVER_WD)
+            pwHardBuffer[0122 / 2] = 1;  // Wait time, non-zero for WD driver
+        // Words 254-255 is negated 32-bit sum of words 0-253, see CheckHomeBlockChecksum()
+        uint32_t sum = 0;
+        for (int i = 0; i < 254; i++)
+            sum += pwHardBuffer[i];
+        sum = 0 - sum;
+        pwHardBuffer[254] = (uint16_t)(sum & 0xffff);
+        pwHardBuffer[255] = (uint16_t)(sum >> 16);
+        lFileSize = RT11_BLOCK_SIZE + ((long)partitions) * partblocks * RT11_BLOCK_SIZE;
+    }
+
+    FILE* fpFile = ::fopen(sImageFileName, "w+b");
+    if (fpFile == nullptr)
+    {
+        m_nLastError = RT11_ERROR_IO;
+        return false;
+    }
+    if ((drivertype != HDD_DRIVER_HZ &&
+         StatsFWrite(g_hardbuffer, 1, RT11_BLOCK_SIZE, fpFile) != RT11_BLOCK_SIZE) ||
+        !PrepareImageFileSize(fpFile, lFileSize, okAllocate))
+    {
+        ::fclose(fpFile);
+        m_nLastError = RT11_ERROR_IO;
+        return false;
+    }
+
+    return Attach(new CFileBlockDevice(fpFile, false, true), drivertype == HDD_DRIVER_HZ, true);
+}
+
 void CHardImage::Detach()
 {
-    if (m_fpFile != nullptr)
+    if (m_pDevice != nullptr)
     {
-        ::fclose(m_fpFile);
-        m_fpFile = nullptr;
+        m_pDevice->Flush();
+        if (m_okOwnDevice)
+            delete m_pDevice;
+        m_pDevice = nullptr;
     }
+    if (m_pPartitionInfos != nullptr)
+    {
+        ::free(m_pPartitionInfos);
+        m_pPartitionInfos = nullptr;
+    }
+    m_nPartitions = 0;
 }
 
 bool CHardImage::PrepareDiskImage(int partition, CDiskImage * pdiskimage)
 {
     if (partition < 0 || partition >= m_nPartitions)
+    {
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
         return false;  // Wrong partition number
+    }
 
     CPartitionInfo* pinfo = m_pPartitionInfos + partition;
-    return pdiskimage->Attach(m_fpFile, pinfo->offset, pinfo->interleaving, pinfo->blocks, m_okReadOnly);
+    return pdiskimage->Attach(m_pDevice, pinfo->offset, pinfo->interleaving, pinfo->blocks, false);
 }
 
 void CHardImage::PrintImageInfo()
@@ -253,8 +349,24 @@ void CHardImage::PrintImageInfo()
         printf("Disk geometry: %d sectors/track, %d heads\n", m_nSectorsPerTrack, m_nSidesPerTrack);
 }
 
-void CHardImage::PrintPartitionTable()
+void CHardImage::PrintPartitionTable(int format)
 {
+    if (format != OUTPUT_FORMAT_TEXT)  // One record per partition, no totals
+    {
+        if (format == OUTPUT_FORMAT_CSV)
+            printf("partition,blocks,bytes,offset\n");
+        for (int i = 0; i < m_nPartitions; i++)
+        {
+            const CPartitionInfo* pinfo = m_pPartitionInfos + i;
+            long bytes = ((long)pinfo->blocks) * 512;
+            if (format == OUTPUT_FORMAT_JSON)
+                printf("{\"partition\":%d,\"blocks\":%d,\"bytes\":%ld,\"offset\":%ld}\n", i, pinfo->blocks, bytes, pinfo->offset);
+            else
+                printf("%d,%d,%ld,%ld\n", i, pinfo->blocks, bytes, pinfo->offset);
+        }
+        return;
+    }
+
     printf("  #  Blocks  Bytes      Offset\n"
            "---  ------  ---------  ----------\n");
 
@@ -270,20 +382,22 @@ void CHardImage::PrintPartitionTable()
     printf("     %6ld\n", blocks);
 }
 
-void CHardImage::SavePartitionToFile(int partition, const char * filename)
+bool CHardImage::SavePartitionToFile(int partition, const char * filename)
 {
     if (partition < 0 || partition >= m_nPartitions)
     {
-        printf("Wrong partition number specified.\n");
-        return;
+        fprintf(stderr, "Wrong partition number specified.\n");
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
+        return false;
     }
 
     // Open output file
     FILE* foutput = fopen(filename, "wb");
     if (foutput == nullptr)
     {
-        printf("Failed to open output file %s: error %d\n", filename, errno);
-        return;
+        fprintf(stderr, "Failed to open output file %s: error %d\n", filename, errno);
+        m_nLastError = RT11_ERROR_HOST_FILE;
+        return false;
     }
 
     CPartitionInfo* pPartInfo = m_pPartitionInfos + partition;
@@ -291,39 +405,41 @@ void CHardImage::SavePartitionToFile(int partition, const char * filename)
     printf("Saving %d blocks, %d bytes.\n", pPartInfo->blocks, ((int)pPartInfo->blocks) * RT11_BLOCK_SIZE);
 
     // Copy data
-    ::fseek(m_fpFile, pPartInfo->offset, SEEK_SET);
     for (int i = 0; i < pPartInfo->blocks; i++)
     {
-        size_t lBytesRead = ::fread(g_hardbuffer, sizeof(uint8_t), RT11_BLOCK_SIZE, m_fpFile);
-        if (lBytesRead != RT11_BLOCK_SIZE)
+        if (!m_pDevice->Read(pPartInfo->offset + ((long)i) * RT11_BLOCK_SIZE, g_hardbuffer, RT11_BLOCK_SIZE))
         {
-            printf("Failed to read hard disk image file.\n");
+            fprintf(stderr, "Failed to read hard disk image file.\n");
             fclose(foutput);
-            return;
+            m_nLastError = RT11_ERROR_IO;
+            return false;
         }
 
         if (m_okInverted)
             InvertBuffer(g_hardbuffer);
 
-        size_t nBytesWritten = fwrite(g_hardbuffer, sizeof(uint8_t), RT11_BLOCK_SIZE, foutput);
+        size_t nBytesWritten = StatsFWrite(g_hardbuffer, sizeof(uint8_t), RT11_BLOCK_SIZE, foutput);
         if (nBytesWritten != RT11_BLOCK_SIZE)
         {
-            printf("Failed to write to output file.\n");
+            fprintf(stderr, "Failed to write to output file.\n");
             fclose(foutput);
-            return;
+            m_nLastError = RT11_ERROR_HOST_FILE;
+            return false;
         }
     }
     fclose(foutput);
 
     printf("\nDone.\n");
+    return true;
 }
 
-void CHardImage::UpdatePartitionFromFile(int partition, const char * filename)
+bool CHardImage::UpdatePartitionFromFile(int partition, const char * filename)
 {
     if (partition < 0 || partition >= m_nPartitions)
     {
-        printf("Wrong partition number specified.\n");
-        return;
+        fprintf(stderr, "Wrong partition number specified.\n");
+        m_nLastError = RT11_ERROR_BAD_PARAMETER;
+        return false;
     }
 
     //TODO: Check if m_okReadOnly
@@ -332,55 +448,58 @@ void CHardImage::UpdatePartitionFromFile(int partition, const char * filename)
     FILE* finput = fopen(filename, "rb");
     if (finput == nullptr)
     {
-        printf("Failed to open input file %s: error %d\n", filename, errno);
-        return;
+        fprintf(stderr, "Failed to open input file %s: error %d\n", filename, errno);
+        m_nLastError = RT11_ERROR_HOST_FILE;
+        return false;
     }
 
     CPartitionInfo* pPartInfo = m_pPartitionInfos + partition;
     printf("Updating partition number %d from file %s\n", partition, filename);
 
     // Get input file size, compare to the partition size
-    ::fseek(finput, 0, SEEK_END);
+    StatsFSeek(finput, 0, SEEK_END);
     long lFileLength = ::ftell(finput);
     if (lFileLength != ((long)pPartInfo->blocks) * RT11_BLOCK_SIZE)
     {
-        printf("The input file has wrong size: %ld, expected %ld.\n", lFileLength, ((long)pPartInfo->blocks) * RT11_BLOCK_SIZE);
+        fprintf(stderr, "The input file has wrong size: %ld, expected %ld.\n", lFileLength, ((long)pPartInfo->blocks) * RT11_BLOCK_SIZE);
         fclose(finput);
-        return;
+        m_nLastError = RT11_ERROR_SIZE_MISMATCH;
+        return false;
     }
 
     printf("Copying %d blocks, %d bytes.\n", pPartInfo->blocks, ((int)pPartInfo->blocks) * RT11_BLOCK_SIZE);
 
     // Copy data
-    ::fseek(finput, 0, SEEK_SET);
-    ::fseek(m_fpFile, pPartInfo->offset, SEEK_SET);
+    StatsFSeek(finput, 0, SEEK_SET);
     for (int i = 0; i < pPartInfo->blocks; i++)
     {
-        size_t lBytesRead = ::fread(g_hardbuffer, sizeof(uint8_t), RT11_BLOCK_SIZE, finput);
+        size_t lBytesRead = StatsFRead(g_hardbuffer, sizeof(uint8_t), RT11_BLOCK_SIZE, finput);
         if (lBytesRead != RT11_BLOCK_SIZE)
         {
-            printf("Failed to read input file.\n");
+            fprintf(stderr, "Failed to read input file.\n");
             fclose(finput);
-            return;
+            m_nLastError = RT11_ERROR_HOST_FILE;
+            return false;
         }
 
         if (m_okInverted)
             InvertBuffer(g_hardbuffer);
 
-        size_t nBytesWritten = fwrite(g_hardbuffer, sizeof(uint8_t), RT11_BLOCK_SIZE, m_fpFile);
-        if (nBytesWritten != RT11_BLOCK_SIZE)
+        if (!m_pDevice->Write(pPartInfo->offset + ((long)i) * RT11_BLOCK_SIZE, g_hardbuffer, RT11_BLOCK_SIZE))
         {
-            printf("Failed to write to hard image file.\n");
+            fprintf(stderr, "Failed to write to hard image file.\n");
             fclose(finput);
-            return;
+            m_nLastError = RT11_ERROR_IO;
+            return false;
         }
     }
     fclose(finput);
 
     printf("\nDone.\n");
+    return true;
 }
 
-void CHardImage::InvertImage()
+bool CHardImage::InvertImage()
 {
     long blocks = m_lFileSize / RT11_BLOCK_SIZE;
     printf("Inverting %ld blocks, %ld bytes.\n", blocks, blocks * RT11_BLOCK_SIZE);
@@ -389,26 +508,25 @@ void CHardImage::InvertImage()
     {
         long offset = i * RT11_BLOCK_SIZE;
 
-        ::fseek(m_fpFile, offset, SEEK_SET);
-        size_t lBytesRead = ::fread(g_hardbuffer, sizeof(uint8_t), RT11_BLOCK_SIZE, m_fpFile);
-        if (lBytesRead != RT11_BLOCK_SIZE)
+        if (!m_pDevice->Read(offset, g_hardbuffer, RT11_BLOCK_SIZE))
         {
-            printf("Failed to read hard disk image file.\n");
-            return;
+            fprintf(stderr, "Failed to read hard disk image file.\n");
+            m_nLastError = RT11_ERROR_IO;
+            return false;
         }
 
         InvertBuffer(g_hardbuffer);
 
-        ::fseek(m_fpFile, offset, SEEK_SET);
-        size_t nBytesWritten = fwrite(g_hardbuffer, sizeof(uint8_t), RT11_BLOCK_SIZE, m_fpFile);
-        if (nBytesWritten != RT11_BLOCK_SIZE)
+        if (!m_pDevice->Write(offset, g_hardbuffer, RT11_BLOCK_SIZE))
         {
-            printf("Failed to write to hard disk image file.\n");
-            return;
+            fprintf(stderr, "Failed to write to hard disk image file.\n");
+            m_nLastError = RT11_ERROR_IO;
+            return false;
         }
     }
 
     printf("\nDone.\n");
+    return true;
 }
 
 
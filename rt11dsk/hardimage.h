@@ -23,13 +23,19 @@ enum HDDDriverType
     HDD_DRIVER_HZ = 21,
 };
 
+// Geometry written to the home block of a newly created image
+#define HDD_CREATE_SECTORS      16
+#define HDD_CREATE_HEADS        4
+
 struct CPartitionInfo;
 class CDiskImage;
+class CBlockDevice;
 
 class CHardImage
 {
 protected:
-    FILE*           m_fpFile;
+    CBlockDevice*   m_pDevice;
+    bool            m_okOwnDevice;      // true - delete m_pDevice in Detach()
     bool            m_okReadOnly;
     bool            m_okInverted;       // Inverted image
     long            m_lFileSize;
@@ -39,6 +45,7 @@ protected:
     int             m_nPartitions;
     CPartitionInfo* m_pPartitionInfos;
     bool            m_okChecksum;
+    int             m_nLastError;       // RT11_ERROR_xxx of the last failed operation
 
 public:
     CHardImage();
@@ -46,6 +53,8 @@ public:
 
 public:
     bool Attach(const char * sFileName, bool okHard32M);
+    bool Attach(CBlockDevice* pDevice, bool okHard32M, bool okOwnDevice);
+    bool Create(const char * sFileName, HDDDriverType drivertype, int partitions, int partblocks, bool okAllocate);
     void Detach();
     bool PrepareDiskImage(int partition, CDiskImage* pdiskimage);
 
@@ -53,13 +62,14 @@ public:
     bool IsReadOnly() const { return m_okReadOnly; }
     int GetPartitionCount() const { return m_nPartitions; }
     bool IsChecksum() const { return m_okChecksum; }
+    int GetLastError() const { return m_nLastError; }
 
 public:
     void PrintImageInfo();
-    void PrintPartitionTable();
-    void SavePartitionToFile(int partition, const char * filename);
-    void UpdatePartitionFromFile(int partition, const char * filename);
-    void InvertImage();
+    void PrintPartitionTable(int format = OUTPUT_FORMAT_TEXT);
+    bool SavePartitionToFile(int partition, const char * filename);
+    bool UpdatePartitionFromFile(int partition, const char * filename);
+    bool InvertImage();
 };
 
 //////////////////////////////////////////////////////////////////////
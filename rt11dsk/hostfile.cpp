@@ -79,6 +79,22 @@ bool CHostFile::ParseFileName63(void)
     return true;
 }
 
+bool CHostFile::assign(const void* src, size_t size, time_t mtime)
+{
+    if (size == 0 || size > RT11_MAX_FILE_SIZE)
+        return false;
+
+    if (data)
+        free(data);
+    mtime_sec = mtime;
+    rt11_sz = (uint16_t) ((size + RT11_BLOCK_SIZE - 1) / RT11_BLOCK_SIZE);
+    data = ::calloc(((size_t) rt11_sz) * RT11_BLOCK_SIZE, 1);
+    if (data == nullptr)
+        return false;
+    memcpy(data, src, size);
+    return true;
+}
+
 bool CHostFile::read(void)
 {
     struct stat st;
@@ -117,7 +133,7 @@ bool CHostFile::read(void)
 
     // Выделяем память и считываем данные файла
     data = ::calloc(dwFileSize, 1);
-    size_t lBytesRead = ::fread(data, 1, st.st_size, fpFile);
+    size_t lBytesRead = StatsFRead(data, 1, st.st_size, fpFile);
     if ((off_t)lBytesRead != st.st_size)
     {
         fprintf(stderr, "Failed to read the file: %s\n", host_fn);
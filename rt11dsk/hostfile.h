@@ -43,6 +43,7 @@ extern "C" {
         ~CHostFile();
         bool ParseFileName63(void);
         bool read(void);
+        bool assign(const void* src, size_t size, time_t mtime);  // Use data from memory instead of read()
 
         inline char* name(void) { return _name; };
         inline char* ext(void) { return _name + 6; };
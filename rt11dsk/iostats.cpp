@@ -0,0 +1,84 @@
+﻿/*  This file is part of UKNCBTL.
+    UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// iostats.cpp : I/O statistics
+
+#include <chrono>
+#include "rt11dsk.h"
+
+
+//////////////////////////////////////////////////////////////////////
+
+CImageStats g_stats;
+
+double StatsGetTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t StatsFRead(void* buffer, size_t size, size_t count, FILE* fp)
+{
+    size_t result = ::fread(buffer, size, count, fp);
+    g_stats.readcalls++;
+    g_stats.bytesread += result * size;
+    return result;
+}
+
+size_t StatsFWrite(const void* buffer, size_t size, size_t count, FILE* fp)
+{
+    size_t result = ::fwrite(buffer, size, count, fp);
+    g_stats.writecalls++;
+    g_stats.byteswritten += result * size;
+    return result;
+}
+
+int StatsFSeek(FILE* fp, long offset, int origin)
+{
+    g_stats.seekcalls++;
+    return ::fseek(fp, offset, origin);
+}
+
+// Statistics goes to stderr to keep the command output clean
+void StatsPrint(bool okJson)
+{
+    double total = 0.0;
+    for (int i = 0; i < STATS_PHASE_COUNT; i++)
+        total += g_stats.phaseseconds[i];
+
+    if (okJson)
+    {
+        fprintf(stderr,
+                "{\"cache_hits\":%lu,\"cache_misses\":%lu,\"cache_evictions\":%lu,"
+                "\"blocks_flushed\":%lu,\"fseek_calls\":%lu,\"fread_calls\":%lu,\"fwrite_calls\":%lu,"
+                "\"bytes_read\":%llu,\"bytes_written\":%llu,"
+                "\"time_attach\":%.6f,\"time_catalog\":%.6f,\"time_transfer\":%.6f,\"time_flush\":%.6f,\"time_total\":%.6f}\n",
+                g_stats.cachehits, g_stats.cachemisses, g_stats.cacheevictions,
+                g_stats.blocksflushed, g_stats.seekcalls, g_stats.readcalls, g_stats.writecalls,
+                g_stats.bytesread, g_stats.byteswritten,
+                g_stats.phaseseconds[STATS_PHASE_ATTACH], g_stats.phaseseconds[STATS_PHASE_CATALOG],
+                g_stats.phaseseconds[STATS_PHASE_TRANSFER], g_stats.phaseseconds[STATS_PHASE_FLUSH], total);
+        return;
+    }
+
+    fprintf(stderr, "\nStatistics:\n");
+    fprintf(stderr, "  Cache:     %lu hits, %lu misses, %lu evictions\n",
+            g_stats.cachehits, g_stats.cachemisses, g_stats.cacheevictions);
+    fprintf(stderr, "  Flushed:   %lu blocks\n", g_stats.blocksflushed);
+    fprintf(stderr, "  Stdio:     %lu fseek, %lu fread, %lu fwrite calls\n",
+            g_stats.seekcalls, g_stats.readcalls, g_stats.writecalls);
+    fprintf(stderr, "  Bytes:     %llu read, %llu written\n", g_stats.bytesread, g_stats.byteswritten);
+    fprintf(stderr, "  Time, ms:  attach %.3f, catalog %.3f, transfer %.3f, flush %.3f, total %.3f\n",
+            g_stats.phaseseconds[STATS_PHASE_ATTACH] * 1000.0, g_stats.phaseseconds[STATS_PHASE_CATALOG] * 1000.0,
+            g_stats.phaseseconds[STATS_PHASE_TRANSFER] * 1000.0, g_stats.phaseseconds[STATS_PHASE_FLUSH] * 1000.0,
+            total * 1000.0);
+}
+
+
+//////////////////////////////////////////////////////////////////////
@@ -29,6 +29,7 @@ void DoDiskExtractAllFiles();
 void DoDiskAddFile();
 void DoDiskDeleteFile();
 void DoDiskExtractAllUnusedFiles();
+void DoDiskInit();
 void DoHardInvert();
 void DoHardList();
 void DoHardExtractPartition();
@@ -36,6 +37,7 @@ void DoHardUpdatePartition();
 void DoHardPartitionList();
 void DoHardPartitionExtractFile();
 void DoHardPartitionAddFile();
+void DoHardInit();
 
 
 //////////////////////////////////////////////////////////////////////
@@ -59,12 +61,23 @@ long    g_lStartOffset = 0;
 bool    g_okInterleaving = false;
 bool    g_okHard32M = false;
 bool    g_okTrimZeroes = false;
+int     g_nInitBlocks = 0;          // Volume or partition size for init commands, 0 = default
+int     g_nInitSegments = 0;        // Catalog segments for init commands, 0 = default
+int     g_nInitExtraWords = 0;      // Catalog entry extra words for init commands
+int     g_nInitPartitions = 1;      // Partition count for hinit command
+HDDDriverType g_nInitDriver = HDD_DRIVER_UNKNOWN;  // Partition table layout for hinit command, ID by default
+bool    g_okAllocate = false;       // Reserve disk space for new image instead of sparse file
+bool    g_okStats = false;          // Print I/O statistics at exit
+bool    g_okStatsJson = false;      // Print I/O statistics as JSON
+int     g_nOutputFormat = OUTPUT_FORMAT_TEXT;  // Listing format for l, hl, hpl commands
+int     g_nExitCode = 0;
 
 enum CommandRequirements
 {
     CMDR_PARAM_FILENAME        = 4,    // Need FileName parameter
     CMDR_PARAM_PARTITION       = 8,    // Need Partition number parameter
     CMDR_IMAGEFILERW           = 32,   // Image file should be writable (not read-only)
+    CMDR_IMAGEFILENEW          = 64,   // Image file is created by the command, do not attach
 };
 
 struct CommandInfo
@@ -82,6 +95,7 @@ static g_CommandInfos[] =
     { "a",    false,  DoDiskAddFile,                CMDR_PARAM_FILENAME | CMDR_IMAGEFILERW },
     { "d",    false,  DoDiskDeleteFile,             CMDR_PARAM_FILENAME | CMDR_IMAGEFILERW },
     { "xu",   false,  DoDiskExtractAllUnusedFiles,  },
+    { "init", false,  DoDiskInit,                   CMDR_IMAGEFILENEW },
     { "hi",   true,   DoHardInvert,                 CMDR_IMAGEFILERW },
     { "hl",   true,   DoHardList,                   },
     { "hx",   true,   DoHardExtractPartition,       CMDR_PARAM_PARTITION | CMDR_PARAM_FILENAME },
@@ -89,6 +103,7 @@ static g_CommandInfos[] =
     { "hpl",  true,   DoHardPartitionList,          CMDR_PARAM_PARTITION },
     { "hpe",  true,   DoHardPartitionExtractFile,   CMDR_PARAM_PARTITION | CMDR_PARAM_FILENAME },
     { "hpa",  true,   DoHardPartitionAddFile,       CMDR_PARAM_PARTITION | CMDR_PARAM_FILENAME | CMDR_IMAGEFILERW },
+    { "hinit", true,  DoHardInit,                   CMDR_IMAGEFILENEW },
 };
 static const int g_CommandInfos_count = (int)(sizeof(g_CommandInfos) / sizeof(CommandInfo));
 
@@ -115,6 +130,7 @@ void PrintUsage()
            "    rt11dsk x <ImageFile>  - extract all files\n"
            "    rt11dsk d <ImageFile> <FileName>  - delete file\n"
            "    rt11dsk xu <ImageFile>  - extract all unused space\n"
+           "    rt11dsk init <ImageFile>  - create new empty image\n"
            "  Hard disk image commands:\n"
            "    rt11dsk hl <HddImage>  - list HDD image partitions\n"
            "    rt11dsk hx <HddImage> <Partn> <FileName>  - extract partition to file\n"
@@ -123,6 +139,7 @@ void PrintUsage()
            "    rt11dsk hpl <HddImage> <Partn>  - list partition contents\n"
            "    rt11dsk hpe <HddImage> <Partn> <FileName>  - extract file from the partition\n"
            "    rt11dsk hpa <HddImage> <Partn> <FileName>  - add file to the partition\n"
+           "    rt11dsk hinit <HddImage>  - create new HDD image with empty partitions\n"
            "  Parameters:\n"
            "    <ImageFile> is UKNC disk image in .dsk or .rtd format\n"
            "    <HddImage>  is UKNC hard disk image file name\n"
@@ -133,6 +150,15 @@ void PrintUsage()
            "    " OPTIONSTR "ms0515  Sector interleaving used for MS0515 disks\n"
            "    " OPTIONSTR "hd32    Hard disk with 32 MB partitions\n"
            "    " OPTIONSTR "trimz   (Extract file commands) Trim trailing zeroes in the last block\n"
+           "    " OPTIONSTR "blocksN (Init commands) Volume or partition size in blocks; 1600 for disk, 65535 for partition by default\n"
+           "    " OPTIONSTR "segsN   (Init commands) Catalog segments, 1..31; 4 for disk, 31 for large volume by default\n"
+           "    " OPTIONSTR "extraN  (Init commands) Extra words in catalog entry; 0 by default\n"
+           "    " OPTIONSTR "partsN  (hinit command) Number of partitions; 1 by default\n"
+           "    " OPTIONSTR "drvid, " OPTIONSTR "drvwd, " OPTIONSTR "drvhd  (hinit command) Partition table layout for ID (default), WD or HD driver;\n"
+           "             use " OPTIONSTR "hd32 for HZ driver layout with 32 MB partitions\n"
+           "    " OPTIONSTR "falloc  (Init commands) Reserve disk space for the image; sparse file by default\n"
+           "    " OPTIONSTR "stats   Print cache, I/O and timing statistics at exit; " OPTIONSTR "stats=json for JSON format\n"
+           "    " OPTIONSTR "format=json, " OPTIONSTR "format=csv  (l, hl, hpl commands) List as JSON Lines or CSV records\n"
           );
 }
 
@@ -147,7 +173,7 @@ bool ParseCommandLine(int argc, char * argv[])
             {
                 if (1 != sscanf(arg + 2, "%ld", &g_lStartOffset))
                 {
-                    printf("Failed to parse option argument: %s\n", arg);
+                    fprintf(stderr, "Failed to parse option argument: %s\n", arg);
                     return false;
                 }
             }
@@ -163,9 +189,77 @@ bool ParseCommandLine(int argc, char * argv[])
             {
                 g_okTrimZeroes = true;
             }
+            else if (strncmp(arg + 1, "blocks", 6) == 0)
+            {
+                if (1 != sscanf(arg + 7, "%d", &g_nInitBlocks))
+                {
+                    fprintf(stderr, "Failed to parse option argument: %s\n", arg);
+                    return false;
+                }
+            }
+            else if (strncmp(arg + 1, "segs", 4) == 0)
+            {
+                if (1 != sscanf(arg + 5, "%d", &g_nInitSegments))
+                {
+                    fprintf(stderr, "Failed to parse option argument: %s\n", arg);
+                    return false;
+                }
+            }
+            else if (strncmp(arg + 1, "extra", 5) == 0)
+            {
+                if (1 != sscanf(arg + 6, "%d", &g_nInitExtraWords))
+                {
+                    fprintf(stderr, "Failed to parse option argument: %s\n", arg);
+                    return false;
+                }
+            }
+            else if (strncmp(arg + 1, "parts", 5) == 0)
+            {
+                if (1 != sscanf(arg + 6, "%d", &g_nInitPartitions))
+                {
+                    fprintf(stderr, "Failed to parse option argument: %s\n", arg);
+                    return false;
+                }
+            }
+            else if (strcmp(arg + 1, "drvid") == 0)
+            {
+                g_nInitDriver = HDD_DRIVER_ID;
+            }
+            else if (strcmp(arg + 1, "drvwd") == 0)
+            {
+                g_nInitDriver = HDD_DRIVER_WD;
+            }
+            else if (strcmp(arg + 1, "drvhd") == 0)
+            {
+                g_nInitDriver = HDD_DRIVER_HD;
+            }
+            else if (strcmp(arg + 1, "falloc") == 0)
+            {
+                g_okAllocate = true;
+            }
+            else if (strcmp(arg + 1, "stats") == 0)
+            {
+                g_okStats = true;
+            }
+            else if (strcmp(arg + 1, "stats=json") == 0)
+            {
+                g_okStats = g_okStatsJson = true;
+            }
+            else if (strcmp(arg + 1, "format=json") == 0)
+            {
+                g_nOutputFormat = OUTPUT_FORMAT_JSON;
+            }
+            else if (strcmp(arg + 1, "format=csv") == 0)
+            {
+                g_nOutputFormat = OUTPUT_FORMAT_CSV;
+            }
+            else if (strcmp(arg + 1, "format=text") == 0)
+            {
+                g_nOutputFormat = OUTPUT_FORMAT_TEXT;
+            }
             else
             {
-                printf("Unknown option: %s\n", arg);
+                fprintf(stderr, "Unknown option: %s\n", arg);
                 return false;
             }
         }
@@ -181,7 +275,7 @@ bool ParseCommandLine(int argc, char * argv[])
                 g_sFileName = arg;
             else
             {
-                printf("Unknown param: %s\n", arg);
+                fprintf(stderr, "Unknown param: %s\n", arg);
                 return false;
             }
         }
@@ -190,7 +284,7 @@ bool ParseCommandLine(int argc, char * argv[])
     // Parsed options validation
     if (g_sCommand == nullptr)
     {
-        printf("Command not specified.\n");
+        fprintf(stderr, "Command not specified.\n");
         return false;
     }
     CommandInfo* pcinfo = nullptr;
@@ -204,7 +298,7 @@ bool ParseCommandLine(int argc, char * argv[])
     }
     if (pcinfo == nullptr)
     {
-        printf("Unknown command: %s\n", g_sCommand);
+        fprintf(stderr, "Unknown command: %s\n", g_sCommand);
         return false;
     }
     g_pCommand = pcinfo;
@@ -218,44 +312,64 @@ bool ParseCommandLine(int argc, char * argv[])
     // More pre-checks based on command requirements
     if (g_sImageFileName == nullptr)
     {
-        printf("Image file not specified.\n");
+        fprintf(stderr, "Image file not specified.\n");
         return false;
     }
     if ((pcinfo->requirements & CMDR_PARAM_PARTITION) != 0 && g_nPartition < 0)
     {
-        printf("Partition number expected.\n");
+        fprintf(stderr, "Partition number expected.\n");
         return false;
     }
     if ((pcinfo->requirements & CMDR_PARAM_FILENAME) != 0 && g_sFileName == nullptr)
     {
-        printf("File name expected.\n");
+        fprintf(stderr, "File name expected.\n");
         return false;
     }
     if ((pcinfo->requirements & CMDR_IMAGEFILERW) != 0 && g_diskimage.IsReadOnly())
     {
-        printf("Cannot perform the operation: disk image file is read-only.\n");
+        fprintf(stderr, "Cannot perform the operation: disk image file is read-only.\n");
         return false;
     }
 
     return true;
 }
 
+static void PrintStatsAtExit()
+{
+    StatsPrint(g_okStatsJson);
+}
+
 int main(int argc, char* argv[])
 {
-    PrintWelcome();
+    bool okParsed = ParseCommandLine(argc, argv);
 
-    if (!ParseCommandLine(argc, argv))
+    // Machine-readable listing goes without the banner, fully buffered
+    if (!okParsed || g_nOutputFormat == OUTPUT_FORMAT_TEXT)
+        PrintWelcome();
+    else
+        setvbuf(stdout, nullptr, _IOFBF, 65536);
+
+    if (!okParsed)
     {
         PrintUsage();
         return 255;
     }
 
+    if (g_okStats)
+        atexit(PrintStatsAtExit);  // Report even when the command fails with exit()
+
+    double starttime = StatsGetTime();
+
     // Подключение к файлу образа
-    if (g_okHardCommand)
+    if ((g_pCommand->requirements & CMDR_IMAGEFILENEW) != 0)
+    {
+        // The command creates the image file by itself
+    }
+    else if (g_okHardCommand)
     {
         if (!g_hardimage.Attach(g_sImageFileName, g_okHard32M))
         {
-            printf("Failed to open the image file.\n");
+            fprintf(stderr, "Failed to open the image file: %s.\n", RT11ErrorString(g_hardimage.GetLastError()));
             return 255;
         }
     }
@@ -263,73 +377,146 @@ int main(int argc, char* argv[])
     {
         if (!g_diskimage.Attach(g_sImageFileName, g_lStartOffset, g_okInterleaving))
         {
-            printf("Failed to open the image file.\n");
+            fprintf(stderr, "Failed to open the image file: %s.\n", RT11ErrorString(g_diskimage.GetLastError()));
             return 255;
         }
     }
 
+    double attachtime = StatsGetTime();
+    g_stats.phaseseconds[STATS_PHASE_ATTACH] += attachtime - starttime;
+
     // Main task
     g_pCommand->commandImpl();
 
+    // Command time except catalog decoding and flushing is the data transfer time
+    double commandtime = StatsGetTime();
+    g_stats.phaseseconds[STATS_PHASE_TRANSFER] +=
+        (commandtime - attachtime) - g_stats.phaseseconds[STATS_PHASE_CATALOG] - g_stats.phaseseconds[STATS_PHASE_FLUSH];
+
     // Завершение работы с файлом
     g_diskimage.Detach();
     g_hardimage.Detach();
 
-    return 0;
+    return g_nExitCode;
 }
 
 
 //////////////////////////////////////////////////////////////////////
 
 
+// Report the error of the image operation; the utility exits with code 255
+static void PrintImageError(int error)
+{
+    fprintf(stderr, "Error: %s.\n", RT11ErrorString(error));
+    g_nExitCode = 255;
+}
+
 void DoDiskList()
 {
-    g_diskimage.DecodeImageCatalog();
-    g_diskimage.PrintCatalogDirectory();
+    if (!g_diskimage.DecodeImageCatalog())
+    {
+        PrintImageError(g_diskimage.GetLastError());
+        return;
+    }
+    g_diskimage.PrintCatalogDirectory(g_nOutputFormat);
 }
 
 void DoDiskExtractFile()
 {
-    g_diskimage.DecodeImageCatalog();
-    g_diskimage.SaveEntryToExternalFile(g_sFileName, g_okTrimZeroes);
+    if (!g_diskimage.DecodeImageCatalog() ||
+        !g_diskimage.SaveEntryToExternalFile(g_sFileName, g_okTrimZeroes))
+        PrintImageError(g_diskimage.GetLastError());
 }
 
 void DoDiskExtractAllFiles()
 {
-    g_diskimage.DecodeImageCatalog();
-    g_diskimage.SaveAllEntriesToExternalFiles();
+    if (!g_diskimage.DecodeImageCatalog() ||
+        !g_diskimage.SaveAllEntriesToExternalFiles())
+        PrintImageError(g_diskimage.GetLastError());
 }
 
 void DoDiskAddFile()
 {
-    g_diskimage.DecodeImageCatalog();
-    g_diskimage.AddFileToImage(g_sFileName);
+    if (!g_diskimage.DecodeImageCatalog() ||
+        !g_diskimage.AddFileToImage(g_sFileName))
+        PrintImageError(g_diskimage.GetLastError());
 }
 
 void DoDiskDeleteFile()
 {
-    g_diskimage.DecodeImageCatalog();
-    g_diskimage.DeleteFileFromImage(g_sFileName);
+    if (!g_diskimage.DecodeImageCatalog() ||
+        !g_diskimage.DeleteFileFromImage(g_sFileName))
+        PrintImageError(g_diskimage.GetLastError());
 }
 
 void DoDiskExtractAllUnusedFiles()
 {
-    g_diskimage.DecodeImageCatalog();
-    g_diskimage.SaveAllUnusedEntriesToExternalFiles();
+    if (!g_diskimage.DecodeImageCatalog() ||
+        !g_diskimage.SaveAllUnusedEntriesToExternalFiles())
+        PrintImageError(g_diskimage.GetLastError());
+}
+
+// Default catalog size: small for floppy disk, maximum for large volumes
+static int GetInitCatalogSegments(int blocks)
+{
+    if (g_nInitSegments > 0)
+        return g_nInitSegments;
+    return (blocks > 4000) ? RT11_MAX_CATALOG_SEGMENTS : 4;
+}
+
+// Format the volume attached to g_diskimage, with the catalog size given by the options
+static bool FormatInitVolume()
+{
+    int blocks = g_diskimage.GetBlockCount();
+    if (blocks > 65535) blocks = 65535;
+    int segments = GetInitCatalogSegments(blocks);
+    printf("Volume size %d blocks, %d catalog segments, %d extra words, data starts at block %d\n",
+           blocks, segments, g_nInitExtraWords, RT11_FIRST_CATALOG_BLOCK + segments * 2);
+
+    if (!g_diskimage.FormatVolume(segments, g_nInitExtraWords))
+    {
+        PrintImageError(g_diskimage.GetLastError());
+        return false;
+    }
+    return true;
+}
+
+void DoDiskInit()
+{
+    int blocks = (g_nInitBlocks > 0) ? g_nInitBlocks : 1600;
+    printf("Creating disk image %s\n", g_sImageFileName);
+    if (!g_diskimage.Create(g_sImageFileName, blocks, g_lStartOffset, g_okInterleaving, g_okAllocate))
+    {
+        fprintf(stderr, "Failed to create the image file.\n");
+        PrintImageError(g_diskimage.GetLastError());
+        return;
+    }
+
+    if (!FormatInitVolume())
+        return;
+
+    printf("\nDone.\n");
 }
 
 void DoHardInvert()
 {
     g_hardimage.PrintImageInfo();
     printf("\n");
-    g_hardimage.InvertImage();
+    if (!g_hardimage.InvertImage())
+        PrintImageError(g_hardimage.GetLastError());
 }
 
 void DoHardList()
 {
     if (!g_hardimage.IsChecksum())
     {
-        printf("Cannot perform the operation: home block checksum is incorrect.\n");
+        fprintf(stderr, "Cannot perform the operation: home block checksum is incorrect.\n");
+        return;
+    }
+
+    if (g_nOutputFormat != OUTPUT_FORMAT_TEXT)
+    {
+        g_hardimage.PrintPartitionTable(g_nOutputFormat);
         return;
     }
 
@@ -343,76 +530,124 @@ void DoHardExtractPartition()
 {
     if (!g_hardimage.IsChecksum())
     {
-        printf("Cannot perform the operation: home block checksum is incorrect.\n");
+        fprintf(stderr, "Cannot perform the operation: home block checksum is incorrect.\n");
         return;
     }
 
-    g_hardimage.SavePartitionToFile(g_nPartition, g_sFileName);
+    if (!g_hardimage.SavePartitionToFile(g_nPartition, g_sFileName))
+        PrintImageError(g_hardimage.GetLastError());
 }
 
 void DoHardUpdatePartition()
 {
     if (!g_hardimage.IsChecksum())
     {
-        printf("Cannot perform the operation: home block checksum is incorrect.\n");
+        fprintf(stderr, "Cannot perform the operation: home block checksum is incorrect.\n");
         return;
     }
 
-    g_hardimage.UpdatePartitionFromFile(g_nPartition, g_sFileName);
+    if (!g_hardimage.UpdatePartitionFromFile(g_nPartition, g_sFileName))
+        PrintImageError(g_hardimage.GetLastError());
 }
 
 void DoHardPartitionList()
 {
     if (!g_hardimage.IsChecksum())
     {
-        printf("Cannot perform the operation: home block checksum is incorrect.\n");
+        fprintf(stderr, "Cannot perform the operation: home block checksum is incorrect.\n");
         return;
     }
 
     if (!g_hardimage.PrepareDiskImage(g_nPartition, &g_diskimage))
     {
-        printf("Failed to prepare partition disk image.\n");
+        fprintf(stderr, "Failed to prepare partition disk image.\n");
+        PrintImageError(g_hardimage.GetLastError());
         return;
     }
 
-    g_diskimage.DecodeImageCatalog();
-    g_diskimage.PrintCatalogDirectory();
+    if (!g_diskimage.DecodeImageCatalog())
+    {
+        PrintImageError(g_diskimage.GetLastError());
+        return;
+    }
+    g_diskimage.PrintCatalogDirectory(g_nOutputFormat);
 }
 
 void DoHardPartitionExtractFile()
 {
     if (!g_hardimage.IsChecksum())
     {
-        printf("Cannot perform the operation: home block checksum is incorrect.\n");
+        fprintf(stderr, "Cannot perform the operation: home block checksum is incorrect.\n");
         return;
     }
 
     if (!g_hardimage.PrepareDiskImage(g_nPartition, &g_diskimage))
     {
-        printf("Failed to prepare partition disk image.\n");
+        fprintf(stderr, "Failed to prepare partition disk image.\n");
+        PrintImageError(g_hardimage.GetLastError());
         return;
     }
 
-    g_diskimage.DecodeImageCatalog();
-    g_diskimage.SaveEntryToExternalFile(g_sFileName, g_okTrimZeroes);
+    if (!g_diskimage.DecodeImageCatalog() ||
+        !g_diskimage.SaveEntryToExternalFile(g_sFileName, g_okTrimZeroes))
+        PrintImageError(g_diskimage.GetLastError());
 }
 
 void DoHardPartitionAddFile()
 {
     if (!g_hardimage.IsChecksum())
     {
-        printf("Cannot perform the operation: home block checksum is incorrect.\n");
+        fprintf(stderr, "Cannot perform the operation: home block checksum is incorrect.\n");
         return;
     }
 
     if (!g_hardimage.PrepareDiskImage(g_nPartition, &g_diskimage))
     {
-        printf("Failed to prepare partition disk image.\n");
+        fprintf(stderr, "Failed to prepare partition disk image.\n");
+        PrintImageError(g_hardimage.GetLastError());
+        return;
+    }
+
+    if (!g_diskimage.DecodeImageCatalog() ||
+        !g_diskimage.AddFileToImage(g_sFileName))
+        PrintImageError(g_diskimage.GetLastError());
+}
+
+void DoHardInit()
+{
+    HDDDriverType drivertype = g_okHard32M ? HDD_DRIVER_HZ : g_nInitDriver;
+    if (drivertype == HDD_DRIVER_UNKNOWN)
+        drivertype = HDD_DRIVER_ID;
+    int partblocks = (g_nInitBlocks > 0) ? g_nInitBlocks : 65535;
+    printf("Creating hard disk image %s\n", g_sImageFileName);
+    if (!g_hardimage.Create(g_sImageFileName, drivertype, g_nInitPartitions, partblocks, g_okAllocate))
+    {
+        fprintf(stderr, "Failed to create the image file.\n");
+        PrintImageError(g_hardimage.GetLastError());
         return;
     }
 
-    g_diskimage.DecodeImageCatalog();
-    g_diskimage.AddFileToImage(g_sFileName);
+    for (int partition = 0; partition < g_hardimage.GetPartitionCount(); partition++)
+    {
+        if (!g_hardimage.PrepareDiskImage(partition, &g_diskimage))
+        {
+            fprintf(stderr, "Failed to prepare partition disk image.\n");
+            PrintImageError(g_hardimage.GetLastError());
+            return;
+        }
+
+        printf("Partition %d: ", partition);
+        bool okFormatted = FormatInitVolume();
+        g_diskimage.Detach();
+        if (!okFormatted)
+            return;
+    }
+
+    printf("\n");
+    g_hardimage.PrintImageInfo();
+    printf("\n");
+    g_hardimage.PrintPartitionTable();
+    printf("\nDone.\n");
 }
 
 
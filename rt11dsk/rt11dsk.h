@@ -34,6 +34,39 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 #define RT11_STATUS_EMPTY       512     /* Marks empty space */
 #define RT11_STATUS_PERM        1024    /* A "real" file */
 #define RT11_STATUS_ENDMARK     2048    /* Marks the end of file entries */
+#define RT11_STATUS_PROTECTED   0100000 /* Protected file */
+
+/* Error codes, see CDiskImage::GetLastError(), CHardImage::GetLastError() */
+enum RT11Error
+{
+    RT11_OK = 0,
+    RT11_ERROR_NOT_ATTACHED,    // No image attached
+    RT11_ERROR_IO,              // Failed to read or write the image
+    RT11_ERROR_NO_MEMORY,
+    RT11_ERROR_BLOCK_RANGE,     // Block number is out of the volume
+    RT11_ERROR_CACHE_FULL,      // All the cached blocks are changed
+    RT11_ERROR_BAD_CATALOG,     // Home block or catalog segment header is out of range
+    RT11_ERROR_BAD_HOME_BLOCK,  // HDD home block is broken
+    RT11_ERROR_BAD_PARAMETER,
+    RT11_ERROR_READ_ONLY,
+    RT11_ERROR_FILE_NOT_FOUND,  // No such file on the volume
+    RT11_ERROR_SIZE_MISMATCH,   // File exists with different size
+    RT11_ERROR_NO_SPACE,        // No free area large enough
+    RT11_ERROR_SEGMENT_FULL,    // New catalog segment needed
+    RT11_ERROR_HOST_FILE,       // Failed to read or write the host file
+    RT11_ERROR_BAD_SECTORS,     // HDD home block: zero sectors per track
+    RT11_ERROR_BAD_SIDES,       // HDD home block: sectors per cylinder less than sectors per track
+};
+
+const char * RT11ErrorString(int error);
+
+/* Listing output formats for l, hl and hpl commands */
+enum OutputFormat
+{
+    OUTPUT_FORMAT_TEXT = 0,     // Human-readable table
+    OUTPUT_FORMAT_JSON,         // JSON Lines, one object per entry
+    OUTPUT_FORMAT_CSV,          // Header line, then one line per entry
+};
 
 //////////////////////////////////////////////////////////////////////
 // RADIX50 convertion rotines headers, see rad50.cpp
@@ -43,4 +76,39 @@ void irad50(int cnt, char str[], uint16_t r50[]);
 void rtDateStr(uint16_t date, char* str);
 
 
+//////////////////////////////////////////////////////////////////////
+// I/O statistics, see iostats.cpp
+
+enum StatsPhase
+{
+    STATS_PHASE_ATTACH = 0,     // Opening the image, reading the partition table
+    STATS_PHASE_CATALOG,        // Catalog decoding
+    STATS_PHASE_TRANSFER,       // The rest of the command: data transfer
+    STATS_PHASE_FLUSH,          // Writing changed blocks back to the image
+    STATS_PHASE_COUNT
+};
+
+struct CImageStats
+{
+    unsigned long cachehits;        // GetBlock() found the block in the cache
+    unsigned long cachemisses;      // GetBlock() had to read the block
+    unsigned long cacheevictions;   // GetBlock() released a cache slot to read the block
+    unsigned long blocksflushed;    // Changed blocks written by FlushChanges()
+    unsigned long seekcalls;        // fseek() calls; stdio calls, not the system calls: stdio buffers the data
+    unsigned long readcalls;        // fread() calls
+    unsigned long writecalls;       // fwrite() calls
+    unsigned long long bytesread;
+    unsigned long long byteswritten;
+    double phaseseconds[STATS_PHASE_COUNT];
+};
+
+extern CImageStats g_stats;
+
+double StatsGetTime();  // Wall clock time in seconds
+size_t StatsFRead(void* buffer, size_t size, size_t count, FILE* fp);
+size_t StatsFWrite(const void* buffer, size_t size, size_t count, FILE* fp);
+int StatsFSeek(FILE* fp, long offset, int origin);
+void StatsPrint(bool okJson);
+
+
 //////////////////////////////////////////////////////////////////////